@@ -3,12 +3,13 @@
 #include "ClientFactory.h"
 #include "ClientAgent.h"
 #include "net/NetworkClient.h"
+#include "net/UdpEndpoint.h"
 #include "core/global.h"
 #include "core/msgtypes.h"
 #include "config/constraints.h"
 #include "dclass/dc/Class.h"
 #include "dclass/dc/Field.h"
-#include "util/Timeout.h"
+#include "util/TimerWheel.h"
 
 using namespace std;
 using dclass::Class;
@@ -22,6 +23,8 @@ static BooleanValueConstraint relocate_is_boolean(relocate_owned);
 
 static ConfigVariable<bool> send_hash_to_client("send_hash", true, astronclient_config);
 static ConfigVariable<bool> send_version_to_client("send_version", true, astronclient_config);
+static ConfigVariable<bool> allow_bundling("bundling", true, astronclient_config);
+static BooleanValueConstraint bundling_is_boolean(allow_bundling);
 
 static ConfigVariable<uint64_t> write_buffer_size("write_buffer_size", 256 * 1024,
         astronclient_config);
@@ -43,20 +46,27 @@ enum InterestPermission {
     INTERESTS_DISABLED
 };
 
-class AstronClient : public Client, public NetworkHandler
+class AstronClient : public Client, public NetworkHandler, public UdpHandler
 {
   private:
     std::shared_ptr<NetworkClient> m_client;
+    std::shared_ptr<UdpSession> m_udp; // Only if the UDP side-channel was agreed on in the hello.
+    // m_udp_seqs is the sequence number of the latest update received over UDP for each
+    //     field of each object, so that older ones which arrive after it can be dropped.
+    //     An object's entry goes when the Client stops knowing about it (see forget_udp_seqs).
+    std::unordered_map<doid_t, std::unordered_map<uint16_t, uint32_t>> m_udp_seqs;
     ConfigNode m_config;
     bool m_clean_disconnect;
     bool m_relocate_owned;
     bool m_send_hash;
     bool m_send_version;
+    bool m_allow_bundling;
+    bool m_bundling; // Whether bundling was agreed on in the hello; see CLIENT_BUNDLE.
     InterestPermission m_interests_allowed;
 
     //Heartbeat
     long m_heartbeat_timeout;
-    Timeout* m_heartbeat_timer = nullptr;
+    WheelTimer m_heartbeat_timer;
 
   public:
     AstronClient(ConfigNode config, ClientAgent* client_agent, const std::shared_ptr<uvw::TcpHandle> &socket,
@@ -66,6 +76,7 @@ class AstronClient : public Client, public NetworkHandler
         m_clean_disconnect(false), m_relocate_owned(relocate_owned.get_rval(config)),
         m_send_hash(send_hash_to_client.get_rval(config)),
         m_send_version(send_version_to_client.get_rval(config)),
+        m_allow_bundling(allow_bundling.get_rval(config)), m_bundling(false),
         m_heartbeat_timeout(heartbeat_timeout_config.get_rval(config))
     {
         pre_initialize();
@@ -73,6 +84,13 @@ class AstronClient : public Client, public NetworkHandler
         m_client->initialize(socket, remote, local, haproxy_mode);
     }
 
+    ~AstronClient()
+    {
+        if(m_udp) {
+            m_udp->close();
+        }
+    }
+
     inline void pre_initialize()
     {
         // Set interest permissions
@@ -92,10 +110,7 @@ class AstronClient : public Client, public NetworkHandler
 
     void heartbeat_timeout()
     {
-        lock_guard<recursive_mutex> lock(m_client_lock);
-        // The heartbeat timer has already deleted itself at this point
-        // Holding on to it means receive_disconnect will try to invoke cancel() on it, and we can't have that.
-        m_heartbeat_timer = nullptr;
+        lock_guard<ParticipantLock> lock(m_client_lock);
         send_disconnect(CLIENT_DISCONNECT_NO_HEARTBEAT,
                         "Server timed out while waiting for heartbeat.");
     }
@@ -104,10 +119,9 @@ class AstronClient : public Client, public NetworkHandler
     {
         //If heartbeat, start the heartbeat timer now.
         if(m_heartbeat_timeout != 0) {
-            m_heartbeat_timer = new Timeout(m_heartbeat_timeout,
-                                std::bind(&AstronClient::heartbeat_timeout,
-                                          this));
-            m_heartbeat_timer->start();
+            m_heartbeat_timer.start(m_io->timers(), m_heartbeat_timeout, [self = this]() {
+                self->heartbeat_timeout();
+            });
         }
 
         stringstream ss;
@@ -160,23 +174,68 @@ class AstronClient : public Client, public NetworkHandler
     // receive_datagram is the handler for datagrams received over the network from a Client.
     virtual void receive_datagram(DatagramHandle dg)
     {
-        lock_guard<recursive_mutex> lock(m_client_lock);
+        lock_guard<ParticipantLock> lock(m_client_lock);
         DatagramIterator dgi(dg);
+        if(!m_bundling || dgi.get_remaining() < sizeof(uint16_t) || dgi.read_uint16() != CLIENT_BUNDLE) {
+            dgi.seek(0);
+            receive_message(dgi);
+            return;
+        }
+
+        // The messages in a bundle are handled in place, one after the other, until they run
+        //     out or one of them gets the client disconnected.
         try {
-            switch(m_state) {
-            // Client has just connected and should only send "CLIENT_HELLO".
-            case CLIENT_STATE_NEW:
-                handle_pre_hello(dgi);
-                break;
-            // Client has sent "CLIENT_HELLO" and can now access anonymous uberdogs.
-            case CLIENT_STATE_ANONYMOUS:
-                handle_pre_auth(dgi);
-                break;
-            // An Uberdog or AI has declared the Client authenticated and the client
-            // can now interact with the server cluster normally.
-            case CLIENT_STATE_ESTABLISHED:
-                handle_authenticated(dgi);
-                break;
+            while(dgi.get_remaining() && !m_clean_disconnect) {
+                DatagramIterator msg = dgi.read_sub_iterator();
+                receive_message(msg);
+            }
+        } catch(const DatagramIteratorEOF&) {
+            send_disconnect(CLIENT_DISCONNECT_TRUNCATED_DATAGRAM,
+                            "Bundle unexpectedly ended while iterating.");
+        }
+    }
+
+    // receive_udp is the handler for datagrams received from the Client over UDP.
+    virtual void receive_udp(uint32_t seq, DatagramHandle dg, bool from_peer)
+    {
+        lock_guard<ParticipantLock> lock(m_client_lock);
+        if(m_clean_disconnect) {
+            return;
+        } else if(!from_peer) {
+            // Anybody who has seen the token could have sent it, so it isn't handled as
+            //     coming from the Client; see handle_udp_candidate.
+            handle_udp_candidate(dg);
+            return;
+        }
+
+        DatagramIterator dgi(dg);
+        receive_message(dgi, true, seq);
+    }
+
+    // receive_message handles one message from the Client, which may have come in a bundle,
+    //     or over UDP with the given sequence number.
+    void receive_message(DatagramIterator &dgi, bool udp = false, uint32_t udp_seq = 0)
+    {
+        try {
+            if(udp) {
+                // The Client only gets a UDP token once it has sent "CLIENT_HELLO".
+                handle_udp(dgi, udp_seq);
+            } else {
+                switch(m_state) {
+                // Client has just connected and should only send "CLIENT_HELLO".
+                case CLIENT_STATE_NEW:
+                    handle_pre_hello(dgi);
+                    break;
+                // Client has sent "CLIENT_HELLO" and can now access anonymous uberdogs.
+                case CLIENT_STATE_ANONYMOUS:
+                    handle_pre_auth(dgi);
+                    break;
+                // An Uberdog or AI has declared the Client authenticated and the client
+                // can now interact with the server cluster normally.
+                case CLIENT_STATE_ESTABLISHED:
+                    handle_authenticated(dgi);
+                    break;
+                }
             }
         } catch(const DatagramIteratorEOF&) {
             // Occurs when a handler attempts to read past end of datagram
@@ -206,7 +265,7 @@ class AstronClient : public Client, public NetworkHandler
     //       responsible for terminating the connection.
     virtual void receive_disconnect(const uvw::ErrorEvent &evt)
     {
-        lock_guard<recursive_mutex> lock(m_client_lock);
+        lock_guard<ParticipantLock> lock(m_client_lock);
 
         if(!m_clean_disconnect && !m_client->is_local()) {
             LoggedEvent event("client-lost");
@@ -214,14 +273,28 @@ class AstronClient : public Client, public NetworkHandler
             log_event(event);
         }
 
-        if(m_heartbeat_timer != nullptr) {
-            m_heartbeat_timer->cancel();
-            m_heartbeat_timer = nullptr;
+        m_heartbeat_timer.stop();
+        if(m_udp) {
+            m_udp->close();
         }
 
         annihilate();
     }
 
+    // An AstronClient can be dropped when it can't keep up with its inbox.
+    virtual bool can_overflow() const
+    {
+        return true;
+    }
+
+    // handle_inbox_overflow drops the client as if its send queue had filled up.
+    // It doesn't take m_client_lock, which is likely held by whatever is stalling us;
+    // receive_disconnect cleans up on the client's own loop.
+    virtual void handle_inbox_overflow()
+    {
+        m_client->disconnect(UV_ENOBUFS);
+    }
+
     // forward_datagram should foward the datagram to the client, or where appopriate parse
     // the packet and send the appropriate equivalent data.
     // Handler for CLIENTAGENT_SEND_DATAGRAM.
@@ -278,7 +351,8 @@ class AstronClient : public Client, public NetworkHandler
         resp->add_doid(do_id);
         resp->add_location(parent_id, zone_id);
         resp->add_uint16(dc_id);
-        resp->add_data(dgi.read_remainder());
+        dgi.read_remainder_into(*resp);
+        m_client->conflation_barrier();
         m_client->send_datagram(resp);
     }
 
@@ -294,7 +368,8 @@ class AstronClient : public Client, public NetworkHandler
         resp->add_doid(do_id);
         resp->add_location(parent_id, zone_id);
         resp->add_uint16(dc_id);
-        resp->add_data(dgi.read_remainder());
+        dgi.read_remainder_into(*resp);
+        m_client->conflation_barrier();
         m_client->send_datagram(resp);
     }
 
@@ -305,8 +380,23 @@ class AstronClient : public Client, public NetworkHandler
         resp->add_uint16(CLIENT_OBJECT_SET_FIELD);
         resp->add_doid(do_id);
         resp->add_uint16(field_id);
-        resp->add_data(dgi.read_remainder());
-        m_client->send_datagram(resp);
+        dgi.read_remainder_into(*resp);
+
+        // Only the latest value of a conflated field matters, so it can replace an older update
+        //     which is still waiting to be sent.  Anything that could leave the client with an
+        //     older value, if an update moved ahead of it, puts up a conflation barrier.
+        // An unreliable field goes over UDP whenever it can, and over TCP like any other
+        //     field whenever it can't (e.g. while the Client isn't getting through on UDP).
+        const dclass::Field* field = g_dcf->get_field_by_id(field_id);
+        if(m_udp && field != nullptr && field->has_keyword("unreliable") &&
+           m_udp->send_datagram(resp)) {
+            return;
+        }
+        if(field != nullptr && field->has_keyword("conflate")) {
+            m_client->send_conflated(resp, ConflationKey{do_id, field_id});
+        } else {
+            m_client->send_datagram(resp);
+        }
     }
 
     // handle_set_fields should inform the client that a group of fields has been updated.
@@ -316,7 +406,8 @@ class AstronClient : public Client, public NetworkHandler
         resp->add_uint16(CLIENT_OBJECT_SET_FIELDS);
         resp->add_doid(do_id);
         resp->add_uint16(num_fields);
-        resp->add_data(dgi.read_remainder());
+        dgi.read_remainder_into(*resp);
+        m_client->conflation_barrier();
         m_client->send_datagram(resp);
     }
 
@@ -327,6 +418,7 @@ class AstronClient : public Client, public NetworkHandler
         resp->add_uint16(CLIENT_OBJECT_LOCATION);
         resp->add_doid(do_id);
         resp->add_location(new_parent, new_zone);
+        m_client->conflation_barrier();
         m_client->send_datagram(resp);
     }
 
@@ -338,7 +430,9 @@ class AstronClient : public Client, public NetworkHandler
         DatagramPtr resp = Datagram::create();
         resp->add_uint16(CLIENT_OBJECT_LEAVING);
         resp->add_doid(do_id);
+        m_client->conflation_barrier();
         m_client->send_datagram(resp);
+        forget_udp_seqs(do_id);
     }
 
     // handle_remove_ownership should notify the client it no has control of the object.
@@ -348,7 +442,22 @@ class AstronClient : public Client, public NetworkHandler
         DatagramPtr resp = Datagram::create();
         resp->add_uint16(CLIENT_OBJECT_LEAVING_OWNER);
         resp->add_doid(do_id);
+        m_client->conflation_barrier();
         m_client->send_datagram(resp);
+        forget_udp_seqs(do_id);
+    }
+
+    virtual void handle_undeclare_object(doid_t do_id)
+    {
+        forget_udp_seqs(do_id);
+    }
+
+    // forget_udp_seqs drops the sequence numbers of the updates the Client sent over UDP for
+    //     an object it has lost sight of.  If it can still see the object some other way,
+    //     an update which arrives late may get through, as it could have before the first.
+    void forget_udp_seqs(doid_t do_id)
+    {
+        m_udp_seqs.erase(do_id);
     }
 
     // handle_interest_done is called when all of the objects from an opened interest have been
@@ -401,10 +510,36 @@ class AstronClient : public Client, public NetworkHandler
             return;
         }
 
+        // A client may ask for optional features, in which case it's told which it got.
+        bool has_features = dgi.get_remaining() > 0;
+        uint32_t features = has_features ? dgi.read_uint32() : 0;
+        UdpEndpoint *udp = m_client_agent->get_udp();
+        features &= (m_allow_bundling ? CLIENT_FEATURE_BUNDLE : 0) |
+                    (udp != nullptr ? CLIENT_FEATURE_UDP : 0);
+
         DatagramPtr resp = Datagram::create();
         resp->add_uint16(CLIENT_HELLO_RESP);
+        if(has_features) {
+            resp->add_uint32(features);
+        }
         m_client->send_datagram(resp);
 
+        if(features & CLIENT_FEATURE_UDP) {
+            m_udp = udp->open_session(this);
+
+            DatagramPtr token = Datagram::create();
+            token->add_uint16(CLIENT_UDP_TOKEN);
+            token->add_uint16(udp->get_port());
+            token->add_uint64(m_udp->get_token());
+            m_client->send_datagram(token);
+        }
+
+        // Anything sent after this may be bundled, so it's turned on last.
+        if(features & CLIENT_FEATURE_BUNDLE) {
+            m_bundling = true;
+            m_client->set_bundling(CLIENT_BUNDLE);
+        }
+
         m_state = CLIENT_STATE_ANONYMOUS;
     }
 
@@ -475,12 +610,98 @@ class AstronClient : public Client, public NetworkHandler
         }
     }
 
+    // handle_udp handles a message the Client sent over UDP: a heartbeat, which is answered
+    //     so the Client can tell that UDP gets through both ways, or an update to an
+    //     unreliable field.  Updates older than one already received for the field are dropped.
+    virtual void handle_udp(DatagramIterator &dgi, uint32_t seq)
+    {
+        uint16_t msg_type = dgi.read_uint16();
+        switch(msg_type) {
+        case CLIENT_HEARTBEAT: {
+            if(dgi.get_remaining() == sizeof(uint64_t)) {
+                // The answer to a challenge which has already been answered.
+                dgi.skip(sizeof(uint64_t));
+            }
+            handle_udp_heartbeat();
+        }
+        break;
+        case CLIENT_OBJECT_SET_FIELD: {
+            DatagramIterator peek = dgi;
+            doid_t do_id = peek.read_doid();
+            uint16_t field_id = peek.read_uint16();
+
+            const Field *field = g_dcf->get_field_by_id(field_id);
+            if(field == nullptr || !field->has_keyword("unreliable")) {
+                stringstream ss;
+                ss << "Client tried to send update for reliable field " << field_id
+                   << " over UDP.";
+                send_disconnect(CLIENT_DISCONNECT_FORBIDDEN_FIELD, ss.str(), true);
+                return;
+            }
+
+            if(lookup_object(do_id) == nullptr) {
+                // Not an object the Client knows, which is dealt with as over TCP; its seq
+                //     isn't remembered, so made-up objects can't fill up m_udp_seqs.
+                handle_client_object_update_field(dgi);
+                break;
+            }
+
+            auto last = m_udp_seqs[do_id].emplace(field_id, seq);
+            if(!last.second) {
+                if(int32_t(seq - last.first->second) <= 0) {
+                    dgi.skip(dgi.get_remaining());
+                    return;
+                }
+                last.first->second = seq;
+            }
+
+            handle_client_object_update_field(dgi);
+        }
+        break;
+        default:
+            stringstream ss;
+            ss << "Message type " << msg_type << " not valid over UDP.";
+            send_disconnect(CLIENT_DISCONNECT_INVALID_MSGTYPE, ss.str(), true);
+            return;
+        }
+    }
+
     // handle_client_heartbeat should ensure this client does not get reset for the current interval.
     // Handler for CLIENT_HEARTBEAT message
     virtual void handle_client_heartbeat()
     {
-        if(m_heartbeat_timer != nullptr) {
-            m_heartbeat_timer->reset();
+        // Once the timer has run out, a late heartbeat doesn't save the client.
+        if(m_heartbeat_timer.is_running()) {
+            m_heartbeat_timer.reset();
+        }
+    }
+
+    // handle_udp_heartbeat answers a heartbeat from the Client over UDP, over UDP.
+    void handle_udp_heartbeat()
+    {
+        handle_client_heartbeat();
+
+        DatagramPtr resp = Datagram::create();
+        resp->add_uint16(CLIENT_HEARTBEAT);
+        m_udp->send_datagram(resp);
+    }
+
+    // handle_udp_candidate handles a datagram with the Client's UDP token from another address
+    //     than the Client's.  If it's a heartbeat, it's answered there with a challenge; if
+    //     it's a heartbeat carrying that challenge, the Client has moved there.  Anything else
+    //     is ignored, as are malformed datagrams, since the Client may not have sent them.
+    void handle_udp_candidate(const DatagramHandle &dg)
+    {
+        DatagramIterator dgi(dg);
+        if(dg->size() == sizeof(uint16_t) && dgi.read_uint16() == CLIENT_HEARTBEAT) {
+            DatagramPtr challenge = Datagram::create();
+            challenge->add_uint16(CLIENT_HEARTBEAT);
+            m_udp->send_challenge(challenge);
+        } else if(dg->size() == sizeof(uint16_t) + sizeof(uint64_t) &&
+                  dgi.read_uint16() == CLIENT_HEARTBEAT &&
+                  m_udp->accept_challenge(dgi.read_uint64())) {
+            m_log->debug() << "UDP side-channel moved to a new address.\n";
+            handle_udp_heartbeat();
         }
     }
 
@@ -546,12 +767,16 @@ class AstronClient : public Client, public NetworkHandler
             }
         }
 
+        // The update is unpacked (checking it against the field) straight into the datagram that
+        // relays it, with room left in front for the server header once it's known to be valid.
         // If a datagram read-related exception occurs while unpacking data it will be handled by
         // receive_datagram and the client will be dc'd with "truncated datagram".
-        vector<uint8_t> data;
+        DatagramPtr resp = Datagram::create_with_headroom(Datagram::server_header_size(1));
+        resp->add_doid(do_id);
+        resp->add_uint16(field_id);
 
         try {
-            dgi.unpack_field(field, data);
+            dgi.unpack_field(field, *resp);
         } catch(const FieldConstraintViolation& violation) {
             // The field that was being updated has constraints.
             // One of its attributes (either length or value) violates the type constraints specified in our dclass.
@@ -565,12 +790,12 @@ class AstronClient : public Client, public NetworkHandler
 
         // If an exception occurs while packing data it will be handled by
         // receive_datagram and the client will be dc'd with "oversized datagram".
-        DatagramPtr resp = Datagram::create();
-        resp->add_server_header(do_id, m_channel, STATESERVER_OBJECT_SET_FIELD);
-        resp->add_doid(do_id);
-        resp->add_uint16(field_id);
-        resp->add_data(data);
-        route_datagram(resp);
+        resp->prepend_server_header(do_id, m_channel, STATESERVER_OBJECT_SET_FIELD);
+        if(field->has_keyword("unreliable")) {
+            route_unreliable(resp);
+        } else {
+            route_datagram(resp);
+        }
     }
 
     // handle_client_object_location occurs when a client sends an OBJECT_LOCATION message.
@@ -1,15 +1,16 @@
 #include "Client.h"
 #include "core/global.h"
 #include "core/msgtypes.h"
+#include "util/SmallVector.h"
 #include "clientagent/ClientMessages.h"
 #include "clientagent/ClientAgent.h"
 using namespace std;
 using dclass::Class;
 
 Client::Client(ConfigNode, ClientAgent* client_agent) :
-    m_client_agent(client_agent)
+    m_client_agent(client_agent), m_io(IOLoop::current())
 {
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    assert(m_io != nullptr);
 
     m_channel = m_client_agent->m_ct.alloc_channel();
     if(!m_channel) {
@@ -37,14 +38,14 @@ Client::~Client()
 {
     // We need to be holding our own lock, just in case another thread is busy
     // doing some last-microsecond cleanup.
-    lock_guard<recursive_mutex> lock(m_client_lock);
+    lock_guard<ParticipantLock> lock(m_client_lock);
 
     assert(!m_pending_interests.size());
 }
 
 void Client::annihilate()
 {
-    lock_guard<recursive_mutex> lock(m_client_lock);
+    lock_guard<ParticipantLock> lock(m_client_lock);
     if(is_terminated()) {
         return;
     }
@@ -92,8 +93,8 @@ void Client::generate_timeout(TimeoutSetCallback timeout_set_callback)
         m_pending_timeouts.push(timeout_set_callback);
     }
 
-    if(std::this_thread::get_id() != g_main_thread_id) {
-        TaskQueue::singleton.enqueue_task([self = this]() {
+    if(!m_io->in_loop_thread()) {
+        m_io->tasks().enqueue_task([self = this]() {
             self->generate_timeouts();
         });
     } else {
@@ -103,7 +104,7 @@ void Client::generate_timeout(TimeoutSetCallback timeout_set_callback)
 
 void Client::generate_timeouts()
 {
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    assert(m_io->in_loop_thread());
 
     if(m_is_generating_timeouts) {
         // Already in the middle of another generate_timeouts invocation.
@@ -156,16 +157,40 @@ const Class *Client::lookup_object(doid_t do_id)
     return nullptr;
 }
 
-// lookup_interests returns a list of all the interests that a parent-zone pair is visible to.
-vector<Interest> Client::lookup_interests(doid_t parent_id, zone_t zone_id)
+// count_interests returns the number of interests that a parent-zone pair is visible to.
+unsigned int Client::count_interests(doid_t parent_id, zone_t zone_id)
 {
-    vector<Interest> interests;
-    for(const auto& it : m_interests) {
-        if(parent_id == it.second.parent && (it.second.zones.find(zone_id) != it.second.zones.end())) {
-            interests.push_back(it.second);
+    auto it = m_location_interests.find(location_as_channel(parent_id, zone_id));
+    return it != m_location_interests.end() ? it->second : 0;
+}
+
+// set_interest adds or replaces an interest, moving its counts in m_location_interests
+// from the zones it had to the zones it has now.
+void Client::set_interest(const Interest &i)
+{
+    erase_interest(i.id);
+    for(const auto& it : i.zones) {
+        ++m_location_interests[location_as_channel(i.parent, it)];
+    }
+    m_interests[i.id] = i;
+}
+
+// erase_interest removes an interest, if it exists, along with its counts in
+// m_location_interests.
+void Client::erase_interest(uint16_t interest_id)
+{
+    auto interest = m_interests.find(interest_id);
+    if(interest == m_interests.end()) {
+        return;
+    }
+
+    for(const auto& it : interest->second.zones) {
+        auto count = m_location_interests.find(location_as_channel(interest->second.parent, it));
+        if(--count->second == 0) {
+            m_location_interests.erase(count);
         }
     }
-    return interests;
+    m_interests.erase(interest);
 }
 
 // build_interest will build an interest from a datagram. It is expected that the datagram
@@ -201,7 +226,7 @@ void Client::add_interest(Interest &i, uint32_t context, channel_t caller)
     unordered_set<zone_t> new_zones;
 
     for(const auto& it : i.zones) {
-        if(lookup_interests(i.parent, it).empty()) {
+        if(count_interests(i.parent, it) == 0) {
             new_zones.insert(it);
         }
     }
@@ -215,7 +240,7 @@ void Client::add_interest(Interest &i, uint32_t context, channel_t caller)
         unordered_set<zone_t> killed_zones;
 
         for(const auto& it : previous_interest.zones) {
-            if(lookup_interests(previous_interest.parent, it).size() > 1) {
+            if(count_interests(previous_interest.parent, it) > 1) {
                 // An interest other than the altered one can see this parent/zone,
                 // so we don't care about it.
                 continue;
@@ -231,7 +256,7 @@ void Client::add_interest(Interest &i, uint32_t context, channel_t caller)
         // Now that we know what zones to kill, let's get to it:
         close_zones(previous_interest.parent, killed_zones);
     }
-    m_interests[i.id] = i;
+    set_interest(i);
 
     if(new_zones.empty()) {
         // We aren't requesting any new zones with this operation, so don't
@@ -255,10 +280,13 @@ void Client::add_interest(Interest &i, uint32_t context, channel_t caller)
     resp->add_uint32(request_context);
     resp->add_doid(i.parent);
     resp->add_uint16(new_zones.size());
+    SmallVector<channel_t, 16> channels;
+    channels.reserve(new_zones.size());
     for(const auto& it : new_zones) {
         resp->add_zone(it);
-        subscribe_channel(location_as_channel(i.parent, it));
+        channels.push_back(location_as_channel(i.parent, it));
     }
+    subscribe_channels(channels.data(), channels.size());
     route_datagram(resp);
 }
 
@@ -269,7 +297,7 @@ void Client::remove_interest(Interest &i, uint32_t context, channel_t caller)
     unordered_set<zone_t> killed_zones;
 
     for(const auto& it : i.zones) {
-        if(lookup_interests(i.parent, it).size() == 1) {
+        if(count_interests(i.parent, it) == 1) {
             // We're the only interest who can see this zone, so let's kill it.
             killed_zones.insert(it);
         }
@@ -281,7 +309,7 @@ void Client::remove_interest(Interest &i, uint32_t context, channel_t caller)
     notify_interest_done(i.id, caller);
     handle_interest_done(i.id, context);
 
-    m_interests.erase(i.id);
+    erase_interest(i.id);
 }
 
 // cloze_zones removes objects visible through the zones from the client and unsubscribes
@@ -291,37 +319,73 @@ void Client::close_zones(doid_t parent, const unordered_set<zone_t> &killed_zone
     // Kill off all objects that are in the matched parent/zones:
 
     vector<doid_t> to_remove;
-    for(const auto& it : m_visible_objects) {
-        const VisibleObject& visible_object = it.second;
-        if(visible_object.parent != parent) {
-            // Object does not belong to the parent in question; ignore.
+    for(const auto& zone : killed_zones) {
+        auto objects = m_location_objects.find(location_as_channel(parent, zone));
+        if(objects == m_location_objects.end()) {
             continue;
         }
 
-        if(killed_zones.find(visible_object.zone) != killed_zones.end()) {
-            if(m_session_objects.find(visible_object.id) != m_session_objects.end()) {
+        for(const auto& do_id : objects->second) {
+            if(m_session_objects.find(do_id) != m_session_objects.end()) {
                 // This object is a session object. The client should be disconnected.
                 send_disconnect(CLIENT_DISCONNECT_SESSION_OBJECT_DELETED,
                                 "A session object has unexpectedly left interest.");
                 return;
             }
 
-            handle_remove_object(visible_object.id);
+            handle_remove_object(do_id);
 
-            m_seen_objects.erase(visible_object.id);
-            m_historical_objects.insert(visible_object.id);
-            to_remove.push_back(visible_object.id);
+            m_seen_objects.erase(do_id);
+            m_historical_objects.insert(do_id);
+            to_remove.push_back(do_id);
         }
     }
 
     for(const auto& it : to_remove) {
-        m_visible_objects.erase(it);
+        erase_visible_object(it);
     }
 
     // Close all of the channels:
+    SmallVector<channel_t, 16> channels;
+    channels.reserve(killed_zones.size());
     for(const auto& it : killed_zones) {
-        unsubscribe_channel(location_as_channel(parent, it));
+        channels.push_back(location_as_channel(parent, it));
     }
+    unsubscribe_channels(channels.data(), channels.size());
+}
+
+// add_visible_object makes an object visible, at the location it has.
+void Client::add_visible_object(const VisibleObject &obj)
+{
+    m_visible_objects[obj.id] = obj;
+    m_location_objects[location_as_channel(obj.parent, obj.zone)].insert(obj.id);
+}
+
+// move_visible_object changes the location of a visible object.
+void Client::move_visible_object(doid_t do_id, doid_t parent, zone_t zone)
+{
+    VisibleObject obj = m_visible_objects[do_id];
+    erase_visible_object(do_id);
+    obj.parent = parent;
+    obj.zone = zone;
+    add_visible_object(obj);
+}
+
+// erase_visible_object makes an object no longer visible, if it was.
+void Client::erase_visible_object(doid_t do_id)
+{
+    auto it = m_visible_objects.find(do_id);
+    if(it == m_visible_objects.end()) {
+        return;
+    }
+
+    channel_t location = location_as_channel(it->second.parent, it->second.zone);
+    auto objects = m_location_objects.find(location);
+    objects->second.erase(do_id);
+    if(objects->second.empty()) {
+        m_location_objects.erase(objects);
+    }
+    m_visible_objects.erase(it);
 }
 
 // is_historical_object returns true if the object was once visible to the client, but has
@@ -349,7 +413,7 @@ void Client::send_disconnect(uint16_t reason, const string &error_string, bool s
 // handle_datagram is the handler for datagrams received from the Astron cluster
 void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
 {
-    lock_guard<recursive_mutex> lock(m_client_lock);
+    lock_guard<ParticipantLock> lock(m_client_lock);
     if(is_terminated()) {
         return;
     }
@@ -414,9 +478,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
     }
     break;
     case CLIENTAGENT_SEND_DATAGRAM: {
-        DatagramPtr forward = Datagram::create();
-        forward->add_data(dgi.read_datagram());
-        forward_datagram(forward);
+        forward_datagram(dgi.read_datagram_view());
     }
     break;
     case CLIENTAGENT_OPEN_CHANNEL: {
@@ -428,7 +490,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
     }
     break;
     case CLIENTAGENT_ADD_POST_REMOVE: {
-        add_post_remove(m_allocated_channel, dgi.read_datagram());
+        add_post_remove(m_allocated_channel, dgi.read_datagram_view());
     }
     break;
     case CLIENTAGENT_CLEAR_POST_REMOVES: {
@@ -461,6 +523,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
         }
 
         m_declared_objects.erase(do_id);
+        handle_undeclare_object(do_id);
     }
     break;
     case CLIENTAGENT_SET_FIELDS_SENDABLE: {
@@ -587,7 +650,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
         }
 
         m_historical_objects.insert(do_id);
-        m_visible_objects.erase(do_id);
+        erase_visible_object(do_id);
     }
     break;
     case STATESERVER_OBJECT_ENTER_OWNER_WITH_REQUIRED_OTHER:
@@ -687,18 +750,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
         doid_t n_parent = dgi.read_doid();
         zone_t n_zone = dgi.read_zone();
 
-        bool disable = true;
-        for(const auto& it : m_interests) {
-            const Interest& i = it.second;
-            if (i.parent == n_parent) {
-                for(const auto& it2 : i.zones) {
-                    if(it2 == n_zone) {
-                        disable = false;
-                        break;
-                    }
-                }
-            }
-        }
+        bool disable = count_interests(n_parent, n_zone) == 0;
 
         bool visible = m_visible_objects.find(do_id) != m_visible_objects.end();
         bool owned = m_owned_objects.find(do_id) != m_owned_objects.end();
@@ -712,8 +764,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
         bool session = m_session_objects.find(do_id) != m_session_objects.end();
 
         if(visible) {
-            m_visible_objects[do_id].parent = n_parent;
-            m_visible_objects[do_id].zone = n_zone;
+            move_visible_object(do_id, n_parent, n_zone);
         }
 
         if(owned) {
@@ -745,7 +796,7 @@ void Client::handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi)
             handle_remove_object(do_id);
             m_seen_objects.erase(do_id);
             m_historical_objects.insert(do_id);
-            m_visible_objects.erase(do_id);
+            erase_visible_object(do_id);
         }
 
         else {
@@ -827,7 +878,7 @@ void Client::handle_object_entrance(DatagramIterator &dgi, bool other)
         obj.dcc = g_dcf->get_class_by_id(dc_id);
         obj.parent = parent;
         obj.zone = zone;
-        m_visible_objects[do_id] = obj;
+        add_visible_object(obj);
     }
     m_seen_objects.insert(do_id);
 
@@ -888,7 +939,7 @@ InterestOperation::~InterestOperation()
 
 void InterestOperation::on_timeout_generate(Timeout* timeout)
 {
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    assert(m_client->m_io->in_loop_thread());
 
     m_timeout = timeout;
     m_timeout->initialize(m_timeout_interval, bind(&InterestOperation::timeout, this));
@@ -897,7 +948,7 @@ void InterestOperation::on_timeout_generate(Timeout* timeout)
 
 void InterestOperation::timeout()
 {
-    lock_guard<recursive_mutex> lock(m_client->m_client_lock);
+    lock_guard<ParticipantLock> lock(m_client->m_client_lock);
     m_client->m_log->warning() << "Interest operation timed out; forcing.\n";
     finish(true);
 }
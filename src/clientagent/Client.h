@@ -104,9 +104,21 @@ class Client : public MDParticipantInterface
     // handle_datagram is the handler for datagrams received from the server
     void handle_datagram(DatagramHandle dg, DatagramIterator &dgi);
 
+    // begin_inbox_drain and end_inbox_drain hold m_client_lock over a batch of the
+    // client's inbox; if the client is busy elsewhere, the batch waits until it lets go.
+    virtual bool begin_inbox_drain()
+    {
+        return m_client_lock.try_lock();
+    }
+    virtual void end_inbox_drain()
+    {
+        m_client_lock.unlock();
+    }
+
   protected:
-    std::recursive_mutex m_client_lock;     // The lock guarding the client.
+    ParticipantLock m_client_lock {this};   // The lock guarding the client.
     ClientAgent* m_client_agent;            // The ClientAgent handling this client
+    IOLoop* m_io;                           // The loop the client was created on, for its timeouts
     ClientState m_state = CLIENT_STATE_NEW; // Current state of the Client state machine
     channel_t m_channel = 0;                // Current channel client is listening on
     channel_t m_allocated_channel = 0;      // Channel assigned to client at creation time
@@ -123,6 +135,8 @@ class Client : public MDParticipantInterface
     std::unordered_set<doid_t> m_historical_objects;
     // m_visible_objects is a map which relates all visible objects to VisibleObject metadata.
     std::unordered_map<doid_t, VisibleObject> m_visible_objects;
+    // m_location_objects indexes m_visible_objects by location (see location_as_channel).
+    std::unordered_map<channel_t, std::unordered_set<doid_t> > m_location_objects;
     // m_declared_objects is a map of declared objects to their metadata.
     std::unordered_map<doid_t, DeclaredObject> m_declared_objects;
     // m_owned_objects is a map of all owned objects to their metadata
@@ -132,6 +146,9 @@ class Client : public MDParticipantInterface
 
     // m_interests is a map of interest ids to interests.
     std::unordered_map<uint16_t, Interest> m_interests;
+    // m_location_interests is the number of interests open on each location (see
+    // location_as_channel); locations without any aren't in it.
+    std::unordered_map<channel_t, unsigned int> m_location_interests;
     // m_pending_interests is a map of contexts to in-progress interests.
     std::unordered_map<uint32_t, InterestOperation*> m_pending_interests;
     // m_fields_sendable is a map of DoIds to sendable field sets.
@@ -159,8 +176,8 @@ class Client : public MDParticipantInterface
     // If that object is not visible to the client, nullptr will be returned instead.
     const dclass::Class* lookup_object(doid_t do_id);
 
-    // lookup_interests returns a list of all the interests that a parent-zone pair is visible to.
-    std::vector<Interest> lookup_interests(doid_t parent_id, zone_t zone_id);
+    // count_interests returns the number of interests that a parent-zone pair is visible to.
+    unsigned int count_interests(doid_t parent_id, zone_t zone_id);
 
     // build_interest will build an interest from a datagram. It is expected that the datagram
     // iterator is positioned such that next item to be read is the interest_id.
@@ -181,6 +198,12 @@ class Client : public MDParticipantInterface
     // from the associated location channels for those objects.
     void close_zones(doid_t parent, const std::unordered_set<zone_t> &killed_zones);
 
+    // add_visible_object, move_visible_object and erase_visible_object change
+    // m_visible_objects, keeping m_location_objects in step with it.
+    void add_visible_object(const VisibleObject &obj);
+    void move_visible_object(doid_t do_id, doid_t parent, zone_t zone);
+    void erase_visible_object(doid_t do_id);
+
     // is_historical_object returns true if the object was once visible to the client, but has
     // since been deleted.  The return is still true even if the object has become visible again.
     bool is_historical_object(doid_t do_id);
@@ -247,6 +270,12 @@ class Client : public MDParticipantInterface
     // Handle when the client loses ownership of an object.
     virtual void handle_remove_ownership(doid_t do_id) = 0;
 
+    // handle_undeclare_object is called when an object declared to the client is undeclared.
+    //     The client isn't told; this is only for cleaning up anything kept for the object.
+    virtual void handle_undeclare_object(doid_t)
+    {
+    }
+
     // handle_interest_done is called when all of the objects from an opened interest have been
     // received. Typically, informs the client that a particular group of objects is loaded.
     virtual void handle_interest_done(uint16_t interest_id, uint32_t context) = 0;
@@ -266,5 +295,9 @@ class Client : public MDParticipantInterface
     // interest operation's caller, if one has been set.
     void notify_interest_done(uint16_t interest_id, channel_t caller);
     void notify_interest_done(const InterestOperation* iop);
+    // set_interest and erase_interest change m_interests, keeping m_location_interests in
+    // step with it.
+    void set_interest(const Interest &i);
+    void erase_interest(uint16_t interest_id);
     bool m_is_generating_timeouts = false;
 };
@@ -7,6 +7,7 @@
 #include "config/constraints.h"
 #include "dclass/file/hash.h"
 #include "net/TcpAcceptor.h"
+#include "net/address_utils.h"
 using namespace std;
 
 RoleConfigGroup clientagent_config("clientagent");
@@ -33,8 +34,19 @@ bool have_client_type(const string& backend)
 ConfigConstraint<string> client_type_exists(have_client_type, ca_client_type,
         "No Client handler exists for the given client type.");
 
+static ConfigGroup udp_config("udp", clientagent_config);
+static ConfigVariable<string> udp_bind_addr("bind", "", udp_config);
+static ConfigVariable<unsigned int> udp_timeout("timeout", 5000, udp_config);
+static bool is_valid_udp_address(const string& str)
+{
+    return str.empty() || is_valid_address(str);
+}
+static ConfigConstraint<string> valid_udp_bind_addr(is_valid_udp_address, udp_bind_addr,
+        "String is not a valid IPv4/IPv6 address or hostname.");
+
 static ConfigGroup tuning_config("tuning", clientagent_config);
 static ConfigVariable<unsigned long> interest_timeout("interest_timeout", 500, tuning_config);
+static ConfigVariable<unsigned int> io_threads("io_threads", 0, tuning_config);
 
 ClientAgent::ClientAgent(RoleConfig roleconfig) : Role(roleconfig), m_net_acceptor(nullptr),
     m_server_version(server_version.get_rval(roleconfig))
@@ -50,7 +62,7 @@ ClientAgent::ClientAgent(RoleConfig roleconfig) : Role(roleconfig), m_net_accept
 
     // ... and also the channel range ...
     ConfigNode channels = clientagent_config.get_child_node(channels_config, roleconfig);
-    m_ct = ChannelTracker(min_channel.get_rval(channels), max_channel.get_rval(channels));
+    m_ct.set_range(min_channel.get_rval(channels), max_channel.get_rval(channels));
 
     // ... then store a copy of the client config.
     m_clientconfig = clientagent_config.get_child_node(ca_client_config, roleconfig);
@@ -66,6 +78,7 @@ ClientAgent::ClientAgent(RoleConfig roleconfig) : Role(roleconfig), m_net_accept
     // Load tuning parameters.
     ConfigNode tuning = clientagent_config.get_child_node(tuning_config, roleconfig);
     m_interest_timeout = interest_timeout.get_rval(tuning);
+    unsigned int num_io_threads = io_threads.get_rval(tuning);
 
     TcpAcceptorCallback callback = std::bind(&ClientAgent::handle_tcp, this,
                                    std::placeholders::_1,
@@ -75,10 +88,28 @@ ClientAgent::ClientAgent(RoleConfig roleconfig) : Role(roleconfig), m_net_accept
     AcceptorErrorCallback err_callback = std::bind(&ClientAgent::handle_error, this,
                                             std::placeholders::_1);
 
-    m_net_acceptor = std::unique_ptr<TcpAcceptor>(new TcpAcceptor(callback, err_callback));
+    TcpAcceptor *acceptor = new TcpAcceptor(callback, err_callback);
+    m_net_acceptor = std::unique_ptr<TcpAcceptor>(acceptor);
 
     m_net_acceptor->set_haproxy_mode(behind_haproxy.get_rval(m_roleconfig));
 
+    // Spread the clients' network I/O over a pool of loops, if we're to have one.
+    if(num_io_threads > 0) {
+        m_io_loops = std::unique_ptr<IOLoopPool>(new IOLoopPool(num_io_threads));
+        acceptor->set_io_loops(m_io_loops.get());
+    }
+
+    // Open the UDP side-channel, if we're to have one.
+    ConfigNode udp = clientagent_config.get_child_node(udp_config, roleconfig);
+    string udp_addr = udp_bind_addr.get_rval(udp);
+    if(!udp_addr.empty()) {
+        m_udp = std::make_shared<UdpEndpoint>(udp_timeout.get_rval(udp));
+        if(!m_udp->bind(udp_addr, 7199)) {
+            m_log->fatal() << "Failed to bind to UDP address: " << udp_addr << "\n";
+            exit(1);
+        }
+    }
+
     // Begin listening for new Clients
     m_net_acceptor->bind(bind_addr.get_rval(m_roleconfig), 7198);
     m_net_acceptor->start();
@@ -122,8 +153,16 @@ ChannelTracker::ChannelTracker(channel_t min, channel_t max) : m_next(min), m_ma
 {
 }
 
+void ChannelTracker::set_range(channel_t min, channel_t max)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_next = min;
+    m_max = max;
+}
+
 channel_t ChannelTracker::alloc_channel()
 {
+    std::lock_guard<std::mutex> lock(m_lock);
     if(m_next <= m_max) {
         return m_next++;
     } else {
@@ -138,5 +177,6 @@ channel_t ChannelTracker::alloc_channel()
 
 void ChannelTracker::free_channel(channel_t channel)
 {
+    std::lock_guard<std::mutex> lock(m_lock);
     m_unused_channels.push(channel);
 }
@@ -1,25 +1,31 @@
 #pragma once
 #include "core/Role.h"
 #include "Client.h"
+#include "util/IOLoop.h"
+#include "net/UdpEndpoint.h"
 
 #include <memory>
+#include <mutex>
 
 extern RoleConfigGroup clientagent_config;
 extern KeyedConfigGroup ca_client_config;
 extern ConfigVariable<std::string> ca_client_type;
 
 // A ChannelTracker is used to keep track of available and allocated channels that
-// the ClientAgent can use to assign to new Clients.
+// the ClientAgent can use to assign to new Clients.  It may be used from any thread.
 // TODO: Consider moving to util/ this class might be reusable in other roles that utilize ranges.
 class ChannelTracker
 {
   public:
     ChannelTracker(channel_t min = INVALID_CHANNEL, channel_t max = INVALID_CHANNEL);
 
+    // set_range sets the range of channels to hand out, before any have been.
+    void set_range(channel_t min, channel_t max);
     channel_t alloc_channel();
     void free_channel(channel_t channel);
 
   private:
+    std::mutex m_lock;
     channel_t m_next;
     channel_t m_max;
     std::queue<channel_t> m_unused_channels;
@@ -33,6 +39,7 @@ class ClientAgent final : public Role
     ClientAgent(RoleConfig rolconfig);
 
     // handle_tcp generates a new Client object from a raw tcp connection.
+    // It runs on the loop the connection belongs to, which with io_threads isn't the main one.
     void handle_tcp(const std::shared_ptr<uvw::TcpHandle> &socket,
                     const uvw::Addr &remote,
                     const uvw::Addr &local,
@@ -60,8 +67,16 @@ class ClientAgent final : public Role
         return m_log.get();
     }
 
+    // get_udp returns the UDP side-channel for clients, or nullptr if there isn't one.
+    UdpEndpoint *get_udp()
+    {
+        return m_udp.get();
+    }
+
   private:
     std::unique_ptr<NetworkAcceptor> m_net_acceptor;
+    std::unique_ptr<IOLoopPool> m_io_loops;
+    std::shared_ptr<UdpEndpoint> m_udp;
     std::string m_client_type;
     std::string m_server_version;
     ChannelTracker m_ct;
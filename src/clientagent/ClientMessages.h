@@ -5,6 +5,8 @@
 #define CLIENT_DISCONNECT 3
 #define CLIENT_EJECT 4
 #define CLIENT_HEARTBEAT 5
+#define CLIENT_BUNDLE 6
+#define CLIENT_UDP_TOKEN 7
 #define CLIENT_OBJECT_SET_FIELD 120
 #define CLIENT_OBJECT_SET_FIELDS 121
 #define CLIENT_OBJECT_LEAVING 132
@@ -19,6 +21,10 @@
 #define CLIENT_ADD_INTEREST_MULTIPLE 201
 #define CLIENT_REMOVE_INTEREST 203
 
+// Features a client may ask for in its CLIENT_HELLO
+#define CLIENT_FEATURE_BUNDLE 0x0001
+#define CLIENT_FEATURE_UDP 0x0002
+
 #define CLIENT_DISCONNECT_GENERIC 1
 #define CLIENT_DISCONNECT_OVERSIZED_DATAGRAM 106
 #define CLIENT_DISCONNECT_NO_HELLO 107
@@ -196,6 +196,8 @@ int main(int argc, char *argv[])
     dcf->add_keyword("ownsend");
     dcf->add_keyword("ownrecv");
     dcf->add_keyword("airecv");
+    dcf->add_keyword("conflate");
+    dcf->add_keyword("unreliable");
     vector<string> dc_file_names = dc_files.get_val();
     for(auto it = dc_file_names.begin(); it != dc_file_names.end(); ++it) {
         bool ok = dclass::append(dcf, *it);
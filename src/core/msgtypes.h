@@ -34,6 +34,11 @@ enum MessageTypes {
     CONTROL_REMOVE_CHANNEL     = 9001,
     CONTROL_ADD_RANGE          = 9002,
     CONTROL_REMOVE_RANGE       = 9003,
+    CONTROL_ADD_CHANNELS       = 9004,
+    CONTROL_REMOVE_CHANNELS    = 9005,
+    CONTROL_ENABLE_FILTER      = 9006,
+    CONTROL_FILTER_RESET       = 9007,
+    CONTROL_FILTER_ADD         = 9008,
     CONTROL_ADD_POST_REMOVE    = 9010,
     CONTROL_CLEAR_POST_REMOVES = 9011,
     CONTROL_SET_CON_NAME       = 9012,
@@ -8,6 +8,16 @@ using namespace std;
 using dclass::Field;
 using dclass::Class;
 
+// fields_size returns the number of bytes a list of (field id, value) pairs takes up in a datagram.
+static size_t fields_size(const FieldValues& fields)
+{
+    size_t size = 0;
+    for(const auto& it : fields) {
+        size += sizeof(uint16_t) + it.second.size();
+    }
+    return size;
+}
+
 void DBOperation::cleanup()
 {
     m_dbserver->clear_operation(this);
@@ -52,6 +62,7 @@ void DBOperation::announce_fields(const FieldValues& fields)
                                   multi ? DBSERVER_OBJECT_SET_FIELDS :
                                   DBSERVER_OBJECT_SET_FIELD);
         update->add_doid(m_doid);
+        update->reserve(update->size() + sizeof(uint16_t) + fields_size(changed_fields));
         if(multi) {
             update->add_uint16(changed_fields.size());
         }
@@ -392,8 +403,7 @@ void DBOperationGet::on_complete(DBObjectSnapshot *snapshot)
             // Try and unpack the field contents using a DatagramIterator.
             // If we get a FieldConstraintViolation, the field in this object (as serialised in the DB) is invalid.
             // If we get a DatagramIteratorEOF, we have a short read for this field.
-            DatagramPtr dg = Datagram::create();
-            dg->add_data(it.second);
+            DatagramPtr dg = Datagram::create(it.second);
             DatagramIterator dgi(dg);
             dgi.unpack_field(it.first, buffer);
         } catch(const FieldConstraintViolation& violation) {
@@ -409,6 +419,8 @@ void DBOperationGet::on_complete(DBObjectSnapshot *snapshot)
         }
     }
 
+    resp->reserve(resp->size() + 2 * sizeof(uint16_t) + fields_size(response_fields));
+
     // WHAT we send depends on our m_resp_msgtype, so:
     if(m_resp_msgtype == DBSERVER_OBJECT_GET_FIELD_RESP) {
         if(response_fields.empty()) {
@@ -687,6 +699,7 @@ void DBOperationUpdate::on_criteria_mismatch(DBObjectSnapshot *snapshot)
         }
     }
 
+    resp->reserve(resp->size() + sizeof(uint16_t) + fields_size(mismatched_fields));
     if(m_resp_msgtype == DBSERVER_OBJECT_SET_FIELDS_IF_EQUALS_RESP) {
         resp->add_uint16(mismatched_fields.size());
     }
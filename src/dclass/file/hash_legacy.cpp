@@ -172,7 +172,7 @@ void hash_keywords(HashGenerator& hashgen, const KeywordList* list)
         const char* keyword;
         int flag;
     };
-    static LegacyKeyword legacy_keywords[] = {
+    static const LegacyKeyword legacy_keywords[] = {
         { "required", 0x0001 },
         { "broadcast", 0x0002 },
         { "ownrecv", 0x0004 },
@@ -182,7 +182,6 @@ void hash_keywords(HashGenerator& hashgen, const KeywordList* list)
         { "clrecv", 0x0040 },
         { "ownsend", 0x0080 },
         { "airecv", 0x0100 },
-        { nullptr, 0 }
     };
 
     size_t num_keywords = list->get_num_keywords();
@@ -191,9 +190,9 @@ void hash_keywords(HashGenerator& hashgen, const KeywordList* list)
     for(size_t i{}; i < num_keywords; ++i) {
         bool set_flag = false;
         string keyword = list->get_keyword(i);
-        for(size_t j{}; j < sizeof(legacy_keywords); ++j) {
-            if(keyword == legacy_keywords[j].keyword) {
-                flags |= legacy_keywords[j].flag;
+        for(const auto& legacy : legacy_keywords) {
+            if(keyword == legacy.keyword) {
+                flags |= legacy.flag;
                 set_flag = true;
                 break;
             }
@@ -0,0 +1,212 @@
+#include "ChannelFilter.h"
+#include <algorithm>
+#include <thread>
+#include "ChannelIndex.h"
+
+typedef boost::icl::discrete_interval<channel_t> interval_t;
+
+static inline size_t bit_for(channel_t c)
+{
+    return channel_hash(c) & (ChannelFilter::BITS - 1);
+}
+
+ChannelFilter::ChannelFilter(bool pass_all) : m_pass_all(pass_all),
+    m_words(new std::atomic<uint64_t>[WORDS])
+{
+    for(size_t i = 0; i < WORDS; ++i) {
+        m_words[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+bool ChannelFilter::wants(channel_t c) const
+{
+    return wants_any(&c, 1);
+}
+
+bool ChannelFilter::wants_any(const channel_t *cl, size_t count) const
+{
+    if(m_pass_all.load(std::memory_order_acquire)) {
+        return true;
+    }
+
+    for(size_t i = 0; i < count; ++i) {
+        size_t bit = bit_for(cl[i]);
+        if(m_words[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64))) {
+            return true;
+        }
+    }
+
+    return m_has_ranges.load(std::memory_order_acquire) && in_ranges(cl, count);
+}
+
+bool ChannelFilter::in_ranges(const channel_t *cl, size_t count) const
+{
+    // Register as a reader before looking at which copy is active; see publish().
+    unsigned int epoch = m_read_epoch.load(std::memory_order_seq_cst);
+    m_readers[epoch].count.fetch_add(1, std::memory_order_seq_cst);
+
+    const RangeList &ranges = m_snapshots[m_active.load(std::memory_order_seq_cst)];
+    bool found = false;
+    for(size_t i = 0; i < count && !found; ++i) {
+        // The first range ending at or after the channel is the only one that can hold it.
+        auto it = std::lower_bound(ranges.begin(), ranges.end(), cl[i],
+        [](const std::pair<channel_t, channel_t> &range, channel_t c) {
+            return range.second < c;
+        });
+        found = it != ranges.end() && it->first <= cl[i];
+    }
+
+    m_readers[epoch].count.fetch_sub(1, std::memory_order_release);
+    return found;
+}
+
+void ChannelFilter::publish()
+{
+    // Rebuild the copy nobody is reading, and point new readers at it...
+    unsigned int stale = m_active.load(std::memory_order_relaxed);
+    RangeList &next = m_snapshots[1 - stale];
+    next.clear();
+    for(const auto& it : m_ranges) {
+        next.push_back(std::make_pair(boost::icl::first(it), boost::icl::last(it)));
+    }
+    m_active.store(1 - stale, std::memory_order_seq_cst);
+    m_has_ranges.store(!m_ranges.empty(), std::memory_order_release);
+
+    // ...then wait out everyone who might still be reading the stale copy, so the
+    // next publish can rebuild it.  As in ChannelMap::publish, drain both epochs.
+    unsigned int epoch = m_read_epoch.load(std::memory_order_relaxed);
+    while(m_readers[1 - epoch].count.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+    }
+    m_read_epoch.store(1 - epoch, std::memory_order_seq_cst);
+    while(m_readers[epoch].count.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+    }
+}
+
+bool ChannelFilter::add_channel(channel_t c)
+{
+    if(pass_all()) {
+        return false;
+    }
+
+    size_t bit = bit_for(c);
+    uint64_t mask = uint64_t(1) << (bit % 64);
+    return !(m_words[bit / 64].fetch_or(mask, std::memory_order_release) & mask);
+}
+
+bool ChannelFilter::add_range(channel_t lo, channel_t hi)
+{
+    if(pass_all()) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_write_lock);
+        interval_t range = interval_t::closed(lo, hi);
+        if(boost::icl::contains(m_ranges, range)) {
+            return false;
+        }
+
+        if(m_ranges.iterative_size() < MAX_RANGES) {
+            m_ranges += range;
+            publish();
+            return true;
+        }
+    }
+
+    // Too many ranges to keep track of; fall back to wanting everything.
+    return set_pass_all();
+}
+
+bool ChannelFilter::set_pass_all()
+{
+    return !m_pass_all.exchange(true, std::memory_order_acq_rel);
+}
+
+void ChannelFilter::merge(const ChannelFilter &other)
+{
+    if(other.pass_all()) {
+        set_pass_all();
+        return;
+    }
+
+    for(size_t i = 0; i < WORDS; ++i) {
+        m_words[i].fetch_or(other.m_words[i].load(std::memory_order_relaxed), std::memory_order_release);
+    }
+
+    std::vector<std::pair<channel_t, channel_t>> ranges;
+    {
+        std::lock_guard<std::mutex> lock(other.m_write_lock);
+        for(const auto& it : other.m_ranges) {
+            ranges.push_back(std::make_pair(boost::icl::first(it), boost::icl::last(it)));
+        }
+    }
+    for(const auto& it : ranges) {
+        add_range(it.first, it.second);
+    }
+}
+
+void ChannelFilter::clear()
+{
+    m_pass_all.store(false, std::memory_order_release);
+    for(size_t i = 0; i < WORDS; ++i) {
+        m_words[i].store(0, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    m_ranges.clear();
+    publish();
+}
+
+void ChannelFilter::write(DatagramPtr dg) const
+{
+    dg->add_bool(pass_all());
+    for(size_t i = 0; i < WORDS; ++i) {
+        dg->add_uint64(m_words[i].load(std::memory_order_relaxed));
+    }
+
+    std::lock_guard<std::mutex> lock(m_write_lock);
+    dg->add_uint16(m_ranges.iterative_size());
+    for(const auto& it : m_ranges) {
+        dg->add_channel(boost::icl::first(it));
+        dg->add_channel(boost::icl::last(it));
+    }
+}
+
+void ChannelFilter::read(DatagramIterator &dgi)
+{
+    // Read everything before changing anything, in case the datagram is truncated.
+    bool pass_all = dgi.read_bool();
+    std::vector<uint64_t> words(WORDS);
+    for(auto& word : words) {
+        word = dgi.read_uint64();
+    }
+    boost::icl::interval_set<channel_t> ranges;
+    uint16_t range_count = dgi.read_uint16();
+    for(uint16_t i = 0; i < range_count; ++i) {
+        channel_t lo = dgi.read_channel();
+        channel_t hi = dgi.read_channel();
+        ranges += interval_t::closed(lo, hi);
+    }
+
+    // If we're going to want everything, say so first; otherwise, say so last.
+    if(pass_all) {
+        set_pass_all();
+    }
+
+    // Each word goes straight from its old value to its new one, so bits set in both
+    //     are never seen clear.  Readers see either the old ranges or the new, likewise.
+    for(size_t i = 0; i < WORDS; ++i) {
+        m_words[i].store(words[i], std::memory_order_release);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_write_lock);
+        m_ranges.swap(ranges);
+        publish();
+    }
+
+    if(!pass_all) {
+        m_pass_all.store(false, std::memory_order_release);
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/icl/interval_set.hpp>
+#include "core/types.h"
+#include "util/Datagram.h"
+#include "util/DatagramIterator.h"
+
+// A ChannelFilter is a conservative summary of a set of channels: wants() may return
+//     true for a channel that isn't in the set, but never false for one that is.
+// Individual channels are hashed into a fixed-size bitmap, ranges are kept exactly
+//     (up to MAX_RANGES of them), and pass_all stands in for "everything".
+//
+// It is used between Message Directors to tell a downstream MD which channels the rest
+//     of the cluster wants, so that it doesn't forward datagrams nobody else will read.
+//     Reads are safe from any thread and never lock; changes must come from one thread
+//     at a time.
+class ChannelFilter
+{
+  public:
+    static const size_t BITS = 1 << 16;
+    static const size_t WORDS = BITS / 64;
+    static const size_t MAX_RANGES = 1024;
+
+    ChannelFilter(bool pass_all = false);
+    ChannelFilter(const ChannelFilter&) = delete;
+    ChannelFilter &operator=(const ChannelFilter&) = delete;
+
+    // wants returns true if c might be in the set.
+    bool wants(channel_t c) const;
+    // wants_any returns true if any of the count channels at cl might be in the set.
+    bool wants_any(const channel_t *cl, size_t count) const;
+
+    inline bool pass_all() const
+    {
+        return m_pass_all.load(std::memory_order_acquire);
+    }
+
+    // These add to the set, returning true if the filter changed as a result.
+    bool add_channel(channel_t c);
+    bool add_range(channel_t lo, channel_t hi);
+    bool set_pass_all();
+
+    // merge adds everything in other to this filter.
+    void merge(const ChannelFilter &other);
+    // clear empties the filter.  Not safe while it's in use; see read() instead.
+    void clear();
+
+    // write adds the filter's full state to dg; read replaces the filter with the state
+    //     written by write().  Throughout a read, wants() is true for every channel that
+    //     was in the set either before or after it.
+    void write(DatagramPtr dg) const;
+    void read(DatagramIterator &dgi);
+
+  private:
+    typedef std::vector<std::pair<channel_t, channel_t>> RangeList;
+
+    std::atomic<bool> m_pass_all;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_words;
+
+    // The ranges as writers see them, guarded by m_write_lock.
+    mutable std::mutex m_write_lock;
+    boost::icl::interval_set<channel_t> m_ranges;
+
+    // The ranges as readers see them: sorted, disjoint copies of m_ranges, published
+    //     left-right the same way as ChannelMap's lockless indexes.  Readers use
+    //     m_snapshots[m_active]; a writer rebuilds the other one, flips m_active, then
+    //     waits out anyone still reading the old one.
+    RangeList m_snapshots[2];
+    std::atomic<unsigned int> m_active {0};
+    std::atomic<bool> m_has_ranges {false};
+    std::atomic<unsigned int> m_read_epoch {0};
+    struct ReaderCount {
+        std::atomic<uint64_t> count {0};
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    mutable ReaderCount m_readers[2];
+
+    // in_ranges returns true if any of the count channels at cl is in a published range.
+    bool in_ranges(const channel_t *cl, size_t count) const;
+    // publish makes m_ranges visible to readers; called with m_write_lock held.
+    void publish();
+};
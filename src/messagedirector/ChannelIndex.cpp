@@ -0,0 +1,270 @@
+#include "ChannelIndex.h"
+#include <algorithm>
+
+static const size_t INITIAL_CAPACITY = 16;
+
+static inline bool contains(const SubscriberList &list, ChannelSubscriber *p)
+{
+    return std::find(list.begin(), list.end(), p) != list.end();
+}
+
+ChannelIndex::ChannelIndex() : m_mask(0), m_size(0)
+{
+    rehash(INITIAL_CAPACITY);
+}
+
+ChannelIndex::ChannelIndex(const ChannelIndex &other) : m_mask(0), m_size(0)
+{
+    *this = other;
+}
+
+ChannelIndex &ChannelIndex::operator=(const ChannelIndex &other)
+{
+    if(this != &other) {
+        m_slots.reset(new Slot[other.m_mask + 1]);
+        std::copy(other.m_slots.get(), other.m_slots.get() + other.m_mask + 1, m_slots.get());
+        m_mask = other.m_mask;
+        m_size = other.m_size;
+    }
+    return *this;
+}
+
+size_t ChannelIndex::slot_for(channel_t c) const
+{
+    size_t i = channel_hash(c) & m_mask;
+    while(!m_slots[i].subscribers.empty() && m_slots[i].channel != c) {
+        i = (i + 1) & m_mask;
+    }
+    return i;
+}
+
+void ChannelIndex::rehash(size_t capacity)
+{
+    std::unique_ptr<Slot[]> old(new Slot[capacity]);
+    size_t old_capacity = m_slots ? m_mask + 1 : 0;
+    m_slots.swap(old);
+    m_mask = capacity - 1;
+
+    for(size_t i = 0; i < old_capacity; ++i) {
+        if(!old[i].subscribers.empty()) {
+            Slot &slot = m_slots[slot_for(old[i].channel)];
+            slot.channel = old[i].channel;
+            slot.subscribers = std::move(old[i].subscribers);
+        }
+    }
+}
+
+bool ChannelIndex::add(channel_t c, ChannelSubscriber *p)
+{
+    // Keep the load factor under 70%; probe lengths climb quickly past that.
+    if((m_size + 1) * 10 > (m_mask + 1) * 7) {
+        rehash((m_mask + 1) * 2);
+    }
+
+    Slot &slot = m_slots[slot_for(c)];
+    if(slot.subscribers.empty()) {
+        slot.channel = c;
+        slot.subscribers.push_back(p);
+        ++m_size;
+        return true;
+    }
+
+    if(!contains(slot.subscribers, p)) {
+        slot.subscribers.push_back(p);
+    }
+    return false;
+}
+
+bool ChannelIndex::remove(channel_t c, ChannelSubscriber *p)
+{
+    size_t hole = slot_for(c);
+    SubscriberList &subscribers = m_slots[hole].subscribers;
+    auto it = std::find(subscribers.begin(), subscribers.end(), p);
+    if(it == subscribers.end()) {
+        return false;
+    }
+
+    // Order within a channel doesn't matter, so swap with the last subscriber.
+    *it = subscribers.back();
+    subscribers.pop_back();
+    if(!subscribers.empty()) {
+        return false;
+    }
+
+    // The slot is now empty; shift back any entries that probed past it, so that
+    // every entry stays reachable from its home slot without tombstones.
+    size_t i = hole;
+    while(true) {
+        i = (i + 1) & m_mask;
+        if(m_slots[i].subscribers.empty()) {
+            break;
+        }
+
+        size_t home = channel_hash(m_slots[i].channel) & m_mask;
+        if(((i - home) & m_mask) >= ((i - hole) & m_mask)) {
+            m_slots[hole].channel = m_slots[i].channel;
+            m_slots[hole].subscribers = std::move(m_slots[i].subscribers);
+            hole = i;
+        }
+    }
+
+    --m_size;
+    return true;
+}
+
+const SubscriberList *ChannelIndex::find(channel_t c) const
+{
+    const Slot &slot = m_slots[slot_for(c)];
+    if(slot.subscribers.empty()) {
+        return nullptr;
+    }
+    return &slot.subscribers;
+}
+
+const SubscriberList *RangeIndex::find(channel_t c) const
+{
+    // Find the last segment starting at or before c...
+    size_t i = std::upper_bound(m_lows.begin(), m_lows.end(), c) - m_lows.begin();
+    if(i == 0) {
+        return nullptr;
+    }
+
+    // ...and check that it reaches c.
+    const Segment &segment = m_segments[i - 1];
+    if(segment.hi < c) {
+        return nullptr;
+    }
+    return &segment.subscribers;
+}
+
+size_t RangeIndex::first_ending_at_or_after(channel_t c) const
+{
+    // Segments are disjoint and sorted, so their upper bounds are sorted too.
+    return std::lower_bound(m_segments.begin(), m_segments.end(), c,
+    [](const Segment &segment, channel_t value) {
+        return segment.hi < value;
+    }) - m_segments.begin();
+}
+
+// replace_span replaces v[begin, end) with the contents of span, shifting the tail once.
+template<typename T>
+static void replace_span(std::vector<T> &v, size_t begin, size_t end, std::vector<T> &span)
+{
+    size_t old_count = end - begin;
+    if(span.size() > old_count) {
+        v.insert(v.begin() + end, span.size() - old_count, T());
+    } else if(span.size() < old_count) {
+        v.erase(v.begin() + begin + span.size(), v.begin() + end);
+    }
+    std::move(span.begin(), span.end(), v.begin() + begin);
+}
+
+template<typename F>
+void RangeIndex::update(channel_t lo, channel_t hi, F fn)
+{
+    std::vector<Segment> span;
+    auto emit = [&span](Segment && piece) {
+        // Join with the previous piece if it's adjacent and has the same subscribers.
+        if(!span.empty() && span.back().hi + 1 == piece.lo &&
+           span.back().subscribers == piece.subscribers) {
+            span.back().hi = piece.hi;
+        } else {
+            span.push_back(std::move(piece));
+        }
+    };
+    auto apply = [&](channel_t p_lo, channel_t p_hi, const SubscriberList &subscribers) {
+        Segment piece {p_lo, p_hi, subscribers};
+        fn(p_lo, p_hi, piece.subscribers);
+        if(!piece.subscribers.empty()) {
+            emit(std::move(piece));
+        }
+    };
+
+    // Take in the segment just before lo too, if it touches lo, so it can be joined.
+    size_t first = first_ending_at_or_after(lo);
+    size_t begin = first;
+    if(begin > 0 && m_segments[begin - 1].hi + 1 == lo) {
+        --begin;
+        emit(std::move(m_segments[begin]));
+    }
+
+    bool gap = true;
+    channel_t cursor = lo;
+    size_t end = first;
+    for(; end < m_segments.size() && m_segments[end].lo <= hi; ++end) {
+        Segment &segment = m_segments[end];
+        if(segment.lo < lo) {
+            // Straddles lo; the part below is untouched.
+            emit(Segment {segment.lo, lo - 1, segment.subscribers});
+        } else if(segment.lo > cursor) {
+            apply(cursor, segment.lo - 1, SubscriberList());
+        }
+
+        apply(std::max(segment.lo, lo), std::min(segment.hi, hi), segment.subscribers);
+
+        if(segment.hi >= hi) {
+            gap = false;
+            if(segment.hi > hi) {
+                // Straddles hi; the part above is untouched.
+                emit(Segment {hi + 1, segment.hi, std::move(segment.subscribers)});
+            }
+        } else {
+            cursor = segment.hi + 1;
+        }
+    }
+
+    if(gap) {
+        apply(cursor, hi, SubscriberList());
+    }
+
+    // And the segment just after hi, if it touches hi.
+    if(end < m_segments.size() && hi != CHANNEL_MAX && m_segments[end].lo == hi + 1) {
+        emit(std::move(m_segments[end]));
+        ++end;
+    }
+
+    std::vector<channel_t> lows(span.size());
+    for(size_t i = 0; i < span.size(); ++i) {
+        lows[i] = span[i].lo;
+    }
+    replace_span(m_segments, begin, end, span);
+    replace_span(m_lows, begin, end, lows);
+}
+
+bool RangeIndex::add(channel_t lo, channel_t hi, ChannelSubscriber *p)
+{
+    bool alone = false;
+    update(lo, hi, [p, &alone](channel_t, channel_t, SubscriberList &subscribers) {
+        auto pos = std::lower_bound(subscribers.begin(), subscribers.end(), p);
+        if(pos == subscribers.end() || *pos != p) {
+            subscribers.insert(pos, p);
+        }
+        if(subscribers.size() == 1) {
+            alone = true;
+        }
+    });
+    return alone;
+}
+
+void RangeIndex::remove(channel_t lo, channel_t hi, ChannelSubscriber *p,
+                        std::vector<std::pair<channel_t, channel_t>> &silent)
+{
+    size_t silent_begin = silent.size();
+    update(lo, hi, [p, &silent, silent_begin](channel_t s_lo, channel_t s_hi,
+                                             SubscriberList &subscribers) {
+        auto pos = std::lower_bound(subscribers.begin(), subscribers.end(), p);
+        if(pos != subscribers.end() && *pos == p) {
+            subscribers.erase(pos);
+        }
+        if(!subscribers.empty()) {
+            return;
+        }
+
+        // Nobody else is left here; join with the previous silent range if adjacent.
+        if(silent.size() > silent_begin && silent.back().second + 1 == s_lo) {
+            silent.back().second = s_hi;
+        } else {
+            silent.push_back(std::make_pair(s_lo, s_hi));
+        }
+    });
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <utility>
+#include "core/types.h"
+#include "util/SmallVector.h"
+
+class ChannelSubscriber;
+
+// channel_hash is the finalizer from MurmurHash3.  std::hash is the identity for integers,
+//     and channels tend to be allocated in runs, which hash tables built on it handle badly.
+inline size_t channel_hash(channel_t c)
+{
+    uint64_t h = c;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return size_t(h);
+}
+
+// Most channels have one or two subscribers, which are kept inline.
+typedef SmallVector<ChannelSubscriber*, 2> SubscriberList;
+
+// A ChannelIndex maps single channels to the subscribers of each.
+// It is an open-addressing hash table (linear probing, with backward-shift deletion
+//     so there are no tombstones), so a lookup is usually a single cache line.
+// A slot is empty exactly when its subscriber list is empty.
+class ChannelIndex
+{
+  public:
+    ChannelIndex();
+    ChannelIndex(const ChannelIndex &other);
+    ChannelIndex &operator=(const ChannelIndex &other);
+
+    // add adds a subscriber to a channel.  Returns true if the channel had no subscribers.
+    bool add(channel_t c, ChannelSubscriber *p);
+    // remove removes a subscriber from a channel.  Returns true if p was the last one.
+    bool remove(channel_t c, ChannelSubscriber *p);
+
+    // find returns the subscribers of a channel, or nullptr if there are none.
+    const SubscriberList *find(channel_t c) const;
+
+    inline size_t size() const
+    {
+        return m_size;
+    }
+
+  private:
+    struct Slot {
+        channel_t channel;
+        SubscriberList subscribers;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    size_t m_size;
+
+    size_t slot_for(channel_t c) const;
+    void rehash(size_t capacity);
+};
+
+// A RangeIndex maps ranges of channels to the subscribers of each.
+// It is kept as a sorted, flat list of disjoint segments; each segment holds the set
+//     of subscribers (sorted, so that neighbours with equal sets can be joined) for
+//     every channel in [lo, hi].  Channels covered by no segment have no subscribers.
+// Lookups binary search a separate array of segment lower bounds.
+class RangeIndex
+{
+  public:
+    struct Segment {
+        channel_t lo;
+        channel_t hi;
+        SubscriberList subscribers;
+    };
+
+    // add subscribes p to every channel in [lo, hi].
+    // Returns true if, afterwards, p is the only subscriber to any part of [lo, hi].
+    bool add(channel_t lo, channel_t hi, ChannelSubscriber *p);
+
+    // remove unsubscribes p from every channel in [lo, hi].
+    // Appends to silent the (joined) parts of [lo, hi] left with no subscribers.
+    void remove(channel_t lo, channel_t hi, ChannelSubscriber *p,
+                std::vector<std::pair<channel_t, channel_t>> &silent);
+
+    // find returns the subscribers of a channel, or nullptr if there are none.
+    const SubscriberList *find(channel_t c) const;
+
+    inline bool empty() const
+    {
+        return m_segments.empty();
+    }
+    // lowest and highest return the bounds of the subscribed space; the index must not be empty.
+    inline channel_t lowest() const
+    {
+        return m_segments.front().lo;
+    }
+    inline channel_t highest() const
+    {
+        return m_segments.back().hi;
+    }
+    inline const std::vector<Segment> &segments() const
+    {
+        return m_segments;
+    }
+
+  private:
+    std::vector<Segment> m_segments;
+    std::vector<channel_t> m_lows; // m_segments[i].lo, kept contiguous for searching.
+
+    // first_ending_at_or_after returns the first segment with hi >= c.
+    size_t first_ending_at_or_after(channel_t c) const;
+    // update calls fn(lo, hi, subscribers) for each piece of [lo, hi] with a distinct set
+    //     of subscribers (including pieces with none), letting it modify the set, and then
+    //     rewrites that part of the table, joining equal neighbours, in one pass.
+    template<typename F>
+    void update(channel_t lo, channel_t hi, F fn);
+};
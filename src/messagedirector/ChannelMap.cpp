@@ -1,4 +1,6 @@
 #include "ChannelMap.h"
+#include <algorithm>
+#include <thread>
 
 typedef boost::icl::discrete_interval<channel_t> interval_t;
 
@@ -17,53 +19,137 @@ static void get_closed_bounds(const interval_t &interval, channel_t &lower, chan
 
 ChannelMap::ChannelMap()
 {
-    // Initialize m_range_susbcriptions with empty range
-    auto empty_set = std::unordered_set<ChannelSubscriber*>();
-    m_range_subscriptions = boost::icl::interval_map<channel_t, std::unordered_set<ChannelSubscriber*> >();
-    m_range_subscriptions += std::make_pair(interval_t::closed(0, CHANNEL_MAX), empty_set);
 }
 
-void ChannelMap::subscribe_channel(ChannelSubscriber *p, channel_t c)
+ChannelMap::WriteBatch::WriteBatch(ChannelMap *map) : m_map(map)
+{
+    m_map->m_lock.lock();
+    ++m_map->m_write_depth;
+}
+
+ChannelMap::WriteBatch::~WriteBatch()
+{
+    if(--m_map->m_write_depth == 0 && !m_map->m_pending_ops.empty()) {
+        m_map->publish();
+    }
+    m_map->m_lock.unlock();
+}
+
+void ChannelMap::enable_lockless_lookups()
 {
     std::lock_guard<std::recursive_mutex> guard(m_lock);
 
-    if(is_subscribed(p, c)) {
+    if(m_lockless) {
         return;
     }
 
-    p->channels().insert(p->channels().end(), c);
-    bool has_subs = (m_channel_subscriptions.find(c) != m_channel_subscriptions.end());
+    unsigned int active = m_active.load(std::memory_order_relaxed);
+    m_indexes[1 - active] = m_indexes[active];
+    m_lockless = true;
+}
 
-    if(!has_subs) {
-        on_add_channel(c);
+bool ChannelMap::add_channel(channel_t c, ChannelSubscriber *p)
+{
+    if(m_lockless) {
+        m_pending_ops.push_back(IndexOp {IndexOp::ADD_CHANNEL, c, c, p});
+    }
+    return writable().channels.add(c, p);
+}
+
+bool ChannelMap::remove_channel(channel_t c, ChannelSubscriber *p)
+{
+    if(m_lockless) {
+        m_pending_ops.push_back(IndexOp {IndexOp::REMOVE_CHANNEL, c, c, p});
     }
+    return writable().channels.remove(c, p);
+}
 
-    m_channel_subscriptions.insert(std::make_pair(c, p));
+bool ChannelMap::add_range(channel_t lo, channel_t hi, ChannelSubscriber *p)
+{
+    if(m_lockless) {
+        m_pending_ops.push_back(IndexOp {IndexOp::ADD_RANGE, lo, hi, p});
+    }
+    return writable().ranges.add(lo, hi, p);
 }
 
-bool ChannelMap::remove_subscriber(ChannelSubscriber *p, channel_t c)
+void ChannelMap::remove_range(channel_t lo, channel_t hi, ChannelSubscriber *p,
+                              std::vector<std::pair<channel_t, channel_t>> &silent)
 {
-    auto sub_cnt = m_channel_subscriptions.count(c);
-    if(sub_cnt == 0) {
-        return false;
+    if(m_lockless) {
+        m_pending_ops.push_back(IndexOp {IndexOp::REMOVE_RANGE, lo, hi, p});
     }
+    writable().ranges.remove(lo, hi, p, silent);
+}
 
-    auto subs = m_channel_subscriptions.equal_range(c);
+void ChannelMap::apply(Indexes &indexes, const IndexOp &op)
+{
+    std::vector<std::pair<channel_t, channel_t>> silent;
+    switch(op.kind) {
+    case IndexOp::ADD_CHANNEL:
+        indexes.channels.add(op.lo, op.p);
+        break;
+    case IndexOp::REMOVE_CHANNEL:
+        indexes.channels.remove(op.lo, op.p);
+        break;
+    case IndexOp::ADD_RANGE:
+        indexes.ranges.add(op.lo, op.hi, op.p);
+        break;
+    case IndexOp::REMOVE_RANGE:
+        indexes.ranges.remove(op.lo, op.hi, op.p, silent);
+        break;
+    }
+}
 
-    for(auto it = subs.first; it != subs.second; ++it) {
-        if(it->second == p) {
-            m_channel_subscriptions.erase(it);
-            --sub_cnt;
-            break;
-        }
+void ChannelMap::publish()
+{
+    // Point new readers at the copy we've been writing to...
+    unsigned int stale = m_active.load(std::memory_order_relaxed);
+    m_active.store(1 - stale, std::memory_order_seq_cst);
+
+    // ...then wait out everyone who might still be reading the stale copy.  Readers
+    // register under the current epoch, so move them on to the other epoch and drain
+    // both; a reader who registered before the flip is counted in one or the other.
+    unsigned int epoch = m_read_epoch.load(std::memory_order_relaxed);
+    while(m_readers[1 - epoch].count.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
+    }
+    m_read_epoch.store(1 - epoch, std::memory_order_seq_cst);
+    while(m_readers[epoch].count.load(std::memory_order_seq_cst) != 0) {
+        std::this_thread::yield();
     }
 
-    return (sub_cnt == 0);
+    // Nobody can see the stale copy any more; bring it up to date for the next batch.
+    for(const auto& op : m_pending_ops) {
+        apply(m_indexes[stale], op);
+    }
+    m_pending_ops.clear();
+}
+
+void ChannelMap::subscribe_channel(ChannelSubscriber *p, channel_t c)
+{
+    WriteBatch batch(this);
+
+    if(is_subscribed(p, c)) {
+        return;
+    }
+
+    p->channels().insert(p->channels().end(), c);
+
+    if(add_channel(c, p)) {
+        on_add_channel(c);
+    }
+    on_subscribe_channels(p, &c, 1);
+}
+
+bool ChannelMap::remove_subscriber(ChannelSubscriber *p, channel_t c)
+{
+    WriteBatch batch(this);
+    return remove_channel(c, p);
 }
 
 void ChannelMap::unsubscribe_channel(ChannelSubscriber *p, channel_t c)
 {
-    std::lock_guard<std::recursive_mutex> guard(m_lock);
+    WriteBatch batch(this);
 
     if(!is_subscribed(p, c)) {
         return;
@@ -74,67 +160,112 @@ void ChannelMap::unsubscribe_channel(ChannelSubscriber *p, channel_t c)
     if(remove_subscriber(p, c)) {
         on_remove_channel(c);
     }
+    on_unsubscribe(p);
 }
 
-void ChannelMap::subscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi)
+void ChannelMap::subscribe_channels(ChannelSubscriber *p, const channel_t *channels, size_t count)
 {
-    std::lock_guard<std::recursive_mutex> guard(m_lock);
+    WriteBatch batch(this);
 
-    // Prepare participant and range
-    std::unordered_set<ChannelSubscriber *> participant_set;
-    participant_set.insert(p);
+    std::vector<channel_t> subscribed, added;
+    for(size_t i = 0; i < count; ++i) {
+        channel_t c = channels[i];
+        if(is_subscribed(p, c)) {
+            continue;
+        }
+
+        p->channels().insert(c);
+        subscribed.push_back(c);
+        if(add_channel(c, p)) {
+            added.push_back(c);
+        }
+    }
 
-    interval_t interval = interval_t::closed(lo, hi);
+    if(!added.empty()) {
+        on_add_channels(added);
+    }
+    if(!subscribed.empty()) {
+        on_subscribe_channels(p, subscribed.data(), subscribed.size());
+    }
+}
 
-    // Update range mappings
-    p->ranges() += interval;
-    m_range_subscriptions += std::make_pair(interval, participant_set);
-
-    // Now, check if anything along this interval is *new*:
-    auto interval_range = m_range_subscriptions.equal_range(interval);
-    for(auto it = interval_range.first; it != interval_range.second; ++it) {
-        if(it->second.size() == 1) {
-            // There's a segment of the interval that has only one element
-            // (our newly added participant!) and thus, we should upstream the
-            // range addition.
-            on_add_range(lo, hi);
-            break;
+void ChannelMap::unsubscribe_channels(ChannelSubscriber *p, const channel_t *channels, size_t count)
+{
+    WriteBatch batch(this);
+
+    std::vector<channel_t> removed;
+    bool unsubscribed = false;
+    for(size_t i = 0; i < count; ++i) {
+        channel_t c = channels[i];
+        if(p->channels().erase(c) == 0) {
+            continue;
         }
+
+        unsubscribed = true;
+        if(remove_channel(c, p)) {
+            removed.push_back(c);
+        }
+    }
+
+    if(!removed.empty()) {
+        on_remove_channels(removed);
+    }
+    if(unsubscribed) {
+        on_unsubscribe(p);
     }
 }
 
+void ChannelMap::on_add_channels(const std::vector<channel_t> &channels)
+{
+    for(const auto& c : channels) {
+        on_add_channel(c);
+    }
+}
+
+void ChannelMap::on_remove_channels(const std::vector<channel_t> &channels)
+{
+    for(const auto& c : channels) {
+        on_remove_channel(c);
+    }
+}
+
+void ChannelMap::subscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi)
+{
+    WriteBatch batch(this);
+
+    // Update range mappings
+    p->ranges() += interval_t::closed(lo, hi);
+
+    // If there's a segment of the interval that now has only one subscriber
+    // (our newly added participant!), then we should upstream the range addition.
+    if(add_range(lo, hi, p)) {
+        on_add_range(lo, hi);
+    }
+    on_subscribe_range(p, lo, hi);
+}
+
 void ChannelMap::unsubscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi)
 {
-    std::lock_guard<std::recursive_mutex> guard(m_lock);
+    WriteBatch batch(this);
+    const RangeIndex &ranges = writable().ranges;
 
     // Pre-check: if there are no ranges subscribed anyway, no use doing this:
-    if(m_range_subscriptions.empty()) {
+    if(ranges.empty()) {
         return;
     }
 
-    // Prepare participant set
-    std::unordered_set<ChannelSubscriber *> participant_set;
-    participant_set.insert(p);
-
-    // Construct the interval we are removing, bounded to m_range_subscriptions.
-    channel_t lower = m_range_subscriptions.begin()->first.lower();
-    channel_t upper = m_range_subscriptions.rbegin()->first.upper();
-    interval_t interval = interval_t::closed(std::max(lo, lower), std::min(hi, upper));
+    // Construct the interval we are removing, bounded to the subscribed ranges.
+    channel_t lower = std::max(lo, ranges.lowest());
+    channel_t upper = std::min(hi, ranges.highest());
 
-    // Calculate the ranges that will "go silent" as a result of our removal:
-    auto silent_ranges = boost::icl::interval_set<channel_t>(interval);
-    auto interval_range = m_range_subscriptions.equal_range(interval);
-    for(auto it = interval_range.first; it != interval_range.second; ++it) {
-        if(!it->second.empty() && !(it->second.size() == 1 && *it->second.begin() == p)) {
-            // We aren't the last subscription in this range, don't kill it.
-            silent_ranges -= it->first;
-        }
+    // Update range mappings, calculating the ranges that will "go silent" as a
+    // result of our removal (i.e. we were the last subscription there):
+    std::vector<std::pair<channel_t, channel_t>> silent_ranges;
+    if(lower <= upper) {
+        p->ranges() -= interval_t::closed(lower, upper);
+        remove_range(lower, upper, p, silent_ranges);
     }
 
-    // Update range mappings
-    p->ranges() -= interval;
-    m_range_subscriptions -= std::make_pair(interval, participant_set);
-
     // Clobber *channel* subscriptions that fall within the range.
     for(auto it = p->channels().begin(); it != p->channels().end();) {
         auto prev = it++;
@@ -149,25 +280,21 @@ void ChannelMap::unsubscribe_range(ChannelSubscriber *p, channel_t lo, channel_t
     }
 
     // Now, clean up any ranges that are now *empty* and should thus be killed:
-    for(auto it = silent_ranges.begin(); it != silent_ranges.end(); ++it) {
-        get_closed_bounds(*it, lower, upper);
-
+    for(const auto& it : silent_ranges) {
         // Okay, this part of the interval is dead, better request it be
         // sliced off:
-        on_remove_range(lower, upper);
+        on_remove_range(it.first, it.second);
     }
+    on_unsubscribe(p);
 }
 
 void ChannelMap::unsubscribe_all(ChannelSubscriber* p)
 {
-    std::lock_guard<std::recursive_mutex> guard(m_lock);
+    WriteBatch batch(this);
 
     // Unsubscribe from indivually subscribed channels
-    auto channels = std::unordered_set<channel_t>(p->channels());
-    for(auto it = channels.begin(); it != channels.end(); ++it) {
-        channel_t channel = *it;
-        unsubscribe_channel(p, channel);
-    }
+    std::vector<channel_t> channels(p->channels().begin(), p->channels().end());
+    unsubscribe_channels(p, channels.data(), channels.size());
 
     // Unsubscribe from subscribed channel ranges
     auto ranges = boost::icl::interval_set<channel_t>(p->ranges());
@@ -179,6 +306,12 @@ void ChannelMap::unsubscribe_all(ChannelSubscriber* p)
     }
 }
 
+bool ChannelMap::in_subscribed_range(channel_t c)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+    return writable().ranges.find(c) != nullptr;
+}
+
 bool ChannelMap::is_subscribed(ChannelSubscriber *p, channel_t c)
 {
     std::lock_guard<std::recursive_mutex> guard(m_lock);
@@ -194,19 +327,66 @@ bool ChannelMap::is_subscribed(ChannelSubscriber *p, channel_t c)
     return false;
 }
 
-void ChannelMap::lookup_channels(const std::vector<channel_t> &cl, std::unordered_set<ChannelSubscriber *> &ps)
+static inline void append(std::unordered_set<ChannelSubscriber *> &ps, const SubscriberList &subs)
 {
-    std::lock_guard<std::recursive_mutex> guard(m_lock);
+    ps.insert(subs.begin(), subs.end());
+}
+
+static inline void append(std::vector<ChannelSubscriber *> &ps, const SubscriberList &subs)
+{
+    ps.insert(ps.end(), subs.begin(), subs.end());
+}
 
-    for(auto it = cl.begin(); it != cl.end(); ++it) {
-        auto subs = m_channel_subscriptions.equal_range(*it);
-        for(auto it2 = subs.first; it2 != subs.second; ++it2) {
-            ps.insert(it2->second);
+template<typename Output>
+static void lookup_in(const ChannelIndex &channels, const RangeIndex &ranges,
+                      const channel_t *cl, size_t count, Output &ps)
+{
+    for(size_t i = 0; i < count; ++i) {
+        const SubscriberList *subs = channels.find(cl[i]);
+        if(subs != nullptr) {
+            append(ps, *subs);
         }
 
-        auto range = boost::icl::find(m_range_subscriptions, *it);
-        if(range != m_range_subscriptions.end()) {
-            ps.insert(range->second.begin(), range->second.end());
+        subs = ranges.find(cl[i]);
+        if(subs != nullptr) {
+            append(ps, *subs);
         }
     }
 }
+
+template<typename Output>
+void ChannelMap::lookup(const channel_t *cl, size_t count, Output &ps)
+{
+    if(!m_lockless) {
+        std::lock_guard<std::recursive_mutex> guard(m_lock);
+        lookup_in(m_indexes[0].channels, m_indexes[0].ranges, cl, count, ps);
+        return;
+    }
+
+    // Register as a reader before looking at which copy is active; see publish().
+    unsigned int epoch = m_read_epoch.load(std::memory_order_seq_cst);
+    m_readers[epoch].count.fetch_add(1, std::memory_order_seq_cst);
+
+    const Indexes &indexes = m_indexes[m_active.load(std::memory_order_seq_cst)];
+    lookup_in(indexes.channels, indexes.ranges, cl, count, ps);
+
+    m_readers[epoch].count.fetch_sub(1, std::memory_order_release);
+}
+
+void ChannelMap::lookup_channels(const std::vector<channel_t> &cl, std::unordered_set<ChannelSubscriber *> &ps)
+{
+    lookup(cl.data(), cl.size(), ps);
+}
+
+void ChannelMap::lookup_channels(const channel_t *cl, size_t count, std::vector<ChannelSubscriber *> &ps)
+{
+    ps.clear();
+    lookup(cl, count, ps);
+
+    // A subscriber may be found through several channels (or a channel and a range);
+    // there are rarely more than a handful, so sorting is cheaper than a set.
+    if(ps.size() > 1) {
+        std::sort(ps.begin(), ps.end());
+        ps.erase(std::unique(ps.begin(), ps.end()), ps.end());
+    }
+}
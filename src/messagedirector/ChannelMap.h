@@ -1,10 +1,12 @@
 #pragma once
+#include <atomic>
 #include <vector>
 #include <unordered_set>
 #include <unordered_map>
 #include <mutex>
 #include "core/types.h"
-#include <boost/icl/interval_map.hpp>
+#include "ChannelIndex.h"
+#include <boost/icl/interval_set.hpp>
 
 class ChannelSubscriber
 {
@@ -41,6 +43,12 @@ class ChannelMap
     // (Args) "c": the channel to be removed.
     void unsubscribe_channel(ChannelSubscriber *p, channel_t c);
 
+    // subscribe_channels and unsubscribe_channels are the same, but for the count channels
+    //     at channels, all at once.  Upstream notifications are batched into a single call to
+    //     on_add_channels/on_remove_channels.
+    void subscribe_channels(ChannelSubscriber *p, const channel_t *channels, size_t count);
+    void unsubscribe_channels(ChannelSubscriber *p, const channel_t *channels, size_t count);
+
     // subscribe_range adds an object to be subscribed to a range of channels.
     // (Args) "lo": the lowest channel to be removed.
     //        "hi": the highest channel to be removed.
@@ -67,23 +75,128 @@ class ChannelMap
 
     // lookup_channels is the same, but it works on a list of channels.
     void lookup_channels(const std::vector<channel_t> &cl, std::unordered_set<ChannelSubscriber *> &ps);
+    // This version replaces the contents of ps with the distinct subscribers to the count
+    //     channels at cl, reusing ps's storage, so it doesn't allocate once ps is big enough.
+    void lookup_channels(const channel_t *cl, size_t count, std::vector<ChannelSubscriber *> &ps);
+
+    // enable_lockless_lookups switches the map to keeping two copies of its indexes, so
+    //     that lookup_channels never takes the lock (see publish()).  Subscription changes
+    //     cost roughly twice as much, and a writer briefly waits out in-flight lookups.
+    // This should be called before the map is shared between threads.
+    void enable_lockless_lookups();
+    inline bool lockless_lookups() const
+    {
+        return m_lockless;
+    }
 
   protected:
+    // in_subscribed_range tests if any subscriber has a range subscription covering c.
+    //     For use by the on_* callbacks, which see the map as updated by the current call.
+    bool in_subscribed_range(channel_t c);
+
     virtual void on_add_channel(channel_t) { }
 
     virtual void on_remove_channel(channel_t) { }
 
+    // on_add_channels and on_remove_channels are passed the channels of a bulk
+    //     (un)subscribe that gained their first or lost their last subscriber.
+    //     By default, they call on_add_channel/on_remove_channel for each.
+    virtual void on_add_channels(const std::vector<channel_t> &channels);
+
+    virtual void on_remove_channels(const std::vector<channel_t> &channels);
+
     virtual void on_add_range(channel_t, channel_t) { }
 
     virtual void on_remove_range(channel_t, channel_t) { }
 
-  private:
-    // Single channel subscriptions
-    std::unordered_multimap<channel_t, ChannelSubscriber *> m_channel_subscriptions;
+    // on_subscribe_channels and on_subscribe_range are called whenever p gains a
+    //     subscription, whether or not anybody else already had it.  on_subscribe_channels
+    //     is passed only the channels p wasn't already subscribed to.
+    virtual void on_subscribe_channels(ChannelSubscriber *, const channel_t *, size_t) { }
 
-    // Range channel subscriptions
-    boost::icl::interval_map<channel_t, std::unordered_set<ChannelSubscriber *> > m_range_subscriptions;
+    virtual void on_subscribe_range(ChannelSubscriber *, channel_t, channel_t) { }
+
+    // on_unsubscribe is called whenever p loses any of its subscriptions.
+    virtual void on_unsubscribe(ChannelSubscriber *) { }
+
+    // lock_subscriptions holds off any subscription changes while it's held.
+    //     The on_* callbacks are always called with it held.
+    inline std::unique_lock<std::recursive_mutex> lock_subscriptions()
+    {
+        return std::unique_lock<std::recursive_mutex>(m_lock);
+    }
+
+  private:
+    struct Indexes {
+        // Single channel subscriptions
+        ChannelIndex channels;
+
+        // Range channel subscriptions
+        RangeIndex ranges;
+    };
+
+    // An IndexOp is a change made to the writable Indexes, which is replayed onto the
+    //     other copy once readers have moved off of it.
+    struct IndexOp {
+        enum Kind : uint8_t { ADD_CHANNEL, REMOVE_CHANNEL, ADD_RANGE, REMOVE_RANGE };
+
+        Kind kind;
+        channel_t lo;
+        channel_t hi;
+        ChannelSubscriber *p;
+    };
+
+    // A WriteBatch holds the lock for a mutating call.  When the outermost batch
+    //     ends, any changes it made are published to lockless readers.
+    class WriteBatch
+    {
+      public:
+        WriteBatch(ChannelMap *map);
+        ~WriteBatch();
+
+      private:
+        ChannelMap *m_map;
+    };
+
+    // In lockless mode, readers use m_indexes[m_active] while writers modify the other
+    //     copy; otherwise only m_indexes[0] is used, guarded by m_lock.
+    Indexes m_indexes[2];
+    std::atomic<unsigned int> m_active {0};
+    std::atomic<bool> m_lockless {false};
+
+    // Left-right reader tracking: a reader registers itself under m_read_epoch before
+    //     looking at m_active, so a writer flipping m_active can wait until nobody is
+    //     left reading the copy it is about to modify.
+    std::atomic<unsigned int> m_read_epoch {0};
+    struct ReaderCount {
+        std::atomic<uint64_t> count {0};
+        char pad[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    ReaderCount m_readers[2];
+
+    // Writer state, guarded by m_lock.
+    std::vector<IndexOp> m_pending_ops;
+    unsigned int m_write_depth = 0;
 
     // In order to make this object thread-safe...
     std::recursive_mutex m_lock;
+
+    inline Indexes &writable()
+    {
+        return m_indexes[m_lockless ? 1 - m_active.load(std::memory_order_relaxed) : 0];
+    }
+    bool add_channel(channel_t c, ChannelSubscriber *p);
+    bool remove_channel(channel_t c, ChannelSubscriber *p);
+    bool add_range(channel_t lo, channel_t hi, ChannelSubscriber *p);
+    void remove_range(channel_t lo, channel_t hi, ChannelSubscriber *p,
+                      std::vector<std::pair<channel_t, channel_t>> &silent);
+    static void apply(Indexes &indexes, const IndexOp &op);
+
+    // lookup appends every subscriber (with repeats) to any of the count channels at cl.
+    template<typename Output>
+    void lookup(const channel_t *cl, size_t count, Output &ps);
+
+    // publish makes the writable copy visible to readers, waits for readers of the
+    //     other copy to finish, then brings that copy up to date.
+    void publish();
 };
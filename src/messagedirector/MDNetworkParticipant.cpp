@@ -1,6 +1,7 @@
 #include "MDNetworkParticipant.h"
 #include "core/global.h"
 #include "core/msgtypes.h"
+#include "util/SmallVector.h"
 
 MDNetworkParticipant::MDNetworkParticipant(const std::shared_ptr<uvw::TcpHandle> &socket)
     : MDParticipantInterface(), m_client(std::make_shared<NetworkClient>(this))
@@ -10,6 +11,14 @@ MDNetworkParticipant::MDNetworkParticipant(const std::shared_ptr<uvw::TcpHandle>
     m_client->initialize(socket);
 }
 
+MDNetworkParticipant::MDNetworkParticipant(const std::shared_ptr<uvw::PipeHandle> &socket)
+    : MDParticipantInterface(), m_client(std::make_shared<NetworkClient>(this))
+{
+    set_con_name("Local Network Participant");
+
+    m_client->initialize(socket);
+}
+
 MDNetworkParticipant::~MDNetworkParticipant()
 {
     m_client->disconnect();
@@ -18,7 +27,12 @@ MDNetworkParticipant::~MDNetworkParticipant()
 void MDNetworkParticipant::handle_datagram(DatagramHandle dg, DatagramIterator&)
 {
     logger().trace() << "MDNetworkParticipant sending to downstream MD" << std::endl;
-    m_client->send_datagram(dg);
+    m_client->send_datagram(std::move(dg));
+}
+
+void MDNetworkParticipant::send_control(DatagramHandle dg)
+{
+    m_client->send_datagram(std::move(dg), SEND_CONTROL);
 }
 
 void MDNetworkParticipant::receive_datagram(DatagramHandle dg)
@@ -36,6 +50,26 @@ void MDNetworkParticipant::receive_datagram(DatagramHandle dg)
             unsubscribe_channel(dgi.read_channel());
             break;
         }
+        case CONTROL_ADD_CHANNELS:
+        case CONTROL_REMOVE_CHANNELS: {
+            uint16_t count = dgi.read_uint16();
+            SmallVector<channel_t, 64> channels;
+            channels.resize(count);
+            for(uint16_t i = 0; i < count; ++i) {
+                channels[i] = dgi.read_channel();
+            }
+
+            if(msg_type == CONTROL_ADD_CHANNELS) {
+                subscribe_channels(channels.data(), count);
+            } else {
+                unsubscribe_channels(channels.data(), count);
+            }
+            break;
+        }
+        case CONTROL_ENABLE_FILTER: {
+            MessageDirector::singleton.enable_downstream_filter(this);
+            break;
+        }
         case CONTROL_ADD_RANGE: {
             channel_t lo = dgi.read_channel();
             channel_t hi = dgi.read_channel();
@@ -50,7 +84,7 @@ void MDNetworkParticipant::receive_datagram(DatagramHandle dg)
         }
         case CONTROL_ADD_POST_REMOVE: {
             channel_t sender = dgi.read_channel();
-            add_post_remove(sender, dgi.read_datagram());
+            add_post_remove(sender, dgi.read_datagram_view());
             break;
         }
         case CONTROL_CLEAR_POST_REMOVES: {
@@ -66,7 +100,7 @@ void MDNetworkParticipant::receive_datagram(DatagramHandle dg)
             break;
         }
         case CONTROL_LOG_MESSAGE: {
-            log_message(dgi.read_blob());
+            log_message(dgi.read_datagram_view());
             break;
         }
         default:
@@ -6,6 +6,7 @@ class MDNetworkParticipant : public MDParticipantInterface, public NetworkHandle
 {
   public:
     MDNetworkParticipant(const std::shared_ptr<uvw::TcpHandle> &socket);
+    MDNetworkParticipant(const std::shared_ptr<uvw::PipeHandle> &socket);
     ~MDNetworkParticipant();
     virtual void initialize()
     {
@@ -13,6 +14,20 @@ class MDNetworkParticipant : public MDParticipantInterface, public NetworkHandle
     }
 
     virtual void handle_datagram(DatagramHandle dg, DatagramIterator &dgi);
+    virtual bool forwards_only() const
+    {
+        return true;
+    }
+
+    // send_control sends a control message down to the downstream MD, ahead of
+    //     any datagrams still waiting to be sent to it.
+    void send_control(DatagramHandle dg);
+
+    // set_corked corks the link to the downstream MD; see NetworkClient::set_corked.
+    inline void set_corked(bool corked, unsigned int linger_us)
+    {
+        m_client->set_corked(corked, linger_us);
+    }
   private:
     virtual void receive_datagram(DatagramHandle dg);
     virtual void receive_disconnect(const uvw::ErrorEvent &evt);
@@ -1,9 +1,15 @@
 #include "MDNetworkUpstream.h"
+#include <algorithm>
 #include "MessageDirector.h"
 #include "net/NetworkConnector.h"
+#include "net/address_utils.h"
 #include "core/global.h"
 #include "core/msgtypes.h"
 
+// CONTROL_ADD_CHANNELS and CONTROL_REMOVE_CHANNELS carry at most this many channels
+// each, keeping them comfortably under the maximum datagram size.
+static const size_t MAX_CONTROL_CHANNELS = 4096;
+
 MDNetworkUpstream::MDNetworkUpstream(MessageDirector *md) :
     m_message_director(md), m_client(std::make_shared<NetworkClient>(this)),
     m_connector(std::make_shared<NetworkConnector>(g_loop))
@@ -13,9 +19,15 @@ MDNetworkUpstream::MDNetworkUpstream(MessageDirector *md) :
 
 void MDNetworkUpstream::connect(const std::string &address)
 {
-    ConnectCallback callback = std::bind(&MDNetworkUpstream::on_connect, this, std::placeholders::_1);
     ConnectErrorCallback err_callback = std::bind(&MDNetworkUpstream::on_connect_error, this, std::placeholders::_1);
 
+    if(is_unix_address(address)) {
+        PipeConnectCallback callback = std::bind(&MDNetworkUpstream::on_connect_local, this, std::placeholders::_1);
+        m_connector->connect_local(unix_address_path(address), callback, err_callback);
+        return;
+    }
+
+    ConnectCallback callback = std::bind(&MDNetworkUpstream::on_connect, this, std::placeholders::_1);
     m_connector->connect(address, 7199, callback, err_callback);
 }
 
@@ -27,6 +39,17 @@ void MDNetworkUpstream::on_connect(const std::shared_ptr<uvw::TcpHandle> &socket
     }
 
     m_client->initialize(socket);
+    connected();
+}
+
+void MDNetworkUpstream::on_connect_local(const std::shared_ptr<uvw::PipeHandle> &socket)
+{
+    m_client->initialize(socket);
+    connected();
+}
+
+void MDNetworkUpstream::connected()
+{
     m_initialized = true;
 
     // Flush any datagrams that we tried to send out before our connection to upstream was initialised.
@@ -37,14 +60,14 @@ void MDNetworkUpstream::on_connect(const std::shared_ptr<uvw::TcpHandle> &socket
     m_connector = nullptr;
 }
 
-void MDNetworkUpstream::send_datagram(DatagramHandle dg)
+void MDNetworkUpstream::send_datagram(DatagramHandle dg, SendLane lane)
 {
     if(!m_initialized) {
         std::lock_guard<std::mutex> lock(m_messages_lock);
-        m_messages.push(dg);
+        m_messages.push(std::make_pair(std::move(dg), lane));
     }
     else {
-        m_client->send_datagram(dg);
+        m_client->send_datagram(std::move(dg), lane);
     }
 }
 
@@ -59,9 +82,9 @@ void MDNetworkUpstream::flush_send_queue()
     {
         std::unique_lock<std::mutex> lock(m_messages_lock);
         while(!m_messages.empty()) {
-            DatagramHandle dg = m_messages.front();
+            auto message = m_messages.front();
             m_messages.pop();
-            m_client->send_datagram(dg);
+            m_client->send_datagram(message.first, message.second);
         }
     }
 
@@ -77,14 +100,46 @@ void MDNetworkUpstream::subscribe_channel(channel_t c)
 {
     DatagramPtr dg = Datagram::create(CONTROL_ADD_CHANNEL);
     dg->add_channel(c);
-    send_datagram(dg);
+    send_datagram(dg, SEND_CONTROL);
 }
 
 void MDNetworkUpstream::unsubscribe_channel(channel_t c)
 {
     DatagramPtr dg = Datagram::create(CONTROL_REMOVE_CHANNEL);
     dg->add_channel(c);
-    send_datagram(dg);
+    send_datagram(dg, SEND_CONTROL);
+}
+
+void MDNetworkUpstream::send_channels(uint16_t msg_type, const std::vector<channel_t> &channels)
+{
+    for(size_t i = 0; i < channels.size(); i += MAX_CONTROL_CHANNELS) {
+        size_t count = std::min(channels.size() - i, MAX_CONTROL_CHANNELS);
+        DatagramPtr dg = Datagram::create(msg_type);
+        dg->add_uint16(count);
+        for(size_t j = i; j < i + count; ++j) {
+            dg->add_channel(channels[j]);
+        }
+        send_datagram(dg, SEND_CONTROL);
+    }
+}
+
+void MDNetworkUpstream::subscribe_channels(const std::vector<channel_t> &channels)
+{
+    // A lone channel still goes in the older (and smaller) message.
+    if(channels.size() == 1) {
+        subscribe_channel(channels[0]);
+        return;
+    }
+    send_channels(CONTROL_ADD_CHANNELS, channels);
+}
+
+void MDNetworkUpstream::unsubscribe_channels(const std::vector<channel_t> &channels)
+{
+    if(channels.size() == 1) {
+        unsubscribe_channel(channels[0]);
+        return;
+    }
+    send_channels(CONTROL_REMOVE_CHANNELS, channels);
 }
 
 void MDNetworkUpstream::subscribe_range(channel_t lo, channel_t hi)
@@ -92,7 +147,7 @@ void MDNetworkUpstream::subscribe_range(channel_t lo, channel_t hi)
     DatagramPtr dg = Datagram::create(CONTROL_ADD_RANGE);
     dg->add_channel(lo);
     dg->add_channel(hi);
-    send_datagram(dg);
+    send_datagram(dg, SEND_CONTROL);
 }
 
 void MDNetworkUpstream::unsubscribe_range(channel_t lo, channel_t hi)
@@ -100,16 +155,40 @@ void MDNetworkUpstream::unsubscribe_range(channel_t lo, channel_t hi)
     DatagramPtr dg = Datagram::create(CONTROL_REMOVE_RANGE);
     dg->add_channel(lo);
     dg->add_channel(hi);
-    send_datagram(dg);
+    send_datagram(dg, SEND_CONTROL);
 }
 
 void MDNetworkUpstream::handle_datagram(DatagramHandle dg)
 {
-    send_datagram(dg);
+    send_datagram(std::move(dg));
+}
+
+void MDNetworkUpstream::send_control(DatagramHandle dg)
+{
+    send_datagram(std::move(dg), SEND_CONTROL);
+}
+
+size_t MDNetworkUpstream::queued_datagrams(SendLane lane)
+{
+    return m_client->queued_datagrams(lane);
 }
 
 void MDNetworkUpstream::receive_datagram(DatagramHandle dg)
 {
+    // Filter updates are the only control messages sent down to us.
+    DatagramIterator dgi(dg);
+    try {
+        if(dgi.read_uint8() == 1 && dgi.read_channel() == CONTROL_MESSAGE) {
+            uint16_t msg_type = dgi.read_uint16();
+            if(msg_type == CONTROL_FILTER_RESET || msg_type == CONTROL_FILTER_ADD) {
+                m_message_director->receive_filter(msg_type, dgi);
+                return;
+            }
+        }
+    } catch(DatagramIteratorEOF &) {
+        // Let the MessageDirector complain about it.
+    }
+
     m_message_director->receive_datagram(dg);
 }
 
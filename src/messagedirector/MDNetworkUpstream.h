@@ -13,18 +13,29 @@ class MDNetworkUpstream : public NetworkHandler, public MDUpstream
 
     void connect(const std::string &address);
     void on_connect(const std::shared_ptr<uvw::TcpHandle> &socket);
+    void on_connect_local(const std::shared_ptr<uvw::PipeHandle> &socket);
     void on_connect_error(const uvw::ErrorEvent& evt);
 
+    // set_corked corks the link to the upstream MD; see NetworkClient::set_corked.
+    inline void set_corked(bool corked, unsigned int linger_us)
+    {
+        m_client->set_corked(corked, linger_us);
+    }
+
     // Queueing interfaces for datagrams pending being sent upstream.
-    void send_datagram(DatagramHandle dg);
+    void send_datagram(DatagramHandle dg, SendLane lane = SEND_BULK);
     void flush_send_queue();
 
     // Interfaces that MDUpstream needs us to implement:
     virtual void subscribe_channel(channel_t c);
     virtual void unsubscribe_channel(channel_t c);
+    virtual void subscribe_channels(const std::vector<channel_t> &channels);
+    virtual void unsubscribe_channels(const std::vector<channel_t> &channels);
     virtual void subscribe_range(channel_t lo, channel_t hi);
     virtual void unsubscribe_range(channel_t lo, channel_t hi);
     virtual void handle_datagram(DatagramHandle dg);
+    virtual void send_control(DatagramHandle dg);
+    virtual size_t queued_datagrams(SendLane lane);
 
     // Interfaces that NetworkClient needs us to implement:
     virtual void initialize()
@@ -40,7 +51,13 @@ class MDNetworkUpstream : public NetworkHandler, public MDUpstream
     std::shared_ptr<NetworkClient> m_client;
     std::shared_ptr<NetworkConnector> m_connector;
     std::mutex m_messages_lock;
-    std::queue<DatagramHandle> m_messages;
+    std::queue<std::pair<DatagramHandle, SendLane>> m_messages;
     bool m_initialized = false;
     bool m_is_sending = false;
+
+    // connected finishes connecting, once m_client has its socket.
+    void connected();
+
+    // send_channels sends a list of channels in as few msg_type messages as it can.
+    void send_channels(uint16_t msg_type, const std::vector<channel_t> &channels);
 };
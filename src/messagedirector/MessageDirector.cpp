@@ -1,6 +1,9 @@
 #include "MessageDirector.h"
 #include <algorithm>
 #include <functional>
+#include <cstdint>
+#include <chrono>
+#include <deque>
 #include <boost/icl/interval_bounds.hpp>
 
 #include "core/global.h"
@@ -8,32 +11,285 @@
 #include "config/ConfigVariable.h"
 #include "config/constraints.h"
 #include "net/TcpAcceptor.h"
+#include "net/PipeAcceptor.h"
+#include "net/address_utils.h"
+#include "util/SmallVector.h"
 #include "MDNetworkParticipant.h"
 #include "MDNetworkUpstream.h"
+#include "SubscriptionCompactor.h"
 
 static ConfigGroup md_config("messagedirector");
 static ConfigVariable<std::string> bind_addr("bind", "unspecified", md_config);
 static ConfigVariable<std::string> connect_addr("connect", "unspecified", md_config);
-static ValidAddressConstraint valid_bind_addr(bind_addr);
-static ValidAddressConstraint valid_connect_addr(connect_addr);
+
+// The Message Director also takes "unix:/path" addresses, for participants on the same host.
+//     Windows has no Unix domain sockets to offer, so they're rejected there.
+#ifdef _WIN32
+static bool is_valid_md_address(const std::string &address)
+{
+    return is_valid_address(address);
+}
+static const char *invalid_md_address = "String is not a valid IPv4/IPv6 address or hostname.";
+#else
+static bool is_valid_md_address(const std::string &address)
+{
+    return is_unix_address(address) || is_valid_address(address);
+}
+static const char *invalid_md_address =
+    "String is not a valid IPv4/IPv6 address, hostname, or unix:/path.";
+#endif
+static ConfigConstraint<std::string> valid_bind_addr(is_valid_md_address, bind_addr,
+        invalid_md_address);
+static ConfigConstraint<std::string> valid_connect_addr(is_valid_md_address, connect_addr,
+        invalid_md_address);
+
 static ConfigVariable<bool> threaded_mode("threaded", true, md_config);
+static ConfigVariable<unsigned int> routing_threads("threads", 1, md_config);
+static const unsigned int DEFAULT_QUEUE_SIZE = 16384;
+static ConfigVariable<unsigned int> queue_size("queue_size", DEFAULT_QUEUE_SIZE, md_config);
+static ConfigVariable<unsigned int> spill_limit("spill_limit", 65536, md_config);
+static ConfigVariable<bool> lockless_mode("lockless_lookups", false, md_config);
+static ConfigVariable<unsigned int> compact_threshold("compact_threshold", 0, md_config);
+static ConfigVariable<bool> filter_upstream("filter_upstream", false, md_config);
+static ConfigVariable<bool> cork_upstream("cork_upstream", false, md_config);
+static ConfigVariable<bool> cork_downstream("cork_downstream", false, md_config);
+static ConfigVariable<unsigned int> cork_linger("cork_linger", 0, md_config);
+static ConfigVariable<unsigned int> inbox_size("inbox_size", 0, md_config);
+static ConfigVariable<std::string> inbox_overflow("inbox_overflow", "block", md_config);
+
+static bool is_valid_inbox_overflow(const std::string& policy)
+{
+    return policy == "block" || policy == "drop" || policy == "disconnect";
+}
+static ConfigConstraint<std::string> inbox_overflow_valid(is_valid_inbox_overflow, inbox_overflow,
+        "Message Director inbox_overflow must be one of block, drop, or disconnect.");
+
+static bool is_valid_compact_threshold(const unsigned int& threshold)
+{
+    return threshold == 0 || threshold >= 2;
+}
+static ConfigConstraint<unsigned int> compact_threshold_valid(is_valid_compact_threshold,
+        compact_threshold, "Message Director compact_threshold must be 0 (off) or at least 2.");
+
+static bool is_power_of_two_queue(const unsigned int& size)
+{
+    return MPSCQueue<int>::is_valid_capacity(size);
+}
+static ConfigConstraint<unsigned int> queue_size_pow2(is_power_of_two_queue, queue_size,
+        "Message Director queue_size must be a power of two (and at least 2).");
+
+static bool is_nonzero_threads(const unsigned int& threads)
+{
+    return threads > 0;
+}
+static ConfigConstraint<unsigned int> threads_nonzero(is_nonzero_threads, routing_threads,
+        "Message Director threads must be at least 1.");
+
+// A CONTROL_FILTER_ADD carries at most this many channels (or ranges); past that, the
+// downstream MD is sent its whole filter again instead.
+static const size_t MAX_FILTER_ADDS = 4096;
+
+// A downstream filter is rebuilt after this many unsubscribes by other participants.
+static const unsigned int FILTER_REBUILD_UNSUBSCRIBES = 1024;
+
+// A routing thread drains at most this many tasks before re-checking for shutdown.
+static const size_t MAX_DRAIN_BATCH = 1024;
+
+// A participant's inbox is drained at most this many datagrams at a time, before the
+// other tasks on its shard get a turn.
+static const size_t INBOX_DRAIN_BATCH = 64;
+
+// Bounds for the adaptive spin before a routing thread parks.  The spin budget
+// doubles every time spinning finds work and halves every time it doesn't.
+static const unsigned int MIN_SPIN = 16;
+static const unsigned int MAX_SPIN = 4096;
+
+// Set on the routing threads, which must never wait for room in a shard's queue: the
+//     room may have to be made by the very thread that's waiting, or by one waiting on it.
+static thread_local bool t_routing_thread = false;
 
 static ConfigGroup daemon_config("daemon");
 static ConfigVariable<std::string> daemon_name("name", "<unnamed>", daemon_config);
 static ConfigVariable<std::string> daemon_url("url", "", daemon_config);
 
+struct RoutingSender;
+
+// A RoutingTask is one unit of work for a routing thread.
+struct RoutingTask {
+    enum Kind : uint8_t {
+        ROUTE,   // Look up the receivers of dg, sent by participant (or upstream if null).
+        DELIVER, // Hand dg to participant, with its payload starting at offset.
+        DELETE,  // Delete the terminated participant.
+        DRAIN,   // Handle a batch of the datagrams in participant's inbox.
+    };
+
+    Kind kind = ROUTE;
+    bool droppable = false; // For ROUTE, see MDParticipantInterface::route_unreliable.
+    MDParticipantInterface *participant = nullptr;
+    DatagramHandle dg;
+    size_t offset = 0;
+    size_t origin = 0; // For DELIVER, the shard which routed it.
+    RoutingSender *sender = nullptr; // For ROUTE and DELIVER, whose datagram it is.
+};
+
+// A RoutingSender keeps track, on its shard, of the deliveries of one sender's datagrams
+//     (or upstream's, for the null sender) which are being handled elsewhere: on another
+//     shard, or from an inbox.  Until they're all done, the sender's next datagrams are
+//     held back, so that its datagram has been fully handled (including any subscription
+//     changes it caused) before its next one is looked up.  Other senders' datagrams
+//     carry on meanwhile, so one slow receiver only holds up the senders it has heard from.
+struct RoutingSender {
+    std::atomic<uint64_t> outstanding {0}; // Updated by any thread.
+
+    // The rest belong to the shard's thread.
+    // Routes waiting for outstanding to reach 0, in order, from next_held on.  Emptied
+    //     (keeping its capacity) once they've all gone, so that holding doesn't allocate.
+    std::vector<RoutingTask> held;
+    size_t next_held = 0;
+    MDParticipantInterface *deleting = nullptr; // Set if a delete is waiting for held to empty.
+
+    inline bool holding() const
+    {
+        return next_held < held.size();
+    }
+};
+
+// A RoutingShard is one routing queue, and the thread draining it.
+//
+// Each shard keeps its routes and its deliveries (and deletes) in separate queues.
+//     A route whose sender still has deliveries outstanding (see RoutingSender) is held
+//     back, and the shard moves on to the next; meanwhile the shard keeps working through
+//     deliveries from other shards, so they can't deadlock.
+struct RoutingShard {
+    RoutingShard(size_t index, size_t capacity) : index(index), routes(capacity), deliveries(capacity)
+    {
+    }
+
+    const size_t index;
+    MPSCQueue<RoutingTask> routes;
+    MPSCQueue<RoutingTask> deliveries;
+    std::unique_ptr<std::thread> thread;
+
+    // The senders routed by this shard, created on their first datagram and kept until
+    //     they're deleted.  Only the shard's thread touches the map.
+    std::unordered_map<const MDParticipantInterface*, std::unique_ptr<RoutingSender>> senders;
+
+    // Senders with routes held back, and how many there are.  released is set when one of
+    //     this shard's senders finishes its outstanding deliveries while any are held.
+    std::vector<RoutingSender*> held_senders;
+    std::atomic<size_t> held_count {0};
+    std::atomic<bool> released {false};
+
+    // Participants whose DRAIN was put off because they were busy (see begin_inbox_drain).
+    //     They're tried again once busy_ready is set, by MessageDirector::inbox_ready.
+    std::vector<MDParticipantInterface*> busy;
+    std::atomic<bool> busy_ready {false};
+
+    inline bool has_work() const
+    {
+        return !deliveries.empty() || !routes.empty() || released || busy_ready;
+    }
+
+    // Tasks pushed to and finished by this shard; used to defer deletes.
+    std::atomic<uint64_t> enqueued {0};
+    std::atomic<uint64_t> processed {0};
+
+    // The thread spins for a while when the queue runs dry, then parks on park_cv.
+    //     Producers only touch the lock when parked is set.
+    std::atomic<bool> parked {false};
+    std::mutex park_lock;
+    std::condition_variable park_cv;
+
+    // Producers waiting for the route overflow list to drop below the spill limit, see
+    //     MessageDirector::wait_for_room.  The shard's thread only touches the lock when
+    //     room_waiters is set.
+    std::atomic<size_t> room_waiters {0};
+    std::mutex room_lock;
+    std::condition_variable room_cv;
+
+    // Counters, see MessageDirector::queue_stats().
+    std::atomic<uint64_t> spill_waits {0};
+    std::atomic<uint64_t> spill_drops {0};
+    std::atomic<uint64_t> batches {0};
+    std::atomic<size_t> last_batch {0};
+    std::atomic<size_t> max_batch {0};
+    std::atomic<uint64_t> parks {0};
+    std::atomic<uint64_t> dispatch_allocations {0};
+    std::atomic<uint64_t> upstream_filtered {0};
+
+    // Reused by process_datagram, so that routing doesn't allocate per datagram.
+    std::vector<ChannelSubscriber*> receivers;
+};
+
+// A ParticipantInbox holds the datagrams routed to a participant which it hasn't handled
+//     yet.  Any routing thread may post to it, but only the participant's own shard
+//     drains it, so the participant still handles one datagram at a time, in order.
+struct ParticipantInbox {
+    struct Entry {
+        DatagramHandle dg;
+        size_t offset; // Where the payload starts.
+        std::chrono::steady_clock::time_point queued;
+        RoutingShard *origin; // The shard waiting for it to be handled, if any...
+        RoutingSender *sender; // ...on behalf of this sender.
+    };
+
+    std::mutex lock;
+    std::deque<Entry> entries;
+    bool scheduled = false;   // A DRAIN task is waiting (or running) for this inbox.
+    bool overflowed = false;  // Overflowed under INBOX_DISCONNECT; drops everything.
+    bool overflow_handled = false; // The participant has been told it overflowed.
+
+    // Counters, see MDInboxStats.
+    size_t max_depth = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t blocked = 0;
+    uint64_t total_wait_us = 0;
+    uint64_t max_wait_us = 0;
+};
+
+MDParticipantInterface::MDParticipantInterface()
+{
+    MessageDirector::singleton.add_participant(this);
+}
+
+MDParticipantInterface::~MDParticipantInterface()
+{
+}
+
 MessageDirector MessageDirector::singleton;
 
 
 MessageDirector::MessageDirector() :  m_initialized(false), m_net_acceptor(nullptr), m_upstream(nullptr),
-    m_shutdown(false), m_main_is_routing(false), m_thread(nullptr), m_log("msgdir", "Message Director")
+    m_shutdown(false), m_threaded(false), m_main_is_routing(false), m_inbox_size(0),
+    m_inbox_overflow(INBOX_BLOCK), m_spill_limit(0), m_spill_drop(false), m_pending_delete_count(0), m_log("msgdir", "Message Director")
 {
+    m_shards.emplace_back(new RoutingShard(0, DEFAULT_QUEUE_SIZE));
 }
 
 MessageDirector::~MessageDirector()
 {
     shutdown_threading();
 
+    // Anything still waiting to be deleted goes now.
+    for(const auto& it : m_pending_deletes) {
+        m_terminated_participants.insert(it.participant);
+    }
+    m_pending_deletes.clear();
+    for(auto& shard : m_shards) {
+        RoutingTask task;
+        while(shard->deliveries.pop(task)) {
+            if(task.kind == RoutingTask::DELETE) {
+                m_terminated_participants.insert(task.participant);
+            }
+        }
+        for(const auto& it : shard->held_senders) {
+            if(it->deleting) {
+                m_terminated_participants.insert(it->deleting);
+            }
+        }
+    }
+
     m_terminated_participants.insert(m_participants.begin(), m_participants.end());
     m_participants.clear();
 
@@ -49,13 +305,20 @@ void MessageDirector::init_network()
         if(bind_addr.get_val() != "unspecified") {
             m_log.info() << "Opening listening socket..." << std::endl;
 
-            TcpAcceptorCallback callback = std::bind(&MessageDirector::handle_connection,
-                                           this, std::placeholders::_1);
-
             AcceptorErrorCallback err_callback = std::bind(&MessageDirector::handle_error,
                                                     this, std::placeholders::_1);
 
-            m_net_acceptor = std::unique_ptr<TcpAcceptor>(new TcpAcceptor(callback, err_callback));
+            if(is_unix_address(bind_addr.get_val())) {
+                PipeAcceptorCallback callback = std::bind(&MessageDirector::handle_local_connection,
+                                                this, std::placeholders::_1);
+
+                m_net_acceptor = std::unique_ptr<PipeAcceptor>(new PipeAcceptor(callback, err_callback));
+            } else {
+                TcpAcceptorCallback callback = std::bind(&MessageDirector::handle_connection,
+                                               this, std::placeholders::_1);
+
+                m_net_acceptor = std::unique_ptr<TcpAcceptor>(new TcpAcceptor(callback, err_callback));
+            }
             m_net_acceptor->bind(bind_addr.get_val(), 7199);
             m_net_acceptor->start();
         }
@@ -65,14 +328,80 @@ void MessageDirector::init_network()
             m_log.info() << "Connecting upstream..." << std::endl;
 
             MDNetworkUpstream *upstream = new MDNetworkUpstream(this);
+            if(cork_upstream.get_val()) {
+                upstream->set_corked(true, cork_linger.get_val());
+            }
 
             upstream->connect(connect_addr.get_val());
 
             m_upstream = upstream;
+
+            if(compact_threshold.get_val() > 0) {
+                m_compactor.reset(new SubscriptionCompactor(compact_threshold.get_val()));
+            }
+
+            // Ask upstream to tell us what it wants, so we can stop sending it the rest.
+            if(filter_upstream.get_val()) {
+                m_upstream->send_control(Datagram::create(CONTROL_ENABLE_FILTER));
+            }
+        }
+
+        // Resize the inbound queue now that the config is loaded.  Nothing else
+        // can be consuming yet, so carry across anything routed before now.
+        if(queue_size.get_val() != m_shards[0]->routes.capacity()) {
+            std::unique_ptr<RoutingShard> shard(new RoutingShard(0, queue_size.get_val()));
+            RoutingTask task;
+            while(m_shards[0]->routes.pop(task)) {
+                shard->routes.push(std::move(task));
+            }
+            m_shards[0] = std::move(shard);
+        }
+
+        m_spill_limit = spill_limit.get_val();
+        m_spill_drop = inbox_overflow.get_val() == "drop";
+
+        if(lockless_mode.get_val()) {
+            enable_lockless_lookups();
+        }
+
+        if(inbox_size.get_val() > 0) {
+            m_inbox_size = inbox_size.get_val();
+            if(inbox_overflow.get_val() == "drop") {
+                m_inbox_overflow = INBOX_DROP;
+            } else if(inbox_overflow.get_val() == "disconnect") {
+                m_inbox_overflow = INBOX_DISCONNECT;
+            }
+
+            // Participants created from now on get theirs in add_participant.
+            std::lock_guard<std::mutex> lock(m_participants_lock);
+            for(const auto& it : m_participants) {
+                create_inbox(it);
+            }
         }
 
         if(threaded_mode.get_val()) {
-            m_thread.reset(new std::thread(std::bind(&MessageDirector::routing_thread, this)));
+            // Additional shards only make sense with threads to drain them.
+            for(unsigned int i = 1; i < routing_threads.get_val(); ++i) {
+                m_shards.emplace_back(new RoutingShard(i, queue_size.get_val()));
+            }
+
+            for(auto& shard : m_shards) {
+                shard->thread.reset(new std::thread(std::bind(&MessageDirector::routing_thread,
+                                                              this, shard.get())));
+            }
+            m_threaded = true;
+
+            if(m_shards.size() > 1) {
+                m_log.info() << "Routing on " << m_shards.size() << " threads." << std::endl;
+
+                // Without a core each, they only get in each other's way.
+                unsigned int cores = std::thread::hardware_concurrency();
+                if(cores != 0 && m_shards.size() >= cores) {
+                    m_log.warning() << "Routing on " << m_shards.size() << " threads with only "
+                                    << cores << " cores; this is likely slower than one thread."
+                                    << std::endl;
+                }
+            }
         }
 
         m_initialized = true;
@@ -81,37 +410,77 @@ void MessageDirector::init_network()
 
 void MessageDirector::shutdown_threading()
 {
-    if(!m_thread) {
+    if(!m_threaded) {
         return;
     }
 
-    // Signal routing thread to shut down:
-    {
-        std::lock_guard<std::mutex> lock(m_messages_lock);
-        m_shutdown = true;
-        m_cv.notify_one();
+    // Signal routing threads to shut down:
+    m_shutdown = true;
+    for(auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard->park_lock);
+        shard->parked = false;
+        shard->park_cv.notify_one();
+    }
+    for(auto& shard : m_shards) {
+        std::lock_guard<std::mutex> lock(shard->room_lock);
+        shard->room_cv.notify_all();
     }
 
-    // Wait for it to do so:
-    m_thread->join();
-    m_thread.reset();
+    // Wait for them to do so:
+    for(auto& shard : m_shards) {
+        shard->thread->join();
+        shard->thread.reset();
+    }
+    m_threaded = false;
+}
+
+size_t MessageDirector::shard_for(const MDParticipantInterface *p) const
+{
+    // Messages from upstream (no participant) always use the first shard.
+    if(m_shards.size() == 1 || p == nullptr) {
+        return 0;
+    }
+
+    // Participant pointers are aligned, so mix the bits before picking a shard.
+    uint64_t key = reinterpret_cast<uintptr_t>(p->routing_affinity());
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (key >> 32) % m_shards.size();
 }
 
-void MessageDirector::route_datagram(MDParticipantInterface *p, DatagramHandle dg)
+void MessageDirector::enqueue_task(size_t index, RoutingTask &&task)
 {
-    std::unique_lock<std::mutex> lock(m_messages_lock);
+    RoutingShard &shard = *m_shards[index];
+    shard.enqueued.fetch_add(1, std::memory_order_acq_rel);
+    if(task.kind == RoutingTask::ROUTE) {
+        shard.routes.push(std::move(task));
+    } else {
+        shard.deliveries.push(std::move(task));
+    }
 
-    // We need to hold the lock to push the datagram into the message queue, and to signal the MD thread (if in threaded mode).
-    m_messages.push(std::make_pair(p, dg));
+    if(m_threaded) {
+        // If in threaded mode, ring the bell if the shard's thread has gone to sleep.
+        wake_shard(shard);
+    }
+}
 
-    if(m_thread) {
-        // If in threaded mode, ring the bell to let the MD thread know we have a datagram to process and return.
-        m_cv.notify_one();
+void MessageDirector::route_datagram(MDParticipantInterface *p, DatagramHandle dg, bool droppable)
+{
+    size_t index = shard_for(p);
+    RoutingShard &shard = *m_shards[index];
+    if(m_spill_limit != 0 && shard.routes.spilled() >= m_spill_limit &&
+       !wait_for_room(shard, droppable)) {
         return;
     }
 
-    // We don't need to hold the message lock past this point, as we're not in threaded mode.
-    lock.unlock();
+    RoutingTask task;
+    task.droppable = droppable;
+    task.participant = p;
+    task.dg = std::move(dg);
+    enqueue_task(index, std::move(task));
+
+    if(m_threaded) {
+        return;
+    }
 
     if(std::this_thread::get_id() != g_main_thread_id) {
         // We aren't working in threaded mode, but we aren't in the main thread
@@ -125,6 +494,254 @@ void MessageDirector::route_datagram(MDParticipantInterface *p, DatagramHandle d
     }
 }
 
+bool MessageDirector::wait_for_room(RoutingShard &shard, bool droppable)
+{
+    if(droppable && m_spill_drop) {
+        shard.spill_drops.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // The shard's own thread (or the main thread, when it does the routing) is the one
+    //     that has to make the room, so it can't wait for it; neither can the other routing
+    //     threads, which it may be waiting on in turn.  They may overshoot the limit a little,
+    //     but what they route comes of handling what's already queued.
+    if(t_routing_thread || (!m_threaded && std::this_thread::get_id() == g_main_thread_id)) {
+        return true;
+    }
+
+    shard.spill_waits.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(shard.room_lock);
+    shard.room_waiters.fetch_add(1);
+    // Pairs with the fence in drain_shard: either it sees room_waiters, or we see the room.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    shard.room_cv.wait(lock, [this, &shard] {
+        return shard.routes.spilled() < m_spill_limit || m_shutdown;
+    });
+    shard.room_waiters.fetch_sub(1);
+    return true;
+}
+
+void MessageDirector::wake_shard(RoutingShard &shard)
+{
+    // Pairs with the fence in park_shard: either the routing thread sees our
+    // task (or outstanding count) when it re-checks, or we see that it has parked.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(shard.parked.load(std::memory_order_relaxed) && shard.parked.exchange(false)) {
+        std::lock_guard<std::mutex> lock(shard.park_lock);
+        shard.park_cv.notify_one();
+    }
+}
+
+void MessageDirector::park_shard(RoutingShard &shard)
+{
+    std::unique_lock<std::mutex> lock(shard.park_lock);
+    shard.parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(shard.has_work() || m_shutdown) {
+        shard.parked = false;
+        return;
+    }
+
+    shard.parks.fetch_add(1, std::memory_order_relaxed);
+    shard.park_cv.wait(lock, [this, &shard] { return !shard.parked || m_shutdown; });
+}
+
+size_t MessageDirector::drain_shard(RoutingShard &shard)
+{
+    size_t count = 0;
+    if(shard.busy_ready.exchange(false)) {
+        count += retry_busy(shard);
+    }
+
+    count += shard.deliveries.drain([this, &shard](RoutingTask && task) {
+        run_task(shard, task);
+    }, MAX_DRAIN_BATCH);
+
+    if(shard.released.exchange(false)) {
+        count += release_routes(shard);
+    }
+
+    RoutingTask task;
+    while(count < MAX_DRAIN_BATCH && shard.routes.pop(task)) {
+        RoutingSender &sender = sender_for(shard, task.participant);
+        task.sender = &sender;
+        if(sender.holding() || sender.outstanding.load() != 0) {
+            hold_route(shard, sender, std::move(task));
+            continue;
+        }
+
+        run_task(shard, task);
+        ++count;
+    }
+
+    if(m_spill_limit != 0) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(shard.room_waiters.load(std::memory_order_relaxed) != 0 &&
+           shard.routes.spilled() < m_spill_limit) {
+            std::lock_guard<std::mutex> lock(shard.room_lock);
+            shard.room_cv.notify_all();
+        }
+    }
+
+    if(count > 0) {
+        shard.batches.fetch_add(1, std::memory_order_relaxed);
+        shard.last_batch.store(count, std::memory_order_relaxed);
+        if(count > shard.max_batch.load(std::memory_order_relaxed)) {
+            shard.max_batch.store(count, std::memory_order_relaxed);
+        }
+
+        // Our progress may be what a terminated participant was waiting on.
+        process_pending_deletes();
+    }
+
+    return count;
+}
+
+void MessageDirector::run_task(RoutingShard &shard, RoutingTask &task)
+{
+    process_task(shard, task);
+    shard.processed.fetch_add(1, std::memory_order_acq_rel);
+}
+
+RoutingSender& MessageDirector::sender_for(RoutingShard &shard, const MDParticipantInterface *p)
+{
+    std::unique_ptr<RoutingSender> &sender = shard.senders[p];
+    if(sender == nullptr) {
+        sender.reset(new RoutingSender);
+    }
+    return *sender;
+}
+
+void MessageDirector::hold_route(RoutingShard &shard, RoutingSender &sender, RoutingTask &&task)
+{
+    if(!sender.holding()) {
+        shard.held_senders.push_back(&sender);
+        shard.held_count.fetch_add(1);
+    }
+    // It may be held for a while; don't let it pin the buffer it was read into meanwhile.
+    task.dg = Datagram::copy_if_view(std::move(task.dg));
+    sender.held.push_back(std::move(task));
+
+    // Pairs with finish_delivery: either it sees held_count and sets released, or we see
+    //     that the last delivery has already finished.
+    if(sender.outstanding.load() == 0) {
+        shard.released = true;
+    }
+}
+
+size_t MessageDirector::release_routes(RoutingShard &shard)
+{
+    size_t count = 0;
+    auto it = shard.held_senders.begin();
+    while(it != shard.held_senders.end()) {
+        RoutingSender &sender = **it;
+        while(sender.holding() && sender.outstanding.load() == 0) {
+            RoutingTask task = std::move(sender.held[sender.next_held++]);
+            run_task(shard, task);
+            ++count;
+        }
+
+        if(sender.holding()) {
+            ++it;
+            continue;
+        }
+
+        sender.held.clear();
+        sender.next_held = 0;
+        it = shard.held_senders.erase(it);
+        shard.held_count.fetch_sub(1);
+        if(sender.deleting != nullptr) {
+            // Its routes were all that was keeping it; see delete_participant.
+            MDParticipantInterface *p = sender.deleting;
+            sender.deleting = nullptr;
+            delete_participant(shard, p);
+        }
+    }
+    return count;
+}
+
+size_t MessageDirector::retry_busy(RoutingShard &shard)
+{
+    std::vector<MDParticipantInterface*> busy;
+    busy.swap(shard.busy);
+
+    size_t count = 0;
+    for(const auto& it : busy) {
+        InboxDrain result = drain_inbox(it);
+        if(result != INBOX_BUSY) {
+            ++count;
+        }
+        continue_drain(shard, it, result);
+    }
+    return count;
+}
+
+void MessageDirector::delete_participant(RoutingShard &shard, MDParticipantInterface *p)
+{
+    shard.busy.erase(std::remove(shard.busy.begin(), shard.busy.end(), p), shard.busy.end());
+
+    auto it = shard.senders.find(p);
+    if(it != shard.senders.end()) {
+        RoutingSender &sender = *it->second;
+        if(sender.holding()) {
+            // Its own datagrams are still waiting to be routed, and they refer to it.
+            sender.deleting = p;
+            return;
+        } else if(sender.outstanding.load() == 0) {
+            shard.senders.erase(it);
+        }
+        // Otherwise deliveries elsewhere still refer to its RoutingSender, which is left
+        //     behind; a participant created at the same address later just shares it.
+    }
+
+    delete p;
+}
+
+void MessageDirector::process_task(RoutingShard &shard, RoutingTask &task)
+{
+    switch(task.kind) {
+    case RoutingTask::ROUTE:
+        process_datagram(shard, *task.sender, task.participant, task.dg, task.droppable);
+        break;
+    case RoutingTask::DELIVER: {
+        DatagramIterator dgi(task.dg, task.offset);
+        deliver_datagram(task.participant, task.dg, dgi);
+        finish_delivery(*m_shards[task.origin], *task.sender);
+        break;
+    }
+    case RoutingTask::DELETE:
+        delete_participant(shard, task.participant);
+        break;
+    case RoutingTask::DRAIN:
+        continue_drain(shard, task.participant, drain_inbox(task.participant));
+        break;
+    }
+}
+
+void MessageDirector::continue_drain(RoutingShard &shard, MDParticipantInterface *p,
+                                     InboxDrain result)
+{
+    if(result == INBOX_MORE) {
+        // More left; go to the back of the queue, so others on this shard get a turn.
+        RoutingTask again;
+        again.kind = RoutingTask::DRAIN;
+        again.participant = p;
+        enqueue_task(shard.index, std::move(again));
+    } else if(result == INBOX_BUSY) {
+        shard.busy.push_back(p);
+    }
+}
+
+void MessageDirector::finish_delivery(RoutingShard &origin, RoutingSender &sender)
+{
+    // N.B. sender may be deleted as soon as outstanding reaches 0; don't touch it after.
+    if(sender.outstanding.fetch_sub(1) == 1 && origin.held_count.load() > 0) {
+        // That was the last one; the sender's held routes (if it has any) can go now.
+        origin.released = true;
+        wake_shard(origin);
+    }
+}
+
 void MessageDirector::flush_queue()
 {
     // We want to be sure this is being invoked from within the main thread.
@@ -136,66 +753,101 @@ void MessageDirector::flush_queue()
     }
 
     m_main_is_routing = true;
-    
-    {
-        std::unique_lock<std::mutex> lock(m_messages_lock);
-
-        while(!m_messages.empty()) {
-            // Get and process the datagram:
-            auto msg = m_messages.front();
-            m_messages.pop();
 
-            lock.unlock();
-            process_datagram(msg.first, msg.second);
-            lock.lock();
+    // N.B. A producer on another thread that is still mid-push will post its
+    // own flush_queue to the main thread, so it's fine to stop early here.
+    RoutingShard &shard = *m_shards[0];
+    while(drain_shard(shard) > 0 || !shard.busy.empty()) {
+        if(shard.busy.empty() || shard.has_work()) {
+            continue;
         }
+
+        // Only busy participants are left, held up on another thread (e.g. a client's
+        //     I/O loop); wait for one to come free, as handling their datagrams directly would.
+        std::unique_lock<std::mutex> lock(shard.park_lock);
+        shard.park_cv.wait(lock, [&shard] { return shard.busy_ready.load(); });
     }
 
     // We're done flushing, we can now be invoked from others.
     m_main_is_routing = false;
 }
 
-// This function runs in a thread; it loops until it's told to shut down:
-void MessageDirector::routing_thread()
+// This function runs in a thread per shard; it loops until it's told to shut down:
+void MessageDirector::routing_thread(RoutingShard *shard)
 {
-    std::unique_lock<std::mutex> lock(m_messages_lock);
+    t_routing_thread = true;
+    unsigned int spin_limit = MIN_SPIN;
 
-    while(true) {
-        // Wait for something interesting to handle...
-        while(m_messages.empty() && !m_shutdown) {
-            m_cv.wait(lock);
+    while(!m_shutdown) {
+        if(drain_shard(*shard) > 0) {
+            continue;
         }
 
-        if(m_shutdown) {
-            // Ehh, we've been told to shut off:
-            return;
+        // Nothing to do; spin for a while before going to sleep, since under
+        // load the next message is usually only a moment away.
+        bool found_work = false;
+        for(unsigned int i = 0; i < spin_limit; ++i) {
+            if(shard->has_work() || m_shutdown) {
+                found_work = true;
+                break;
+            }
+            std::this_thread::yield();
         }
 
-        // Get and process the message:
-        auto msg = m_messages.front();
-        m_messages.pop();
+        if(found_work) {
+            spin_limit = std::min(spin_limit * 2, MAX_SPIN);
+        } else {
+            spin_limit = std::max(spin_limit / 2, MIN_SPIN);
+            park_shard(*shard);
+        }
+    }
+}
 
-        lock.unlock();
-        process_datagram(msg.first, msg.second);
-        lock.lock();
+MDQueueStats MessageDirector::queue_stats() const
+{
+    MDQueueStats stats = {};
+    stats.shards = m_shards.size();
+    for(const auto& shard : m_shards) {
+        stats.depth += shard->routes.size() + shard->deliveries.size();
+        stats.capacity += shard->routes.capacity() + shard->deliveries.capacity();
+        stats.spills += shard->routes.spills() + shard->deliveries.spills();
+        stats.spilled += shard->routes.spilled() + shard->deliveries.spilled();
+        stats.spill_waits += shard->spill_waits.load(std::memory_order_relaxed);
+        stats.spill_drops += shard->spill_drops.load(std::memory_order_relaxed);
+        stats.messages += shard->processed.load(std::memory_order_relaxed);
+        stats.batches += shard->batches.load(std::memory_order_relaxed);
+        stats.last_batch = std::max(stats.last_batch, shard->last_batch.load(std::memory_order_relaxed));
+        stats.max_batch = std::max(stats.max_batch, shard->max_batch.load(std::memory_order_relaxed));
+        stats.parks += shard->parks.load(std::memory_order_relaxed);
+        stats.dispatch_allocations += shard->dispatch_allocations.load(std::memory_order_relaxed);
+        stats.upstream_filtered += shard->upstream_filtered.load(std::memory_order_relaxed);
     }
+    if(m_upstream) {
+        stats.upstream_control_depth = m_upstream->queued_datagrams(SEND_CONTROL);
+        stats.upstream_bulk_depth = m_upstream->queued_datagrams(SEND_BULK);
+    }
+    return stats;
 }
 
-void MessageDirector::process_datagram(MDParticipantInterface *p, DatagramHandle dg)
+void MessageDirector::process_datagram(RoutingShard &shard, RoutingSender &sender,
+                                       MDParticipantInterface *p, DatagramHandle &dg,
+                                       bool droppable)
 {
     m_log.trace() << "Processing datagram...." << std::endl;
 
-    std::vector<channel_t> channels;
+    // Most datagrams have a single receiver, and few have more than a handful.
+    SmallVector<channel_t, 16> channels;
     DatagramIterator dgi(dg);
     try {
         // Unpack channels to send messages to
         uint8_t channel_count = dgi.read_uint8();
+        channels.resize(channel_count);
         auto receive_log = m_log.trace();
         receive_log << "Receivers: ";
         for(uint8_t i = 0; i < channel_count; ++i) {
             channel_t channel = dgi.read_channel();
             receive_log << channel << ", ";
-            channels.push_back(channel);
+            channels[i] = channel;
         }
         receive_log << "\n";
     } catch(DatagramIteratorEOF &) {
@@ -211,29 +863,58 @@ void MessageDirector::process_datagram(MDParticipantInterface *p, DatagramHandle
     }
 
     // Find the participants that need to receive the message
-    std::unordered_set<ChannelSubscriber*> receiving_participants;
-    lookup_channels(channels, receiving_participants);
+    std::vector<ChannelSubscriber*> &receiving_participants = shard.receivers;
+    size_t receivers_capacity = receiving_participants.capacity();
+    lookup_channels(channels.data(), channels.size(), receiving_participants);
     if(p) {
-        receiving_participants.erase(p);
+        auto it = std::find(receiving_participants.begin(), receiving_participants.end(), p);
+        if(it != receiving_participants.end()) {
+            receiving_participants.erase(it);
+        }
+    }
+
+    if(!channels.is_inline() || receiving_participants.capacity() != receivers_capacity) {
+        shard.dispatch_allocations.fetch_add(1, std::memory_order_relaxed);
     }
 
     // Send the datagram to each participant
+    size_t payload = dgi.tell();
     for(const auto& it : receiving_participants) {
         auto participant = static_cast<MDParticipantInterface *>(it);
-        DatagramIterator msg_dgi(dg, dgi.tell());
-
-        try {
-            participant->handle_datagram(dg, msg_dgi);
-        } catch(DatagramIteratorEOF &) {
-            // Log error with receivers output
-            m_log.error() << "Detected truncated datagram in handle_datagram for '"
-                          << participant->m_name << "' from participant '" << p->m_name << "'.\n";
-            return;
+
+        if(m_inbox_size > 0) {
+            post_to_inbox(shard, sender, participant, dg, payload, droppable);
+            continue;
         }
+
+        size_t receiver_shard = shard_for(participant);
+        if(receiver_shard != shard.index) {
+            // Hand it off to the receiver's own shard, so that each participant
+            // only ever handles datagrams on one thread.
+            RoutingTask task;
+            task.kind = RoutingTask::DELIVER;
+            task.participant = participant;
+            task.dg = dg;
+            task.offset = payload;
+            task.origin = shard.index;
+            task.sender = &sender;
+            sender.outstanding.fetch_add(1);
+            enqueue_task(receiver_shard, std::move(task));
+            continue;
+        }
+
+        // The same iterator is reused for each receiver, rewound to the payload.
+        // A receiver choking on the payload doesn't stop the rest from getting it, just
+        //     as with a DELIVER, so that who sees it doesn't depend on the shard layout.
+        dgi.seek(payload);
+        deliver_datagram(participant, dg, dgi);
     }
 
     // Send message upstream, if necessary
-    if(p && m_upstream) {
+    if(p && m_upstream && !m_upstream_filter.wants_any(channels.data(), channels.size())) {
+        shard.upstream_filtered.fetch_add(1, std::memory_order_relaxed);
+        m_log.trace() << "...not routing upstream: Nobody there wants it." << std::endl;
+    } else if(p && m_upstream) {
         m_upstream->handle_datagram(dg);
         m_log.trace() << "...routing upstream." << std::endl;
     } else if(!p) {
@@ -247,9 +928,276 @@ void MessageDirector::process_datagram(MDParticipantInterface *p, DatagramHandle
     // N.B. Participants may reach end-of-life after receiving a datagram, or may
     // be terminated in another thread (for example if a network socket closes);
     // either way, process any received terminates after processing a datagram.
-    process_terminates();
+    // When sharded, deletes are instead scheduled by process_pending_deletes.
+    if(m_shards.size() == 1) {
+        process_terminates();
+    }
 }
 
+void MessageDirector::deliver_datagram(MDParticipantInterface *p, const DatagramHandle &dg,
+                                       DatagramIterator &dgi)
+{
+    try {
+        p->handle_datagram(dg, dgi);
+    } catch(DatagramIteratorEOF &) {
+        // Log error with receivers output
+        m_log.error() << "Detected truncated datagram in handle_datagram for '"
+                      << p->m_name << "'.\n";
+    }
+}
+
+std::vector<MDInboxStats> MessageDirector::inbox_stats()
+{
+    std::vector<MDInboxStats> stats;
+    if(m_inbox_size == 0) {
+        return stats;
+    }
+
+    std::lock_guard<std::mutex> lock(m_participants_lock);
+    for(const auto& p : m_participants) {
+        ParticipantInbox &inbox = *p->m_inbox;
+        std::lock_guard<std::mutex> inbox_lock(inbox.lock);
+
+        MDInboxStats entry;
+        entry.name = p->m_name;
+        entry.depth = inbox.entries.size();
+        entry.max_depth = inbox.max_depth;
+        entry.delivered = inbox.delivered;
+        entry.dropped = inbox.dropped;
+        entry.blocked = inbox.blocked;
+        entry.total_wait_us = inbox.total_wait_us;
+        entry.max_wait_us = inbox.max_wait_us;
+        stats.push_back(std::move(entry));
+    }
+    return stats;
+}
+
+void MessageDirector::create_inbox(MDParticipantInterface *p)
+{
+    p->m_inbox.reset(new ParticipantInbox);
+}
+
+void MessageDirector::post_to_inbox(RoutingShard &shard, RoutingSender &sender,
+                                    MDParticipantInterface *p, DatagramHandle &dg,
+                                    size_t offset, bool droppable)
+{
+    ParticipantInbox &inbox = *p->m_inbox;
+    size_t receiver_shard = shard_for(p);
+    bool in_step = !p->forwards_only();
+    InboxOverflow policy = p->can_overflow() ? m_inbox_overflow : INBOX_BLOCK;
+    if(policy == INBOX_DROP && !droppable) {
+        // Anything else would leave the participant out of step, so it waits for room.
+        policy = INBOX_BLOCK;
+    }
+
+    std::unique_lock<std::mutex> lock(inbox.lock);
+    bool overflowed = false;
+    if(inbox.entries.size() >= m_inbox_size && !inbox.overflowed && !p->is_terminated()) {
+        if(policy == INBOX_DROP) {
+            ++inbox.dropped;
+            return;
+        } else if(policy == INBOX_DISCONNECT) {
+            // Nothing more will be handled; the DRAIN already scheduled lets it know.
+            m_log.warning() << "Inbox of '" << p->m_name << "' overflowed, disconnecting it.\n";
+            inbox.overflowed = true;
+            overflowed = true;
+            inbox.dropped += inbox.entries.size();
+            for(const auto& it : inbox.entries) {
+                if(it.origin) {
+                    finish_delivery(*it.origin, *it.sender);
+                }
+            }
+            inbox.entries.clear();
+        } else {
+            // Waiting here for room would hold up everyone else this thread routes, so it's
+            //     queued anyway and its sender waits instead, as for an in-step delivery.
+            //     Each sender can only put one datagram past the limit this way.
+            ++inbox.blocked;
+            in_step = true;
+        }
+    }
+
+    if(inbox.overflowed) {
+        ++inbox.dropped;
+        if(overflowed) {
+            // That DRAIN may have been put off as busy; telling it needn't wait.
+            lock.unlock();
+            inbox_ready(p);
+        }
+        return;
+    } else if(p->is_terminated()) {
+        return;
+    }
+
+    if(!inbox.entries.empty()) {
+        // It has to wait its turn, so don't let it pin the buffer it was read into meanwhile.
+        //     The copy replaces dg, so any more receivers waiting their turn share it.
+        dg = Datagram::copy_if_view(std::move(dg));
+    }
+
+    ParticipantInbox::Entry entry;
+    entry.dg = dg;
+    entry.offset = offset;
+    entry.queued = std::chrono::steady_clock::now();
+    entry.origin = nullptr;
+    entry.sender = nullptr;
+    if(in_step) {
+        // Like a DELIVER, the sender won't be routed again until it's been handled.
+        entry.origin = &shard;
+        entry.sender = &sender;
+        sender.outstanding.fetch_add(1);
+    }
+    inbox.entries.push_back(std::move(entry));
+    inbox.max_depth = std::max(inbox.max_depth, inbox.entries.size());
+
+    if(!inbox.scheduled) {
+        inbox.scheduled = true;
+        lock.unlock();
+
+        RoutingTask task;
+        task.kind = RoutingTask::DRAIN;
+        task.participant = p;
+        enqueue_task(receiver_shard, std::move(task));
+    }
+}
+
+MessageDirector::InboxDrain MessageDirector::drain_inbox(MDParticipantInterface *p)
+{
+    // Telling it that it overflowed doesn't wait on whatever might have it busy.
+    if(take_inbox_overflow(p)) {
+        p->handle_inbox_overflow();
+        return INBOX_DRAINED;
+    }
+
+    // A terminated participant's datagrams are just thrown away, which needn't wait.
+    bool began = false;
+    if(!p->is_terminated()) {
+        if(!p->begin_inbox_drain()) {
+            return INBOX_BUSY;
+        }
+        began = true;
+    }
+
+    ParticipantInbox &inbox = *p->m_inbox;
+    bool more = true;
+    for(size_t i = 0; more && i < INBOX_DRAIN_BATCH; ++i) {
+        ParticipantInbox::Entry entry;
+        {
+            std::lock_guard<std::mutex> lock(inbox.lock);
+            if(inbox.overflowed && !inbox.overflow_handled && !p->is_terminated()) {
+                // Handled below, once we're done with it.
+                break;
+            } else if(inbox.entries.empty() || p->is_terminated()) {
+                // Nothing more for it; anything left goes with the participant.
+                for(const auto& it : inbox.entries) {
+                    if(it.origin) {
+                        finish_delivery(*it.origin, *it.sender);
+                    }
+                }
+                inbox.entries.clear();
+                inbox.scheduled = false;
+                more = false;
+                break;
+            }
+
+            entry = std::move(inbox.entries.front());
+            inbox.entries.pop_front();
+
+            auto waited = std::chrono::steady_clock::now() - entry.queued;
+            uint64_t wait_us = std::chrono::duration_cast<std::chrono::microseconds>(waited).count();
+            ++inbox.delivered;
+            inbox.total_wait_us += wait_us;
+            inbox.max_wait_us = std::max(inbox.max_wait_us, wait_us);
+        }
+
+        DatagramIterator dgi(entry.dg, entry.offset);
+        deliver_datagram(p, entry.dg, dgi);
+        if(entry.origin) {
+            finish_delivery(*entry.origin, *entry.sender);
+        }
+    }
+    if(began) {
+        p->end_inbox_drain();
+    }
+
+    if(take_inbox_overflow(p)) {
+        // Outside the lock, as it will likely terminate the participant.
+        p->handle_inbox_overflow();
+        return INBOX_DRAINED;
+    }
+
+    return more ? INBOX_MORE : INBOX_DRAINED;
+}
+
+bool MessageDirector::take_inbox_overflow(MDParticipantInterface *p)
+{
+    ParticipantInbox &inbox = *p->m_inbox;
+    std::lock_guard<std::mutex> lock(inbox.lock);
+    if(inbox.overflowed && !inbox.overflow_handled && !p->is_terminated()) {
+        inbox.overflow_handled = true;
+        inbox.scheduled = false;
+        return true;
+    }
+    return false;
+}
+
+void MessageDirector::inbox_ready(MDParticipantInterface *p)
+{
+    if(m_inbox_size == 0) {
+        return;
+    }
+
+    RoutingShard &shard = *m_shards[shard_for(p)];
+    shard.busy_ready = true;
+    if(m_threaded) {
+        wake_shard(shard);
+        return;
+    }
+
+    // The main thread may be waiting for it in flush_queue; if not, it retries it now.
+    {
+        std::lock_guard<std::mutex> lock(shard.park_lock);
+        shard.park_cv.notify_one();
+    }
+    if(std::this_thread::get_id() != g_main_thread_id) {
+        TaskQueue::singleton.enqueue_task([self = this]() {
+            self->flush_queue();
+        });
+    } else {
+        flush_queue();
+    }
+}
+
+void ParticipantLock::lock()
+{
+    m_mutex.lock();
+    ++m_depth;
+}
+
+bool ParticipantLock::try_lock()
+{
+    if(m_mutex.try_lock()) {
+        ++m_depth;
+        return true;
+    }
+
+    // Either whoever holds it sees m_missed once it lets go, or it's gone by our second try.
+    m_missed = true;
+    if(m_mutex.try_lock()) {
+        ++m_depth;
+        return true;
+    }
+    return false;
+}
+
+void ParticipantLock::unlock()
+{
+    bool last = --m_depth == 0;
+    m_mutex.unlock();
+    if(last && m_missed.exchange(false)) {
+        MessageDirector::singleton.inbox_ready(m_participant);
+    }
+}
 
 void MessageDirector::process_terminates()
 {
@@ -267,7 +1215,9 @@ void MessageDirector::process_terminates()
 
 void MessageDirector::on_add_channel(channel_t c)
 {
-    if(m_upstream) {
+    if(m_compactor) {
+        m_compactor->add_channels(std::vector<channel_t> {c}, m_upstream);
+    } else if(m_upstream) {
         // Send upstream control message
         m_upstream->subscribe_channel(c);
     }
@@ -275,12 +1225,36 @@ void MessageDirector::on_add_channel(channel_t c)
 
 void MessageDirector::on_remove_channel(channel_t c)
 {
-    if(m_upstream) {
+    if(m_compactor) {
+        on_remove_channels(std::vector<channel_t> {c});
+    } else if(m_upstream) {
         // Send upstream control message
         m_upstream->unsubscribe_channel(c);
     }
 }
 
+void MessageDirector::on_add_channels(const std::vector<channel_t> &channels)
+{
+    if(m_compactor) {
+        m_compactor->add_channels(channels, m_upstream);
+    } else if(m_upstream) {
+        // Send upstream control message(s)
+        m_upstream->subscribe_channels(channels);
+    }
+}
+
+void MessageDirector::on_remove_channels(const std::vector<channel_t> &channels)
+{
+    if(m_compactor) {
+        m_compactor->remove_channels(channels, m_upstream, [this](channel_t c) {
+            return in_subscribed_range(c);
+        });
+    } else if(m_upstream) {
+        // Send upstream control message(s)
+        m_upstream->unsubscribe_channels(channels);
+    }
+}
+
 void MessageDirector::on_add_range(channel_t lo, channel_t hi)
 {
     if(m_upstream) {
@@ -294,6 +1268,152 @@ void MessageDirector::on_remove_range(channel_t lo, channel_t hi)
     if(m_upstream) {
         // Send upstream control message
         m_upstream->unsubscribe_range(lo, hi);
+
+        // That also dropped any channels we had compacted into ranges there.
+        if(m_compactor) {
+            m_compactor->readvertise(lo, hi, m_upstream);
+        }
+    }
+}
+
+void MessageDirector::on_subscribe_channels(ChannelSubscriber *p, const channel_t *channels, size_t count)
+{
+    if(m_downstream_filters.empty()) {
+        return;
+    }
+
+    FilterUpdates updates;
+    add_to_downstream_filters(p, false, channels, count, {}, updates);
+    send_filter_updates(updates);
+}
+
+void MessageDirector::on_subscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi)
+{
+    if(m_downstream_filters.empty()) {
+        return;
+    }
+
+    FilterUpdates updates;
+    add_to_downstream_filters(p, false, nullptr, 0, {std::make_pair(lo, hi)}, updates);
+    send_filter_updates(updates);
+}
+
+void MessageDirector::on_unsubscribe(ChannelSubscriber *p)
+{
+    FilterUpdates updates;
+    for(auto& it : m_downstream_filters) {
+        DownstreamFilter &filter = *it.second;
+        if(it.first != p && ++filter.stale >= FILTER_REBUILD_UNSUBSCRIBES) {
+            rebuild_downstream_filter(filter, updates);
+        }
+    }
+    send_filter_updates(updates);
+}
+
+void MessageDirector::enable_downstream_filter(MDNetworkParticipant *p)
+{
+    auto lock = lock_subscriptions();
+
+    std::unique_ptr<DownstreamFilter> &filter = m_downstream_filters[p];
+    if(!filter) {
+        filter.reset(new DownstreamFilter(p));
+    }
+
+    FilterUpdates updates;
+    rebuild_downstream_filter(*filter, updates);
+    send_filter_updates(updates);
+}
+
+void MessageDirector::rebuild_downstream_filter(DownstreamFilter &filter, FilterUpdates &updates)
+{
+    filter.sent.clear();
+    filter.stale = 0;
+
+    // Anything our own upstream wants, the downstream MD has to send us too.
+    if(m_upstream) {
+        filter.sent.merge(m_upstream_filter);
+    }
+
+    if(!filter.sent.pass_all()) {
+        std::lock_guard<std::mutex> lock(m_participants_lock);
+        for(const auto& it : m_participants) {
+            if(it == filter.participant) {
+                continue;
+            }
+
+            for(const auto& c : it->channels()) {
+                filter.sent.add_channel(c);
+            }
+            for(const auto& range : it->ranges()) {
+                filter.sent.add_range(boost::icl::first(range), boost::icl::last(range));
+            }
+        }
+    }
+
+    DatagramPtr dg = Datagram::create(CONTROL_FILTER_RESET);
+    filter.sent.write(dg);
+    updates.push_back(std::make_pair(filter.participant, dg));
+}
+
+void MessageDirector::add_to_downstream_filters(ChannelSubscriber *except, bool pass_all,
+        const channel_t *channels, size_t count,
+        const std::vector<std::pair<channel_t, channel_t>> &ranges,
+        FilterUpdates &updates)
+{
+    for(auto& it : m_downstream_filters) {
+        DownstreamFilter &filter = *it.second;
+        if(it.first == except || filter.sent.pass_all()) {
+            continue;
+        }
+
+        // Only tell the downstream MD about what's new to its filter.
+        std::vector<channel_t> added_channels;
+        std::vector<std::pair<channel_t, channel_t>> added_ranges;
+        if(pass_all) {
+            filter.sent.set_pass_all();
+        }
+        for(size_t i = 0; i < count; ++i) {
+            if(filter.sent.add_channel(channels[i])) {
+                added_channels.push_back(channels[i]);
+            }
+        }
+        for(const auto& range : ranges) {
+            if(filter.sent.add_range(range.first, range.second)) {
+                added_ranges.push_back(range);
+            }
+        }
+
+        if(filter.sent.pass_all()) {
+            added_channels.clear();
+            added_ranges.clear();
+        } else if(added_channels.empty() && added_ranges.empty()) {
+            continue;
+        } else if(added_channels.size() > MAX_FILTER_ADDS || added_ranges.size() > MAX_FILTER_ADDS) {
+            DatagramPtr dg = Datagram::create(CONTROL_FILTER_RESET);
+            filter.sent.write(dg);
+            updates.push_back(std::make_pair(filter.participant, dg));
+            continue;
+        }
+
+        DatagramPtr dg = Datagram::create(CONTROL_FILTER_ADD);
+        dg->add_bool(filter.sent.pass_all());
+        dg->add_uint16(added_channels.size());
+        for(const auto& c : added_channels) {
+            dg->add_channel(c);
+        }
+        dg->add_uint16(added_ranges.size());
+        for(const auto& range : added_ranges) {
+            dg->add_channel(range.first);
+            dg->add_channel(range.second);
+        }
+        updates.push_back(std::make_pair(filter.participant, dg));
+    }
+}
+
+void MessageDirector::send_filter_updates(const FilterUpdates &updates)
+{
+    for(const auto& it : updates) {
+        it.first->send_control(it.second);
     }
 }
 
@@ -302,7 +1422,21 @@ void MessageDirector::handle_connection(const std::shared_ptr<uvw::TcpHandle> &s
     uvw::Addr remote = socket->peer();
     m_log.info() << "Got an incoming connection from "
                  << remote.ip << ":" << remote.port << std::endl;
-    new MDNetworkParticipant(socket); // It deletes itself when connection is lost
+    // It deletes itself when connection is lost
+    MDNetworkParticipant *participant = new MDNetworkParticipant(socket);
+    if(cork_downstream.get_val()) {
+        participant->set_corked(true, cork_linger.get_val());
+    }
+}
+
+void MessageDirector::handle_local_connection(const std::shared_ptr<uvw::PipeHandle> &socket)
+{
+    m_log.info() << "Got an incoming connection on " << socket->sock() << std::endl;
+    // It deletes itself when connection is lost
+    MDNetworkParticipant *participant = new MDNetworkParticipant(socket);
+    if(cork_downstream.get_val()) {
+        participant->set_corked(true, cork_linger.get_val());
+    }
 }
 
 void MessageDirector::handle_error(const uvw::ErrorEvent& evt)
@@ -317,10 +1451,19 @@ void MessageDirector::add_participant(MDParticipantInterface* p)
 {
     std::lock_guard<std::mutex> lock(m_participants_lock);
     m_participants.insert(p);
+    if(m_inbox_size > 0) {
+        create_inbox(p);
+    }
 }
 
 void MessageDirector::remove_participant(MDParticipantInterface* p)
 {
+    // Stop keeping a filter for it, if it was a downstream MD which asked for one.
+    {
+        auto lock = lock_subscriptions();
+        m_downstream_filters.erase(p);
+    }
+
     // Unsubscribe the participant from any remaining channels
     unsubscribe_all(p);
 
@@ -337,16 +1480,86 @@ void MessageDirector::remove_participant(MDParticipantInterface* p)
     // during that time.
     p->post_remove();
 
-    // Mark the participant for deletion
-    {
+    // Mark the participant for deletion; its inbox may still have a drain on the way.
+    if(m_shards.size() > 1 || m_inbox_size > 0) {
+        schedule_delete(p);
+    } else {
         std::lock_guard<std::mutex> lock(m_terminated_lock);
         m_terminated_participants.insert(p);
     }
 }
 
+void MessageDirector::schedule_delete(MDParticipantInterface *p)
+{
+    // The participant is already unsubscribed, so no new deliveries can be routed to
+    // it; but tasks enqueued before now may still reference it.  Once every shard has
+    // processed everything it had been given up to this point, any deliveries to it
+    // are already in its own shard's queue, and a delete queued there runs after them.
+    PendingDelete pending;
+    pending.participant = p;
+    for(const auto& shard : m_shards) {
+        pending.thresholds.push_back(shard->enqueued.load(std::memory_order_acquire));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_terminated_lock);
+        m_pending_deletes.push_back(std::move(pending));
+        m_pending_delete_count.fetch_add(1, std::memory_order_release);
+    }
+
+    // Nothing may be in flight at all, in which case no shard will check for us.
+    process_pending_deletes();
+}
+
+void MessageDirector::process_pending_deletes()
+{
+    if(m_pending_delete_count.load(std::memory_order_acquire) == 0) {
+        return;
+    }
+
+    std::vector<MDParticipantInterface*> ready;
+    {
+        std::lock_guard<std::mutex> lock(m_terminated_lock);
+        auto it = m_pending_deletes.begin();
+        while(it != m_pending_deletes.end()) {
+            bool drained = true;
+            for(size_t i = 0; i < m_shards.size(); ++i) {
+                if(m_shards[i]->processed.load(std::memory_order_acquire) < it->thresholds[i]) {
+                    drained = false;
+                    break;
+                }
+            }
+
+            if(drained) {
+                ready.push_back(it->participant);
+                it = m_pending_deletes.erase(it);
+                m_pending_delete_count.fetch_sub(1, std::memory_order_release);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for(const auto& p : ready) {
+        RoutingTask task;
+        task.kind = RoutingTask::DELETE;
+        task.participant = p;
+        enqueue_task(shard_for(p), std::move(task));
+    }
+
+    if(!ready.empty() && !m_threaded) {
+        // Only with inboxes; the main thread might not flush again until the next datagram.
+        TaskQueue::singleton.enqueue_task([self = this]() {
+            self->flush_queue();
+        });
+    }
+}
+
 void MessageDirector::preroute_post_remove(channel_t sender, DatagramHandle post_remove)
 {
     // Add post remove upstream
+    // N.B. this goes the same way as CONTROL_CLEAR_POST_REMOVES, so that a clear followed
+    // by an add (which replaces the post removes) can't arrive the other way around.
     if(m_upstream != nullptr) {
         DatagramPtr dg = Datagram::create(CONTROL_ADD_POST_REMOVE);
         dg->add_channel(sender);
@@ -358,6 +1571,8 @@ void MessageDirector::preroute_post_remove(channel_t sender, DatagramHandle post
 void MessageDirector::recall_post_removes(channel_t sender)
 {
     // Clear post removes upstream
+    // N.B. this isn't sent as a control message: the datagrams sent before it, which
+    // the post removes were standing in for, must get there first.
     if(m_upstream != nullptr) {
         DatagramPtr dg = Datagram::create(CONTROL_CLEAR_POST_REMOVES);
         dg->add_channel(sender);
@@ -370,6 +1585,50 @@ void MessageDirector::receive_datagram(DatagramHandle dg)
     route_datagram(nullptr, dg);
 }
 
+void MessageDirector::receive_filter(uint16_t msg_type, DatagramIterator &dgi)
+{
+    auto lock = lock_subscriptions();
+    FilterUpdates updates;
+
+    try {
+        if(msg_type == CONTROL_FILTER_RESET) {
+            m_upstream_filter.read(dgi);
+            for(auto& it : m_downstream_filters) {
+                rebuild_downstream_filter(*it.second, updates);
+            }
+        } else {
+            bool pass_all = dgi.read_bool();
+            std::vector<channel_t> channels(dgi.read_uint16());
+            for(auto& c : channels) {
+                c = dgi.read_channel();
+            }
+            std::vector<std::pair<channel_t, channel_t>> ranges(dgi.read_uint16());
+            for(auto& range : ranges) {
+                range.first = dgi.read_channel();
+                range.second = dgi.read_channel();
+            }
+
+            if(pass_all) {
+                m_upstream_filter.set_pass_all();
+            }
+            for(const auto& c : channels) {
+                m_upstream_filter.add_channel(c);
+            }
+            for(const auto& range : ranges) {
+                m_upstream_filter.add_range(range.first, range.second);
+            }
+
+            // Our downstream MDs need to send us whatever upstream wants, too.
+            add_to_downstream_filters(nullptr, pass_all, channels.data(), channels.size(),
+                                      ranges, updates);
+        }
+    } catch(DatagramIteratorEOF &) {
+        m_log.error() << "Detected truncated filter update from upstream.\n";
+    }
+
+    send_filter_updates(updates);
+}
+
 void MessageDirector::receive_disconnect(const uvw::ErrorEvent &evt)
 {
     m_log.fatal() << "Lost connection to upstream md: " << evt.what() << std::endl;
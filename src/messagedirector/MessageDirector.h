@@ -2,7 +2,6 @@
 #include <vector>
 #include <unordered_set>
 #include <string>
-#include <queue>
 #include <thread>
 #include <atomic>
 #include <memory>
@@ -10,15 +9,65 @@
 #include <condition_variable>
 #include <boost/icl/interval_map.hpp>
 #include "ChannelMap.h"
+#include "ChannelFilter.h"
 #include "core/global.h"
 #include "util/Datagram.h"
 #include "util/DatagramIterator.h"
 #include "util/TaskQueue.h"
+#include "util/MPSCQueue.h"
 #include "net/NetworkAcceptor.h"
+#include "net/NetworkClient.h"
 
 class MDParticipantInterface;
+class MDNetworkParticipant;
 class MDUpstream;
 
+// MDQueueStats is a snapshot of the MessageDirector's inbound queue counters,
+//     summed across all routing threads.
+struct MDQueueStats {
+    size_t shards;       // Number of routing queues (messagedirector/threads).
+    size_t depth;        // Tasks currently waiting in the rings.
+    size_t capacity;     // Total size of the rings (messagedirector/queue_size per queue).
+    uint64_t spills;     // Tasks that overflowed a ring since startup.
+    size_t spilled;      // Tasks currently waiting in the overflow lists.
+    uint64_t spill_waits; // Times a producer waited for room (see messagedirector/spill_limit).
+    uint64_t spill_drops; // Droppable datagrams dropped instead of waiting for room.
+    uint64_t messages;   // Tasks (routes, and deliveries when sharded) processed since startup.
+    uint64_t batches;    // Non-empty drains of a queue since startup.
+    size_t last_batch;   // Size of the most recent drain.
+    size_t max_batch;    // Largest drain seen since startup.
+    uint64_t parks;      // Number of times a routing thread went to sleep.
+
+    // Times routing a datagram had to grow one of its (otherwise reused) buffers.
+    //     This should stop increasing once the MessageDirector has warmed up.
+    uint64_t dispatch_allocations;
+
+    // Datagrams not sent upstream because the upstream MD's filter said nobody wanted them.
+    uint64_t upstream_filtered;
+
+    // Datagrams waiting to be written to the upstream MD, in each SendLane.
+    size_t upstream_control_depth;
+    size_t upstream_bulk_depth;
+};
+
+// MDInboxStats is a snapshot of one participant's inbox (see messagedirector/inbox_size).
+struct MDInboxStats {
+    std::string name;       // The participant's connection name, if it set one.
+    size_t depth;           // Datagrams waiting to be handled.
+    size_t max_depth;       // Deepest the inbox has been since startup.
+    uint64_t delivered;     // Datagrams handed to the participant.
+    uint64_t dropped;       // Datagrams discarded because the inbox was full.
+    uint64_t blocked;       // Datagrams which found it full, holding their sender back.
+    uint64_t total_wait_us; // Time delivered datagrams spent waiting, summed.
+    uint64_t max_wait_us;   // Longest any one datagram waited.
+};
+
+struct RoutingTask;
+struct RoutingSender;
+struct RoutingShard;
+struct ParticipantInbox;
+class SubscriptionCompactor;
+
 // A MessageDirector is the internal networking object for an Astron server-node.
 // The MessageDirector receives message from other servers and routes them to the
 //     Client Agent, State Server, DB Server, DB-SS, and other server-nodes as necessary.
@@ -35,7 +84,17 @@ class MessageDirector final : public ChannelMap
     // route_datagram accepts any Astron message (a Datagram), and
     //     properly routes it to any subscribed listeners.
     // Message on the CONTROL_MESSAGE channel are processed internally by the MessageDirector.
-    void route_datagram(MDParticipantInterface *p, DatagramHandle dg);
+    // A droppable datagram may be dropped instead of waiting for room in a full inbox, under
+    //     messagedirector/inbox_overflow: drop; only its sender can say (see route_unreliable).
+    void route_datagram(MDParticipantInterface *p, DatagramHandle dg, bool droppable = false);
+
+    // queue_stats returns the current inbound queue counters.
+    MDQueueStats queue_stats() const;
+    // inbox_stats returns the inbox counters of every participant; empty unless inboxes are enabled.
+    std::vector<MDInboxStats> inbox_stats();
+    // inbox_ready tells the MessageDirector that p, which turned down a batch of its inbox
+    //     (see begin_inbox_drain), is no longer busy.  Any thread may call it.
+    void inbox_ready(MDParticipantInterface *p);
 
     // logger returns the MessageDirector log category.
     inline LogCategory& logger()
@@ -46,12 +105,24 @@ class MessageDirector final : public ChannelMap
     // For MDUpstream (and subclasses) to call.
     void receive_datagram(DatagramHandle dg);
     void receive_disconnect(const uvw::ErrorEvent &evt);
+    // receive_filter applies a CONTROL_FILTER_RESET or CONTROL_FILTER_ADD from upstream,
+    //     with dgi positioned just after the message type.
+    void receive_filter(uint16_t msg_type, DatagramIterator &dgi);
+
+    // For MDNetworkParticipant to call, when the downstream MD asks to be told which
+    //     channels are wanted from it (with CONTROL_ENABLE_FILTER).
+    void enable_downstream_filter(MDNetworkParticipant *p);
 
   protected:
     void on_add_channel(channel_t c);
     void on_remove_channel(channel_t c);
+    void on_add_channels(const std::vector<channel_t> &channels);
+    void on_remove_channels(const std::vector<channel_t> &channels);
     void on_add_range(channel_t lo, channel_t hi);
     void on_remove_range(channel_t lo, channel_t hi);
+    void on_subscribe_channels(ChannelSubscriber *p, const channel_t *channels, size_t count);
+    void on_subscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi);
+    void on_unsubscribe(ChannelSubscriber *p);
 
   private:
     MessageDirector();
@@ -61,24 +132,127 @@ class MessageDirector final : public ChannelMap
     std::unique_ptr<NetworkAcceptor> m_net_acceptor;
     MDUpstream *m_upstream;
 
+    // When enabled, decides how channel subscriptions are advertised upstream.
+    std::unique_ptr<SubscriptionCompactor> m_compactor;
+
+    // Channel filters, see ChannelFilter.  All guarded by lock_subscriptions().
+    // m_upstream_filter is what the upstream MD has said it wants; it wants everything
+    //     until it says otherwise.  Each downstream MD which asked for a filter has a
+    //     DownstreamFilter, holding what we have told it we want: everything subscribed
+    //     by our other participants, plus whatever our own upstream wants.
+    // Unsubscribing doesn't shrink the filters straight away; a downstream filter is
+    //     rebuilt from scratch once enough unsubscribes have made it stale.
+    ChannelFilter m_upstream_filter {true};
+    struct DownstreamFilter {
+        DownstreamFilter(MDNetworkParticipant *participant) : participant(participant)
+        {
+        }
+
+        MDNetworkParticipant *participant;
+        ChannelFilter sent;
+        unsigned int stale = 0; // Unsubscribes since the filter was last rebuilt.
+    };
+    std::unordered_map<MDParticipantInterface*, std::unique_ptr<DownstreamFilter>> m_downstream_filters;
+    typedef std::vector<std::pair<MDNetworkParticipant*, DatagramHandle>> FilterUpdates;
+
     // Connected participants
     std::unordered_set<MDParticipantInterface*> m_participants;
     std::unordered_set<MDParticipantInterface*> m_terminated_participants;
 
     // Threading stuff:
-    bool m_shutdown;
+    // Each shard is drained by one routing thread (or by the main thread, when not
+    //     in threaded mode).  With a single shard, routing and delivery both happen on
+    //     the one thread.  With several, a message is routed on its sender's shard and
+    //     then delivered on each receiver's shard.  Either way, a sender's next message
+    //     isn't routed until its last one has been handled everywhere it went.
+    std::atomic<bool> m_shutdown;
+    bool m_threaded;
     bool m_main_is_routing;
-    std::unique_ptr<std::thread> m_thread;
+    std::vector<std::unique_ptr<RoutingShard>> m_shards;
     std::mutex m_participants_lock;
     std::mutex m_terminated_lock;
-    std::mutex m_messages_lock;
-    std::queue<std::pair<MDParticipantInterface *, DatagramHandle>> m_messages;
-    std::condition_variable m_cv;
-    
+
+    // With inboxes (messagedirector/inbox_size), a routed datagram is queued on each
+    //     receiver's ParticipantInbox instead, which the receiver's shard drains.  The
+    //     sender still waits for deliveries as usual, except to forwards_only() participants,
+    //     which may lag behind up to a full inbox.  m_inbox_overflow applies to the inboxes
+    //     of can_overflow() participants; the rest always block.  m_inbox_size is 0 when
+    //     disabled.
+    enum InboxOverflow {
+        INBOX_BLOCK,      // The datagram's sender waits until it's been handled.
+        INBOX_DROP,       // The datagram is dropped, if droppable; otherwise as INBOX_BLOCK.
+        INBOX_DISCONNECT, // The participant is disconnected.
+    };
+    size_t m_inbox_size;
+    InboxOverflow m_inbox_overflow;
+
+    // Past m_spill_limit tasks in a shard's route overflow list (0 is unlimited), a new
+    //     route is dropped if droppable and m_spill_drop is set; otherwise its producer
+    //     waits for room, unless it's the one that would have to make it (see wait_for_room).
+    size_t m_spill_limit;
+    bool m_spill_drop;
+
+    // Participants terminated while sharded, waiting for in-flight tasks to drain.
+    struct PendingDelete {
+        MDParticipantInterface *participant;
+        std::vector<uint64_t> thresholds; // Per-shard enqueue counts at terminate time.
+    };
+    std::vector<PendingDelete> m_pending_deletes;
+    std::atomic<size_t> m_pending_delete_count;
+
+    size_t shard_for(const MDParticipantInterface *p) const;
+    void enqueue_task(size_t shard, RoutingTask &&task);
+    // wait_for_room is called before routing to a shard whose spill limit has been reached.
+    //     Returns false if the datagram should be dropped instead.
+    bool wait_for_room(RoutingShard &shard, bool droppable);
+    void run_task(RoutingShard &shard, RoutingTask &task);
+    void process_task(RoutingShard &shard, RoutingTask &task);
+    RoutingSender& sender_for(RoutingShard &shard, const MDParticipantInterface *p);
+    // hold_route keeps a route back until its sender's outstanding deliveries are done;
+    //     release_routes runs the held routes which can go now, returning how many ran.
+    void hold_route(RoutingShard &shard, RoutingSender &sender, RoutingTask &&task);
+    size_t release_routes(RoutingShard &shard);
+    // delete_participant deletes p, on its own shard, once none of its routes are held.
+    void delete_participant(RoutingShard &shard, MDParticipantInterface *p);
+    // finish_delivery tells origin that one of the deliveries it routed for sender is done.
+    void finish_delivery(RoutingShard &origin, RoutingSender &sender);
     void flush_queue();
-    void process_datagram(MDParticipantInterface *p, DatagramHandle dg);
+    size_t drain_shard(RoutingShard &shard);
+    void wake_shard(RoutingShard &shard);
+    void park_shard(RoutingShard &shard);
+    void process_datagram(RoutingShard &shard, RoutingSender &sender, MDParticipantInterface *p,
+                          DatagramHandle &dg, bool droppable);
+    // deliver_datagram hands dg to p, logging (rather than passing on) a truncated payload.
+    void deliver_datagram(MDParticipantInterface *p, const DatagramHandle &dg, DatagramIterator &dgi);
+    void create_inbox(MDParticipantInterface *p);
+    // post_to_inbox queues dg for p.  If it has to wait behind others, dg is swapped for a
+    //     copy (when it's a view), so as not to pin a receive buffer; see Datagram::create_view.
+    void post_to_inbox(RoutingShard &shard, RoutingSender &sender, MDParticipantInterface *p,
+                       DatagramHandle &dg, size_t offset, bool droppable);
+    // drain_inbox handles a batch of p's datagrams, unless p is busy (see begin_inbox_drain);
+    //     continue_drain schedules whatever comes next for p, on p's own shard.
+    enum InboxDrain {
+        INBOX_DRAINED, // Nothing is left.
+        INBOX_MORE,    // There is more to drain.
+        INBOX_BUSY,    // p put the batch off.
+    };
+    InboxDrain drain_inbox(MDParticipantInterface *p);
+    void continue_drain(RoutingShard &shard, MDParticipantInterface *p, InboxDrain result);
+    size_t retry_busy(RoutingShard &shard);
+    // take_inbox_overflow returns true, once, after p's inbox overflowed under INBOX_DISCONNECT.
+    bool take_inbox_overflow(MDParticipantInterface *p);
+    // These update downstream filters, appending the messages to send to updates.  They
+    //     are sent afterwards by send_filter_updates, as sending may disconnect a participant.
+    void rebuild_downstream_filter(DownstreamFilter &filter, FilterUpdates &updates);
+    void add_to_downstream_filters(ChannelSubscriber *except, bool pass_all,
+                                   const channel_t *channels, size_t count,
+                                   const std::vector<std::pair<channel_t, channel_t>> &ranges,
+                                   FilterUpdates &updates);
+    void send_filter_updates(const FilterUpdates &updates);
     void process_terminates();
-    void routing_thread();
+    void schedule_delete(MDParticipantInterface *p);
+    void process_pending_deletes();
+    void routing_thread(RoutingShard *shard);
     void shutdown_threading();
 
     LogCategory m_log;
@@ -91,6 +265,7 @@ class MessageDirector final : public ChannelMap
 
     // I/O OPERATIONS
     void handle_connection(const std::shared_ptr<uvw::TcpHandle> &socket);
+    void handle_local_connection(const std::shared_ptr<uvw::PipeHandle> &socket);
     void handle_error(const uvw::ErrorEvent& evt);
 };
 
@@ -107,10 +282,8 @@ class MDParticipantInterface : public ChannelSubscriber
     friend class MessageDirector;
 
   public:
-    MDParticipantInterface()
-    {
-        MessageDirector::singleton.add_participant(this);
-    }
+    MDParticipantInterface();
+    virtual ~MDParticipantInterface();
 
     // handle_datagram should handle a message received from the MessageDirector.
     // Implementations of handle_datagram should be non-blocking operations.
@@ -132,6 +305,54 @@ class MDParticipantInterface : public ChannelSubscriber
         }
     }
 
+    // routing_affinity returns the key used to pick this participant's routing thread
+    //     when the MessageDirector runs with more than one.  Participants which share
+    //     unsynchronized state with each other must return the same key, so that they
+    //     are never handling datagrams concurrently.
+    virtual const void *routing_affinity() const
+    {
+        return this;
+    }
+
+    // forwards_only should return true for participants which never change subscriptions
+    //     from handle_datagram (a downstream MD just passes datagrams on).  With inboxes,
+    //     senders don't wait for these to catch up.  Every other participant is kept in
+    //     step with whoever sends to it, just as without inboxes.
+    virtual bool forwards_only() const
+    {
+        return false;
+    }
+
+    // can_overflow should return true for participants which can be cut off when their
+    //     inbox is full, as messagedirector/inbox_overflow says: by losing unreliable
+    //     updates, or by being disconnected.  Anyone else's blocks, as with "block".
+    virtual bool can_overflow() const
+    {
+        return forwards_only();
+    }
+
+    // handle_inbox_overflow is called, on the participant's own routing thread, after
+    //     its inbox overflowed under the "disconnect" policy.  The datagrams waiting in
+    //     it have been dropped, as are any routed to it from now on; the participant
+    //     should close its connection and terminate.
+    virtual void handle_inbox_overflow()
+    {
+        terminate();
+    }
+
+    // begin_inbox_drain is called before a batch of the participant's inbox is handled.
+    //     If it returns false, the participant is busy (e.g. its lock is held elsewhere),
+    //     and the batch is put off while its routing thread gets on with other work, until
+    //     MessageDirector::inbox_ready is called; a ParticipantLock takes care of that.
+    //     Otherwise, end_inbox_drain is called after the batch.
+    virtual bool begin_inbox_drain()
+    {
+        return true;
+    }
+    virtual void end_inbox_drain()
+    {
+    }
+
     // terminate cleans up the participant's subscriptions and signals
     //     the message director that the object is ready for deletion.
     inline void terminate()
@@ -148,7 +369,13 @@ class MDParticipantInterface : public ChannelSubscriber
   protected:
     inline void route_datagram(DatagramHandle dg)
     {
-        MessageDirector::singleton.route_datagram(this, dg);
+        MessageDirector::singleton.route_datagram(this, std::move(dg));
+    }
+    // route_unreliable routes a datagram which the cluster can lose without getting out of
+    //     step, such as an update of an "unreliable" field.  It's what inbox_overflow: drop drops.
+    inline void route_unreliable(DatagramHandle dg)
+    {
+        MessageDirector::singleton.route_datagram(this, std::move(dg), true);
     }
     inline void subscribe_channel(channel_t c)
     {
@@ -160,6 +387,18 @@ class MDParticipantInterface : public ChannelSubscriber
         logger().trace() << "MDParticipant '" << m_name << "' unsubscribed channel: " << c << std::endl;
         MessageDirector::singleton.unsubscribe_channel(this, c);
     }
+    inline void subscribe_channels(const channel_t *channels, size_t count)
+    {
+        logger().trace() << "MDParticipant '" << m_name << "' subscribed "
+                         << count << " channels." << std::endl;
+        MessageDirector::singleton.subscribe_channels(this, channels, count);
+    }
+    inline void unsubscribe_channels(const channel_t *channels, size_t count)
+    {
+        logger().trace() << "MDParticipant '" << m_name << "' unsubscribed "
+                         << count << " channels." << std::endl;
+        MessageDirector::singleton.unsubscribe_channels(this, channels, count);
+    }
     inline void subscribe_range(channel_t lo, channel_t hi)
     {
         logger().trace() << "MDParticipant '" << m_name << "' subscribed range, "
@@ -180,7 +419,9 @@ class MDParticipantInterface : public ChannelSubscriber
     inline void add_post_remove(channel_t sender, DatagramHandle dg)
     {
         logger().trace() << "MDParticipant '" << m_name << "' added post remove." << std::endl;
-        m_post_removes[sender].push_back(dg);
+        // Post removes are kept until the participant goes away, so don't let them pin
+        //     whatever datagram they arrived in; the upstream copy can use the view as-is.
+        m_post_removes[sender].push_back(Datagram::copy_if_view(dg));
         MessageDirector::singleton.preroute_post_remove(sender, dg);
     }
     inline void clear_post_removes(channel_t sender)
@@ -197,9 +438,9 @@ class MDParticipantInterface : public ChannelSubscriber
     {
         m_url = url;
     }
-    inline void log_message(std::vector<uint8_t> message)
+    inline void log_message(DatagramHandle message)
     {
-        g_eventsender.send(Datagram::create(message));
+        g_eventsender.send(message);
     }
     inline LogCategory logger()
     {
@@ -212,6 +453,31 @@ class MDParticipantInterface : public ChannelSubscriber
     std::atomic<bool> m_is_terminated {false};
     std::string m_name;
     std::string m_url;
+
+    // Datagrams waiting to be handled, if inboxes are enabled.
+    std::unique_ptr<ParticipantInbox> m_inbox;
+};
+
+// A ParticipantLock is a recursive mutex for a participant which is also used outside its
+//     routing thread (as a Client is by its I/O loop), for begin_inbox_drain to try.
+//     A failed try_lock is remembered, and the unlock which lets go of the lock calls
+//     MessageDirector::inbox_ready, so the put-off batch is retried without polling.
+class ParticipantLock
+{
+  public:
+    explicit ParticipantLock(MDParticipantInterface *participant) : m_participant(participant)
+    {
+    }
+
+    void lock();
+    bool try_lock();
+    void unlock();
+
+  private:
+    MDParticipantInterface *m_participant;
+    std::recursive_mutex m_mutex;
+    unsigned int m_depth = 0; // How many times the holder has locked it.
+    std::atomic<bool> m_missed {false};
 };
 
 // This class abstractly represents an "upstream" link on the Message Director.
@@ -222,7 +488,15 @@ class MDUpstream
   public:
     virtual void subscribe_channel(channel_t c) = 0;
     virtual void unsubscribe_channel(channel_t c) = 0;
+    virtual void subscribe_channels(const std::vector<channel_t> &channels) = 0;
+    virtual void unsubscribe_channels(const std::vector<channel_t> &channels) = 0;
     virtual void subscribe_range(channel_t lo, channel_t hi) = 0;
     virtual void unsubscribe_range(channel_t lo, channel_t hi) = 0;
     virtual void handle_datagram(DatagramHandle dg) = 0;
+
+    // send_control sends a control message ahead of any queued datagrams.
+    //     Only for messages which are safe to reorder that way.
+    virtual void send_control(DatagramHandle dg) = 0;
+    // queued_datagrams returns the number of datagrams waiting to be sent in a lane.
+    virtual size_t queued_datagrams(SendLane lane) = 0;
 };
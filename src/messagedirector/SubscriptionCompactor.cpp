@@ -0,0 +1,126 @@
+#include "SubscriptionCompactor.h"
+#include <algorithm>
+#include "MessageDirector.h"
+
+typedef std::vector<std::pair<channel_t, channel_t>> range_list;
+
+// append_range adds [lo, hi] to a list of ranges, joining it to the last one if adjacent.
+static void append_range(range_list &ranges, channel_t lo, channel_t hi)
+{
+    if(!ranges.empty() && ranges.back().second + 1 == lo) {
+        ranges.back().second = hi;
+    } else {
+        ranges.push_back(std::make_pair(lo, hi));
+    }
+}
+
+SubscriptionCompactor::SubscriptionCompactor(size_t threshold) : m_threshold(threshold)
+{
+}
+
+bool SubscriptionCompactor::in_ranges(channel_t c) const
+{
+    return boost::icl::contains(m_ranges, c);
+}
+
+void SubscriptionCompactor::add_channels(const std::vector<channel_t> &channels, MDUpstream *upstream)
+{
+    range_list ranges;
+    std::unordered_set<channel_t> unsent; // Added individually by this call, not yet sent.
+    std::vector<channel_t> withdrawn; // Sent individually before, now part of a range.
+
+    for(const auto& c : channels) {
+        // Grow a compacted range that this channel touches.
+        if((c > 0 && in_ranges(c - 1)) || (c < CHANNEL_MAX && in_ranges(c + 1))) {
+            m_ranges += c;
+            append_range(ranges, c, c);
+            continue;
+        }
+
+        m_channels.insert(c);
+        unsent.insert(c);
+
+        // Find the run of individual channels around this one.
+        channel_t lo = c, hi = c;
+        while(lo > 0 && m_channels.find(lo - 1) != m_channels.end()) {
+            --lo;
+        }
+        while(hi < CHANNEL_MAX && m_channels.find(hi + 1) != m_channels.end()) {
+            ++hi;
+        }
+        if(hi - lo + 1 < m_threshold) {
+            continue;
+        }
+
+        // Long enough; advertise it as a range instead.
+        m_ranges += interval_t::closed(lo, hi);
+        append_range(ranges, lo, hi);
+        for(channel_t run = lo; ; ++run) {
+            m_channels.erase(run);
+            if(unsent.erase(run) == 0) {
+                withdrawn.push_back(run);
+            }
+            if(run == hi) {
+                break;
+            }
+        }
+    }
+
+    // The ranges go first, so the withdrawn channels are never uncovered upstream.
+    for(const auto& it : ranges) {
+        upstream->subscribe_range(it.first, it.second);
+    }
+
+    std::vector<channel_t> added;
+    for(const auto& c : channels) {
+        if(unsent.find(c) != unsent.end()) {
+            added.push_back(c);
+        }
+    }
+    if(!added.empty()) {
+        upstream->subscribe_channels(added);
+    }
+    if(!withdrawn.empty()) {
+        upstream->unsubscribe_channels(withdrawn);
+    }
+}
+
+void SubscriptionCompactor::remove_channels(const std::vector<channel_t> &channels, MDUpstream *upstream,
+                                            const std::function<bool(channel_t)> &in_range)
+{
+    std::vector<channel_t> removed;
+    std::vector<channel_t> holes;
+
+    for(const auto& c : channels) {
+        if(m_channels.erase(c) > 0) {
+            removed.push_back(c);
+        } else if(in_ranges(c)) {
+            m_ranges -= c;
+            if(!in_range(c)) {
+                holes.push_back(c);
+            }
+        }
+    }
+
+    if(!removed.empty()) {
+        upstream->unsubscribe_channels(removed);
+    }
+
+    // Cut the holes out of the compacted ranges, a run of them at a time.
+    std::sort(holes.begin(), holes.end());
+    range_list ranges;
+    for(const auto& c : holes) {
+        append_range(ranges, c, c);
+    }
+    for(const auto& it : ranges) {
+        upstream->unsubscribe_range(it.first, it.second);
+    }
+}
+
+void SubscriptionCompactor::readvertise(channel_t lo, channel_t hi, MDUpstream *upstream)
+{
+    auto overlap = m_ranges & interval_t::closed(lo, hi);
+    for(const auto& it : overlap) {
+        upstream->subscribe_range(boost::icl::first(it), boost::icl::last(it));
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <functional>
+#include <unordered_set>
+#include <vector>
+#include <boost/icl/interval_set.hpp>
+#include "core/types.h"
+
+class MDUpstream;
+
+// A SubscriptionCompactor decides how a MessageDirector advertises its individually
+//     subscribed channels to its upstream.  Channels are advertised one at a time until
+//     they form a contiguous run of at least `threshold` channels, at which point the
+//     run is advertised as a single range instead.
+//
+// The upstream view stays exact: a compacted range grows by a channel at a time as
+//     neighbouring channels are subscribed, and a channel unsubscribed from the middle
+//     of one is cut out of it with a one-channel CONTROL_REMOVE_RANGE, splitting it.
+// Fragments are never turned back into individual channels; a CONTROL_REMOVE_RANGE
+//     also drops the individual channels it covers, so there is no way to swap a range
+//     for channels upstream without briefly subscribing neither.
+class SubscriptionCompactor
+{
+  public:
+    SubscriptionCompactor(size_t threshold);
+
+    // add_channels advertises channels which just gained their first local subscriber.
+    void add_channels(const std::vector<channel_t> &channels, MDUpstream *upstream);
+
+    // remove_channels withdraws channels which just lost their last local subscriber.
+    // in_range should return true if a channel is still covered by a range subscription
+    //     (which the upstream also knows about), so it must not be cut out upstream.
+    void remove_channels(const std::vector<channel_t> &channels, MDUpstream *upstream,
+                         const std::function<bool(channel_t)> &in_range);
+
+    // readvertise re-sends the compacted parts of [lo, hi], after the MessageDirector
+    //     has sent a CONTROL_REMOVE_RANGE for it on behalf of a range subscription.
+    void readvertise(channel_t lo, channel_t hi, MDUpstream *upstream);
+
+    inline size_t individual_channels() const
+    {
+        return m_channels.size();
+    }
+    inline size_t compacted_ranges() const
+    {
+        return m_ranges.iterative_size();
+    }
+
+  private:
+    typedef boost::icl::discrete_interval<channel_t> interval_t;
+
+    size_t m_threshold;
+    std::unordered_set<channel_t> m_channels; // Channels advertised individually.
+    boost::icl::interval_set<channel_t> m_ranges; // Channels advertised as ranges.
+
+    bool in_ranges(channel_t c) const;
+};
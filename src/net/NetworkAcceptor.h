@@ -11,7 +11,7 @@ class NetworkAcceptor
 
     // Parses the string "address" and binds to it. If no port is specified
     // as part of the address, it will use default_port.
-    void bind(const std::string &address, unsigned int default_port);
+    virtual void bind(const std::string &address, unsigned int default_port) = 0;
 
     void start();
     void stop();
@@ -24,7 +24,6 @@ class NetworkAcceptor
   protected:
     std::unique_ptr<std::thread> m_thread;
     std::shared_ptr<uvw::Loop> m_loop;
-    std::shared_ptr<uvw::TcpHandle> m_acceptor;
 
     bool m_started = false;
     bool m_haproxy_mode = false;
@@ -33,4 +32,8 @@ class NetworkAcceptor
     NetworkAcceptor(AcceptorErrorCallback err_callback);
 
     virtual void start_accept() = 0;
+
+    // listen and close start and stop listening on the bound address.
+    virtual void listen() = 0;
+    virtual void close() = 0;
 };
@@ -1,10 +1,143 @@
 #include "NetworkClient.h"
 #include <stdexcept>
+#include <algorithm>
+#include <climits>
+#include <atomic>
 #include "core/global.h"
 #include "config/ConfigVariable.h"
 
+// Each write takes at most this much of the bulk lane (but always at least one datagram).
+static const size_t MAX_BULK_WRITE = 256 * 1024;
+// Datagrams up to this size are copied into the send buffer rather than written in place.
+static const size_t MAX_COPIED_SIZE = 128;
+
+// Data is received into chunks of this size, unless a datagram needs a larger one...
+static const size_t RECV_CHUNK_SIZE = 64 * 1024;
+// ...and a new chunk is started when the current one has less room than this left.
+static const size_t RECV_MIN_READ = 4 * 1024;
+// Receive chunks nothing refers to are kept for reuse by any connection on the same loop.
+static const size_t RECV_CHUNK_POOL_SIZE = 16;
+static thread_local std::vector<std::shared_ptr<uint8_t>> recv_chunk_pool;
+
+// A CorkFlusher writes out the corked NetworkClients with something queued, once per
+//     pass of the event loop: from a check handle, which runs after the pass's I/O
+//     callbacks.  Other threads wake the loop with an async handle, which libuv only
+//     signals once until the loop gets to it, however many datagrams are sent meanwhile.
+class CorkFlusher
+{
+  public:
+    static CorkFlusher singleton;
+    ~CorkFlusher();
+
+    // start creates the loop handles, if it hasn't already; main thread only.
+    void start();
+    // add hands the flusher a client which has just become dirty.
+    void add(std::shared_ptr<NetworkClient> client);
+
+  private:
+    std::mutex m_lock;
+    std::vector<std::shared_ptr<NetworkClient>> m_dirty;
+    std::shared_ptr<uvw::CheckHandle> m_check;
+    std::shared_ptr<uvw::AsyncHandle> m_wakeup;
+    std::shared_ptr<uvw::TimerHandle> m_linger_timer;
+
+    void flush();
+};
+
+CorkFlusher CorkFlusher::singleton;
+
+CorkFlusher::~CorkFlusher()
+{
+    if(m_check) {
+        m_check->close();
+        m_wakeup->close();
+        m_linger_timer->close();
+    }
+}
+
+void CorkFlusher::start()
+{
+    assert(std::this_thread::get_id() == g_main_thread_id);
+    if(m_check) {
+        return;
+    }
+
+    m_check = g_loop->resource<uvw::CheckHandle>();
+    m_check->on<uvw::CheckEvent>([self = this](const uvw::CheckEvent&, uvw::CheckHandle&) {
+        self->flush();
+    });
+    m_check->start();
+
+    m_wakeup = g_loop->resource<uvw::AsyncHandle>();
+    m_wakeup->on<uvw::AsyncEvent>([self = this](const uvw::AsyncEvent&, uvw::AsyncHandle&) {
+        self->flush();
+    });
+
+    m_linger_timer = g_loop->resource<uvw::TimerHandle>();
+    m_linger_timer->on<uvw::TimerEvent>([self = this](const uvw::TimerEvent&, uvw::TimerHandle&) {
+        self->flush();
+    });
+
+    // None of these should keep the loop running by themselves.
+    m_check->unreference();
+    m_wakeup->unreference();
+    m_linger_timer->unreference();
+}
+
+void CorkFlusher::add(std::shared_ptr<NetworkClient> client)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_dirty.push_back(std::move(client));
+    }
+
+    // On the main thread, the check handle gets to it at the end of this pass.
+    if(std::this_thread::get_id() != g_main_thread_id) {
+        m_wakeup->send();
+    }
+}
+
+void CorkFlusher::flush()
+{
+    std::vector<std::shared_ptr<NetworkClient>> dirty;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if(m_dirty.empty()) {
+            return;
+        }
+        dirty.swap(m_dirty);
+    }
+
+    uint64_t now = uvw::Utilities::hrtime();
+    uint64_t next_deadline = UINT64_MAX;
+    std::vector<std::shared_ptr<NetworkClient>> lingering;
+    for(auto& client : dirty) {
+        std::unique_lock<std::mutex> lock(client->m_mutex);
+        uint64_t deadline = client->m_dirty_since + client->m_linger_ns;
+        if(deadline > now && client->m_total_queue_size < MAX_BULK_WRITE && client->is_connected(lock)) {
+            next_deadline = std::min(next_deadline, deadline);
+            lingering.push_back(std::move(client));
+            continue;
+        }
+
+        client->m_dirty = false;
+        client->flush_send_queue(lock);
+    }
+
+    if(!lingering.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_dirty.insert(m_dirty.end(), lingering.begin(), lingering.end());
+        }
+
+        // Loop timers only count whole milliseconds, so an idle loop may linger a bit longer.
+        uint64_t wait_ms = (next_deadline - now + 999999) / 1000000;
+        m_linger_timer->start(uvw::TimerHandle::Time{wait_ms}, uvw::TimerHandle::Time{0});
+    }
+}
+
 NetworkClient::NetworkClient(NetworkHandler *handler) : m_handler(handler), m_socket(nullptr),
-                                                        m_async_timer(), m_send_queue(),
+                                                        m_async_timer(),
                                                         m_disconnect_error(UV_EOF)
 {
 }
@@ -16,11 +149,6 @@ NetworkClient::~NetworkClient()
     assert(!is_connected(lock));
 
     shutdown(lock);
-
-    if(m_send_buf != nullptr) {
-        delete [] m_send_buf;
-        m_send_buf = nullptr;
-    }
 }
 
 void NetworkClient::shutdown(std::unique_lock<std::mutex> &lock)
@@ -33,7 +161,7 @@ void NetworkClient::shutdown(std::unique_lock<std::mutex> &lock)
     auto async_timer = m_async_timer;
 
     lock.unlock();
-    TaskQueue::singleton.enqueue_task([=]() {
+    m_io->tasks().enqueue_task([=]() {
         socket->close();
         async_timer->stop();
         async_timer->close();
@@ -45,25 +173,67 @@ void NetworkClient::shutdown(std::unique_lock<std::mutex> &lock)
     m_haproxy_handler = nullptr;
 }
 
+void NetworkClient::set_corked(bool corked, unsigned int linger_us)
+{
+    assert(std::this_thread::get_id() == g_main_thread_id);
+    if(corked) {
+        CorkFlusher::singleton.start();
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_corked = corked;
+    m_linger_ns = uint64_t(linger_us) * 1000;
+    if(!corked) {
+        flush_send_queue(lock);
+    }
+}
+
 void NetworkClient::initialize(const std::shared_ptr<uvw::TcpHandle>& socket,
                                const uvw::Addr &remote,
                                const uvw::Addr &local,
                                const bool haproxy_mode,
                                std::unique_lock<std::mutex> &lock)
+{
+    socket->noDelay(true);
+    socket->keepAlive(true, uvw::TcpHandle::Time{60});
+
+    start(socket, remote, local, haproxy_mode, lock);
+}
+
+void NetworkClient::initialize(const std::shared_ptr<uvw::PipeHandle>& socket,
+                               std::unique_lock<std::mutex> &lock)
+{
+    // The connecting end of a Unix domain socket usually has no name,
+    // so both ends go by the path it was bound to.
+    uvw::Addr addr {"unix:" + socket->sock(), 0};
+    if(addr.ip == "unix:") {
+        addr.ip += socket->peer();
+    }
+
+    start(socket, addr, addr, false, lock);
+}
+
+template<typename Handle>
+void NetworkClient::start(const std::shared_ptr<Handle>& socket,
+                          const uvw::Addr &remote,
+                          const uvw::Addr &local,
+                          const bool haproxy_mode,
+                          std::unique_lock<std::mutex> &lock)
 {
     if(m_socket) {
         throw std::logic_error("Trying to set a socket of a network client whose socket was already set.");
     }
 
-    // This function should ONLY run in the main thread. libuv is not thread-safe.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    // This function should ONLY run in the socket's loop's thread. libuv is not thread-safe.
+    m_io = IOLoop::current();
+    assert(m_io != nullptr && m_io->loop().get() == &socket->loop());
+    // Corking is only for clients on the main loop, which the CorkFlusher runs on.
+    assert(!m_corked || m_io == &IOLoop::main());
 
     m_socket = socket;
+    m_stream = reinterpret_cast<uv_stream_t*>(socket->raw());
 
-    m_socket->noDelay(true);
-    m_socket->keepAlive(true, uvw::TcpHandle::Time{60});
-
-    m_async_timer = g_loop->resource<uvw::TimerHandle>();
+    m_async_timer = m_io->loop()->resource<uvw::TimerHandle>();
 
     m_remote = remote;
     m_local = local;
@@ -82,10 +252,10 @@ void NetworkClient::initialize(const std::shared_ptr<uvw::TcpHandle>& socket,
     }
 
     // NOT protected by a lock, make sure it runs in main!
-    start_receive();
+    start_receive(*socket);
 }
 
-void NetworkClient::send_datagram(DatagramHandle dg)
+void NetworkClient::send_datagram(DatagramHandle dg, SendLane lane)
 {
     std::unique_lock<std::mutex> lock(m_mutex);
 
@@ -94,21 +264,98 @@ void NetworkClient::send_datagram(DatagramHandle dg)
         return;
     }
 
+    queue_datagram(std::move(dg), lane, lock);
+}
+
+void NetworkClient::send_conflated(DatagramHandle dg, const ConflationKey &key)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if(!is_connected(lock)) {
+        return;
+    }
+
+    std::deque<DatagramHandle> &bulk = m_send_queue[SEND_BULK];
+    uint64_t next = m_bulk_taken + bulk.size();
+    auto it = m_conflated.find(key);
+    if(it == m_conflated.end()) {
+        m_conflated.emplace(key, next);
+        m_conflated_order.emplace_back(next, key);
+    } else if(it->second >= m_bulk_taken && it->second >= m_conflation_floor) {
+        // The last update with this key is still waiting to be sent: replace it.
+        if(m_is_sending) {
+            // See queue_datagram.
+            dg = Datagram::copy_if_view(std::move(dg));
+        }
+        DatagramHandle &queued = bulk[it->second - m_bulk_taken];
+        m_queue_bytes[SEND_BULK] += dg->size();
+        m_queue_bytes[SEND_BULK] -= queued->size();
+        m_total_queue_size += dg->size();
+        m_total_queue_size -= queued->size();
+        queued = std::move(dg);
+
+        // It's already queued to be written, but the new one may be larger.
+        if(m_total_queue_size > m_max_queue_size && m_max_queue_size != 0) {
+            disconnect(UV_ENOBUFS, lock);
+        }
+        return;
+    } else {
+        it->second = next;
+        m_conflated_order.emplace_back(next, key);
+    }
+
+    queue_datagram(std::move(dg), SEND_BULK, lock);
+}
+
+void NetworkClient::queue_datagram(DatagramHandle dg, SendLane lane, std::unique_lock<std::mutex> &lock)
+{
+    // A view (e.g. of a datagram read from another connection) keeps the whole buffer it
+    //     was read into alive.  While a write is in flight, whatever is queued waits for it,
+    //     maybe for a long time on a slow link, so a view gets a copy of its own instead.
+    if(m_is_sending) {
+        dg = Datagram::copy_if_view(std::move(dg));
+    }
+
     // Put the packet in our outgoing send queue
-    m_send_queue.push_back(dg);
+    size_t size = dg->size();
+    m_send_queue[lane].push_back(std::move(dg));
+    m_queue_bytes[lane] += size;
 
     // Check our quota, disconnect if it's too much
-    m_total_queue_size += dg->size();
+    m_total_queue_size += size;
     if(m_total_queue_size > m_max_queue_size && m_max_queue_size != 0) {
         disconnect(UV_ENOBUFS, lock);
         return;
     }
 
-    // Poke the main thread to flush its buffer (it's fine if this is called
+    // Corked clients are written out by the CorkFlusher, along with anything else sent
+    // before it gets to them.
+    if(m_corked) {
+        if(!m_dirty) {
+            m_dirty = true;
+            m_dirty_since = uvw::Utilities::hrtime();
+            lock.unlock();
+            CorkFlusher::singleton.add(shared_from_this());
+        }
+        return;
+    }
+
+    // A bundling client leaves the flush to the end of its loop's pass, even on the loop's
+    //     own thread, so that everything sent during the pass goes out together.
+    if(m_bundle_msgtype != 0) {
+        if(!m_flush_queued) {
+            m_flush_queued = true;
+            lock.unlock();
+            defer_flush();
+        }
+        return;
+    }
+
+    // Poke the loop's thread to flush its buffer (it's fine if this is called
     // twice, it checks if it's already sending)
-    if(g_main_thread_id != std::this_thread::get_id()) {
+    if(!m_io->in_loop_thread()) {
         lock.unlock();
-        TaskQueue::singleton.enqueue_task([self = shared_from_this()] () {
+        m_io->tasks().enqueue_task([self = shared_from_this()] () {
             std::unique_lock<std::mutex> lock(self->m_mutex);
             self->flush_send_queue(lock);
         });
@@ -117,118 +364,202 @@ void NetworkClient::send_datagram(DatagramHandle dg)
     }
 }
 
-void NetworkClient::defragment_input(std::unique_lock<std::mutex>& lock)
+void NetworkClient::defer_flush()
 {
-    while(m_data_buf.size() > sizeof(dgsize_t)) {
-        // Enough data to know the expected length of the datagram.
-        dgsize_t data_size = *reinterpret_cast<dgsize_t*>(&m_data_buf[0]);
-        if(m_data_buf.size() >= data_size + sizeof(dgsize_t)) {
-            auto overread_size = (m_data_buf.size() - data_size - sizeof(dgsize_t));
-            DatagramPtr dg = Datagram::create(reinterpret_cast<const uint8_t*>(&m_data_buf[sizeof(dgsize_t)]), data_size);
-            if(0 < overread_size) {
-                // Splice leftover data to new m_data_buf based on expected datagram length.
-                m_data_buf = std::vector<unsigned char>(reinterpret_cast<char*>(&m_data_buf[sizeof(dgsize_t) + data_size]),
-                                                        reinterpret_cast<char*>(&m_data_buf[sizeof(dgsize_t) + data_size + overread_size]));
-            } else {
-                // No overread, buffer is empty.
-                m_data_buf = std::vector<unsigned char>();
-            }
+    if(!m_io->in_loop_thread()) {
+        m_io->tasks().enqueue_task([self = shared_from_this()] () {
+            self->defer_flush();
+        });
+        return;
+    }
 
-            lock.unlock();
-            m_handler->receive_datagram(dg);
-            lock.lock();
-        }
-        else {
-            return;
-        }
+    m_io->defer([self = shared_from_this()] () {
+        std::unique_lock<std::mutex> lock(self->m_mutex);
+        self->m_flush_queued = false;
+        self->flush_send_queue(lock);
+    });
+}
+
+// chunk_unused returns true if nothing but the one reference refers to a receive chunk,
+//     so that it's safe to write over.
+static bool chunk_unused(const std::shared_ptr<uint8_t> &chunk)
+{
+    if(chunk.use_count() != 1) {
+        return false;
     }
+
+    // The last datagram to let go of the chunk may have done so on another thread;
+    //     make sure its reads of the chunk happen before our writes.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
 }
 
-void NetworkClient::process_datagram(const std::unique_ptr<char[]>& data, size_t size)
+void NetworkClient::next_receive_chunk(size_t min_size)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
+    size_t pending = m_recv_end - m_recv_start;
+    size_t size = std::max(RECV_CHUNK_SIZE, min_size);
 
-    // This function should ONLY run in the main thread. It's a libuv event.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    if(m_recv_chunk != nullptr && m_recv_cap == size && chunk_unused(m_recv_chunk)) {
+        // Nothing refers to the current chunk, so start over at the front of it.
+        memmove(m_recv_chunk.get(), m_recv_chunk.get() + m_recv_start, pending);
+    } else {
+        std::shared_ptr<uint8_t> chunk;
+        if(size == RECV_CHUNK_SIZE && !recv_chunk_pool.empty()) {
+            chunk = std::move(recv_chunk_pool.back());
+            recv_chunk_pool.pop_back();
+        } else {
+            chunk.reset(new uint8_t[size], std::default_delete<uint8_t[]>());
+        }
 
-    if(m_data_buf.size() == 0 && size >= sizeof(dgsize_t)) {
-        // Fast-path mode: Check if we have just enough data from the stream for a single datagram.
-        // Should occur in most cases, as we're expecting <= the average TCP MSS for most datagrams.
-        dgsize_t datagram_size = *reinterpret_cast<dgsize_t*>(data.get());
-        if(datagram_size == size - sizeof(dgsize_t)) {
-            // Yep. Dispatch to receive_datagram and early-out.
-            DatagramPtr dg = Datagram::create(reinterpret_cast<const uint8_t*>(data.get() + sizeof(dgsize_t)), datagram_size);
-            lock.unlock();
-            m_handler->receive_datagram(dg);
-            return;
+        if(pending > 0) {
+            // The unfinished datagram straddles the two chunks: this is the only copy made.
+            memcpy(chunk.get(), m_recv_chunk.get() + m_recv_start, pending);
         }
+        m_recv_chunk = std::move(chunk);
+        m_recv_cap = size;
     }
 
-    m_data_buf.insert(m_data_buf.end(), data.get(), data.get() + size);
-    defragment_input(lock);
+    m_recv_start = 0;
+    m_recv_end = pending;
 }
 
-void NetworkClient::start_receive()
+void NetworkClient::process_input(size_t length)
 {
-    // Sets up all the handlers needed for the NetworkClient instance and starts receiving data from the stream.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    // This function should ONLY run in the loop's thread. It's a libuv event.
+    assert(m_io->in_loop_thread());
+
+    m_recv_end += length;
+
+    if(m_haproxy_handler != nullptr) {
+        size_t bytes_consumed = m_haproxy_handler->consume(m_recv_chunk.get() + m_recv_start, length);
+        m_recv_start += bytes_consumed;
+        if(bytes_consumed < length || bytes_consumed == 0) {
+            if(m_haproxy_handler->has_error()) {
+                // An error occured while processing the HAProxy headers.
+                // Disconnect the client with the error code passed down as the reason, and destroy the HAProxyHandler instance without doing anything else.
+                disconnect(m_haproxy_handler->get_error());
+                m_haproxy_handler = nullptr;
+                m_recv_start = m_recv_end;
+                return;
+            }
 
-    m_socket->on<uvw::DataEvent>([self = shared_from_this()](const uvw::DataEvent &event, uvw::TcpHandle &) {
-        if(self->m_haproxy_handler != nullptr) {
-            size_t bytes_consumed = self->m_haproxy_handler->consume(reinterpret_cast<const uint8_t*>(event.data.get()), event.length);
-            if(bytes_consumed < event.length || bytes_consumed == 0) {
-                if(self->m_haproxy_handler->has_error()) {
-                    // An error occured while processing the HAProxy headers.
-                    // Disconnect the client with the error code passed down as the reason, and destroy the HAProxyHandler instance without doing anything else.
-                    self->disconnect(self->m_haproxy_handler->get_error());
-                    self->m_haproxy_handler = nullptr;
-                    return;
-                }
-
-                self->m_is_local = self->m_haproxy_handler->is_local();
-                if(!self->m_is_local) {
-                    self->m_local = self->m_haproxy_handler->get_local();
-                    self->m_remote = self->m_haproxy_handler->get_remote();
-                    self->m_tlv_buf = self->m_haproxy_handler->get_tlvs();
-                }
-
-                ssize_t bytes_left = event.length - bytes_consumed;
-                if(0 < bytes_left) {
-                    // Feed any left-over bytes (if any) back to process_datagram.
-                    std::unique_ptr<char[]> overread_bytes = std::make_unique<char[]>(bytes_left);
-                    memcpy(overread_bytes.get(), event.data.get() + bytes_consumed, bytes_left);
-                    self->process_datagram(overread_bytes, bytes_left);
-                }
-
-                self->m_haproxy_handler = nullptr;
-                self->m_handler->initialize();
+            m_is_local = m_haproxy_handler->is_local();
+            if(!m_is_local) {
+                m_local = m_haproxy_handler->get_local();
+                m_remote = m_haproxy_handler->get_remote();
+                m_tlv_buf = m_haproxy_handler->get_tlvs();
             }
+
+            m_haproxy_handler = nullptr;
+            m_handler->initialize();
+            // Any left-over bytes are the start of the datagrams, and are handled below.
         } else {
-            self->process_datagram(event.data, event.length);
+            return;
         }
-    });
+    }
 
-    m_socket->on<uvw::ErrorEvent>([self = shared_from_this()](const uvw::ErrorEvent& event, uvw::TcpHandle &) {
-        self->handle_disconnect((uv_errno_t)event.code());
-    });
+    while(m_recv_end - m_recv_start >= sizeof(dgsize_t)) {
+        // Enough data to know the expected length of the datagram.
+        const uint8_t *frame = m_recv_chunk.get() + m_recv_start;
+        dgsize_t data_size;
+        memcpy(&data_size, frame, sizeof(dgsize_t));
+        data_size = swap_le(data_size);
+        if(m_recv_end - m_recv_start < sizeof(dgsize_t) + data_size) {
+            break;
+        }
 
-    m_socket->on<uvw::EndEvent>([self = shared_from_this()](const uvw::EndEvent&, uvw::TcpHandle &) {
-        self->handle_disconnect(UV_EOF);
-    });
+        m_recv_start += sizeof(dgsize_t) + data_size;
+        DatagramPtr dg = Datagram::create_view(frame + sizeof(dgsize_t), data_size, m_recv_chunk);
+        m_handler->receive_datagram(dg);
+    }
 
-    m_socket->on<uvw::CloseEvent>([self = shared_from_this()](const uvw::CloseEvent&, uvw::TcpHandle &) {
-        self->handle_disconnect(UV_EOF);
+    if(m_recv_start == m_recv_end) {
+        // Between reads, only keep the chunk if it's still of use: unused chunks go to the
+        //     pool, rather than sitting idle with every connection.
+        if(chunk_unused(m_recv_chunk)) {
+            if(m_recv_cap == RECV_CHUNK_SIZE && recv_chunk_pool.size() < RECV_CHUNK_POOL_SIZE) {
+                recv_chunk_pool.push_back(std::move(m_recv_chunk));
+            }
+            m_recv_chunk = nullptr;
+        } else if(m_recv_cap - m_recv_end < RECV_MIN_READ) {
+            m_recv_chunk = nullptr;
+        }
+
+        if(m_recv_chunk == nullptr) {
+            m_recv_cap = m_recv_start = m_recv_end = 0;
+        }
+    }
+}
+
+template<typename Handle>
+void NetworkClient::alloc_callback(uv_handle_t *handle, size_t, uv_buf_t *buf)
+{
+    NetworkClient &self = *static_cast<Handle*>(handle->data)->template data<NetworkClient>();
+
+    // Read into the current chunk if there's a reasonable amount of room left in it, and
+    //     enough for the rest of the unfinished datagram (if any).
+    size_t pending = self.m_recv_end - self.m_recv_start;
+    size_t wanted = RECV_MIN_READ;
+    if(pending >= sizeof(dgsize_t)) {
+        dgsize_t data_size;
+        memcpy(&data_size, self.m_recv_chunk.get() + self.m_recv_start, sizeof(dgsize_t));
+        wanted = std::max(wanted, sizeof(dgsize_t) + swap_le(data_size) - pending);
+    }
+
+    if(self.m_recv_chunk == nullptr || self.m_recv_cap - self.m_recv_end < wanted) {
+        self.next_receive_chunk(pending + wanted);
+    }
+
+    *buf = uv_buf_init(reinterpret_cast<char*>(self.m_recv_chunk.get() + self.m_recv_end),
+                       static_cast<unsigned int>(self.m_recv_cap - self.m_recv_end));
+}
+
+template<typename Handle>
+void NetworkClient::read_callback(uv_stream_t *stream, ssize_t nread, const uv_buf_t *)
+{
+    // Hold a reference for as long as the handler might be called.
+    auto self = static_cast<Handle*>(stream->data)->template data<NetworkClient>();
+
+    // nread == 0 is equivalent to EAGAIN/EWOULDBLOCK, and is not an error.
+    if(nread > 0) {
+        self->process_input(static_cast<size_t>(nread));
+    } else if(nread < 0) {
+        self->handle_disconnect((uv_errno_t)nread);
+    }
+}
+
+template<typename Handle>
+void NetworkClient::start_receive(Handle &socket)
+{
+    // Sets up all the handlers needed for the NetworkClient instance and starts receiving data from the stream.
+    assert(m_io->in_loop_thread());
+
+    socket.template on<uvw::ErrorEvent>([self = shared_from_this()](const uvw::ErrorEvent& event, Handle &) {
+        self->handle_disconnect((uv_errno_t)event.code());
     });
 
-    m_socket->on<uvw::WriteEvent>([self = shared_from_this()](const uvw::WriteEvent&, uvw::TcpHandle &) {
-        self->send_finished();
+    socket.template on<uvw::CloseEvent>([self = shared_from_this()](const uvw::CloseEvent&, Handle &) {
+        self->handle_disconnect(UV_EOF);
     });
 
     m_async_timer->on<uvw::TimerEvent>([self = shared_from_this()](const uvw::TimerEvent&, uvw::TimerHandle &) {
         self->send_expired();
     });
 
-    m_socket->read();
+    // uvw's read() would allocate a new buffer for every read, and hand it over for us to
+    //     copy the datagrams out of; instead, read straight into our receive chunks.  The
+    //     read callbacks find us through the socket's user data, which also keeps us alive
+    //     for as long as libuv might call us back.
+    socket.data(shared_from_this());
+    int err = uv_read_start(reinterpret_cast<uv_stream_t*>(socket.raw()),
+                            &NetworkClient::alloc_callback<Handle>,
+                            &NetworkClient::read_callback<Handle>);
+    if(err != 0) {
+        // Our caller holds the lock, so handle the error once it's done.
+        m_io->tasks().enqueue_task([self = shared_from_this(), err]() {
+            self->handle_disconnect((uv_errno_t)err);
+        });
+    }
 }
 
 void NetworkClient::disconnect(uv_errno_t ec, std::unique_lock<std::mutex> &lock)
@@ -247,9 +578,9 @@ void NetworkClient::disconnect(uv_errno_t ec, std::unique_lock<std::mutex> &lock
     } else {
         // Let flush_send_queue execute first:
         // The send_finished callback is responsible for closing the socket at the end of the flush.
-        if(g_main_thread_id != std::this_thread::get_id()) {
+        if(!m_io->in_loop_thread()) {
             lock.unlock();
-            TaskQueue::singleton.enqueue_task([self = shared_from_this()] () {
+            m_io->tasks().enqueue_task([self = shared_from_this()] () {
                 std::unique_lock<std::mutex> lock(self->m_mutex);
                 self->flush_send_queue(lock);
             });
@@ -261,8 +592,8 @@ void NetworkClient::disconnect(uv_errno_t ec, std::unique_lock<std::mutex> &lock
 
 void NetworkClient::handle_disconnect(uv_errno_t ec, std::unique_lock<std::mutex> &lock)
 {
-    // This function should ONLY run in the main thread. It's a libuv event.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    // This function should ONLY run in the loop's thread. It's a libuv event.
+    assert(m_io->in_loop_thread());
 
     if(m_disconnect_handled) {
         return;
@@ -287,56 +618,127 @@ void NetworkClient::handle_disconnect(uv_errno_t ec, std::unique_lock<std::mutex
 
 void NetworkClient::flush_send_queue(std::unique_lock<std::mutex> &lock)
 {
-    // libuv is NOT thread-safe. This function must ONLY be called in the main
+    // libuv is NOT thread-safe. This function must ONLY be called in the loop's
     // thread.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    assert(m_io->in_loop_thread());
 
     // If we aren't connected, stop here
     if(!is_connected(lock)) {
         return;
     }
 
-    // Are we sending already?
-    if(m_is_sending) {
+    // Are we sending already?  (Or still waiting on a write that expired?)
+    if(m_is_sending || !m_sending.empty()) {
         return;
     }
 
     // Do we have anything to send?
-    if(!m_send_queue.size()) {
+    std::deque<DatagramHandle> &control = m_send_queue[SEND_CONTROL];
+    std::deque<DatagramHandle> &bulk = m_send_queue[SEND_BULK];
+    if(control.empty() && bulk.empty()) {
         assert(m_total_queue_size == 0);
         return;
     }
 
-    auto socket = m_socket;
+    // Figure out how much of the bulk lane to take
+    size_t bulk_count = 0;
+    size_t bulk_size = 0;
+    for(const auto& dg : bulk) {
+        if(bulk_count > 0 && bulk_size + dg->size() > MAX_BULK_WRITE) {
+            break;
+        }
+        bulk_size += dg->size();
+        ++bulk_count;
+    }
 
-    // Figure out how big of a send buffer we need
-    size_t buffer_size = 0;
-    for(auto dg : m_send_queue) {
-        buffer_size += sizeof(dgsize_t) + dg->size();
+    // Take the datagrams to write, control lane first; they stay alive until the write is done.
+    assert(m_sending.empty());
+    m_sending.reserve(control.size() + bulk_count);
+    m_sending.insert(m_sending.end(), std::make_move_iterator(control.begin()),
+                     std::make_move_iterator(control.end()));
+    m_sending.insert(m_sending.end(), std::make_move_iterator(bulk.begin()),
+                     std::make_move_iterator(bulk.begin() + bulk_count));
+
+    // Discount it from our send queues:
+    m_total_queue_size -= m_queue_bytes[SEND_CONTROL] + bulk_size;
+    m_queue_bytes[SEND_CONTROL] = 0;
+    m_queue_bytes[SEND_BULK] -= bulk_size;
+    control.clear();
+    bulk.erase(bulk.begin(), bulk.begin() + bulk_count);
+    m_bulk_taken += bulk_count;
+    forget_conflated(lock);
+
+    // When bundling, consecutive datagrams are grouped into bundles that fit in a datagram.
+    m_bundles.clear();
+    if(m_bundle_msgtype != 0) {
+        Bundle bundle {0, sizeof(uint16_t)};
+        for(const auto& dg : m_sending) {
+            size_t size = sizeof(dgsize_t) + dg->size();
+            if(bundle.count > 0 && bundle.size + size > DGSIZE_MAX) {
+                m_bundles.push_back(bundle);
+                bundle = Bundle {0, sizeof(uint16_t)};
+            }
+            bundle.size += size;
+            ++bundle.count;
+        }
+        m_bundles.push_back(bundle);
     }
-    assert(m_send_buf == nullptr);
-    m_send_buf = new char[buffer_size];
 
-    // Fill the send buffer with our data:
-    char *send_ptr = &m_send_buf[0];
-    for(auto dg : m_send_queue) {
+    // The datagrams are written in place, with their size tags in between coming from
+    //     m_send_buf.  Small datagrams are cheaper to copy there too than to give a buffer
+    //     of their own, so consecutive small datagrams go out as one buffer.  So do the
+    //     headers of any bundles.
+    size_t copy_size = 0;
+    for(const auto& dg : m_sending) {
+        copy_size += sizeof(dgsize_t) + (dg->size() <= MAX_COPIED_SIZE ? dg->size() : 0);
+    }
+    for(const auto& bundle : m_bundles) {
+        copy_size += bundle.count > 1 ? sizeof(dgsize_t) + sizeof(uint16_t) : 0;
+    }
+    m_send_buf.resize(copy_size);
+    m_send_bufs.clear();
+
+    char *copy_start = m_send_buf.data();
+    char *copy_ptr = copy_start;
+    auto next_bundle = m_bundles.begin();
+    size_t bundle_left = 0; // How many more datagrams go in the current bundle.
+    for(const auto& dg : m_sending) {
+        // Add the bundle header, if this datagram starts a bundle:
+        if(bundle_left == 0 && next_bundle != m_bundles.end()) {
+            bundle_left = next_bundle->count;
+            if(bundle_left > 1) {
+                dgsize_t len = swap_le((dgsize_t)next_bundle->size);
+                uint16_t msgtype = swap_le(m_bundle_msgtype);
+                memcpy(copy_ptr, (char*)&len, sizeof(dgsize_t));
+                copy_ptr += sizeof(dgsize_t);
+                memcpy(copy_ptr, (char*)&msgtype, sizeof(uint16_t));
+                copy_ptr += sizeof(uint16_t);
+            }
+            ++next_bundle;
+        }
+        if(bundle_left > 0) {
+            --bundle_left;
+        }
+
         // Add the size tag:
         dgsize_t len = swap_le(dg->size());
-        memcpy(send_ptr, (char*)&len, sizeof(dgsize_t));
-        send_ptr += sizeof(dgsize_t);
+        memcpy(copy_ptr, (char*)&len, sizeof(dgsize_t));
+        copy_ptr += sizeof(dgsize_t);
 
         // Add the data:
-        memcpy(send_ptr, dg->get_data(), dg->size());
-        send_ptr += dg->size();
-
-        // Discount it from our send queue:
-        m_total_queue_size -= dg->size();
+        if(dg->size() <= MAX_COPIED_SIZE) {
+            memcpy(copy_ptr, dg->get_data(), dg->size());
+            copy_ptr += dg->size();
+        } else {
+            m_send_bufs.push_back(uv_buf_init(copy_start, (unsigned int)(copy_ptr - copy_start)));
+            m_send_bufs.push_back(uv_buf_init((char*)dg->get_data(), dg->size()));
+            copy_start = copy_ptr;
+        }
     }
-    assert(send_ptr == &m_send_buf[buffer_size]);
-
-    // Clean up our m_send_queue:
-    assert(m_total_queue_size == 0);
-    m_send_queue.clear();
+    if(copy_ptr != copy_start) {
+        m_send_bufs.push_back(uv_buf_init(copy_start, (unsigned int)(copy_ptr - copy_start)));
+    }
+    assert(copy_ptr == m_send_buf.data() + copy_size);
 
     // Start async timeout, a value of 0 indicates the writes shouldn't timeout (used in debugging)
     if(m_write_timeout > 0) {
@@ -344,28 +746,46 @@ void NetworkClient::flush_send_queue(std::unique_lock<std::mutex> &lock)
         m_async_timer->start(uvw::TimerHandle::Time{m_write_timeout}, uvw::TimerHandle::Time{0});
     }
 
-    // Bombs away!
+    // Bombs away!  (libuv copies m_send_bufs itself, but not what they point to.)
     m_is_sending = true;
-    lock.unlock();
-    socket->write(m_send_buf, buffer_size);
-    lock.lock();
+    m_write_req.data = this;
+    int err = uv_write(&m_write_req, m_stream, m_send_bufs.data(),
+                       (unsigned int)m_send_bufs.size(), &NetworkClient::write_callback);
+    if(err != 0) {
+        m_is_sending = false;
+        m_sending.clear();
+        handle_disconnect((uv_errno_t)err, lock);
+    }
 }
 
-void NetworkClient::send_finished()
+void NetworkClient::write_callback(uv_write_t *req, int status)
+{
+    // The socket's user data keeps us alive until its last callback; see start_receive.
+    static_cast<NetworkClient*>(req->data)->send_finished(status);
+}
+
+void NetworkClient::send_finished(int status)
 {
     std::unique_lock<std::mutex> lock(m_mutex);
 
-    // This function should ONLY run in the main thread. It's a libuv event.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    // This function should ONLY run in the loop's thread. It's a libuv event.
+    assert(m_io->in_loop_thread());
+
+    // Let go of the datagrams we just wrote:
+    m_sending.clear();
+
+    // If the write expired, send_expired has already dealt with it.
+    if(!m_is_sending) {
+        return;
+    }
 
     // Mark ourselves as "not sending"
-    assert(m_is_sending);
     m_is_sending = false;
 
-    // Discard the buffer we just used:
-    assert(m_send_buf != nullptr);
-    delete [] m_send_buf;
-    m_send_buf = nullptr;
+    if(status < 0) {
+        handle_disconnect((uv_errno_t)status, lock);
+        return;
+    }
 
     // If we aren't connected, stop here
     if(!is_connected(lock)) {
@@ -389,20 +809,42 @@ void NetworkClient::send_expired()
 {
     std::unique_lock<std::mutex> lock(m_mutex);
 
-    // This function should ONLY run in the main thread. It's a libuv event.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    // This function should ONLY run in the loop's thread. It's a libuv event.
+    assert(m_io->in_loop_thread());
 
     // We need to clean up after ourselves before invoking disconnect:
     // Otherwise we might inadvertedly end up hitting flush_send_queue, and we don't want to do that here.
+    // The write itself is still in progress, and keeps its buffers until it ends.
     assert(m_is_sending);
     m_is_sending = false;
 
-    assert(m_send_buf != nullptr);
-    delete[] m_send_buf;
-    m_send_buf = nullptr;
+    clear_send_queues(lock);
+
+    disconnect(UV_ETIMEDOUT, lock);
+}
 
+void NetworkClient::clear_send_queues(std::unique_lock<std::mutex> &)
+{
     m_total_queue_size = 0;
-    m_send_queue.clear();
+    for(int lane = 0; lane < SEND_LANES; ++lane) {
+        m_send_queue[lane].clear();
+        m_queue_bytes[lane] = 0;
+    }
 
-    disconnect(UV_ETIMEDOUT, lock);
+    m_bulk_taken = m_conflation_floor = 0;
+    m_conflated.clear();
+    m_conflated_order.clear();
+}
+
+void NetworkClient::forget_conflated(std::unique_lock<std::mutex> &)
+{
+    uint64_t floor = std::max(m_bulk_taken, m_conflation_floor);
+    while(!m_conflated_order.empty() && m_conflated_order.front().first < floor) {
+        auto it = m_conflated.find(m_conflated_order.front().second);
+        // A newer datagram with the same key may have replaced this one since.
+        if(it != m_conflated.end() && it->second == m_conflated_order.front().first) {
+            m_conflated.erase(it);
+        }
+        m_conflated_order.pop_front();
+    }
 }
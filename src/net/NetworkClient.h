@@ -1,10 +1,12 @@
 #pragma once
 #include <vector>
+#include <deque>
 #include <queue>
 #include <mutex>
+#include <unordered_map>
 #include "deps/uvw/uvw.hpp"
 #include "util/Datagram.h"
-#include "util/TaskQueue.h"
+#include "util/IOLoop.h"
 #include "HAProxyHandler.h"
 
 // NOTES:
@@ -12,12 +14,46 @@
 // Do not subclass NetworkClient. Instead, you should implement NetworkHandler
 // and instantiate NetworkClient with std::make_shared.
 //
-// To begin receiving, pass it an ASIO socket via initialize().
+// To begin receiving, pass it a connected socket via initialize(): either a TCP socket,
+// or a Unix domain socket (libuv pipe) for processes on the same host.  Call initialize()
+// from the thread of the IOLoop the socket belongs to; the NetworkClient does all of its
+// I/O on that loop, though datagrams may be sent from any thread.
 //
 // You must not destruct your NetworkHandler implementor until
 // receive_disconnect is called!
 
 class NetworkClient;
+class CorkFlusher;
+
+// A SendLane picks which of a NetworkClient's send queues a datagram waits in.
+// Everything waiting in the control lane is written ahead of the bulk lane, and each
+//     write takes only a limited amount of the bulk lane, so control messages never
+//     wait behind more than one write's worth of bulk data.
+// Datagrams within a lane are sent in order; between lanes, they may be reordered.
+enum SendLane : uint8_t {
+    SEND_CONTROL, // Small, latency-sensitive messages, e.g. subscription changes.
+    SEND_BULK,    // Everything else.
+    SEND_LANES
+};
+
+// A ConflationKey says what a conflated datagram is an update of (e.g. one field of one
+//     object), so that a newer update can take the place of an older one; see send_conflated.
+struct ConflationKey {
+    uint64_t object;
+    uint16_t field;
+
+    inline bool operator==(const ConflationKey &other) const
+    {
+        return object == other.object && field == other.field;
+    }
+};
+
+struct ConflationKeyHash {
+    inline size_t operator()(const ConflationKey &key) const
+    {
+        return std::hash<uint64_t>()(key.object * 0x9E3779B97F4A7C15ULL ^ key.field);
+    }
+};
 
 class NetworkHandler
 {
@@ -27,6 +63,8 @@ protected:
     virtual void initialize() = 0;
     // receive_datagram is called when both a datagram's size and its data
     //     have been received asynchronously from the network.
+    // The datagram is a view into the connection's receive buffer, which it keeps from
+    //     being reused; a handler that holds onto datagrams for long should copy them.
     virtual void receive_datagram(DatagramHandle dg) = 0;
     // receive_disconnect is called when the remote host closes the
     //     connection or otherwise when the tcp connection is lost.
@@ -56,6 +94,12 @@ public:
         initialize(socket, remote, local, haproxy_mode, lock);
     }
 
+    inline void initialize(const std::shared_ptr<uvw::PipeHandle>& socket)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        initialize(socket, lock);
+    }
+
     inline void set_write_timeout(unsigned int timeout)
     {
         std::unique_lock<std::mutex> lock(m_mutex);
@@ -68,8 +112,57 @@ public:
         m_max_queue_size = max_bytes;
     }
 
-    // send_datagram immediately sends the datagram over TCP (blocking).
-    void send_datagram(DatagramHandle dg);
+    // set_corked turns corking on or off.  A corked client doesn't write each datagram as
+    //     it's sent; instead, everything queued during one pass of the event loop goes out
+    //     together at the end of the pass, in a single write.  With a linger (in
+    //     microseconds), it waits up to that long for more to write, unless a full
+    //     write's worth is already queued.  Must be called from the main thread, and
+    //     only for clients on the main loop.
+    void set_corked(bool corked, unsigned int linger_us = 0);
+
+    // set_bundling turns bundling on, with the given message type, or off with 0.  When a
+    //     write has more than one datagram to send, a bundling client sends them together as
+    //     the body of one bundle message: a datagram starting with the bundle's msgtype,
+    //     followed by each of the datagrams with its own length tag.  Bundles are split as
+    //     needed to fit the maximum datagram size.  To give datagrams a chance to be bundled,
+    //     a bundling client's writes wait for the end of its loop's pass (see IOLoop::defer),
+    //     whether they were sent from the loop's own thread or another.
+    inline void set_bundling(uint16_t msgtype)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_bundle_msgtype = msgtype;
+    }
+
+    // send_datagram queues the datagram to be sent in the given lane.
+    void send_datagram(DatagramHandle dg, SendLane lane = SEND_BULK);
+
+    // send_conflated queues the datagram in the bulk lane, like send_datagram, unless a
+    //     datagram sent with the same key is still waiting there; then the new datagram takes
+    //     the old one's place in the queue, and the old one is never sent.  This is for updates
+    //     where only the latest value matters, so that a client that isn't keeping up gets
+    //     fewer of them, instead of a longer and longer queue.
+    void send_conflated(DatagramHandle dg, const ConflationKey &key);
+
+    // conflation_barrier stops send_conflated from replacing anything queued so far.  Call it
+    //     before sending something that a conflated update mustn't be moved ahead of.
+    inline void conflation_barrier()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_conflation_floor = m_bulk_taken + m_send_queue[SEND_BULK].size();
+        forget_conflated(lock);
+    }
+
+    // queued_datagrams and queued_bytes return how much is waiting in a send lane.
+    inline size_t queued_datagrams(SendLane lane)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_send_queue[lane].size();
+    }
+    inline uint64_t queued_bytes(SendLane lane)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_queue_bytes[lane];
+    }
 
     // disconnect closes the TCP connection without informing the NetworkHandler.
     inline void disconnect(uv_errno_t ec)
@@ -135,7 +228,22 @@ private:
                     const uvw::Addr &local,
                     const bool haproxy_mode,
                     std::unique_lock<std::mutex> &lock);
+    void initialize(const std::shared_ptr<uvw::PipeHandle>& socket, std::unique_lock<std::mutex> &lock);
+    // start does the rest of initialize, for either kind of socket.
+    template<typename Handle>
+    void start(const std::shared_ptr<Handle>& socket,
+               const uvw::Addr &remote,
+               const uvw::Addr &local,
+               const bool haproxy_mode,
+               std::unique_lock<std::mutex> &lock);
     void disconnect(uv_errno_t ec, std::unique_lock<std::mutex> &lock);
+    // queue_datagram is the rest of send_datagram, once the datagram's place is decided.
+    void queue_datagram(DatagramHandle dg, SendLane lane, std::unique_lock<std::mutex> &lock);
+    // clear_send_queues throws away everything queued.
+    void clear_send_queues(std::unique_lock<std::mutex> &lock);
+    // forget_conflated drops the conflation entries of datagrams that can no longer be
+    //     replaced, because they've been taken to be written or are behind a barrier.
+    void forget_conflated(std::unique_lock<std::mutex> &lock);
 
     /* This cleans up all libuv handles */
     void shutdown(std::unique_lock<std::mutex> &lock);
@@ -143,18 +251,31 @@ private:
     /* Asynchronous call loop */
     // flush_send_queue is called to try and flush m_send_queue to the socket
     void flush_send_queue(std::unique_lock<std::mutex> &lock);
-    // send_finished is called when an async_send has completed
-    void send_finished();
+    // defer_flush flushes m_send_queue at the end of the loop's pass; see set_bundling.
+    void defer_flush();
+    // send_finished is called when an async_send has completed (or failed, with status < 0)
+    void send_finished(int status);
+    // write_callback is the libuv write callback set by flush_send_queue.
+    static void write_callback(uv_write_t *req, int status);
     // send_expired is called when an async_send has expired
     void send_expired();
 
     // start_receive is called by initialize() to begin receiving data.
-    void start_receive();
+    template<typename Handle>
+    void start_receive(Handle &socket);
+    // alloc_callback and read_callback are the libuv read callbacks set by start_receive.
+    template<typename Handle>
+    static void alloc_callback(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+    template<typename Handle>
+    static void read_callback(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf);
 
     void handle_disconnect(uv_errno_t ec, std::unique_lock<std::mutex> &lock);
 
-    void defragment_input(std::unique_lock<std::mutex> &lock);
-    void process_datagram(const std::unique_ptr<char[]>& data, size_t length);
+    // next_receive_chunk moves on to a new receive chunk of at least min_size bytes,
+    //     taking along the unfinished datagram (if any) from the end of the current one.
+    void next_receive_chunk(size_t min_size);
+    // process_input handles length bytes just read into the receive chunk.
+    void process_input(size_t length);
 
     inline bool is_connected(std::unique_lock<std::mutex>&)
     {   
@@ -162,24 +283,67 @@ private:
     }
 
     bool m_is_sending = false;
-    char *m_send_buf = nullptr;
+    // The write in progress: m_sending holds the datagrams being written, m_send_buf the
+    //     length tags (and copies of small datagrams) written along with them.
+    uv_write_t m_write_req;
+    std::vector<DatagramHandle> m_sending;
+    std::vector<char> m_send_buf;
+    std::vector<uv_buf_t> m_send_bufs;
+
+    // Bundling, see set_bundling.  m_bundles splits m_sending into the bundles of the write
+    //     in progress, in order; a bundle of one datagram is sent as it is.
+    struct Bundle {
+        size_t count; // How many datagrams are in it.
+        size_t size; // The size of its body: msgtype, length tags and datagrams.
+    };
+    uint16_t m_bundle_msgtype = 0;
+    std::vector<Bundle> m_bundles;
+    bool m_flush_queued = false; // Set while a deferred flush is waiting to run.
+
+    // Corking, see set_corked.  m_dirty is set while the CorkFlusher holds this client.
+    bool m_corked = false;
+    bool m_dirty = false;
+    uint64_t m_dirty_since = 0; // uv_hrtime() when m_dirty was set.
+    uint64_t m_linger_ns = 0;
+    friend class CorkFlusher;
 
     NetworkHandler *m_handler;
-    std::shared_ptr<uvw::TcpHandle> m_socket;
+    IOLoop *m_io = nullptr; // The loop m_socket belongs to.
+    std::shared_ptr<uvw::BaseHandle> m_socket;
+    uv_stream_t *m_stream = nullptr; // m_socket's libuv handle.
     std::shared_ptr<uvw::TimerHandle> m_async_timer;
     std::unique_ptr<HAProxyHandler> m_haproxy_handler;
     uvw::Addr m_remote;
     uvw::Addr m_local;
-    std::vector<unsigned char> m_data_buf;
+
+    // Receiving, loop thread only.  Data is read into m_recv_chunk at m_recv_end, and the
+    //     datagrams in it are handed out as views into the chunk.  The bytes from
+    //     m_recv_start to m_recv_end are the start of a datagram which hasn't all arrived.
+    std::shared_ptr<uint8_t> m_recv_chunk;
+    size_t m_recv_cap = 0;
+    size_t m_recv_start = 0;
+    size_t m_recv_end = 0;
 
     // HAProxy specific:
     std::vector<uint8_t> m_tlv_buf;
     bool m_is_local = false;
 
-    uint64_t m_total_queue_size = 0;
+    uint64_t m_total_queue_size = 0; // Summed across all lanes.
+    uint64_t m_queue_bytes[SEND_LANES] = {};
     uint64_t m_max_queue_size = 0;
     unsigned int m_write_timeout = 0;
-    std::vector<DatagramHandle> m_send_queue;
+    std::deque<DatagramHandle> m_send_queue[SEND_LANES];
+
+    // Conflation, see send_conflated.  Datagrams in the bulk lane are numbered in the order
+    //     they were queued, so the one numbered n is at m_send_queue[SEND_BULK][n - m_bulk_taken]
+    //     for as long as it is still queued.  m_conflated gives the number of the last
+    //     datagram queued with each key; anything numbered below m_conflation_floor is left be.
+    //     m_conflated_order lists the same entries by number, so that each can be forgotten
+    //     as soon as its datagram is taken to be written or a barrier passes it.
+    uint64_t m_bulk_taken = 0; // How many datagrams have been taken off the bulk lane.
+    uint64_t m_conflation_floor = 0;
+    std::unordered_map<ConflationKey, uint64_t, ConflationKeyHash> m_conflated;
+    std::deque<std::pair<uint64_t, ConflationKey>> m_conflated_order;
 
     std::mutex m_mutex;
 
@@ -26,8 +26,10 @@ void NetworkConnector::do_connect(const std::string &address,
 void NetworkConnector::destroy()
 {
     m_connect_callback = nullptr;
+    m_pipe_connect_callback = nullptr;
     m_err_callback = nullptr;
     m_socket = nullptr;
+    m_pipe = nullptr;
 }
 
 void NetworkConnector::connect(const std::string &address, unsigned int default_port,
@@ -52,3 +54,26 @@ void NetworkConnector::connect(const std::string &address, unsigned int default_
 
     do_connect(address, default_port);
 }
+
+void NetworkConnector::connect_local(const std::string &path,
+                                     PipeConnectCallback callback, ConnectErrorCallback err_callback)
+{
+    assert(std::this_thread::get_id() == g_main_thread_id);
+
+    m_pipe_connect_callback = callback;
+    m_err_callback = err_callback;
+
+    m_pipe = m_loop->resource<uvw::PipeHandle>();
+
+    m_pipe->once<uvw::ConnectEvent>([self = shared_from_this()](const uvw::ConnectEvent &, uvw::PipeHandle&) {
+        if(self->m_pipe_connect_callback != nullptr)
+            self->m_pipe_connect_callback(self->m_pipe);
+    });
+
+    m_pipe->once<uvw::ErrorEvent>([self = shared_from_this()](const uvw::ErrorEvent &evt, uvw::PipeHandle&) {
+        if(self->m_err_callback != nullptr)
+            self->m_err_callback(evt);
+    });
+
+    m_pipe->connect(path);
+}
@@ -2,6 +2,7 @@
 #include "deps/uvw/uvw.hpp"
 
 typedef std::function<void(const std::shared_ptr<uvw::TcpHandle> &)> ConnectCallback;
+typedef std::function<void(const std::shared_ptr<uvw::PipeHandle> &)> PipeConnectCallback;
 typedef std::function<void(const uvw::ErrorEvent& evt)> ConnectErrorCallback;
 
 class NetworkConnector : public std::enable_shared_from_this<NetworkConnector>
@@ -15,10 +16,15 @@ class NetworkConnector : public std::enable_shared_from_this<NetworkConnector>
     void destroy();
     void connect(const std::string &address, unsigned int default_port,
                  ConnectCallback callback, ConnectErrorCallback err_callback);
+    // connect_local is the same, but connects to the Unix domain socket at path.
+    void connect_local(const std::string &path,
+                       PipeConnectCallback callback, ConnectErrorCallback err_callback);
   private:
     std::shared_ptr<uvw::TcpHandle> m_socket;
+    std::shared_ptr<uvw::PipeHandle> m_pipe;
     std::shared_ptr<uvw::Loop> m_loop;
     ConnectCallback m_connect_callback;
+    PipeConnectCallback m_pipe_connect_callback;
     ConnectErrorCallback m_err_callback;
 
     void do_connect(const std::string &address, uint16_t port);
@@ -0,0 +1,75 @@
+#include "PipeAcceptor.h"
+#ifndef _WIN32
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+#include "core/global.h"
+#include "address_utils.h"
+
+PipeAcceptor::PipeAcceptor(PipeAcceptorCallback &callback, AcceptorErrorCallback& err_callback) :
+    NetworkAcceptor(err_callback),
+    m_callback(callback),
+    m_acceptor(nullptr)
+{
+}
+
+void PipeAcceptor::bind(const std::string &address, unsigned int)
+{
+    assert(std::this_thread::get_id() == g_main_thread_id);
+
+    m_path = is_unix_address(address) ? unix_address_path(address) : address;
+
+#ifndef _WIN32
+    // Only ever remove a socket; anything else at the path is left for bind to fail on.
+    struct stat st;
+    if(stat(m_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(m_path.c_str());
+    }
+#endif
+
+    m_acceptor = m_loop->resource<uvw::PipeHandle>();
+
+    // Setup listen/error event handlers.
+    start_accept();
+
+    m_acceptor->bind(m_path);
+}
+
+void PipeAcceptor::listen()
+{
+    m_acceptor->listen();
+}
+
+void PipeAcceptor::close()
+{
+    m_acceptor->close();
+#ifndef _WIN32
+    unlink(m_path.c_str());
+#endif
+}
+
+void PipeAcceptor::start_accept()
+{
+    m_acceptor->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::PipeHandle &srv) {
+        std::shared_ptr<uvw::PipeHandle> client = srv.loop().resource<uvw::PipeHandle>();
+        srv.accept(*client);
+        handle_accept(client);
+    });
+
+    m_acceptor->on<uvw::ErrorEvent>([this](const uvw::ErrorEvent &evt, uvw::PipeHandle &) {
+        // Inform the error callback:
+        this->m_err_callback(evt);
+    });
+}
+
+void PipeAcceptor::handle_accept(const std::shared_ptr<uvw::PipeHandle>& socket)
+{
+    if(!m_started) {
+        // We were turned off sometime before this operation completed; ignore.
+        socket->close();
+        return;
+    }
+
+    // Inform the callback:
+    m_callback(socket);
+}
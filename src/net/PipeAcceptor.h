@@ -0,0 +1,27 @@
+#pragma once
+#include "NetworkAcceptor.h"
+#include <functional>
+
+typedef std::function<void(const std::shared_ptr<uvw::PipeHandle>&)> PipeAcceptorCallback;
+
+// A PipeAcceptor listens on a Unix domain socket, for processes on the same host.
+class PipeAcceptor : public NetworkAcceptor
+{
+  public:
+    PipeAcceptor(PipeAcceptorCallback &callback, AcceptorErrorCallback &err_callback);
+    virtual ~PipeAcceptor() {}
+
+    // The address is the path to bind, with or without its "unix:" prefix; the port is unused.
+    // A socket left behind at that path (by a server that didn't shut down cleanly) is replaced.
+    virtual void bind(const std::string &address, unsigned int default_port);
+
+  private:
+    PipeAcceptorCallback m_callback;
+    std::shared_ptr<uvw::PipeHandle> m_acceptor;
+    std::string m_path;
+
+    virtual void start_accept();
+    virtual void listen();
+    virtual void close();
+    void handle_accept(const std::shared_ptr<uvw::PipeHandle>& socket);
+};
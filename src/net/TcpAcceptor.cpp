@@ -1,11 +1,50 @@
 #include "TcpAcceptor.h"
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+#include "core/global.h"
+#include "address_utils.h"
 
 TcpAcceptor::TcpAcceptor(TcpAcceptorCallback &callback, AcceptorErrorCallback& err_callback) :
     NetworkAcceptor(err_callback),
-    m_callback(callback)
+    m_callback(callback),
+    m_acceptor(nullptr)
 {
 }
 
+void TcpAcceptor::bind(const std::string &address,
+        unsigned int default_port)
+{
+    assert(std::this_thread::get_id() == g_main_thread_id);
+
+    m_acceptor = m_loop->resource<uvw::TcpHandle>();
+    m_acceptor->simultaneousAccepts(true);
+
+    std::vector<uvw::Addr> addresses = resolve_address(address, default_port, m_loop);
+
+    if(addresses.size() == 0) {
+        this->m_err_callback(uvw::ErrorEvent{(int)UV_EADDRNOTAVAIL});
+        return;
+    }
+
+    // Setup listen/error event handlers.
+    start_accept();
+
+    for (uvw::Addr& addr : addresses) {
+        m_acceptor->bind(addr);
+    }
+}
+
+void TcpAcceptor::listen()
+{
+    m_acceptor->listen();
+}
+
+void TcpAcceptor::close()
+{
+    m_acceptor->close();
+}
+
 void TcpAcceptor::start_accept()
 {
     m_acceptor->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::TcpHandle &srv) {
@@ -30,9 +69,38 @@ void TcpAcceptor::handle_accept(const std::shared_ptr<uvw::TcpHandle>& socket)
 
     uvw::Addr remote = socket->peer();
     uvw::Addr local = socket->sock();
+
+#ifndef _WIN32
+    if(m_io_loops != nullptr) {
+        hand_off(socket, remote, local);
+        return;
+    }
+#endif
+
     handle_endpoints(socket, remote, local);
 }
 
+void TcpAcceptor::hand_off(const std::shared_ptr<uvw::TcpHandle>& socket, const uvw::Addr& remote, const uvw::Addr& local)
+{
+#ifndef _WIN32
+    // A handle can't move between loops, but the connection can: the new loop opens its own
+    // handle on a duplicate of the descriptor.  Our handle never started reading, so closing
+    // it leaves the connection as it was.
+    int fd = dup(socket->fileno());
+    socket->close();
+    if(fd < 0) {
+        return;
+    }
+
+    IOLoop &io = m_io_loops->next();
+    io.tasks().enqueue_task([this, &io, fd, remote, local]() {
+        auto client = io.loop()->resource<uvw::TcpHandle>();
+        client->open(fd);
+        handle_endpoints(client, remote, local);
+    });
+#endif
+}
+
 void TcpAcceptor::handle_endpoints(const std::shared_ptr<uvw::TcpHandle>& socket, const uvw::Addr& remote, const uvw::Addr& local)
 {
     // Inform the callback:
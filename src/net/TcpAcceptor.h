@@ -1,6 +1,7 @@
 #pragma once
 #include "NetworkAcceptor.h"
 #include <functional>
+#include "util/IOLoop.h"
 
 typedef std::function<void(const std::shared_ptr<uvw::TcpHandle>&, const uvw::Addr& remote, const uvw::Addr& local, const bool haproxy_mode)> TcpAcceptorCallback;
 
@@ -10,10 +11,25 @@ class TcpAcceptor : public NetworkAcceptor
     TcpAcceptor(TcpAcceptorCallback &callback, AcceptorErrorCallback &err_callback);
     virtual ~TcpAcceptor() {}
 
+    virtual void bind(const std::string &address, unsigned int default_port);
+
+    // set_io_loops hands accepted connections out to the loops of a pool, round-robin, rather
+    //     than keeping them on the main loop; the callback then runs on the connection's loop.
+    //     (Not on Windows, where connections all stay on the main loop.)
+    inline void set_io_loops(IOLoopPool *io_loops)
+    {
+        m_io_loops = io_loops;
+    }
+
   private:
     TcpAcceptorCallback m_callback;
+    std::shared_ptr<uvw::TcpHandle> m_acceptor;
+    IOLoopPool *m_io_loops = nullptr;
 
     virtual void start_accept();
+    virtual void listen();
+    virtual void close();
     void handle_accept(const std::shared_ptr<uvw::TcpHandle>& socket);
     void handle_endpoints(const std::shared_ptr<uvw::TcpHandle>& socket, const uvw::Addr& remote, const uvw::Addr& local);
+    void hand_off(const std::shared_ptr<uvw::TcpHandle>& socket, const uvw::Addr& remote, const uvw::Addr& local);
 };
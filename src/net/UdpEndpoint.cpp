@@ -0,0 +1,309 @@
+#include "UdpEndpoint.h"
+#include <cstring>
+#include "core/global.h"
+#include "address_utils.h"
+
+// Datagrams are only sent over UDP if they fit this, so that they aren't fragmented on the
+//     way (which makes losing them more likely) on any reasonable path.
+static const size_t MAX_UDP_PAYLOAD = 1200;
+// The sizes of the headers described in UdpEndpoint.h.
+static const size_t PEER_HEADER_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+static const size_t ENDPOINT_HEADER_SIZE = sizeof(uint32_t);
+
+static size_t address_size(const sockaddr *addr)
+{
+    return addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+static bool same_address(const sockaddr_storage &known, const sockaddr *addr)
+{
+    if(known.ss_family != addr->sa_family) {
+        return false;
+    } else if(addr->sa_family == AF_INET6) {
+        auto a = reinterpret_cast<const sockaddr_in6*>(&known);
+        auto b = reinterpret_cast<const sockaddr_in6*>(addr);
+        return a->sin6_port == b->sin6_port &&
+               memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+    } else {
+        auto a = reinterpret_cast<const sockaddr_in*>(&known);
+        auto b = reinterpret_cast<const sockaddr_in*>(addr);
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+}
+
+UdpSession::UdpSession(std::shared_ptr<UdpEndpoint> endpoint, UdpHandler *handler,
+                       uint64_t token) :
+    m_endpoint(std::move(endpoint)), m_io(IOLoop::current()), m_token(token), m_handler(handler)
+{
+    assert(m_io != nullptr);
+}
+
+bool UdpSession::is_active()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return is_active(lock);
+}
+
+bool UdpSession::is_active(std::lock_guard<std::mutex> &)
+{
+    return m_has_peer && uv_hrtime() - m_last_heard < m_endpoint->m_timeout_ns;
+}
+
+bool UdpSession::send_datagram(const DatagramHandle &dg)
+{
+    if(dg->size() + ENDPOINT_HEADER_SIZE > MAX_UDP_PAYLOAD) {
+        return false;
+    }
+
+    sockaddr_storage peer;
+    uint32_t seq;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if(!is_active(lock)) {
+            return false;
+        }
+        peer = m_peer;
+        seq = m_next_seq++;
+    }
+
+    m_endpoint->send(peer, seq, dg);
+    return true;
+}
+
+bool UdpSession::send_challenge(const DatagramPtr &dg)
+{
+    sockaddr_storage candidate;
+    uint32_t seq;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if(!m_has_candidate) {
+            return false;
+        }
+        dg->add_uint64(m_challenge);
+        candidate = m_candidate;
+        seq = m_next_seq++;
+    }
+
+    m_endpoint->send(candidate, seq, dg);
+    return true;
+}
+
+bool UdpSession::accept_challenge(uint64_t challenge)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if(!m_has_candidate || challenge != m_challenge) {
+        return false;
+    }
+
+    m_peer = m_candidate;
+    m_has_candidate = false;
+    m_last_heard = uv_hrtime();
+    return true;
+}
+
+void UdpSession::close()
+{
+    {
+        std::lock_guard<std::recursive_mutex> lock(m_handler_lock);
+        if(m_handler == nullptr) {
+            return;
+        }
+        m_handler = nullptr;
+    }
+
+    m_endpoint->forget(m_token);
+}
+
+void UdpSession::receive(const sockaddr *addr, uint32_t seq, DatagramHandle dg)
+{
+    bool from_peer = true;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        bool newer = int32_t(seq - m_last_seq) > 0;
+        if(!m_has_peer) {
+            // The first to use the token is the peer.
+            memcpy(&m_peer, addr, address_size(addr));
+            m_has_peer = true;
+            newer = true;
+        } else if(!same_address(m_peer, addr)) {
+            // It may be the peer's new address (e.g. behind a NAT), or anybody who has seen
+            //     the token; either way, the peer stays put until it's answered a challenge.
+            if(!newer) {
+                return;
+            }
+            if(!m_has_candidate || !same_address(m_candidate, addr)) {
+                memcpy(&m_candidate, addr, address_size(addr));
+                m_has_candidate = true;
+                std::lock_guard<std::mutex> endpoint_lock(m_endpoint->m_lock);
+                m_challenge = m_endpoint->random_u64(endpoint_lock);
+            }
+            from_peer = false;
+        }
+
+        if(from_peer) {
+            if(newer) {
+                m_last_seq = seq;
+            }
+            m_last_heard = uv_hrtime();
+        }
+    }
+
+    // The handler is called with the handler lock held, so that close() can't return while
+    //     it runs.
+    m_io->tasks().enqueue_task([self = shared_from_this(), seq, dg, from_peer]() {
+        std::lock_guard<std::recursive_mutex> lock(self->m_handler_lock);
+        if(self->m_handler != nullptr) {
+            self->m_handler->receive_udp(seq, dg, from_peer);
+        }
+    });
+}
+
+UdpEndpoint::UdpEndpoint(unsigned int timeout_ms) :
+    m_timeout_ns(uint64_t(timeout_ms) * 1000000)
+{
+}
+
+UdpEndpoint::~UdpEndpoint()
+{
+    if(m_socket) {
+        m_socket->close();
+    }
+}
+
+bool UdpEndpoint::bind(const std::string &address, unsigned int default_port)
+{
+    assert(std::this_thread::get_id() == g_main_thread_id);
+
+    std::vector<uvw::Addr> addresses = resolve_address(address, default_port, g_loop);
+    if(addresses.size() == 0) {
+        return false;
+    }
+
+    sockaddr_storage addr;
+    const uvw::Addr &bind_addr = addresses[0];
+    int err;
+    if(bind_addr.ip.find(':') != std::string::npos) {
+        err = uv_ip6_addr(bind_addr.ip.c_str(), bind_addr.port, reinterpret_cast<sockaddr_in6*>(&addr));
+    } else {
+        err = uv_ip4_addr(bind_addr.ip.c_str(), bind_addr.port, reinterpret_cast<sockaddr_in*>(&addr));
+    }
+    if(err != 0) {
+        return false;
+    }
+
+    m_socket = g_loop->resource<uvw::UDPHandle>();
+    m_udp = reinterpret_cast<uv_udp_t*>(m_socket->raw());
+    if(uv_udp_bind(m_udp, reinterpret_cast<const sockaddr*>(&addr), 0) != 0) {
+        return false;
+    }
+
+    sockaddr_storage bound;
+    int bound_len = sizeof(bound);
+    uv_udp_getsockname(m_udp, reinterpret_cast<sockaddr*>(&bound), &bound_len);
+    m_port = ntohs(bound.ss_family == AF_INET6 ?
+                   reinterpret_cast<sockaddr_in6*>(&bound)->sin6_port :
+                   reinterpret_cast<sockaddr_in*>(&bound)->sin_port);
+
+    // uvw's recv() would allocate a new buffer for every datagram; instead, receive them
+    //     all into m_recv_buf.  The callbacks find us through the socket's user data, which
+    //     also keeps us alive for as long as libuv might call us back.
+    m_socket->data(shared_from_this());
+    return uv_udp_recv_start(m_udp, &UdpEndpoint::alloc_callback,
+                             &UdpEndpoint::recv_callback) == 0;
+}
+
+std::shared_ptr<UdpSession> UdpEndpoint::open_session(UdpHandler *handler)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    // The token is all that authenticates a peer, so it has to be unpredictable from any
+    //     others: each one is read straight from the OS's random source, not a seeded PRNG.
+    uint64_t token;
+    do {
+        token = random_u64(lock);
+    } while(token == 0 || m_sessions.find(token) != m_sessions.end());
+
+    auto session = std::make_shared<UdpSession>(shared_from_this(), handler, token);
+    m_sessions[token] = session;
+    return session;
+}
+
+void UdpEndpoint::forget(uint64_t token)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_sessions.erase(token);
+}
+
+uint64_t UdpEndpoint::random_u64(std::lock_guard<std::mutex> &)
+{
+    return (uint64_t(m_random_device()) << 32) | m_random_device();
+}
+
+void UdpEndpoint::send(const sockaddr_storage &peer, uint32_t seq, DatagramHandle dg)
+{
+    // libuv is NOT thread-safe, so the socket is only used from the main loop.
+    if(std::this_thread::get_id() != g_main_thread_id) {
+        IOLoop::main().tasks().enqueue_task([self = shared_from_this(), peer, seq, dg]() {
+            self->send(peer, seq, dg);
+        });
+        return;
+    }
+
+    uint32_t seq_le = swap_le(seq);
+    uv_buf_t bufs[] = {
+        uv_buf_init(reinterpret_cast<char*>(&seq_le), sizeof(seq_le)),
+        uv_buf_init(reinterpret_cast<char*>(const_cast<uint8_t*>(dg->get_data())), dg->size())
+    };
+
+    // If the socket can't take it right now, the datagram is dropped, as it might have been
+    //     on the way anyway.
+    uv_udp_try_send(m_udp, bufs, 2, reinterpret_cast<const sockaddr*>(&peer));
+}
+
+void UdpEndpoint::receive(ssize_t nread, const sockaddr *addr, unsigned flags)
+{
+    // Errors, empty reads and truncated datagrams (too big for m_recv_buf) are all dropped.
+    if(nread < (ssize_t)PEER_HEADER_SIZE || addr == nullptr || (flags & UV_UDP_PARTIAL)) {
+        return;
+    }
+    if(size_t(nread) - PEER_HEADER_SIZE > DGSIZE_MAX) {
+        return;
+    }
+
+    uint64_t token;
+    uint32_t seq;
+    memcpy(&token, m_recv_buf, sizeof(token));
+    memcpy(&seq, m_recv_buf + sizeof(token), sizeof(seq));
+    token = swap_le(token);
+    seq = swap_le(seq);
+
+    std::shared_ptr<UdpSession> session;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        auto it = m_sessions.find(token);
+        if(it == m_sessions.end()) {
+            return;
+        }
+        session = it->second.lock();
+    }
+    if(session == nullptr) {
+        return;
+    }
+
+    DatagramHandle dg = Datagram::create(reinterpret_cast<uint8_t*>(m_recv_buf) + PEER_HEADER_SIZE,
+                                         dgsize_t(nread - PEER_HEADER_SIZE));
+    session->receive(addr, seq, dg);
+}
+
+void UdpEndpoint::alloc_callback(uv_handle_t *handle, size_t, uv_buf_t *buf)
+{
+    UdpEndpoint &self = *static_cast<uvw::UDPHandle*>(handle->data)->data<UdpEndpoint>();
+    *buf = uv_buf_init(self.m_recv_buf, sizeof(self.m_recv_buf));
+}
+
+void UdpEndpoint::recv_callback(uv_udp_t *handle, ssize_t nread, const uv_buf_t *,
+                                const sockaddr *addr, unsigned flags)
+{
+    UdpEndpoint &self = *static_cast<uvw::UDPHandle*>(handle->data)->data<UdpEndpoint>();
+    self.receive(nread, addr, flags);
+}
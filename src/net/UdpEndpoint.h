@@ -0,0 +1,147 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include "deps/uvw/uvw.hpp"
+#include "util/Datagram.h"
+#include "util/IOLoop.h"
+
+// NOTES:
+//
+// A UdpEndpoint is a UDP socket shared by many peers, each with its own UdpSession.  A peer
+// is given its session's token over some other, trusted connection, and must start each
+// datagram it sends with that token.
+//
+//     peer -> endpoint: uint64 token, uint32 seq, <payload>
+//     endpoint -> peer: uint32 seq, <payload>
+//
+// Each side numbers the datagrams it sends in order, so that the other side can tell old
+// ones that arrive late.  Nothing is resent, and a datagram the socket can't take right away
+// is dropped.
+//
+// The session binds to the address of the first datagram with its token.  As the token is
+// sent in the clear, a datagram from anywhere else doesn't move it: that address is only a
+// candidate, which the handler may challenge (see send_challenge) and the session moves to
+// once the challenge has been echoed back from there.  A datagram from a candidate whose seq
+// isn't newer than the last one accepted is dropped, so old datagrams can't be replayed.
+//
+// The socket lives on the main loop, but sessions may be used from any thread.
+
+class UdpEndpoint;
+
+class UdpHandler
+{
+  protected:
+    // receive_udp is called with each datagram received for the session (after the header),
+    //     along with its sequence number, on the loop the session was opened on.  from_peer
+    //     is false if it came from a candidate address (see above), in which case only a
+    //     challenge, or the answer to one, should be taken from it.
+    virtual void receive_udp(uint32_t seq, DatagramHandle dg, bool from_peer) = 0;
+
+    friend class UdpSession;
+};
+
+class UdpSession : public std::enable_shared_from_this<UdpSession>
+{
+  public:
+    UdpSession(std::shared_ptr<UdpEndpoint> endpoint, UdpHandler *handler, uint64_t token);
+
+    inline uint64_t get_token() const
+    {
+        return m_token;
+    }
+
+    // is_active returns true if the peer has been heard from recently enough (see the
+    //     endpoint's timeout) to expect that datagrams sent to it get there.
+    bool is_active();
+
+    // send_datagram sends the datagram to the peer, and returns true, if the session is
+    //     active and the datagram is small enough to go in one packet.  Otherwise, it returns
+    //     false and the caller should send it some other way.
+    bool send_datagram(const DatagramHandle &dg);
+
+    // send_challenge appends the current candidate's challenge to dg and sends it there.
+    //     Returns false, sending nothing, if there's no candidate.
+    bool send_challenge(const DatagramPtr &dg);
+    // accept_challenge moves the session to the current candidate, and returns true, if
+    //     challenge is the one sent there.
+    bool accept_challenge(uint64_t challenge);
+
+    // close stops the session: its token is no longer accepted, and its handler isn't
+    //     called again, once close returns.  Don't hold any lock the handler takes.
+    void close();
+
+  private:
+    std::shared_ptr<UdpEndpoint> m_endpoint;
+    IOLoop *m_io; // The loop the handler is called on.
+    uint64_t m_token;
+
+    // m_handler_lock is held while the handler is called, and guards m_handler.
+    std::recursive_mutex m_handler_lock;
+    UdpHandler *m_handler; // Set to nullptr on close.
+
+    // m_lock guards the rest.
+    std::mutex m_lock;
+    sockaddr_storage m_peer;
+    bool m_has_peer = false;
+    uint64_t m_last_heard = 0; // uv_hrtime() of the last datagram from the peer.
+    uint32_t m_last_seq = 0; // The newest seq accepted from the peer.
+    uint32_t m_next_seq = 0;
+
+    // The address last heard from other than the peer's, and the challenge for it.
+    sockaddr_storage m_candidate;
+    bool m_has_candidate = false;
+    uint64_t m_challenge = 0;
+
+    bool is_active(std::lock_guard<std::mutex> &lock);
+    // receive is called by the endpoint, on the main loop, for each datagram from the peer.
+    void receive(const sockaddr *addr, uint32_t seq, DatagramHandle dg);
+    friend class UdpEndpoint;
+};
+
+class UdpEndpoint : public std::enable_shared_from_this<UdpEndpoint>
+{
+  public:
+    // timeout_ms is how long a session stays active without hearing from its peer.
+    UdpEndpoint(unsigned int timeout_ms);
+    ~UdpEndpoint();
+
+    // bind opens the socket, on the main loop; main thread only.  Returns false if it can't.
+    bool bind(const std::string &address, unsigned int default_port);
+
+    // open_session starts a session with a new token, whose handler is called on the
+    //     calling thread's loop.
+    std::shared_ptr<UdpSession> open_session(UdpHandler *handler);
+
+    inline uint16_t get_port() const
+    {
+        return m_port;
+    }
+
+  private:
+    std::shared_ptr<uvw::UDPHandle> m_socket;
+    uv_udp_t *m_udp = nullptr; // m_socket's libuv handle.
+    uint16_t m_port = 0;
+    uint64_t m_timeout_ns;
+
+    std::mutex m_lock;
+    std::unordered_map<uint64_t, std::weak_ptr<UdpSession>> m_sessions;
+    std::random_device m_random_device; // Guarded by m_lock.
+
+    // Receiving, main loop only.
+    char m_recv_buf[65536];
+
+    void forget(uint64_t token);
+    // random_u64 returns a value read from the OS's random source; m_lock must be held.
+    uint64_t random_u64(std::lock_guard<std::mutex> &lock);
+    // send writes out a datagram to a peer, from the main loop.
+    void send(const sockaddr_storage &peer, uint32_t seq, DatagramHandle dg);
+    void receive(ssize_t nread, const sockaddr *addr, unsigned flags);
+
+    static void alloc_callback(uv_handle_t *handle, size_t suggested, uv_buf_t *buf);
+    static void recv_callback(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+                              const sockaddr *addr, unsigned flags);
+
+    friend class UdpSession;
+};
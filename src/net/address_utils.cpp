@@ -126,6 +126,19 @@ bool is_valid_address(const std::string &hostspec)
     }
 }
 
+static const std::string UNIX_PREFIX = "unix:";
+
+bool is_unix_address(const std::string &hostspec)
+{
+    return hostspec.size() > UNIX_PREFIX.size() &&
+           hostspec.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX) == 0;
+}
+
+std::string unix_address_path(const std::string &hostspec)
+{
+    return hostspec.substr(UNIX_PREFIX.size());
+}
+
 std::vector<uvw::Addr> resolve_address(const std::string &hostspec, uint16_t port, const std::shared_ptr<uvw::Loop> &loop)
 {
     #ifdef _WIN32
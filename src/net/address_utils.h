@@ -2,4 +2,9 @@
 
 bool is_valid_address(const std::string &hostspec);
 
+// Addresses of the form "unix:/path/to/socket" name a Unix domain socket, for
+// processes on the same host.  Only some listeners and connectors accept them.
+bool is_unix_address(const std::string &hostspec);
+std::string unix_address_path(const std::string &hostspec);
+
 std::vector<uvw::Addr> resolve_address(const std::string &hostspec, uint16_t port, const std::shared_ptr<uvw::Loop> &loop);
@@ -221,7 +221,7 @@ void DBStateServer::handle_set_field(DatagramIterator &dgi)
         DatagramPtr dg = Datagram::create(m_db_channel, do_id, DBSERVER_OBJECT_SET_FIELD);
         dg->add_doid(do_id);
         dg->add_uint16(field_id);
-        dg->add_data(dgi.read_remainder());
+        dgi.read_remainder_into(*dg);
         route_datagram(dg);
     }
 }
@@ -344,7 +344,7 @@ void DBStateServer::handle_get_field_resp(DatagramIterator& dgi)
     m_log->trace() << "Received GetFieldResp from database." << std::endl;
 
     // Add database field payload to response (don't know dclass, so must copy payload) and send
-    dg->add_data(dgi.read_remainder());
+    dgi.read_remainder_into(*dg);
     route_datagram(dg);
 }
 
@@ -446,7 +446,7 @@ void DBStateServer::handle_get_fields_resp(DatagramIterator& dgi)
     // Add database field payload to response (don't know dclass, so must copy payload).
     if(dgi.read_bool() == true) {
         dgi.read_uint16(); // Discard field count
-        dg->add_data(dgi.read_remainder());
+        dgi.read_remainder_into(*dg);
     }
     route_datagram(dg);
 }
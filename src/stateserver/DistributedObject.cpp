@@ -88,6 +88,14 @@ DistributedObject::~DistributedObject()
 
 void DistributedObject::append_required_data(DatagramPtr dg, bool client_only, bool also_owner)
 {
+    // Make room for all of the required fields up front, rather than growing field by field.
+    size_t required_size = 0;
+    for(const auto& it : m_required_fields) {
+        required_size += it.second.size();
+    }
+    dg->reserve(dg->size() + sizeof(doid_t) + sizeof(doid_t) + sizeof(zone_t) + sizeof(uint16_t)
+                + required_size);
+
     dg->add_doid(m_do_id);
     dg->add_location(m_parent_id, m_zone_id);
     dg->add_uint16(m_dclass->get_id());
@@ -104,6 +112,12 @@ void DistributedObject::append_required_data(DatagramPtr dg, bool client_only, b
 
 void DistributedObject::append_other_data(DatagramPtr dg, bool client_only, bool also_owner)
 {
+    size_t other_size = sizeof(uint16_t);
+    for(const auto& it : m_ram_fields) {
+        other_size += sizeof(uint16_t) + it.second.size();
+    }
+    dg->reserve(dg->size() + other_size);
+
     if(client_only) {
         vector<const Field*> broadcast_fields;
         for(auto it = m_ram_fields.begin(); it != m_ram_fields.end(); ++it) {
@@ -401,7 +415,11 @@ bool DistributedObject::handle_one_update(DatagramIterator &dgi, channel_t sende
         dg->add_doid(m_do_id);
         dg->add_uint16(field_id);
         dg->add_data(data);
-        route_datagram(dg);
+        if(field->has_keyword("unreliable")) {
+            route_unreliable(dg);
+        } else {
+            route_datagram(dg);
+        }
     }
     return true;
 }
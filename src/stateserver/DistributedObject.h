@@ -16,6 +16,12 @@ class DistributedObject : public MDParticipantInterface
 
     virtual void handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi);
 
+    // Objects share their StateServer's object tables, so they route on its thread.
+    virtual const void *routing_affinity() const
+    {
+        return m_stateserver->routing_affinity();
+    }
+
     inline doid_t get_id() const
     {
         return m_do_id;
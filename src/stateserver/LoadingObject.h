@@ -16,6 +16,12 @@ class LoadingObject final : public MDParticipantInterface
 
     void begin();
     void handle_datagram(DatagramHandle in_dg, DatagramIterator &dgi);
+
+    // Loaders hand datagrams straight to the dbss, so they route on its thread.
+    const void *routing_affinity() const
+    {
+        return m_dbss->routing_affinity();
+    }
   private:
     DBStateServer *m_dbss;
     doid_t m_do_id;
@@ -0,0 +1,624 @@
+// ChannelMapBenchmark compares the ChannelMap's flat channel/range indexes against
+// the unordered_multimap + boost::icl structures they replaced.
+//
+// Usage: channelmap_bench [subscriptions...]
+//     Defaults to 100000, 1000000 and 10000000 subscriptions.
+//
+// Before benchmarking, it replays a long random sequence of (un)subscribes against
+// both the ChannelMap and a copy of the original implementation, and fails if their
+// lookups or upstream notifications (on_add_range etc.) ever differ.
+//
+// Finally, it measures lookup latency while another thread churns subscriptions,
+// with and without lockless lookups.
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/icl/interval_map.hpp>
+
+#include "messagedirector/ChannelMap.h"
+
+typedef boost::icl::discrete_interval<channel_t> interval_t;
+typedef std::chrono::steady_clock bench_clock;
+
+// LegacyChannelMap is the ChannelMap as it was before ChannelIndex/RangeIndex, except
+// for the clamping fix noted in unsubscribe_range.
+class LegacyChannelMap
+{
+  public:
+    LegacyChannelMap();
+    virtual ~LegacyChannelMap() {}
+
+    void subscribe_channel(ChannelSubscriber *p, channel_t c);
+    void unsubscribe_channel(ChannelSubscriber *p, channel_t c);
+    void subscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi);
+    void unsubscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi);
+    void unsubscribe_all(ChannelSubscriber *p);
+    bool remove_subscriber(ChannelSubscriber *p, channel_t c);
+    bool is_subscribed(ChannelSubscriber *p, channel_t c);
+    void lookup_channels(const std::vector<channel_t> &cl, std::unordered_set<ChannelSubscriber *> &ps);
+
+  protected:
+    virtual void on_add_channel(channel_t) { }
+    virtual void on_remove_channel(channel_t) { }
+    virtual void on_add_range(channel_t, channel_t) { }
+    virtual void on_remove_range(channel_t, channel_t) { }
+
+  private:
+    std::unordered_multimap<channel_t, ChannelSubscriber *> m_channel_subscriptions;
+    boost::icl::interval_map<channel_t, std::unordered_set<ChannelSubscriber *> > m_range_subscriptions;
+    std::recursive_mutex m_lock;
+};
+
+static void legacy_closed_bounds(const interval_t &interval, channel_t &lower, channel_t &upper)
+{
+    lower = interval.lower();
+    upper = interval.upper();
+
+    if(!(interval.bounds().bits() & 2)) {
+        lower += 1;
+    }
+    if(!(interval.bounds().bits() & 1)) {
+        upper -= 1;
+    }
+}
+
+LegacyChannelMap::LegacyChannelMap()
+{
+    // Initialize m_range_susbcriptions with empty range
+    auto empty_set = std::unordered_set<ChannelSubscriber*>();
+    m_range_subscriptions = boost::icl::interval_map<channel_t, std::unordered_set<ChannelSubscriber*> >();
+    m_range_subscriptions += std::make_pair(interval_t::closed(0, CHANNEL_MAX), empty_set);
+}
+
+void LegacyChannelMap::subscribe_channel(ChannelSubscriber *p, channel_t c)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    if(is_subscribed(p, c)) {
+        return;
+    }
+
+    p->channels().insert(p->channels().end(), c);
+    bool has_subs = (m_channel_subscriptions.find(c) != m_channel_subscriptions.end());
+
+    if(!has_subs) {
+        on_add_channel(c);
+    }
+
+    m_channel_subscriptions.insert(std::make_pair(c, p));
+}
+
+bool LegacyChannelMap::remove_subscriber(ChannelSubscriber *p, channel_t c)
+{
+    auto sub_cnt = m_channel_subscriptions.count(c);
+    if(sub_cnt == 0) {
+        return false;
+    }
+
+    auto subs = m_channel_subscriptions.equal_range(c);
+
+    for(auto it = subs.first; it != subs.second; ++it) {
+        if(it->second == p) {
+            m_channel_subscriptions.erase(it);
+            --sub_cnt;
+            break;
+        }
+    }
+
+    return (sub_cnt == 0);
+}
+
+void LegacyChannelMap::unsubscribe_channel(ChannelSubscriber *p, channel_t c)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    if(!is_subscribed(p, c)) {
+        return;
+    }
+
+    p->channels().erase(c);
+
+    if(remove_subscriber(p, c)) {
+        on_remove_channel(c);
+    }
+}
+
+void LegacyChannelMap::subscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    // Prepare participant and range
+    std::unordered_set<ChannelSubscriber *> participant_set;
+    participant_set.insert(p);
+
+    interval_t interval = interval_t::closed(lo, hi);
+
+    // Update range mappings
+    p->ranges() += interval;
+    m_range_subscriptions += std::make_pair(interval, participant_set);
+
+    // Now, check if anything along this interval is *new*:
+    auto interval_range = m_range_subscriptions.equal_range(interval);
+    for(auto it = interval_range.first; it != interval_range.second; ++it) {
+        if(it->second.size() == 1) {
+            // There's a segment of the interval that has only one element
+            // (our newly added participant!) and thus, we should upstream the
+            // range addition.
+            on_add_range(lo, hi);
+            break;
+        }
+    }
+}
+
+void LegacyChannelMap::unsubscribe_range(ChannelSubscriber *p, channel_t lo, channel_t hi)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    // Pre-check: if there are no ranges subscribed anyway, no use doing this:
+    if(m_range_subscriptions.empty()) {
+        return;
+    }
+
+    // Prepare participant set
+    std::unordered_set<ChannelSubscriber *> participant_set;
+    participant_set.insert(p);
+
+    // Construct the interval we are removing, bounded to m_range_subscriptions.
+    // N.B. The original read the raw bounds here, which are exclusive for some segments,
+    // so it could report an extra unsubscribed channel as silent at either end.
+    channel_t lower, upper, unused;
+    legacy_closed_bounds(m_range_subscriptions.begin()->first, lower, unused);
+    legacy_closed_bounds(m_range_subscriptions.rbegin()->first, unused, upper);
+    interval_t interval = interval_t::closed(std::max(lo, lower), std::min(hi, upper));
+
+    // Calculate the ranges that will "go silent" as a result of our removal:
+    auto silent_ranges = boost::icl::interval_set<channel_t>(interval);
+    auto interval_range = m_range_subscriptions.equal_range(interval);
+    for(auto it = interval_range.first; it != interval_range.second; ++it) {
+        if(!it->second.empty() && !(it->second.size() == 1 && *it->second.begin() == p)) {
+            // We aren't the last subscription in this range, don't kill it.
+            silent_ranges -= it->first;
+        }
+    }
+
+    // Update range mappings
+    p->ranges() -= interval;
+    m_range_subscriptions -= std::make_pair(interval, participant_set);
+
+    // Clobber *channel* subscriptions that fall within the range.
+    for(auto it = p->channels().begin(); it != p->channels().end();) {
+        auto prev = it++;
+        channel_t c = *prev;
+
+        if(lo <= c && c <= hi) {
+            // N.B. we do NOT call unsubscribe_channel, because that might send
+            // off an on_remove_channel event. Instead, we just manually update:
+            remove_subscriber(p, c);
+            p->channels().erase(prev);
+        }
+    }
+
+    // Now, clean up any ranges that are now *empty* and should thus be killed:
+    for(auto it = silent_ranges.begin(); it != silent_ranges.end(); ++it) {
+        legacy_closed_bounds(*it, lower, upper);
+
+        // Okay, this part of the interval is dead, better request it be
+        // sliced off:
+        on_remove_range(lower, upper);
+    }
+}
+
+void LegacyChannelMap::unsubscribe_all(ChannelSubscriber* p)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    // Unsubscribe from indivually subscribed channels
+    auto channels = std::unordered_set<channel_t>(p->channels());
+    for(auto it = channels.begin(); it != channels.end(); ++it) {
+        channel_t channel = *it;
+        unsubscribe_channel(p, channel);
+    }
+
+    // Unsubscribe from subscribed channel ranges
+    auto ranges = boost::icl::interval_set<channel_t>(p->ranges());
+    for(auto it = ranges.begin(); it != ranges.end(); ++it) {
+        channel_t lower;
+        channel_t upper;
+        legacy_closed_bounds(*it, lower, upper);
+        unsubscribe_range(p, lower, upper);
+    }
+}
+
+bool LegacyChannelMap::is_subscribed(ChannelSubscriber *p, channel_t c)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    if(p->channels().find(c) != p->channels().end()) {
+        return true;
+    }
+
+    if(p->ranges().find(c) != p->ranges().end()) {
+        return true;
+    }
+
+    return false;
+}
+
+void LegacyChannelMap::lookup_channels(const std::vector<channel_t> &cl, std::unordered_set<ChannelSubscriber *> &ps)
+{
+    std::lock_guard<std::recursive_mutex> guard(m_lock);
+
+    for(auto it = cl.begin(); it != cl.end(); ++it) {
+        auto subs = m_channel_subscriptions.equal_range(*it);
+        for(auto it2 = subs.first; it2 != subs.second; ++it2) {
+            ps.insert(it2->second);
+        }
+
+        auto range = boost::icl::find(m_range_subscriptions, *it);
+        if(range != m_range_subscriptions.end()) {
+            ps.insert(range->second.begin(), range->second.end());
+        }
+    }
+}
+
+// Recording wraps a channel map, logging its upstream notifications.
+template<typename Map>
+class Recording : public Map
+{
+  public:
+    std::vector<std::string> events;
+
+  protected:
+    virtual void on_add_channel(channel_t c)
+    {
+        events.push_back("add_channel " + std::to_string(uint64_t(c)));
+    }
+    virtual void on_remove_channel(channel_t c)
+    {
+        events.push_back("remove_channel " + std::to_string(uint64_t(c)));
+    }
+    virtual void on_add_range(channel_t lo, channel_t hi)
+    {
+        events.push_back("add_range " + std::to_string(uint64_t(lo)) + "-" + std::to_string(uint64_t(hi)));
+    }
+    virtual void on_remove_range(channel_t lo, channel_t hi)
+    {
+        events.push_back("remove_range " + std::to_string(uint64_t(lo)) + "-" + std::to_string(uint64_t(hi)));
+    }
+};
+
+template<typename Map>
+static std::vector<size_t> lookup_indices(Map &map, channel_t c, const std::vector<ChannelSubscriber> &subs)
+{
+    std::unordered_set<ChannelSubscriber*> found;
+    map.lookup_channels(std::vector<channel_t> {c}, found);
+
+    std::vector<size_t> indices;
+    for(const auto& p : found) {
+        indices.push_back(p - subs.data());
+    }
+    std::sort(indices.begin(), indices.end());
+    return indices;
+}
+
+// check_parity replays random operations against both maps, comparing as it goes.
+static bool check_parity(unsigned int operations, bool lockless)
+{
+    const unsigned int num_subscribers = 8;
+    const uint64_t space = 256;
+
+    Recording<ChannelMap> current;
+    Recording<LegacyChannelMap> legacy;
+    std::vector<ChannelSubscriber> current_subs(num_subscribers);
+    std::vector<ChannelSubscriber> legacy_subs(num_subscribers);
+    if(lockless) {
+        current.enable_lockless_lookups();
+    }
+
+    std::mt19937_64 gen(1234);
+    std::uniform_int_distribution<unsigned int> pick_op(0, 99);
+    std::uniform_int_distribution<unsigned int> pick_sub(0, num_subscribers - 1);
+    std::uniform_int_distribution<uint64_t> pick_channel(0, space - 1);
+    std::uniform_int_distribution<uint64_t> pick_width(0, 24);
+
+    for(unsigned int n = 0; n < operations; ++n) {
+        unsigned int op = pick_op(gen);
+        unsigned int s = pick_sub(gen);
+        channel_t lo = pick_channel(gen);
+        channel_t hi = std::min<uint64_t>(lo + pick_width(gen), space - 1);
+
+        if(op < 30) {
+            current.subscribe_channel(&current_subs[s], lo);
+            legacy.subscribe_channel(&legacy_subs[s], lo);
+        } else if(op < 50) {
+            current.unsubscribe_channel(&current_subs[s], lo);
+            legacy.unsubscribe_channel(&legacy_subs[s], lo);
+        } else if(op < 72) {
+            current.subscribe_range(&current_subs[s], lo, hi);
+            legacy.subscribe_range(&legacy_subs[s], lo, hi);
+        } else if(op < 97) {
+            // The legacy map asserts if the range misses everything that's subscribed
+            // (it builds an empty interval), so don't ask it to.
+            boost::icl::interval_set<channel_t> covered;
+            for(auto& sub : legacy_subs) {
+                covered += sub.ranges();
+            }
+            if(!covered.empty() && (hi < boost::icl::first(covered) || lo > boost::icl::last(covered))) {
+                continue;
+            }
+
+            current.unsubscribe_range(&current_subs[s], lo, hi);
+            legacy.unsubscribe_range(&legacy_subs[s], lo, hi);
+        } else {
+            current.unsubscribe_all(&current_subs[s]);
+            legacy.unsubscribe_all(&legacy_subs[s]);
+        }
+
+        if(current.events != legacy.events) {
+            std::cerr << "Notifications differ after operation " << n << ":\n";
+            for(const auto& e : current.events) {
+                std::cerr << "  new:    " << e << "\n";
+            }
+            for(const auto& e : legacy.events) {
+                std::cerr << "  legacy: " << e << "\n";
+            }
+            return false;
+        }
+        current.events.clear();
+        legacy.events.clear();
+
+        for(uint64_t c = 0; c < space; ++c) {
+            if(lookup_indices(current, c, current_subs) != lookup_indices(legacy, c, legacy_subs)) {
+                std::cerr << "Lookup of channel " << c << " differs after operation " << n << ".\n";
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+static void report(const char *what, size_t count, double legacy, double current)
+{
+    std::cout << "  " << what << ": legacy " << uint64_t(count / legacy) << "/s, flat "
+              << uint64_t(count / current) << "/s (" << legacy / current << "x)" << std::endl;
+}
+
+// bench_channels compares single-channel subscriptions: n channels spread over a
+// pool of subscribers, with a tenth of them having a second subscriber.
+static void bench_channels(size_t n)
+{
+    const size_t lookups = 5000000;
+    std::vector<ChannelSubscriber> subs(1024);
+    std::mt19937_64 gen(n);
+    std::vector<channel_t> channels(n);
+    for(auto& c : channels) {
+        c = gen();
+    }
+    std::vector<channel_t> probes(lookups);
+    for(size_t i = 0; i < lookups; ++i) {
+        // Half of the lookups hit, half miss.
+        probes[i] = (i & 1) ? channels[gen() % n] : channel_t(gen());
+    }
+
+    double legacy_insert, current_insert, legacy_lookup, current_lookup;
+    size_t legacy_found = 0, current_found = 0;
+    {
+        std::unordered_multimap<channel_t, ChannelSubscriber *> legacy;
+        auto start = bench_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            legacy.insert(std::make_pair(channels[i], &subs[i % subs.size()]));
+            if(i % 10 == 0) {
+                legacy.insert(std::make_pair(channels[i], &subs[(i + 1) % subs.size()]));
+            }
+        }
+        legacy_insert = seconds_since(start);
+
+        start = bench_clock::now();
+        for(const auto& c : probes) {
+            auto range = legacy.equal_range(c);
+            for(auto it = range.first; it != range.second; ++it) {
+                legacy_found += it->second != nullptr;
+            }
+        }
+        legacy_lookup = seconds_since(start);
+    }
+    {
+        ChannelIndex current;
+        auto start = bench_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            current.add(channels[i], &subs[i % subs.size()]);
+            if(i % 10 == 0) {
+                current.add(channels[i], &subs[(i + 1) % subs.size()]);
+            }
+        }
+        current_insert = seconds_since(start);
+
+        start = bench_clock::now();
+        for(const auto& c : probes) {
+            const SubscriberList *list = current.find(c);
+            if(list != nullptr) {
+                for(const auto& p : *list) {
+                    current_found += p != nullptr;
+                }
+            }
+        }
+        current_lookup = seconds_since(start);
+    }
+
+    std::cout << n << " channel subscriptions:" << std::endl;
+    report("subscribe", n, legacy_insert, current_insert);
+    report("lookup", lookups, legacy_lookup, current_lookup);
+    if(legacy_found != current_found) {
+        std::cerr << "  Lookup results differ!" << std::endl;
+    }
+}
+
+// bench_ranges compares range subscriptions: n ranges of random width (some
+// overlapping), each owned by one of a pool of subscribers.
+static void bench_ranges(size_t n)
+{
+    const size_t lookups = 5000000;
+    std::vector<ChannelSubscriber> subs(1024);
+    std::mt19937_64 gen(n);
+    const uint64_t spacing = 1 << 16;
+    std::vector<std::pair<channel_t, channel_t>> ranges(n);
+    for(size_t i = 0; i < n; ++i) {
+        channel_t lo = channel_t(i) * spacing + gen() % spacing;
+        ranges[i] = std::make_pair(lo, lo + gen() % (2 * spacing));
+    }
+    std::shuffle(ranges.begin(), ranges.end(), gen);
+    std::vector<channel_t> probes(lookups);
+    for(auto& c : probes) {
+        c = gen() % (n * spacing);
+    }
+
+    double legacy_insert, current_insert, legacy_lookup, current_lookup;
+    size_t legacy_found = 0, current_found = 0;
+    {
+        boost::icl::interval_map<channel_t, std::unordered_set<ChannelSubscriber *> > legacy;
+        auto start = bench_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            std::unordered_set<ChannelSubscriber *> set;
+            set.insert(&subs[i % subs.size()]);
+            legacy += std::make_pair(interval_t::closed(ranges[i].first, ranges[i].second), set);
+        }
+        legacy_insert = seconds_since(start);
+
+        start = bench_clock::now();
+        for(const auto& c : probes) {
+            auto it = boost::icl::find(legacy, c);
+            if(it != legacy.end()) {
+                legacy_found += it->second.size();
+            }
+        }
+        legacy_lookup = seconds_since(start);
+    }
+    {
+        RangeIndex current;
+        auto start = bench_clock::now();
+        for(size_t i = 0; i < n; ++i) {
+            current.add(ranges[i].first, ranges[i].second, &subs[i % subs.size()]);
+        }
+        current_insert = seconds_since(start);
+
+        start = bench_clock::now();
+        for(const auto& c : probes) {
+            const SubscriberList *list = current.find(c);
+            if(list != nullptr) {
+                current_found += list->size();
+            }
+        }
+        current_lookup = seconds_since(start);
+    }
+
+    std::cout << n << " range subscriptions:" << std::endl;
+    report("subscribe", n, legacy_insert, current_insert);
+    report("lookup", lookups, legacy_lookup, current_lookup);
+    if(legacy_found != current_found) {
+        std::cerr << "  Lookup results differ!" << std::endl;
+    }
+}
+
+// bench_churn measures lookups on one thread while another repeatedly moves a
+// block of subscribers between zones, as in a mass teleport.
+static void bench_churn(bool lockless)
+{
+    const size_t lookups = 2000000;
+    const size_t zones = 100000;
+    const size_t movers = 500;
+
+    ChannelMap map;
+    if(lockless) {
+        map.enable_lockless_lookups();
+    }
+    std::vector<ChannelSubscriber> subs(movers + 1);
+    for(size_t z = 0; z < zones; ++z) {
+        map.subscribe_channel(&subs[movers], z);
+    }
+
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> moves(0);
+    std::thread writer([&]() {
+        std::mt19937_64 gen(1);
+        while(!done) {
+            ChannelSubscriber &p = subs[gen() % movers];
+            map.unsubscribe_all(&p);
+            channel_t base = gen() % (zones - 50);
+            for(channel_t z = base; z < base + 50; ++z) {
+                map.subscribe_channel(&p, z);
+            }
+            moves.fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+
+    std::mt19937_64 gen(2);
+    std::vector<double> latencies;
+    latencies.reserve(lookups);
+    std::vector<channel_t> channels(1);
+    std::unordered_set<ChannelSubscriber*> found;
+    auto start = bench_clock::now();
+    for(size_t i = 0; i < lookups; ++i) {
+        channels[0] = gen() % zones;
+        found.clear();
+        auto before = bench_clock::now();
+        map.lookup_channels(channels, found);
+        latencies.push_back(std::chrono::duration<double, std::micro>(bench_clock::now() - before).count());
+    }
+    double elapsed = seconds_since(start);
+    done = true;
+    writer.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << (lockless ? "  lockless" : "  locked") << ": "
+              << uint64_t(lookups / elapsed) << " lookups/s, "
+              << uint64_t(moves / elapsed) << " zone changes/s, latency p50 "
+              << latencies[lookups / 2] << "us p99 " << latencies[lookups * 99 / 100]
+              << "us p99.99 " << latencies[lookups * 9999 / 10000] << "us max "
+              << latencies.back() << "us" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if(!check_parity(20000, false) || !check_parity(5000, true)) {
+        return 1;
+    }
+    std::cout << "Parity check passed." << std::endl;
+
+    std::vector<size_t> sizes;
+    for(int i = 1; i < argc; ++i) {
+        sizes.push_back(std::stoul(argv[i]));
+    }
+    if(sizes.empty()) {
+        sizes = {100000, 1000000, 10000000};
+    }
+
+    for(const auto& n : sizes) {
+        bench_channels(n);
+    }
+
+    // Range subscriptions are far rarer in practice (and every insert into the flat
+    // index shifts its tail), so they're measured at smaller sizes.
+    for(size_t n = 1000; n <= std::min<size_t>(sizes.back(), 100000); n *= 10) {
+        bench_ranges(n);
+    }
+
+    std::cout << "Lookups during subscription churn:" << std::endl;
+    bench_churn(false);
+    bench_churn(true);
+
+    return 0;
+}
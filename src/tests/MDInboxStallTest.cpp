@@ -0,0 +1,356 @@
+// MDInboxStallTest checks that, with inboxes, a participant which is stuck (like a Client
+// whose lock is held by its I/O loop) doesn't hold up routing to anybody else, even with
+// a single routing thread.  With messagedirector/inbox_overflow: disconnect, it checks that
+// overflowing cuts the participant off; with block, that the routing thread sits idle while
+// the full inbox waits, and picks up again as soon as the participant is let go.
+// With spill, it checks that messagedirector/spill_limit holds back a thread which routes
+// faster than a stalled routing thread can keep up with.
+//
+// Usage: md_stall_test [disconnect|block|spill]
+//     Exits non-zero, saying why, if any check fails.
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "core/global.h"
+#include "messagedirector/MessageDirector.h"
+
+static const channel_t STALLED_CHANNEL = 2000000;
+static const channel_t OBSERVER_CHANNEL = 2000001;
+static const channel_t SENDER_BASE_CHANNEL = 2000100;
+static const unsigned int INBOX_SIZE = 4;
+static const unsigned int MESSAGES = 1000;
+
+// The routing thread may use this much CPU time while a full inbox is held for STALL_MS.
+static const unsigned int STALL_MS = 200;
+static const unsigned int STALL_CPU_MS = 50;
+
+// For spill: the smallest ring there is, so that nearly everything spills.
+static const unsigned int SPILL_QUEUE_SIZE = 2;
+static const unsigned int SPILL_LIMIT = 8;
+
+// StalledParticipant takes its inbox under a ParticipantLock, as a Client does.
+class StalledParticipant : public MDParticipantInterface
+{
+  public:
+    StalledParticipant()
+    {
+        subscribe_channel(STALLED_CHANNEL);
+    }
+
+    ParticipantLock lock {this};
+    std::atomic<uint64_t> received {0};
+    std::atomic<bool> overflowed {false};
+
+    virtual void handle_datagram(DatagramHandle, DatagramIterator &)
+    {
+        std::lock_guard<ParticipantLock> guard(lock);
+        received.fetch_add(1);
+    }
+
+    virtual bool can_overflow() const
+    {
+        return true;
+    }
+    virtual void handle_inbox_overflow()
+    {
+        // Like a Client, it only asks for its connection to be closed.
+        overflowed = true;
+    }
+    virtual bool begin_inbox_drain()
+    {
+        return lock.try_lock();
+    }
+    virtual void end_inbox_drain()
+    {
+        lock.unlock();
+    }
+};
+
+// GatedParticipant handles its datagrams directly on the routing thread, which waits for
+//     the gate whenever it's held.
+class GatedParticipant : public MDParticipantInterface
+{
+  public:
+    GatedParticipant()
+    {
+        subscribe_channel(STALLED_CHANNEL);
+    }
+
+    std::mutex gate;
+    std::atomic<uint64_t> received {0};
+
+    virtual void handle_datagram(DatagramHandle, DatagramIterator &)
+    {
+        std::lock_guard<std::mutex> guard(gate);
+        received.fetch_add(1);
+    }
+};
+
+class ObserverParticipant : public MDParticipantInterface
+{
+  public:
+    explicit ObserverParticipant(channel_t held_senders) : m_held_senders(held_senders)
+    {
+        subscribe_channel(OBSERVER_CHANNEL);
+    }
+
+    std::atomic<uint64_t> received {0};
+    std::atomic<uint64_t> from_held {0}; // From the senders which reached the stalled one.
+
+    virtual void handle_datagram(DatagramHandle, DatagramIterator &dgi)
+    {
+        channel_t sender = dgi.read_channel();
+        if(sender >= SENDER_BASE_CHANNEL && sender < SENDER_BASE_CHANNEL + m_held_senders) {
+            from_held.fetch_add(1);
+        }
+        received.fetch_add(1);
+    }
+
+  private:
+    channel_t m_held_senders;
+};
+
+class SenderParticipant : public MDParticipantInterface
+{
+  public:
+    explicit SenderParticipant(unsigned int index) : m_channel(SENDER_BASE_CHANNEL + index)
+    {
+    }
+
+    virtual void handle_datagram(DatagramHandle, DatagramIterator &)
+    {
+    }
+
+    inline void send(channel_t to)
+    {
+        route_datagram(Datagram::create(to, m_channel, 0));
+    }
+
+  private:
+    channel_t m_channel;
+};
+
+static bool wait_until(const std::function<bool()> &done)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while(!done()) {
+        if(std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+static int fail(const std::string &why)
+{
+    std::cerr << "FAIL: " << why << std::endl;
+    return 1;
+}
+
+static void init(const std::string &settings)
+{
+    std::stringstream config;
+    config << "messagedirector:\n"
+           << "    threaded: true\n"
+           << "    threads: 1\n"
+           << settings;
+    g_config->load(config);
+
+    MessageDirector::singleton.init_network();
+}
+
+static std::string inbox_settings(const std::string &overflow)
+{
+    std::stringstream settings;
+    settings << "    inbox_size: " << INBOX_SIZE << "\n"
+             << "    inbox_overflow: " << overflow << "\n";
+    return settings.str();
+}
+
+static int test_disconnect()
+{
+    init(inbox_settings("disconnect"));
+
+    StalledParticipant *stalled = new StalledParticipant();
+    ObserverParticipant *observer = new ObserverParticipant(1);
+    std::vector<SenderParticipant*> senders;
+    for(unsigned int i = 0; i <= INBOX_SIZE + 1; ++i) {
+        senders.push_back(new SenderParticipant(i));
+    }
+    SenderParticipant *first = senders[0];
+    SenderParticipant *other = senders.back();
+
+    std::unique_lock<ParticipantLock> stall(stalled->lock);
+
+    // The first sender reaches the stalled participant, so its next datagram waits...
+    first->send(STALLED_CHANNEL);
+    first->send(OBSERVER_CHANNEL);
+
+    // ...but nobody else's does, though there's only the one routing thread.
+    for(unsigned int i = 0; i < MESSAGES; ++i) {
+        other->send(OBSERVER_CHANNEL);
+    }
+    if(!wait_until([&] { return observer->received == MESSAGES; })) {
+        return fail("a stalled participant delayed routing to another");
+    } else if(observer->from_held != 0) {
+        return fail("a sender got ahead of its datagram to a stalled participant");
+    }
+
+    // Filling up its inbox disconnects it, without waiting for it to come unstuck...
+    for(unsigned int i = 1; i <= INBOX_SIZE; ++i) {
+        senders[i]->send(STALLED_CHANNEL);
+    }
+    if(!wait_until([&] { return stalled->overflowed.load(); })) {
+        return fail("a stalled participant's inbox overflowed without disconnecting it");
+    }
+
+    // ...and lets the senders waiting on it carry on.
+    if(!wait_until([&] { return observer->from_held == 1; })) {
+        return fail("a sender was still held after its receiver was disconnected");
+    } else if(stalled->received != 0) {
+        return fail("a datagram was handled while its receiver was stalled");
+    }
+
+    stall.unlock();
+    return 0;
+}
+
+static int test_block()
+{
+    init(inbox_settings("block"));
+
+    // One more sender than fits in the inbox reaches the stalled participant.
+    const unsigned int held = INBOX_SIZE + 1;
+    StalledParticipant *stalled = new StalledParticipant();
+    ObserverParticipant *observer = new ObserverParticipant(held);
+    std::vector<SenderParticipant*> senders;
+    for(unsigned int i = 0; i <= held; ++i) {
+        senders.push_back(new SenderParticipant(i));
+    }
+    SenderParticipant *other = senders.back();
+
+    std::unique_lock<ParticipantLock> stall(stalled->lock);
+
+    for(unsigned int i = 0; i < held; ++i) {
+        senders[i]->send(STALLED_CHANNEL);
+        senders[i]->send(OBSERVER_CHANNEL);
+    }
+    for(unsigned int i = 0; i < MESSAGES; ++i) {
+        other->send(OBSERVER_CHANNEL);
+    }
+    if(!wait_until([&] { return observer->received == MESSAGES; })) {
+        return fail("a full inbox delayed routing to another participant");
+    }
+
+    bool full = false;
+    for(const auto& it : MessageDirector::singleton.inbox_stats()) {
+        full = full || it.blocked > 0;
+    }
+    if(!full) {
+        return fail("the stalled participant's inbox never filled up");
+    }
+
+    // Nothing can happen until it's let go, so the routing thread shouldn't be busy.
+    std::clock_t start = std::clock();
+    std::this_thread::sleep_for(std::chrono::milliseconds(STALL_MS));
+    double cpu_ms = 1000.0 * (std::clock() - start) / CLOCKS_PER_SEC;
+    if(cpu_ms > STALL_CPU_MS) {
+        std::stringstream why;
+        why << "routing used " << cpu_ms << "ms of CPU in " << STALL_MS
+            << "ms while a full inbox was held";
+        return fail(why.str());
+    } else if(observer->from_held != 0 || stalled->received != 0) {
+        return fail("a datagram got past a stalled participant");
+    }
+
+    // Letting go of it is enough for everything waiting on it to be handled.
+    stall.unlock();
+    if(!wait_until([&] { return stalled->received == held; })) {
+        return fail("a stalled participant wasn't drained once it was let go");
+    } else if(!wait_until([&] { return observer->from_held == held; })) {
+        return fail("a sender was still held after its receiver caught up");
+    } else if(stalled->overflowed) {
+        return fail("a full inbox overflowed under the block policy");
+    }
+
+    return 0;
+}
+
+static int test_spill()
+{
+    std::stringstream settings;
+    settings << "    queue_size: " << SPILL_QUEUE_SIZE << "\n"
+             << "    spill_limit: " << SPILL_LIMIT << "\n";
+    init(settings.str());
+
+    GatedParticipant *gated = new GatedParticipant();
+    SenderParticipant *sender = new SenderParticipant(0);
+
+    // The routing thread gets stuck on the first datagram, while the sender keeps going.
+    std::unique_lock<std::mutex> stall(gated->gate);
+    std::atomic<unsigned int> sent {0};
+    std::thread producer([&] {
+        for(unsigned int i = 0; i < MESSAGES; ++i) {
+            sender->send(STALLED_CHANNEL);
+            sent.fetch_add(1);
+        }
+    });
+
+    // It should be made to wait, instead of spilling everything.
+    bool waited = wait_until([] { return MessageDirector::singleton.queue_stats().spill_waits > 0; });
+    MDQueueStats stats = MessageDirector::singleton.queue_stats();
+    if(!waited || sent == MESSAGES) {
+        stall.unlock();
+        producer.join();
+        return fail("a producer wasn't held back by the spill limit");
+    } else if(stats.spilled > SPILL_LIMIT) {
+        stall.unlock();
+        producer.join();
+        std::stringstream why;
+        why << stats.spilled << " tasks spilled, past the limit of " << SPILL_LIMIT;
+        return fail(why.str());
+    }
+
+    // Once the routing thread gets going again, so does the producer.
+    stall.unlock();
+    producer.join();
+    if(!wait_until([&] { return gated->received == MESSAGES; })) {
+        return fail("datagrams went missing after waiting for room");
+    } else if(MessageDirector::singleton.queue_stats().spilled != 0) {
+        return fail("spilled tasks were left behind");
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    g_main_thread_id = std::this_thread::get_id();
+    g_logger.reset(new Logger("", LSEVERITY_ERROR));
+
+    std::string mode = argc > 1 ? argv[1] : "disconnect";
+    int result;
+    if(mode == "disconnect") {
+        result = test_disconnect();
+    } else if(mode == "block") {
+        result = test_block();
+    } else if(mode == "spill") {
+        result = test_spill();
+    } else {
+        std::cerr << "Usage: md_stall_test [disconnect|block|spill]" << std::endl;
+        return 2;
+    }
+
+    if(result == 0) {
+        std::cout << "ok" << std::endl;
+    }
+    return result;
+}
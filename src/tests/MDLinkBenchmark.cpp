@@ -0,0 +1,156 @@
+// MDLinkBenchmark measures the cost of sending datagrams over an MD-to-MD link: a
+// NetworkClient sending to another over loopback TCP, fed by a producer thread the way
+// routing threads feed a Message Director's links.
+//
+// Usage: link_bench [corked] [messages] [linger_us] [burst] [gap_us] [payload]
+//     The producer sends "burst" datagrams back to back, then pauses for gap_us, so
+//     that the link sees traffic in bursts (as when a routing thread drains a batch)
+//     rather than either a trickle or a flood.
+//
+// Besides throughput, it reports the read and write system calls made per datagram
+// (both ends, as counted by /proc/self/io), which is what corking is meant to cut, and
+// the main loop's TaskQueue counters, through which an uncorked link's sends reach it.
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "core/global.h"
+#include "net/NetworkClient.h"
+#include "util/TaskQueue.h"
+
+// syscalls returns the number of read and write system calls made by this process.
+static uint64_t syscalls()
+{
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value, total = 0;
+    while(io >> key >> value) {
+        if(key == "syscr:" || key == "syscw:") {
+            total += value;
+        }
+    }
+    return total;
+}
+
+class BenchHandler : public NetworkHandler
+{
+  public:
+    BenchHandler(uint64_t expected) : m_expected(expected)
+    {
+    }
+
+    std::atomic<uint64_t> received {0};
+
+  protected:
+    virtual void initialize()
+    {
+    }
+
+    virtual void receive_datagram(DatagramHandle)
+    {
+        if(received.fetch_add(1, std::memory_order_relaxed) + 1 == m_expected) {
+            g_loop->stop();
+        }
+    }
+
+    virtual void receive_disconnect(const uvw::ErrorEvent &evt)
+    {
+        std::cerr << "Link lost: " << evt.what() << std::endl;
+        g_loop->stop();
+    }
+
+  private:
+    uint64_t m_expected;
+};
+
+static unsigned long arg_or(int argc, char *argv[], int index, unsigned long def)
+{
+    return argc > index ? std::stoul(argv[index]) : def;
+}
+
+int main(int argc, char *argv[])
+{
+    bool corked = arg_or(argc, argv, 1, 1) != 0;
+    unsigned long messages = arg_or(argc, argv, 2, 1000000);
+    unsigned long linger = arg_or(argc, argv, 3, 0);
+    unsigned long burst = arg_or(argc, argv, 4, 16);
+    unsigned long gap = arg_or(argc, argv, 5, 50);
+    unsigned long payload = arg_or(argc, argv, 6, 32);
+
+    g_main_thread_id = std::this_thread::get_id();
+    g_logger.reset(new Logger("", LSEVERITY_WARNING));
+    g_loop = uvw::Loop::getDefault();
+    TaskQueue::singleton.init_queue();
+
+    BenchHandler sink_handler(messages);
+    BenchHandler source_handler(0);
+    auto sink = std::make_shared<NetworkClient>(&sink_handler);
+    auto source = std::make_shared<NetworkClient>(&source_handler);
+
+    auto listener = g_loop->resource<uvw::TcpHandle>();
+    listener->once<uvw::ListenEvent>([&](const uvw::ListenEvent&, uvw::TcpHandle &srv) {
+        auto socket = g_loop->resource<uvw::TcpHandle>();
+        srv.accept(*socket);
+        sink->initialize(socket);
+        srv.close();
+    });
+    listener->bind("127.0.0.1", 0);
+    listener->listen();
+
+    auto connection = g_loop->resource<uvw::TcpHandle>();
+    connection->once<uvw::ConnectEvent>([&](const uvw::ConnectEvent&, uvw::TcpHandle &) {
+        source->initialize(connection);
+        source->set_corked(corked, linger);
+        g_loop->stop();
+    });
+    connection->connect(listener->sock().ip, listener->sock().port);
+    g_loop->run();
+
+    uint64_t syscalls_before = syscalls();
+    auto start = std::chrono::steady_clock::now();
+
+    // The producer stands in for a routing thread.
+    std::thread producer([&]() {
+        for(unsigned long n = 0; n < messages; ++n) {
+            DatagramPtr dg = Datagram::create(4000, 5000, 0);
+            dg->add_uint64(n);
+            dg->add_data(std::string(payload, 'x'));
+            source->send_datagram(dg);
+
+            if(gap > 0 && (n + 1) % burst == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(gap));
+            }
+        }
+    });
+
+    g_loop->run();
+    producer.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    uint64_t calls = syscalls() - syscalls_before;
+    TaskQueueStats tasks = TaskQueue::singleton.stats();
+
+    std::cout << "corked=" << corked
+              << " linger_us=" << linger
+              << " messages=" << messages
+              << " burst=" << burst
+              << " gap_us=" << gap
+              << " payload=" << payload
+              << " elapsed=" << elapsed.count() << "s"
+              << " rate=" << uint64_t(messages / elapsed.count()) << "/s"
+              << " syscalls=" << calls
+              << " syscalls_per_message=" << double(calls) / messages
+              << " tasks=" << tasks.enqueued
+              << " task_wakeups=" << tasks.wakeups
+              << " tasks_allocated=" << tasks.allocated
+              << " max_drain_us=" << tasks.max_drain_ns / 1000
+              << " max_task_us=" << tasks.max_task_ns / 1000
+              << std::endl;
+
+    source->disconnect();
+    sink->disconnect();
+    return sink_handler.received == messages ? 0 : 1;
+}
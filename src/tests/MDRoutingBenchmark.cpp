@@ -0,0 +1,207 @@
+// MDRoutingBenchmark measures MessageDirector routing throughput between in-process
+// participants, so that the single routing thread can be compared against
+// messagedirector/threads: N.
+//
+// Usage: md_bench [threads] [messages] [work] [participants] [producers]
+//     "work" is the number of hashing rounds each handle_datagram performs over the
+//     payload, standing in for the cost of a real participant's message handler.
+//
+// Besides throughput, every receiver checks that datagrams from each sender arrive in
+// order and that it is never entered by two threads at once, and every allocation
+// made on a routing thread after its first delivery is counted.
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/global.h"
+#include "messagedirector/MessageDirector.h"
+
+static const channel_t BENCH_BASE_CHANNEL = 1000000;
+
+static std::atomic<uint64_t> order_violations(0);
+static std::atomic<uint64_t> concurrent_entries(0);
+
+// Set on routing threads once they have delivered a datagram.
+static thread_local bool count_allocations = false;
+static std::atomic<uint64_t> routing_allocations(0);
+
+void *operator new(size_t size)
+{
+    if(count_allocations) {
+        routing_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    void *ptr = std::malloc(size ? size : 1);
+    if(ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+class BenchParticipant : public MDParticipantInterface
+{
+  public:
+    BenchParticipant(unsigned int index, unsigned int participants, unsigned int work) :
+        m_index(index), m_work(work), m_last_seq(participants, 0)
+    {
+        subscribe_channel(BENCH_BASE_CHANNEL + index);
+    }
+
+    virtual void handle_datagram(DatagramHandle, DatagramIterator &dgi)
+    {
+        count_allocations = true;
+        if(m_in_handler.exchange(true)) {
+            concurrent_entries.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        dgi.skip(sizeof(channel_t) + sizeof(uint16_t)); // sender, msgtype
+        uint32_t sender = dgi.read_uint32();
+        uint64_t seq = dgi.read_uint64();
+        if(seq <= m_last_seq[sender]) {
+            order_violations.fetch_add(1, std::memory_order_relaxed);
+        }
+        m_last_seq[sender] = seq;
+
+        // Simulated handler cost.
+        uint64_t hash = 14695981039346656037ULL;
+        for(unsigned int round = 0; round < m_work; ++round) {
+            hash = (hash ^ (seq + round)) * 1099511628211ULL;
+        }
+        m_sink = hash;
+
+        m_in_handler = false;
+        m_received.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    inline void send(unsigned int to, uint64_t seq)
+    {
+        // The MessageDirector doesn't echo datagrams back to their sender.
+        if(to == m_index) {
+            to = (to + 1) % m_last_seq.size();
+        }
+
+        DatagramPtr dg = Datagram::create(BENCH_BASE_CHANNEL + to, BENCH_BASE_CHANNEL + m_index, 0);
+        dg->add_uint32(m_index);
+        dg->add_uint64(seq);
+        route_datagram(dg);
+    }
+
+    inline uint64_t received() const
+    {
+        return m_received.load(std::memory_order_relaxed);
+    }
+
+  private:
+    unsigned int m_index;
+    unsigned int m_work;
+    std::vector<uint64_t> m_last_seq;
+    std::atomic<bool> m_in_handler {false};
+    std::atomic<uint64_t> m_received {0};
+    volatile uint64_t m_sink = 0;
+};
+
+static unsigned long arg_or(int argc, char *argv[], int index, unsigned long def)
+{
+    return argc > index ? std::stoul(argv[index]) : def;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long threads = arg_or(argc, argv, 1, 1);
+    unsigned long messages = arg_or(argc, argv, 2, 2000000);
+    unsigned long work = arg_or(argc, argv, 3, 200);
+    unsigned long participants = arg_or(argc, argv, 4, 64);
+    unsigned long producers = arg_or(argc, argv, 5, 4);
+
+    if(participants < producers || producers == 0) {
+        std::cerr << "Need at least one participant per producer." << std::endl;
+        return 1;
+    }
+
+    g_main_thread_id = std::this_thread::get_id();
+    g_logger.reset(new Logger("", LSEVERITY_WARNING));
+
+    std::stringstream config;
+    config << "messagedirector:\n"
+           << "    threaded: true\n"
+           << "    threads: " << threads << "\n";
+    g_config->load(config);
+
+    MessageDirector::singleton.init_network();
+
+    std::vector<BenchParticipant*> bench;
+    for(unsigned int i = 0; i < participants; ++i) {
+        bench.push_back(new BenchParticipant(i, participants, work));
+    }
+
+    // Each producer thread sends on behalf of its own slice of the participants,
+    // so that each sender's sequence numbers are issued in order.
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> producer_threads;
+    for(unsigned int t = 0; t < producers; ++t) {
+        producer_threads.emplace_back([&, t]() {
+            std::vector<BenchParticipant*> senders;
+            for(unsigned int i = t; i < participants; i += producers) {
+                senders.push_back(bench[i]);
+            }
+
+            std::mt19937 gen(t);
+            std::uniform_int_distribution<unsigned int> dist(0, participants - 1);
+            uint64_t seq = 0;
+            for(unsigned long n = t; n < messages; n += producers) {
+                // Sequence numbers only need to increase per sender, so one counter will do.
+                BenchParticipant *from = senders[n % senders.size()];
+                from->send(dist(gen), ++seq);
+            }
+        });
+    }
+    for(auto& thread : producer_threads) {
+        thread.join();
+    }
+
+    // Wait until every datagram has been handled.
+    uint64_t delivered = 0;
+    while(delivered < messages) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        delivered = 0;
+        for(const auto& p : bench) {
+            delivered += p->received();
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    MDQueueStats stats = MessageDirector::singleton.queue_stats();
+    std::cout << "threads=" << threads
+              << " messages=" << messages
+              << " work=" << work
+              << " participants=" << participants
+              << " producers=" << producers
+              << " elapsed=" << elapsed.count() << "s"
+              << " rate=" << uint64_t(messages / elapsed.count()) << "/s"
+              << " max_batch=" << stats.max_batch
+              << " spills=" << stats.spills
+              << " spill_waits=" << stats.spill_waits
+              << " dispatch_allocations=" << stats.dispatch_allocations
+              << " routing_allocations=" << routing_allocations
+              << " order_violations=" << order_violations
+              << " concurrent_entries=" << concurrent_entries
+              << std::endl;
+
+    return (order_violations == 0 && concurrent_entries == 0) ? 0 : 1;
+}
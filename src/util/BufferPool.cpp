@@ -0,0 +1,160 @@
+#include "BufferPool.h"
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+constexpr size_t BufferPool::MIN_SIZE;
+constexpr size_t BufferPool::MAX_SIZE;
+
+// One size class per power of two from MIN_SIZE to MAX_SIZE.
+static const size_t NUM_CLASSES = 11;
+// How many bytes of each size class a thread keeps for itself, and the depot keeps for everyone.
+static const size_t THREAD_CACHE_BYTES = 64 * 1024;
+static const size_t DEPOT_BYTES = 4 * 1024 * 1024;
+
+static inline size_t class_of(size_t size)
+{
+    size_t cls = 0;
+    for(size_t capacity = BufferPool::MIN_SIZE; capacity < size; capacity <<= 1) {
+        ++cls;
+    }
+    return cls;
+}
+
+static inline size_t class_size(size_t cls)
+{
+    return BufferPool::MIN_SIZE << cls;
+}
+
+// A FreeList is a stack of free buffers of one class, linked through the buffers themselves.
+struct FreeList {
+    struct Node {
+        Node *next;
+    };
+
+    Node *head = nullptr;
+    size_t count = 0;
+
+    inline void push(uint8_t *buf)
+    {
+        Node *node = reinterpret_cast<Node*>(buf);
+        node->next = head;
+        head = node;
+        ++count;
+    }
+
+    inline uint8_t* pop()
+    {
+        Node *node = head;
+        head = node->next;
+        --count;
+        return reinterpret_cast<uint8_t*>(node);
+    }
+
+    inline void free_all()
+    {
+        while(head != nullptr) {
+            delete [] pop();
+        }
+    }
+};
+
+static inline size_t thread_limit(size_t cls)
+{
+    return std::max<size_t>(8, THREAD_CACHE_BYTES / class_size(cls));
+}
+
+// The Depot holds whole FreeLists from the threads' caches, so that exchanging buffers
+//     with it costs one lock and a couple of pointers, no matter how many there are.
+class Depot
+{
+  public:
+    // take replaces an (empty) list with one from the depot, if it has any.
+    void take(size_t cls, FreeList &to)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if(!m_lists[cls].empty()) {
+            to = m_lists[cls].back();
+            m_lists[cls].pop_back();
+        }
+    }
+
+    // give hands a list over to the depot, leaving it empty.  If the depot is full, the list is freed.
+    void give(size_t cls, FreeList &from)
+    {
+        FreeList list = from;
+        from = FreeList();
+
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if(m_lists[cls].size() * thread_limit(cls) * class_size(cls) < DEPOT_BYTES) {
+                m_lists[cls].push_back(list);
+                return;
+            }
+        }
+
+        list.free_all();
+    }
+
+  private:
+    std::mutex m_lock;
+    std::vector<FreeList> m_lists[NUM_CLASSES];
+};
+
+static Depot& depot()
+{
+    // Never destroyed: threads (e.g. the MessageDirector's routing threads) may still
+    //     hand their caches back to it while static objects are being torn down.
+    static Depot *depot = new Depot;
+    return *depot;
+}
+
+struct ThreadCache {
+    FreeList lists[NUM_CLASSES];
+
+    ~ThreadCache()
+    {
+        for(size_t cls = 0; cls < NUM_CLASSES; ++cls) {
+            if(lists[cls].head != nullptr) {
+                depot().give(cls, lists[cls]);
+            }
+        }
+    }
+};
+
+static thread_local ThreadCache cache;
+
+uint8_t* BufferPool::allocate(size_t &size)
+{
+    if(size > MAX_SIZE) {
+        return new uint8_t[size];
+    }
+
+    size_t cls = class_of(size);
+    size = class_size(cls);
+
+    FreeList &list = cache.lists[cls];
+    if(list.head == nullptr) {
+        depot().take(cls, list);
+        if(list.head == nullptr) {
+            return new uint8_t[size];
+        }
+    }
+    return list.pop();
+}
+
+void BufferPool::release(uint8_t *buf, size_t size)
+{
+    if(size > MAX_SIZE || size < MIN_SIZE || (size & (size - 1)) != 0) {
+        delete [] buf;
+        return;
+    }
+
+    size_t cls = class_of(size);
+    FreeList &list = cache.lists[cls];
+    if(list.count >= thread_limit(cls)) {
+        // Our cache is full; pass it on to whichever thread is allocating these.
+        depot().give(cls, list);
+    }
+    list.push(buf);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// The BufferPool hands out the buffers behind Datagrams.  Buffer sizes are rounded up to
+//     a power of two (from MIN_SIZE to MAX_SIZE), and freed buffers are kept for reuse,
+//     first in a small cache belonging to the freeing thread, and then in a shared depot
+//     which the threads exchange whole batches of buffers with.  Buffers are often
+//     allocated on one thread (e.g. a network thread) and freed on another (e.g. a routing
+//     thread), and the depot is what carries them back.
+//
+// Larger buffers are not pooled, but are still safe to allocate and release through here.
+// Pooled buffers are plain new[] allocations, so a buffer from elsewhere may also be given
+//     to release() as long as its size is given correctly.
+class BufferPool
+{
+  public:
+    static constexpr size_t MIN_SIZE = 64;
+    static constexpr size_t MAX_SIZE = 65536;
+
+    // allocate returns a buffer of at least size bytes, and sets size to its actual capacity.
+    static uint8_t* allocate(size_t &size);
+    // release returns a buffer to the pool; size must be the capacity allocate gave it.
+    static void release(uint8_t *buf, size_t size);
+
+    // size_for returns the capacity allocate would give a request for size bytes.
+    static inline size_t size_for(size_t size)
+    {
+        if(size > MAX_SIZE) {
+            return size;
+        }
+
+        size_t capacity = MIN_SIZE;
+        while(capacity < size) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+};
@@ -1,4 +1,9 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <new>
 #include <unordered_set>
 #include <string>
 #include <vector>
@@ -7,8 +12,11 @@
 #include <stdexcept>
 #include <string.h> // memcpy
 #include <memory>
+#include <type_traits>
+#include <utility>
 #include "core/types.h"
 #include "dclass/util/byteorder.h"
+#include "util/BufferPool.h"
 
 #ifdef ASTRON_32BIT_DATAGRAMS
 typedef uint32_t dgsize_t;
@@ -20,8 +28,153 @@ typedef uint16_t dgsize_t;
 
 
 class Datagram; // foward declaration
-typedef std::shared_ptr<Datagram> DatagramPtr;
-typedef std::shared_ptr<const Datagram> DatagramHandle;
+template<typename T> class DatagramRef;
+typedef DatagramRef<Datagram> DatagramPtr;
+typedef DatagramRef<const Datagram> DatagramHandle;
+
+// A DatagramRef is a reference-counted pointer to a Datagram, which is what Datagram::create
+//     hands out.  It behaves like the std::shared_ptr it replaces (DatagramPtr and DatagramHandle
+//     used to be shared_ptrs), but the count lives in the Datagram itself, so there's no separate
+//     control block to allocate.  Moving a DatagramRef doesn't touch the count at all, so pass
+//     them along with std::move wherever the caller is done with its reference.
+template<typename T>
+class DatagramRef
+{
+  public:
+    DatagramRef() noexcept : m_ptr(nullptr)
+    {
+    }
+    DatagramRef(std::nullptr_t) noexcept : m_ptr(nullptr)
+    {
+    }
+    DatagramRef(const DatagramRef &other) noexcept : m_ptr(other.m_ptr)
+    {
+        retain();
+    }
+    DatagramRef(DatagramRef &&other) noexcept : m_ptr(other.m_ptr)
+    {
+        other.m_ptr = nullptr;
+    }
+    // A DatagramPtr converts to a DatagramHandle, but not the other way around.
+    template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    DatagramRef(const DatagramRef<U> &other) noexcept : m_ptr(other.m_ptr)
+    {
+        retain();
+    }
+    template<typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    DatagramRef(DatagramRef<U> &&other) noexcept : m_ptr(other.m_ptr)
+    {
+        other.m_ptr = nullptr;
+    }
+
+    ~DatagramRef()
+    {
+        release();
+    }
+
+    DatagramRef& operator=(const DatagramRef &other) noexcept
+    {
+        DatagramRef(other).swap(*this);
+        return *this;
+    }
+    DatagramRef& operator=(DatagramRef &&other) noexcept
+    {
+        DatagramRef(std::move(other)).swap(*this);
+        return *this;
+    }
+    DatagramRef& operator=(std::nullptr_t) noexcept
+    {
+        reset();
+        return *this;
+    }
+
+    inline T* get() const noexcept
+    {
+        return m_ptr;
+    }
+    inline T& operator*() const noexcept
+    {
+        return *m_ptr;
+    }
+    inline T* operator->() const noexcept
+    {
+        return m_ptr;
+    }
+    inline explicit operator bool() const noexcept
+    {
+        return m_ptr != nullptr;
+    }
+
+    inline void reset() noexcept
+    {
+        release();
+        m_ptr = nullptr;
+    }
+    inline void swap(DatagramRef &other) noexcept
+    {
+        std::swap(m_ptr, other.m_ptr);
+    }
+
+    // use_count returns the number of references to the datagram (0 if there is none).
+    long use_count() const noexcept;
+
+  private:
+    template<typename U> friend class DatagramRef;
+    friend class Datagram;
+
+    // Takes over a reference which has already been counted.
+    struct adopt_t {};
+    DatagramRef(T *ptr, adopt_t) noexcept : m_ptr(ptr)
+    {
+    }
+
+    inline void retain() noexcept;
+    inline void release() noexcept;
+
+    T *m_ptr;
+};
+
+template<typename T, typename U>
+inline bool operator==(const DatagramRef<T> &a, const DatagramRef<U> &b) noexcept
+{
+    return a.get() == b.get();
+}
+template<typename T, typename U>
+inline bool operator!=(const DatagramRef<T> &a, const DatagramRef<U> &b) noexcept
+{
+    return a.get() != b.get();
+}
+template<typename T>
+inline bool operator==(const DatagramRef<T> &a, std::nullptr_t) noexcept
+{
+    return a.get() == nullptr;
+}
+template<typename T>
+inline bool operator==(std::nullptr_t, const DatagramRef<T> &a) noexcept
+{
+    return a.get() == nullptr;
+}
+template<typename T>
+inline bool operator!=(const DatagramRef<T> &a, std::nullptr_t) noexcept
+{
+    return a.get() != nullptr;
+}
+template<typename T>
+inline bool operator!=(std::nullptr_t, const DatagramRef<T> &a) noexcept
+{
+    return a.get() != nullptr;
+}
+
+namespace std
+{
+template<typename T>
+struct hash<DatagramRef<T>> {
+    size_t operator()(const DatagramRef<T> &ref) const noexcept
+    {
+        return hash<T*>()(ref.get());
+    }
+};
+}
 
 // A DatagramOverflow is an exception which occurs when an add_<value> method is called which would
 // increase the size of the datagram past DGSIZE_MAX (preventing integer and buffer overflow).
@@ -34,12 +187,23 @@ class DatagramOverflow : public std::runtime_error
 // A Datagram is a buffer of binary data ready for networking (ie. formatted according to Astron's
 // over-the-wire formatting specification).  It is most often used to represent Astron client and
 // server messages, as well as occasionally DistributedObject field data.
+//
+// Datagrams are only made by the create functions, which allocate the Datagram, its reference
+// count and (unless it's very large) room for its data as a single block from the BufferPool.
+// The data only moves out to a buffer of its own if the datagram outgrows that room.
 class Datagram
 {
   protected:
     uint8_t* buf;
     size_t buf_cap; // Can be larger than buf_offset, so use a size_t
     dgsize_t buf_offset;
+    size_t buf_headroom; // Free room in front of buf, for a header to be prepended into.
+    mutable std::atomic<uint32_t> ref_count;
+    size_t block_size; // The size of the block this Datagram was allocated in.
+    // buf_owner is set if buf belongs to something else (see create_view), and keeps it alive.
+    std::shared_ptr<const void> buf_owner;
+    // buf_parent is set instead if buf is part of another datagram's data (see create_view).
+    DatagramHandle buf_parent;
 
     void check_add_length(dgsize_t len)
     {
@@ -51,158 +215,265 @@ class Datagram
         }
 
         if(buf_offset + len > buf_cap) {
-            uint8_t *tmp_buf = new uint8_t[buf_cap + len + 64];
-            memcpy(tmp_buf, buf, buf_cap);
-            delete [] buf;
-            buf = tmp_buf;
-            buf_cap = buf_cap + len + 64;
+            // Grow geometrically, so that building up a large datagram doesn't copy it over and over.
+            grow(std::max<size_t>(buf_offset + len, buf_cap * 2));
         }
     }
-    // default-constructor:
-    //     creates a new datagram with some pre-allocated space
-    Datagram() : buf(new uint8_t[64]), buf_cap(64), buf_offset(0)
+
+    // grow moves the datagram's data into a new buffer with room for at least capacity bytes,
+    //     keeping the same headroom in front of it.
+    void grow(size_t capacity)
     {
+        size_t headroom = buf_headroom;
+        size_t block = headroom + capacity;
+        uint8_t *tmp_buf = BufferPool::allocate(block);
+        memcpy(tmp_buf + headroom, buf, buf_offset);
+        release_buffer();
+        buf = tmp_buf + headroom;
+        buf_cap = block - headroom;
+        buf_headroom = headroom;
     }
 
-    /*
-    // TODO: Deal with overload collision with Datagram(uint16_t message_type)
-
-    // sized-constructor:
-    //     allows you to specify the capacity of the datagram ahead of time,
-    //     this should be used when the exact size is known ahead of time for performance
-    Datagram(dgsize_t capacity) : buf(new uint8_t[capacity]), buf_cap(capacity),
-    	buf_offset(0)
+    // add_headroom makes room for length more bytes at the front of the datagram, and returns
+    //     a pointer to them.  If there isn't enough headroom, the data is moved along to make some.
+    uint8_t* add_headroom(dgsize_t length)
     {
+        if(buf_offset + length > DGSIZE_MAX) {
+            std::stringstream err_str;
+            err_str << "dg tried to prepend data past max datagram size, buf_offset+len("
+                    << buf_offset + length << ")" << " max_size(" << DGSIZE_MAX << ")" << std::endl;
+            throw DatagramOverflow(err_str.str());
+        }
+
+        if(length > buf_headroom) {
+            size_t block = length + std::max<size_t>(buf_cap, buf_offset);
+            uint8_t *tmp_buf = BufferPool::allocate(block);
+            memcpy(tmp_buf + length, buf, buf_offset);
+            release_buffer();
+            buf = tmp_buf + length;
+            buf_cap = block - length;
+            buf_headroom = length;
+        }
+
+        buf -= length;
+        buf_cap += length;
+        buf_headroom -= length;
+        buf_offset += length;
+        return buf;
     }
-    */
 
-    // copy-constructor:
-    //     creates a new datagram which is a deep-copy of another datagram;
-    //     capacity is not perserved and instead is reduced to the size of the source datagram.
-    Datagram(const Datagram &dg) : buf(new uint8_t[dg.size()]), buf_cap(dg.size()),
-        buf_offset(dg.size())
+    // release_buffer lets go of buf, unless it's the room allocated along with the datagram.
+    void release_buffer()
     {
-        memcpy(buf, dg.buf, dg.size());
+        uint8_t *base = buf - buf_headroom;
+        if(buf_owner) {
+            buf_owner.reset();
+        } else if(buf_parent) {
+            buf_parent.reset();
+        } else if(base != inline_data()) {
+            BufferPool::release(base, buf_cap + buf_headroom);
+        }
+        buf_headroom = 0;
     }
 
-    // shallow-constructor:
-    //     creates a new datagram that uses an existing buffer as its data
-    Datagram(uint8_t *data, dgsize_t length, dgsize_t capacity) : buf(data),
-        buf_cap(capacity), buf_offset(length)
+    inline uint8_t* inline_data()
     {
+        return reinterpret_cast<uint8_t*>(this) + sizeof(Datagram);
     }
 
-    // binary-constructor(pointer):
-    //     creates a new datagram with a copy of the data contained at the pointer.
-    Datagram(const uint8_t *data, dgsize_t length) : buf(new uint8_t[length]), buf_cap(length),
-        buf_offset(length)
+    // The room allocated along with a datagram is limited, so that the blocks stay poolable.
+    static constexpr size_t MAX_INLINE_BLOCK = BufferPool::MAX_SIZE;
+
+    // block-constructor:
+    //     creates an empty datagram at the start of a block of block_size bytes,
+    //     using the rest of the block for its data.
+    Datagram(size_t block_size) : buf(inline_data()), buf_cap(block_size - sizeof(Datagram)),
+        buf_offset(0), buf_headroom(0), ref_count(1), block_size(block_size)
     {
-        memcpy(buf, data, length);
     }
 
-    // binary-constructor(vector):
-    //     creates a new datagram with a copy of the binary data contained in a vector<uint8_t>.
-    Datagram(const std::vector<uint8_t> &data) : buf(new uint8_t[data.size()]),
-        buf_cap(data.size()), buf_offset(data.size())
+    Datagram(const Datagram&) = delete;
+    Datagram& operator=(const Datagram&) = delete;
+
+    ~Datagram()
     {
-        memcpy(buf, &data[0], data.size());
+        release_buffer();
     }
 
-    // binary-constructor(string):
-    //     creates a new datagram with a copy of the data contained in a string, treated as binary.
-    Datagram(const std::string &data) : buf(new uint8_t[data.length()]), buf_cap(data.length()),
-        buf_offset(data.length())
+    // make allocates a new, empty datagram with room for at least capacity bytes.
+    static DatagramPtr make(size_t capacity)
     {
-        memcpy(buf, data.c_str(), data.length());
+        size_t block = sizeof(Datagram) + capacity;
+        if(block > MAX_INLINE_BLOCK) {
+            // Give the data a buffer of its own, instead of allocating an unpoolable block.
+            block = sizeof(Datagram);
+        }
+
+        uint8_t *mem = BufferPool::allocate(block);
+        Datagram *dg = new (mem) Datagram(block);
+        if(dg->buf_cap < capacity) {
+            dg->grow(capacity);
+        }
+        return DatagramPtr(dg, DatagramPtr::adopt_t());
     }
 
-    // server-header-constructor(single-receiver):
-    //     creates a new datagram initialized with a server header (accepts only 1 receiver).
-    Datagram(channel_t to_channel, channel_t from_channel, uint16_t message_type) :
-        buf(new uint8_t[64]), buf_cap(64), buf_offset(0)
+    template<typename T> friend class DatagramRef;
+
+    inline void ref() const noexcept
     {
-        add_server_header(to_channel, from_channel, message_type);
+        ref_count.fetch_add(1, std::memory_order_relaxed);
     }
 
-    // server-header-constructor(multi-target):
-    //     creates a new datagram initialized with a server header (accepts a set of receivers)
-    Datagram(const std::unordered_set<channel_t> &to_channels, channel_t from_channel,
-             uint16_t message_type) : buf(new uint8_t[64]), buf_cap(64), buf_offset(0)
+    inline void unref() const noexcept
     {
-        add_server_header(to_channels, from_channel, message_type);
+        if(ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            Datagram *self = const_cast<Datagram*>(this);
+            size_t block = block_size;
+            self->~Datagram();
+            BufferPool::release(reinterpret_cast<uint8_t*>(self), block);
+        }
     }
 
-    // control-header constructor:
-    //     creates a new datagram initialized with a control header containing the msgtype.
-    Datagram(uint16_t message_type) : buf(new uint8_t[64]), buf_cap(64), buf_offset(0)
+  public:
+    // create returns a new, empty datagram with some pre-allocated space.
+    static DatagramPtr create()
     {
-        add_control_header(message_type);
+        return make(64);
     }
 
+    // create_with_capacity returns an empty datagram with room for at least capacity bytes.
+    //     This should be used when the size is known ahead of time for performance.
+    static DatagramPtr create_with_capacity(size_t capacity)
+    {
+        return make(capacity);
+    }
 
-  public:
-    static DatagramPtr create()
+    // create_with_headroom returns an empty datagram with room for at least capacity bytes, and
+    //     headroom bytes in front of them.  This lets a payload be built before the header that
+    //     goes in front of it is known (see prepend_server_header), without moving the payload.
+    static DatagramPtr create_with_headroom(size_t headroom, size_t capacity = 64)
     {
-        DatagramPtr dg_ptr(new Datagram);
-        return dg_ptr;
+        DatagramPtr dg = make(headroom + capacity);
+        dg->buf += headroom;
+        dg->buf_cap -= headroom;
+        dg->buf_headroom = headroom;
+        return dg;
     }
 
+    // create(DatagramHandle) returns a new datagram which is a deep-copy of another datagram;
+    //     capacity is not perserved and instead is reduced to the size of the source datagram.
     static DatagramPtr create(DatagramHandle dg)
     {
-        DatagramPtr dg_ptr(new Datagram(*dg.get()));
-        return dg_ptr;
+        return create(dg->get_data(), dg->size());
     }
 
+    // create(uint8_t*, length, capacity) returns a new datagram that uses an existing buffer as its
+    //     data; the datagram takes ownership of the buffer, which must have come from new[] or the
+    //     BufferPool.
     static DatagramPtr create(uint8_t *data, dgsize_t length, dgsize_t capacity)
     {
-        DatagramPtr dg_ptr(new Datagram(data, length, capacity));
-        return dg_ptr;
+        DatagramPtr dg = make(0);
+        dg->buf = data;
+        dg->buf_cap = capacity;
+        dg->buf_offset = length;
+        return dg;
     }
 
+    // create_view returns a new datagram over data which belongs to owner, without copying it;
+    //     the datagram keeps owner alive, and makes its own copy of the data if added to.
+    static DatagramPtr create_view(const uint8_t *data, dgsize_t length,
+                                   std::shared_ptr<const void> owner)
+    {
+        DatagramPtr dg = make(0);
+        dg->buf = const_cast<uint8_t*>(data);
+        dg->buf_cap = length;
+        dg->buf_offset = length;
+        dg->buf_owner = std::move(owner);
+        return dg;
+    }
+
+    // create_view(DatagramHandle, offset, length) returns a new datagram over length bytes of
+    //     another datagram's data, starting at offset, without copying them.  The view keeps the
+    //     parent alive, so it's meant for passing a nested payload along (see
+    //     DatagramIterator::read_datagram_view) rather than for holding on to.
+    static DatagramPtr create_view(DatagramHandle parent, dgsize_t offset, dgsize_t length)
+    {
+        DatagramPtr dg = make(0);
+        dg->buf = const_cast<uint8_t*>(parent->get_data()) + offset;
+        dg->buf_cap = length;
+        dg->buf_offset = length;
+        dg->buf_parent = std::move(parent);
+        return dg;
+    }
+
+    // copy_if_view returns the datagram itself, or a copy of it if it is a view of something
+    //     else's data; this should be used before holding on to a datagram that may be a view.
+    static DatagramHandle copy_if_view(DatagramHandle dg)
+    {
+        if(dg->is_view()) {
+            return create(dg);
+        }
+        return dg;
+    }
+
+    // create(const uint8_t*, length) returns a new datagram with a copy of the data at the pointer.
     static DatagramPtr create(const uint8_t *data, dgsize_t length)
     {
-        DatagramPtr dg_ptr(new Datagram(data, length));
-        return dg_ptr;
+        DatagramPtr dg = make(length);
+        memcpy(dg->buf, data, length);
+        dg->buf_offset = length;
+        return dg;
     }
 
+    // create(vector) returns a new datagram with a copy of the binary data in a vector<uint8_t>.
     static DatagramPtr create(const std::vector<uint8_t> &data)
     {
-        DatagramPtr dg_ptr(new Datagram(data));
-        return dg_ptr;
+        return create(data.data(), data.size());
     }
 
+    // create(string) returns a new datagram with a copy of the data in a string, treated as binary.
     static DatagramPtr create(const std::string &data)
     {
-        DatagramPtr dg_ptr(new Datagram(data));
-        return dg_ptr;
+        return create(reinterpret_cast<const uint8_t*>(data.c_str()), data.length());
     }
 
+    // create(to, from, message_type) returns a new datagram initialized with a server header
+    //     (accepts only 1 receiver).
     static DatagramPtr create(channel_t to_channel, channel_t from_channel,
                               uint16_t message_type)
     {
-        DatagramPtr dg_ptr(new Datagram(to_channel, from_channel, message_type));
-        return dg_ptr;
+        DatagramPtr dg = make(64);
+        dg->add_server_header(to_channel, from_channel, message_type);
+        return dg;
     }
 
+    // create(to_channels, from, message_type) returns a new datagram initialized with a server
+    //     header (accepts a set of receivers).
     static DatagramPtr create(const std::unordered_set<channel_t> &to_channels,
                               channel_t from_channel,
                               uint16_t message_type)
     {
-        DatagramPtr dg_ptr(new Datagram(to_channels, from_channel, message_type));
-        return dg_ptr;
+        DatagramPtr dg = make(64);
+        dg->add_server_header(to_channels, from_channel, message_type);
+        return dg;
     }
 
+    // create(message_type) returns a new datagram initialized with a control header containing
+    //     the msgtype.
     static DatagramPtr create(uint16_t message_type)
     {
-        DatagramPtr dg_ptr(new Datagram(message_type));
-        return dg_ptr;
+        DatagramPtr dg = make(64);
+        dg->add_control_header(message_type);
+        return dg;
     }
 
-
-    // destructor
-    ~Datagram()
+    // reserve makes sure the datagram has room for at least capacity bytes in total,
+    // so that adding up to that much won't need to reallocate.
+    void reserve(size_t capacity)
     {
-        delete [] buf;
+        if(capacity > buf_cap) {
+            grow(capacity);
+        }
     }
 
     // add_bool adds an 8-bit integer to the datagram that is guaranteed
@@ -455,6 +726,28 @@ class Datagram
         add_uint16(message_type);
     }
 
+    // server_header_size returns the size of a server header with num_targets receivers;
+    //     server_header_size(1) is the headroom needed to prepend an ordinary server header.
+    static constexpr size_t server_header_size(size_t num_targets)
+    {
+        return sizeof(uint8_t) + (num_targets + 1) * sizeof(channel_t) + sizeof(uint16_t);
+    }
+
+    // prepend_server_header writes a server header (see add_server_header) in front of the data
+    //     already in the datagram.  This is done in place if the datagram has enough headroom,
+    //     otherwise the data has to be moved along to make room.
+    void prepend_server_header(channel_t to, channel_t from, uint16_t message_type)
+    {
+        uint8_t *header = add_headroom(server_header_size(1));
+        *(uint8_t *)header = 1;
+        header += sizeof(uint8_t);
+        *(channel_t *)header = swap_le(to);
+        header += sizeof(channel_t);
+        *(channel_t *)header = swap_le(from);
+        header += sizeof(channel_t);
+        *(uint16_t *)header = swap_le(message_type);
+    }
+
     // add_control_header prepends a header for control messages that are handled by a
     // MessageDirector instance. The method is provided entirely for convenience.
     //
@@ -478,14 +771,42 @@ class Datagram
     // cap returns the currently allocated size of the datagram in memory (ie. capacity).
     // Note: the datagram handles resizing automatically so this method is primarily available
     //       for debugging, and possible performance considerations.
-    dgsize_t cap() const
+    size_t cap() const
     {
         return buf_cap;
     }
 
+    // is_view returns true if the datagram's data belongs to something else (see create_view).
+    bool is_view() const
+    {
+        return buf_owner || buf_parent;
+    }
+
     // get_data returns a pointer to the start of the Datagram's data buffer.
     const uint8_t* get_data() const
     {
         return buf;
     }
 };
+
+template<typename T>
+inline void DatagramRef<T>::retain() noexcept
+{
+    if(m_ptr != nullptr) {
+        m_ptr->ref();
+    }
+}
+
+template<typename T>
+inline void DatagramRef<T>::release() noexcept
+{
+    if(m_ptr != nullptr) {
+        m_ptr->unref();
+    }
+}
+
+template<typename T>
+long DatagramRef<T>::use_count() const noexcept
+{
+    return m_ptr != nullptr ? m_ptr->ref_count.load(std::memory_order_relaxed) : 0;
+}
@@ -32,19 +32,21 @@ class DatagramIterator
   protected:
     DatagramHandle m_dg;
     dgsize_t m_offset;
+    dgsize_t m_end; // Where reading stops; the end of the datagram, except in a sub-iterator.
 
     void check_read_length(dgsize_t length)
     {
-        if(m_offset + length > m_dg->size()) {
+        if(m_offset + length > m_end) {
             std::stringstream error;
             error << "dgi tried to read past dg end, offset+length(" << m_offset + length << ")"
-                  << " buf_size(" << m_dg->size() << ")" << std::endl;
+                  << " buf_size(" << m_end << ")" << std::endl;
             throw DatagramIteratorEOF(error.str());
         };
     }
   public:
     // constructor
-    DatagramIterator(DatagramHandle dg, dgsize_t offset = 0) : m_dg(dg), m_offset(offset)
+    DatagramIterator(DatagramHandle dg, dgsize_t offset = 0) : m_dg(dg), m_offset(offset),
+        m_end(dg->size())
     {
         check_read_length(0); //shortcuts, yay
     }
@@ -215,7 +217,36 @@ class DatagramIterator
     DatagramPtr read_datagram()
     {
         dgsize_t length = read_size();
-        return Datagram::create(m_dg->get_data() + m_offset, length);
+        check_read_length(length);
+        DatagramPtr dg = Datagram::create(m_dg->get_data() + m_offset, length);
+        m_offset += length;
+        return dg;
+    }
+
+    // read_datagram_view reads a blob from the datagram and returns it as a view of this datagram's
+    //     data, rather than a copy.  Prefer it to read_datagram for payloads that are only being
+    //     passed along; see Datagram::create_view.
+    DatagramHandle read_datagram_view()
+    {
+        dgsize_t length = read_size();
+        check_read_length(length);
+        DatagramHandle dg = Datagram::create_view(m_dg, m_offset, length);
+        m_offset += length;
+        return dg;
+    }
+
+    // read_sub_iterator reads a blob from the datagram and returns an iterator over just its
+    //     bytes, which can't read past the end of the blob.  Nothing is copied or allocated, so
+    //     it's the cheapest way to go through many small messages packed into one datagram.
+    //     Offsets (tell, seek) are still those of the whole datagram.
+    DatagramIterator read_sub_iterator()
+    {
+        dgsize_t length = read_size();
+        check_read_length(length);
+        DatagramIterator sub(*this);
+        sub.m_end = m_offset + length;
+        m_offset += length;
+        return sub;
     }
 
     // read_data returns the next <length> bytes in the datagram.
@@ -230,7 +261,16 @@ class DatagramIterator
     // read_remainder returns a vector containing the rest of the bytes in the datagram.
     std::vector<uint8_t> read_remainder()
     {
-        return read_data(m_dg->size() - m_offset);
+        return read_data(m_end - m_offset);
+    }
+
+    // read_remainder_into appends the rest of the bytes in the datagram to dg, copying them
+    //     straight across instead of through a temporary.  Use it for relaying a payload.
+    void read_remainder_into(Datagram &dg)
+    {
+        dgsize_t length = m_end - m_offset;
+        dg.add_data(m_dg->get_data() + m_offset, length);
+        m_offset += length;
     }
 
 
@@ -243,14 +283,21 @@ class DatagramIterator
         return buffer;
     }
 
-    // unpack_field can also be called to read into an existing buffer.
+    // unpack_field can also be called to read into an existing buffer, or onto the end of a
+    //     datagram (e.g. one being built to relay the value, see Datagram::create_with_headroom).
     void unpack_field(const dclass::Field* field, std::vector<uint8_t> &buffer)
     {
         unpack_dtype(field->get_type(), buffer);
     }
+    void unpack_field(const dclass::Field* field, Datagram &dg)
+    {
+        unpack_dtype(field->get_type(), dg);
+    }
 
-    // unpack_dtype accepts a DistributedType and copies the data for the value into a buffer.
-    void unpack_dtype(const dclass::DistributedType* dtype, std::vector<uint8_t> &buffer)
+    // unpack_dtype accepts a DistributedType and copies the data for the value into a buffer
+    //     (either a std::vector<uint8_t> or a Datagram).
+    template<typename Buffer>
+    void unpack_dtype(const dclass::DistributedType* dtype, Buffer &buffer)
     {
         using namespace dclass;
 
@@ -279,12 +326,16 @@ class DatagramIterator
             // Also any other type lucky enough to be fixed size will be computed faster
             const NumericType* num = dtype->as_numeric();
 
-            std::vector<uint8_t> data = read_data(dtype->get_size());
+            dgsize_t size = dtype->get_size();
+            check_read_length(size);
+            const uint8_t *data = m_dg->get_data() + m_offset;
+            m_offset += size;
 
             // Check for any value range constraints applying to fixed-size numerical types:
             if(num && num->has_range()) {
                 // We do have a value range constraint to check for.
-                if(!num->within_range(&data, 0)) {
+                std::vector<uint8_t> value(data, data + size);
+                if(!num->within_range(&value, 0)) {
                     std::stringstream error;
                     error << "Failed to unpack numeric-type field of type " << num->get_alias()
                           << " due to value range constraint violation";
@@ -292,7 +343,7 @@ class DatagramIterator
                 }
             }
 
-            buffer.insert(buffer.end(), data.begin(), data.end());
+            append_to(buffer, data, size);
 
             return;
         }
@@ -308,7 +359,7 @@ class DatagramIterator
             dgsize_t net_len = swap_le(len);
 
             uint64_t elem_cnt = 0;
-            buffer.insert(buffer.end(), (uint8_t*)&net_len, (uint8_t*)&net_len + sizeof(dgsize_t));
+            append_to(buffer, (uint8_t*)&net_len, sizeof(dgsize_t));
 
             if(dtype->get_type() == T_VARARRAY) {
                 // We handle variable-length arrays in a slightly different manner, as we have to check for value constraints.
@@ -320,8 +371,9 @@ class DatagramIterator
                 }
             } else {
                 // We're dealing with a blob or a string, ergo elem_cnt == len
-                std::vector<uint8_t> data = read_data(len);
-                buffer.insert(buffer.end(), data.begin(), data.end());
+                check_read_length(len);
+                append_to(buffer, m_dg->get_data() + m_offset, len);
+                m_offset += len;
                 elem_cnt = len;
             }
 
@@ -357,6 +409,16 @@ class DatagramIterator
         }
     }
 
+    // append_to adds length bytes of data to the end of a buffer being unpacked into.
+    static void append_to(std::vector<uint8_t> &buffer, const uint8_t *data, size_t length)
+    {
+        buffer.insert(buffer.end(), data, data + length);
+    }
+    static void append_to(Datagram &dg, const uint8_t *data, size_t length)
+    {
+        dg.add_data(data, length);
+    }
+
     // skip_field can be used to seek past the packed field data for a Field.
     //     Throws DatagramIteratorEOF if it skips past the end of the datagram.
     void skip_field(const dclass::Field* field)
@@ -457,7 +519,7 @@ class DatagramIterator
     // get_remaining returns the number of unread bytes left
     dgsize_t get_remaining() const
     {
-        return m_dg->size() - m_offset;
+        return m_end - m_offset;
     }
 
     // seek sets the current message offset in std::vector<uint8_t>
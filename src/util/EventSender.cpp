@@ -94,7 +94,12 @@ static inline void pack_string(DatagramPtr dg, const std::string &str)
 
 DatagramHandle LoggedEvent::make_datagram() const
 {
-    DatagramPtr dg = Datagram::create();
+    // Each string takes at most 3 bytes of header (see pack_string), plus 3 for the map's.
+    size_t capacity = 3;
+    for(auto &it : m_kv) {
+        capacity += 3 + it.first.length() + 3 + it.second.length();
+    }
+    DatagramPtr dg = Datagram::create_with_capacity(capacity);
 
     // First, append the size of our map:
     size_t size = m_kv.size();
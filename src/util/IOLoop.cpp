@@ -0,0 +1,123 @@
+#include "IOLoop.h"
+#include <future>
+#include "core/global.h"
+
+// The loop run by this thread, if it runs an IOLoop other than the main one.
+static thread_local IOLoop *current_loop = nullptr;
+
+IOLoop::IOLoop() : m_loop(uvw::Loop::create()), m_own_tasks(new TaskQueue)
+{
+    m_tasks = m_own_tasks.get();
+
+    // The loop's handles have to be set up by its own thread, before it starts running.
+    std::promise<void> ready;
+    m_thread = std::thread([this, &ready]() {
+        current_loop = this;
+        m_thread_id = std::this_thread::get_id();
+        m_tasks->init_queue(m_loop, m_thread_id);
+        ready.set_value();
+
+        // The TaskQueue's async handle keeps the loop running until we close it.
+        m_loop->run();
+    });
+    ready.get_future().wait();
+}
+
+IOLoop::IOLoop(const std::shared_ptr<uvw::Loop> &loop, std::thread::id thread_id,
+               TaskQueue &tasks) : m_loop(loop), m_tasks(&tasks), m_thread_id(thread_id)
+{
+}
+
+IOLoop::~IOLoop()
+{
+    if(!m_thread.joinable()) {
+        // The main loop; that's run (and closed) by main().
+        return;
+    }
+
+    // Close everything on the loop, which lets its run() return.
+    m_tasks->enqueue_task([loop = m_loop]() {
+        loop->walk([](uvw::BaseHandle &handle) {
+            handle.close();
+        });
+    });
+    m_thread.join();
+}
+
+TimerWheel& IOLoop::timers()
+{
+    assert(in_loop_thread());
+
+    if(m_timers == nullptr) {
+        m_timers.reset(new TimerWheel(*this));
+    }
+    return *m_timers;
+}
+
+void IOLoop::defer(TaskCallback task)
+{
+    assert(in_loop_thread());
+
+    if(m_defer_check == nullptr) {
+        m_defer_check = m_loop->resource<uvw::CheckHandle>();
+        m_defer_check->on<uvw::CheckEvent>([this](const uvw::CheckEvent&, uvw::CheckHandle&) {
+            run_deferred();
+        });
+        m_defer_idle = m_loop->resource<uvw::IdleHandle>();
+        m_defer_idle->on<uvw::IdleEvent>([](const uvw::IdleEvent&, uvw::IdleHandle&) {});
+
+        // Neither should keep the loop running by itself.
+        m_defer_check->unreference();
+        m_defer_idle->unreference();
+    }
+
+    if(m_deferred.empty()) {
+        m_defer_check->start();
+        m_defer_idle->start();
+    }
+    m_deferred.push_back(std::move(task));
+}
+
+void IOLoop::run_deferred()
+{
+    // Tasks deferred by these tasks wait for the next pass.
+    std::vector<TaskCallback> tasks;
+    tasks.swap(m_deferred);
+    m_defer_check->stop();
+    m_defer_idle->stop();
+
+    for(auto& task : tasks) {
+        task();
+    }
+}
+
+IOLoop& IOLoop::main()
+{
+    static IOLoop main_loop(g_loop, g_main_thread_id, TaskQueue::singleton);
+    return main_loop;
+}
+
+IOLoop* IOLoop::current()
+{
+    if(current_loop != nullptr) {
+        return current_loop;
+    }
+
+    if(std::this_thread::get_id() == g_main_thread_id) {
+        return &main();
+    }
+
+    return nullptr;
+}
+
+IOLoopPool::IOLoopPool(unsigned int size)
+{
+    for(unsigned int i = 0; i < size; ++i) {
+        m_loops.emplace_back(new IOLoop);
+    }
+}
+
+IOLoop& IOLoopPool::next()
+{
+    return *m_loops[m_next.fetch_add(1, std::memory_order_relaxed) % m_loops.size()];
+}
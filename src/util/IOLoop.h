@@ -0,0 +1,90 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "deps/uvw/uvw.hpp"
+#include "util/TaskQueue.h"
+#include "util/TimerWheel.h"
+
+// An IOLoop is an event loop, along with the thread that runs it and a TaskQueue for
+// handing it work from other threads.  The main loop (g_loop) is run by the main thread;
+// the loops of an IOLoopPool each run a thread of their own.
+//
+// libuv is NOT thread-safe: anything built on a loop's handles (e.g. a NetworkClient or a
+// Timeout) must only be used from that loop's thread, or else through its TaskQueue.
+class IOLoop
+{
+  public:
+    // Creates a new loop, and starts a thread to run it.
+    IOLoop();
+    ~IOLoop();
+
+    // main returns the main thread's loop.
+    static IOLoop& main();
+    // current returns the loop run by the calling thread, or nullptr if it doesn't run one.
+    static IOLoop* current();
+
+    inline const std::shared_ptr<uvw::Loop>& loop() const
+    {
+        return m_loop;
+    }
+
+    inline TaskQueue& tasks()
+    {
+        return *m_tasks;
+    }
+
+    // timers returns the loop's TimerWheel.  Only call it from the loop's thread.
+    TimerWheel& timers();
+
+    // defer runs the task at the end of the loop's current pass, once the I/O callbacks and
+    //     queued tasks of that pass have run.  Unlike the TaskQueue, it never runs the task
+    //     straight away.  Only call it from the loop's thread.
+    void defer(TaskCallback task);
+
+    // in_loop_thread returns true if the calling thread is the one running this loop.
+    inline bool in_loop_thread() const
+    {
+        return std::this_thread::get_id() == m_thread_id;
+    }
+
+  private:
+    // The main loop already exists; this just wraps it.
+    IOLoop(const std::shared_ptr<uvw::Loop> &loop, std::thread::id thread_id, TaskQueue &tasks);
+
+    std::shared_ptr<uvw::Loop> m_loop;
+    TaskQueue *m_tasks;
+    std::unique_ptr<TaskQueue> m_own_tasks;
+    std::thread m_thread;
+    std::thread::id m_thread_id;
+    std::unique_ptr<TimerWheel> m_timers; // Created on first use, by the loop's thread.
+
+    // Tasks waiting for the end of the pass, see defer.  The check handle runs them; the
+    //     idle handle stops the loop from blocking in poll before it does.  Both are created
+    //     on first use, and only started while there are tasks waiting.
+    std::vector<TaskCallback> m_deferred;
+    std::shared_ptr<uvw::CheckHandle> m_defer_check;
+    std::shared_ptr<uvw::IdleHandle> m_defer_idle;
+
+    void run_deferred();
+};
+
+// An IOLoopPool is a set of IOLoops for a role to spread its connections over.
+class IOLoopPool
+{
+  public:
+    IOLoopPool(unsigned int size);
+
+    // next returns the loop to give the next connection to, round-robin.
+    IOLoop& next();
+
+    inline size_t size() const
+    {
+        return m_loops.size();
+    }
+
+  private:
+    std::vector<std::unique_ptr<IOLoop>> m_loops;
+    std::atomic<size_t> m_next {0};
+};
@@ -0,0 +1,223 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// An MPSCQueue is a bounded, lock-free multi-producer/single-consumer queue.
+// Any number of threads may push() concurrently; exactly one thread at a time
+//     may pop() or drain() from it.
+//
+// The lock-free part is a power-of-two ring of sequenced slots (after Dmitry Vyukov's
+//     bounded queue).  A producer claims a slot with a single CAS and then publishes it;
+//     the consumer never takes a lock while the ring has elements.
+//
+// When the ring is full, producers do NOT block (the consumer is frequently also a
+//     producer, e.g. the MessageDirector routing datagrams while handling one), instead
+//     they spill into a mutex-protected overflow list.  While anything is spilled, every
+//     push goes to the overflow so that each producer's messages stay in order; the
+//     consumer only takes the overflow once the ring is completely empty.
+//
+// The overflow list itself is unbounded.  A user which can't let it grow without limit
+//     (e.g. the MessageDirector, see messagedirector/spill_limit) watches spilled() and
+//     holds back those of its producers which can afford to wait.
+template<typename T>
+class MPSCQueue
+{
+  public:
+    // capacity must be a power of two.
+    explicit MPSCQueue(size_t capacity) : m_mask(capacity - 1), m_slots(new Slot[capacity])
+    {
+        for(size_t i = 0; i < capacity; ++i) {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    static bool is_valid_capacity(size_t capacity)
+    {
+        return capacity >= 2 && (capacity & (capacity - 1)) == 0;
+    }
+
+    inline size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    // push adds an item to the queue.  Safe to call from any thread.
+    // Returns false if the item had to be spilled into the overflow list.
+    bool push(T item)
+    {
+        if(!m_spilled.load(std::memory_order_acquire) && try_push(item)) {
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(m_overflow_lock);
+        m_overflow.push_back(std::move(item));
+        m_spilled.store(true, std::memory_order_release);
+        m_spills.fetch_add(1, std::memory_order_relaxed);
+        m_spilled_items.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // pop removes the oldest available item into out.  Consumer thread only.
+    bool pop(T& out)
+    {
+        if(!m_pending.empty()) {
+            out = std::move(m_pending.front());
+            m_pending.pop_front();
+            m_spilled_items.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        switch(try_pop(out)) {
+        case PopResult::ITEM:
+            return true;
+        case PopResult::BUSY:
+            // A producer has claimed the next slot but not yet published it;
+            // the overflow is newer than that slot, so we can't skip ahead to it.
+            return false;
+        case PopResult::EMPTY:
+            break;
+        }
+
+        if(!m_spilled.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_overflow_lock);
+            m_pending.swap(m_overflow);
+            m_spilled.store(false, std::memory_order_release);
+        }
+
+        if(m_pending.empty()) {
+            return false;
+        }
+
+        out = std::move(m_pending.front());
+        m_pending.pop_front();
+        m_spilled_items.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // drain pops up to max items, passing each to f.  Consumer thread only.
+    // Returns the number of items popped.
+    template<typename F>
+    size_t drain(F&& f, size_t max)
+    {
+        size_t count = 0;
+        T item;
+        while(count < max && pop(item)) {
+            ++count;
+            f(std::move(item));
+        }
+        return count;
+    }
+
+    // empty returns true if there is nothing for the consumer to pop.  Consumer thread only.
+    bool empty() const
+    {
+        return m_enqueue_pos.load(std::memory_order_acquire) ==
+               m_dequeue_pos.load(std::memory_order_acquire) &&
+               !m_spilled.load(std::memory_order_acquire) && m_pending.empty();
+    }
+
+    // size returns the approximate number of items in the ring; spilled items
+    // are not included (see spilled()).
+    size_t size() const
+    {
+        size_t enq = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t deq = m_dequeue_pos.load(std::memory_order_relaxed);
+        return enq > deq ? enq - deq : 0;
+    }
+
+    // pushed returns the number of items that have ever been pushed, spilled or not.
+    inline uint64_t pushed() const
+    {
+        return m_enqueue_pos.load(std::memory_order_relaxed) + spills();
+    }
+
+    // spills returns the number of items that have ever overflowed the ring.
+    inline uint64_t spills() const
+    {
+        return m_spills.load(std::memory_order_relaxed);
+    }
+
+    // spilled returns the number of items which overflowed the ring and haven't been popped yet.
+    inline size_t spilled() const
+    {
+        return m_spilled_items.load(std::memory_order_relaxed);
+    }
+
+  private:
+    enum class PopResult { ITEM, EMPTY, BUSY };
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    bool try_push(T& item)
+    {
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        while(true) {
+            Slot &slot = m_slots[pos & m_mask];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if(diff == 0) {
+                if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(item);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if(diff < 0) {
+                // Full.
+                return false;
+            } else {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    PopResult try_pop(T& out)
+    {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Slot &slot = m_slots[pos & m_mask];
+        size_t seq = slot.seq.load(std::memory_order_acquire);
+        if(seq != pos + 1) {
+            if(m_enqueue_pos.load(std::memory_order_acquire) == pos) {
+                return PopResult::EMPTY;
+            }
+            return PopResult::BUSY;
+        }
+
+        out = std::move(slot.value);
+        slot.value = T();
+        slot.seq.store(pos + m_mask + 1, std::memory_order_release);
+        m_dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        return PopResult::ITEM;
+    }
+
+    // Producer and consumer indices are padded onto separate cache lines.
+    const size_t m_mask;
+    std::unique_ptr<Slot[]> m_slots;
+    char m_pad0[64];
+    std::atomic<size_t> m_enqueue_pos {0};
+    char m_pad1[64];
+    std::atomic<size_t> m_dequeue_pos {0};
+    char m_pad2[64];
+
+    // Overflow handling.
+    std::atomic<bool> m_spilled {false};
+    std::atomic<uint64_t> m_spills {0};
+    std::atomic<size_t> m_spilled_items {0};
+    std::mutex m_overflow_lock;
+    std::deque<T> m_overflow;
+    std::deque<T> m_pending; // Consumer-only: overflow items taken but not yet popped.
+};
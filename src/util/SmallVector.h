@@ -0,0 +1,218 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+// A SmallVector is a vector of trivially copyable elements which keeps its first
+//     N elements inline, only touching the heap once it grows past N.
+// It is intended for the many short lists on hot paths (e.g. the subscribers of a
+//     channel), where a std::vector would cost an allocation and a pointer chase each.
+template<typename T, size_t N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "SmallVector only supports trivially copyable types.");
+    static_assert(N > 0, "SmallVector needs room for at least one inline element.");
+
+  public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    SmallVector() : m_data(m_inline), m_size(0), m_capacity(N)
+    {
+    }
+    SmallVector(const SmallVector &other) : SmallVector()
+    {
+        assign(other.begin(), other.end());
+    }
+    SmallVector(SmallVector &&other) : SmallVector()
+    {
+        take(other);
+    }
+    ~SmallVector()
+    {
+        release();
+    }
+
+    SmallVector &operator=(const SmallVector &other)
+    {
+        if(this != &other) {
+            assign(other.begin(), other.end());
+        }
+        return *this;
+    }
+    SmallVector &operator=(SmallVector &&other)
+    {
+        if(this != &other) {
+            release();
+            m_data = m_inline;
+            m_size = 0;
+            m_capacity = N;
+            take(other);
+        }
+        return *this;
+    }
+
+    inline iterator begin()
+    {
+        return m_data;
+    }
+    inline iterator end()
+    {
+        return m_data + m_size;
+    }
+    inline const_iterator begin() const
+    {
+        return m_data;
+    }
+    inline const_iterator end() const
+    {
+        return m_data + m_size;
+    }
+    inline T &operator[](size_t i)
+    {
+        return m_data[i];
+    }
+    inline const T &operator[](size_t i) const
+    {
+        return m_data[i];
+    }
+    inline T &back()
+    {
+        return m_data[m_size - 1];
+    }
+    inline T *data()
+    {
+        return m_data;
+    }
+    inline const T *data() const
+    {
+        return m_data;
+    }
+    inline size_t size() const
+    {
+        return m_size;
+    }
+    inline size_t capacity() const
+    {
+        return m_capacity;
+    }
+    inline bool empty() const
+    {
+        return m_size == 0;
+    }
+    inline bool is_inline() const
+    {
+        return m_data == m_inline;
+    }
+
+    inline void push_back(const T &value)
+    {
+        if(m_size == m_capacity) {
+            grow(m_capacity * 2);
+        }
+        m_data[m_size++] = value;
+    }
+    inline void pop_back()
+    {
+        --m_size;
+    }
+    inline void clear()
+    {
+        m_size = 0;
+    }
+
+    // insert places value before pos, shifting the tail up.
+    iterator insert(const_iterator pos, const T &value)
+    {
+        size_t index = pos - m_data;
+        push_back(value);
+        std::rotate(m_data + index, m_data + m_size - 1, m_data + m_size);
+        return m_data + index;
+    }
+
+    // erase removes the element at pos, preserving the order of the rest.
+    iterator erase(const_iterator pos)
+    {
+        size_t index = pos - m_data;
+        std::memmove(m_data + index, m_data + index + 1, (m_size - index - 1) * sizeof(T));
+        --m_size;
+        return m_data + index;
+    }
+
+    void reserve(size_t capacity)
+    {
+        if(capacity > m_capacity) {
+            grow(capacity);
+        }
+    }
+
+    void resize(size_t size)
+    {
+        reserve(size);
+        if(size > m_size) {
+            std::fill(m_data + m_size, m_data + size, T());
+        }
+        m_size = size;
+    }
+
+    template<typename It>
+    void assign(It first, It last)
+    {
+        m_size = 0;
+        reserve(std::distance(first, last));
+        for(; first != last; ++first) {
+            m_data[m_size++] = *first;
+        }
+    }
+
+    bool operator==(const SmallVector &other) const
+    {
+        return m_size == other.m_size && std::equal(begin(), end(), other.begin());
+    }
+    bool operator!=(const SmallVector &other) const
+    {
+        return !(*this == other);
+    }
+
+  private:
+    T *m_data;
+    uint32_t m_size;
+    uint32_t m_capacity;
+    T m_inline[N];
+
+    void grow(size_t capacity)
+    {
+        T *data = new T[capacity];
+        std::memcpy(data, m_data, m_size * sizeof(T));
+        release();
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+    void release()
+    {
+        if(m_data != m_inline) {
+            delete [] m_data;
+        }
+    }
+
+    // take steals other's elements, leaving it empty.  Assumes *this is empty and inline.
+    void take(SmallVector &other)
+    {
+        if(other.m_data == other.m_inline) {
+            std::memcpy(m_inline, other.m_inline, other.m_size * sizeof(T));
+        } else {
+            m_data = other.m_data;
+            m_capacity = other.m_capacity;
+            other.m_data = other.m_inline;
+            other.m_capacity = N;
+        }
+        m_size = other.m_size;
+        other.m_size = 0;
+    }
+};
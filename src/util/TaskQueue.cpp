@@ -1,10 +1,28 @@
 #include "TaskQueue.h"
+#include <algorithm>
 
 TaskQueue TaskQueue::singleton;
 
+static inline uint64_t now_ns()
+{
+    return uv_hrtime();
+}
+
+static inline void store_max(std::atomic<uint64_t> &max, uint64_t value)
+{
+    // Only the loop's thread writes these, so there's no need for a CAS.
+    if(value > max.load(std::memory_order_relaxed)) {
+        max.store(value, std::memory_order_relaxed);
+    }
+}
+
+TaskQueue::TaskQueue() : m_tasks(RING_SIZE)
+{
+}
+
 TaskQueue::~TaskQueue()
 {
-    assert(m_task_queue.empty());
+    assert(m_tasks.empty());
     if(m_flush_handle) {
         m_flush_handle->close();
         m_flush_handle = nullptr;
@@ -13,9 +31,15 @@ TaskQueue::~TaskQueue()
 
 void TaskQueue::init_queue()
 {
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    init_queue(g_loop, g_main_thread_id);
+}
 
-    m_flush_handle = g_loop->resource<uvw::AsyncHandle>();
+void TaskQueue::init_queue(const std::shared_ptr<uvw::Loop> &loop, std::thread::id thread_id)
+{
+    assert(std::this_thread::get_id() == thread_id);
+
+    m_thread_id = thread_id;
+    m_flush_handle = loop->resource<uvw::AsyncHandle>();
     m_flush_handle->on<uvw::AsyncEvent>([self = this](const uvw::AsyncEvent&, uvw::AsyncHandle&) {
         self->flush_tasks();
     });
@@ -23,43 +47,74 @@ void TaskQueue::init_queue()
 
 void TaskQueue::enqueue_task(TaskCallback task)
 {
-    {
-        std::lock_guard<std::mutex> lock(m_queue_mutex);
-        m_task_queue.push(task);        
+    if(!task.is_inline()) {
+        m_allocated.fetch_add(1, std::memory_order_relaxed);
     }
+    m_tasks.push(std::move(task));
 
-    if(std::this_thread::get_id() != g_main_thread_id) {
-        m_flush_handle->send();
-    } else {
+    if(std::this_thread::get_id() == m_thread_id) {
         flush_tasks();
+        return;
+    }
+
+    // Only the first task since the last flush needs to wake the loop up.  The flush
+    //     clears m_wakeup_pending before it starts popping, so if it was still set, our
+    //     task will be seen by that flush.  (This has to be a read-modify-write, and not
+    //     just a load, for our push to be visible to the flush that clears it.)
+    if(m_wakeup_pending.exchange(true, std::memory_order_acq_rel)) {
+        return;
     }
+
+    m_wakeup_time.store(now_ns(), std::memory_order_relaxed);
+    m_wakeups.fetch_add(1, std::memory_order_relaxed);
+    m_flush_handle->send();
 }
 
 void TaskQueue::flush_tasks()
 {
-    // We need to make absolutely certain this is running within the main (loop's) thread.
-    assert(std::this_thread::get_id() == g_main_thread_id);
+    // We need to make absolutely certain this is running within the loop's thread.
+    assert(std::this_thread::get_id() == m_thread_id);
 
     if(m_in_flush) {
-        // We're already in the middle of a flush_tasks operation.    
+        // We're already in the middle of a flush_tasks operation.
         return;
     }
 
     m_in_flush = true;
-    std::queue<TaskCallback> pending_tasks;
 
-    {
-        std::lock_guard<std::mutex> lock(m_queue_mutex);
-        pending_tasks = std::move(m_task_queue);
+    if(m_wakeup_pending.exchange(false, std::memory_order_acq_rel)) {
+        uint64_t woken = m_wakeup_time.load(std::memory_order_relaxed);
+        uint64_t start = now_ns();
+        uint64_t latency = start > woken ? start - woken : 0;
+        m_last_drain_ns.store(latency, std::memory_order_relaxed);
+        store_max(m_max_drain_ns, latency);
     }
 
-    {
-        while(!pending_tasks.empty()) {
-            TaskCallback task = pending_tasks.front();
-            pending_tasks.pop();
-            task();
-        }
+    // Tasks enqueued by the tasks we run (from this thread) are picked up by this same loop.
+    uint64_t ran = 0;
+    TaskCallback task;
+    while(m_tasks.pop(task)) {
+        uint64_t start = now_ns();
+        task();
+        store_max(m_max_task_ns, now_ns() - start);
+        task = TaskCallback();
+        ++ran;
     }
+    m_ran.fetch_add(ran, std::memory_order_relaxed);
 
     m_in_flush = false;
 }
+
+TaskQueueStats TaskQueue::stats() const
+{
+    TaskQueueStats stats = {};
+    stats.enqueued = m_tasks.pushed();
+    stats.ran = m_ran.load(std::memory_order_relaxed);
+    stats.allocated = m_allocated.load(std::memory_order_relaxed);
+    stats.spills = m_tasks.spills();
+    stats.wakeups = m_wakeups.load(std::memory_order_relaxed);
+    stats.last_drain_ns = m_last_drain_ns.load(std::memory_order_relaxed);
+    stats.max_drain_ns = m_max_drain_ns.load(std::memory_order_relaxed);
+    stats.max_task_ns = m_max_task_ns.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -1,24 +1,221 @@
 #pragma once
 
-#include <queue>
-#include <mutex>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include "core/global.h"
 #include "deps/uvw/uvw.hpp"
+#include "util/MPSCQueue.h"
 
-typedef std::function<void()> TaskCallback;
+// A TaskCallback is a move-only void() callable.  Unlike a std::function, it keeps any
+//     callable whose captures fit in INLINE_SIZE bytes (e.g. a shared_ptr and a couple of
+//     words) inside itself, so handing such a task to another thread doesn't allocate.
+//     Larger callables are still accepted, but go on the heap.
+class TaskCallback
+{
+  public:
+    static constexpr size_t INLINE_SIZE = 48;
+
+    TaskCallback() = default;
+
+    template<typename F, typename = typename std::enable_if<
+                 !std::is_same<typename std::decay<F>::type, TaskCallback>::value>::type>
+    TaskCallback(F&& f)
+    {
+        typedef typename std::decay<F>::type Fn;
+        construct<Fn>(std::forward<F>(f), std::integral_constant<bool, fits_inline<Fn>()>());
+    }
+
+    TaskCallback(TaskCallback &&other) : m_ops(other.m_ops)
+    {
+        if(m_ops != nullptr) {
+            m_ops->move(&m_storage, &other.m_storage);
+            other.m_ops = nullptr;
+        }
+    }
+
+    TaskCallback& operator=(TaskCallback &&other)
+    {
+        if(this != &other) {
+            reset();
+            m_ops = other.m_ops;
+            if(m_ops != nullptr) {
+                m_ops->move(&m_storage, &other.m_storage);
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    TaskCallback(const TaskCallback&) = delete;
+    TaskCallback& operator=(const TaskCallback&) = delete;
+
+    ~TaskCallback()
+    {
+        reset();
+    }
+
+    inline void operator()()
+    {
+        m_ops->invoke(&m_storage);
+    }
+
+    inline explicit operator bool() const
+    {
+        return m_ops != nullptr;
+    }
+
+    // is_inline returns false if the callable had to be allocated on the heap.
+    inline bool is_inline() const
+    {
+        return m_ops == nullptr || m_ops->is_inline;
+    }
+
+  private:
+    typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type Storage;
+
+    struct Ops {
+        void (*invoke)(void *storage);
+        void (*move)(void *dst, void *src); // Moves src into dst, and destroys src.
+        void (*destroy)(void *storage);
+        bool is_inline;
+    };
+
+    template<typename Fn>
+    static constexpr bool fits_inline()
+    {
+        return sizeof(Fn) <= INLINE_SIZE && alignof(Fn) <= alignof(Storage) &&
+               std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    template<typename Fn, typename F>
+    inline void construct(F&& f, std::true_type /* inline */)
+    {
+        new (&m_storage) Fn(std::forward<F>(f));
+        m_ops = &inline_ops<Fn>;
+    }
+
+    template<typename Fn, typename F>
+    inline void construct(F&& f, std::false_type /* inline */)
+    {
+        *reinterpret_cast<Fn**>(&m_storage) = new Fn(std::forward<F>(f));
+        m_ops = &heap_ops<Fn>;
+    }
+
+    template<typename Fn>
+    struct InlineOps {
+        static void invoke(void *storage)
+        {
+            (*static_cast<Fn*>(storage))();
+        }
+        static void move(void *dst, void *src)
+        {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        }
+        static void destroy(void *storage)
+        {
+            static_cast<Fn*>(storage)->~Fn();
+        }
+    };
+
+    template<typename Fn>
+    struct HeapOps {
+        static void invoke(void *storage)
+        {
+            (**static_cast<Fn**>(storage))();
+        }
+        static void move(void *dst, void *src)
+        {
+            *static_cast<Fn**>(dst) = *static_cast<Fn**>(src);
+        }
+        static void destroy(void *storage)
+        {
+            delete *static_cast<Fn**>(storage);
+        }
+    };
+
+    template<typename Fn>
+    static const Ops inline_ops;
+    template<typename Fn>
+    static const Ops heap_ops;
+
+    inline void reset()
+    {
+        if(m_ops != nullptr) {
+            m_ops->destroy(&m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    Storage m_storage;
+    const Ops *m_ops = nullptr;
+};
+
+template<typename Fn>
+const TaskCallback::Ops TaskCallback::inline_ops = {
+    &InlineOps<Fn>::invoke, &InlineOps<Fn>::move, &InlineOps<Fn>::destroy, true
+};
+template<typename Fn>
+const TaskCallback::Ops TaskCallback::heap_ops = {
+    &HeapOps<Fn>::invoke, &HeapOps<Fn>::move, &HeapOps<Fn>::destroy, false
+};
+
+// TaskQueueStats is a snapshot of a TaskQueue's counters.
+//     The counters are cumulative: sample them twice to get rates.
+struct TaskQueueStats {
+    uint64_t enqueued;       // Tasks enqueued since startup.
+    uint64_t ran;            // Tasks run since startup.
+    uint64_t allocated;      // Tasks whose captures were too large to be kept inline.
+    uint64_t spills;         // Tasks that overflowed the ring since startup.
+    uint64_t wakeups;        // Times another thread woke the loop up to run its tasks; tasks
+                             //     enqueued while a wakeup was already pending don't count.
+    uint64_t last_drain_ns;  // Time from the most recent wakeup to its tasks starting to run.
+    uint64_t max_drain_ns;   // Longest such time since startup.
+    uint64_t max_task_ns;    // Longest time a single task has taken to run.
+};
 
 class TaskQueue
 {
     private:
-        std::mutex m_queue_mutex;
-        std::queue<TaskCallback> m_task_queue;
+        // How many tasks the lock-free ring holds; beyond that they spill into a list.
+        static constexpr size_t RING_SIZE = 1024;
+
+        MPSCQueue<TaskCallback> m_tasks;
         std::shared_ptr<uvw::AsyncHandle> m_flush_handle;
+        std::thread::id m_thread_id; // The thread running the loop the tasks run on.
         bool m_in_flush = false;
+
+        // Set by the first task enqueued from another thread since the last flush; until
+        //     the flush starts, further tasks can skip waking the loop.
+        std::atomic<bool> m_wakeup_pending {false};
+        std::atomic<uint64_t> m_wakeup_time {0};
+
+        // Counters, see stats().
+        std::atomic<uint64_t> m_allocated {0};
+        std::atomic<uint64_t> m_wakeups {0};
+        std::atomic<uint64_t> m_ran {0};
+        std::atomic<uint64_t> m_last_drain_ns {0};
+        std::atomic<uint64_t> m_max_drain_ns {0};
+        std::atomic<uint64_t> m_max_task_ns {0};
     public:
+        TaskQueue();
         ~TaskQueue();
+        // singleton is the main loop's queue; see IOLoop for the queues of other loops.
         static TaskQueue singleton;
+        // init_queue sets the queue up to run its tasks on the main loop...
         void init_queue();
+        // ...or on another loop, run by the given thread.  Call it from that thread.
+        void init_queue(const std::shared_ptr<uvw::Loop> &loop, std::thread::id thread_id);
+        // enqueue_task runs the task on the queue's loop: right away if called from the
+        //     loop's thread, otherwise as soon as the loop wakes up.  Safe to call from any thread.
         void enqueue_task(TaskCallback task);
         void flush_tasks();
+
+        // stats returns the queue's counters.  Safe to call from any thread.
+        TaskQueueStats stats() const;
 };
@@ -3,16 +3,17 @@
 #include <atomic>
 #include <memory>
 #include "deps/uvw/uvw.hpp"
-#include "util/TaskQueue.h"
+#include "util/IOLoop.h"
 
-// This class abstracts the uvw::TimerHandle timer in order to provide a generic
+// This class abstracts the loop's TimerWheel in order to provide a generic
 // facility for timeouts. Once constructed, this class will wait a certain
 // amount of time and then call the function. The timeout must be canceled
 // with cancel() before you invalidate your callback.
 //
 // You must start the timeout with start().
 //
-// NOTE: The thread that calls the function is the main thread.
+// NOTE: The thread that calls the function is the thread of the IOLoop the Timeout was
+// created on (usually the main thread), which must also be the one to start it.
 // Make sure that your callback doesn't have unintended consequences on performance.
 // NOTE 2: The Timeout deletes itself under 2 different conditions:
 // a) The timeout has been reached
@@ -44,14 +45,14 @@ class Timeout
     void initialize(unsigned long ms, TimeoutCallback callback);
 
   private:
-    std::shared_ptr<uvw::Loop> m_loop;
-    std::shared_ptr<uvw::TimerHandle> m_timer;
+    IOLoop *m_io;
+    WheelTimer m_timer;
+    bool m_started;
     TimeoutCallback m_callback;
     unsigned long m_timeout_interval;
 
     std::atomic<bool> m_callback_disabled;
 
-    void setup();
     void destroy_timer();
     void timer_callback();
 };
@@ -0,0 +1,169 @@
+#include "TimerWheel.h"
+#include <algorithm>
+#include "util/IOLoop.h"
+
+constexpr uint64_t TimerWheel::TICK_MS;
+constexpr size_t TimerWheel::SLOTS;
+
+static inline void link_before(TimerLink *head, TimerLink *link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static inline void unlink(TimerLink *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = nullptr;
+}
+
+WheelTimer::~WheelTimer()
+{
+    stop();
+}
+
+void WheelTimer::start(TimerWheel &wheel, unsigned long ms, TaskCallback callback)
+{
+    stop();
+
+    m_wheel = &wheel;
+    m_interval = ms;
+    m_callback = std::move(callback);
+    m_deadline = wheel.now() + ms;
+    wheel.schedule(this);
+}
+
+void WheelTimer::reset()
+{
+    if(m_wheel == nullptr) {
+        return;
+    }
+
+    uint64_t deadline = m_wheel->now() + m_interval;
+    if(is_running() && deadline >= m_deadline) {
+        // The usual case (e.g. a heartbeat): the timer is only getting later.  Leave it
+        //     in its slot for now, it will be moved along when that slot's tick comes.
+        m_deadline = deadline;
+        return;
+    }
+
+    stop();
+    m_deadline = deadline;
+    m_wheel->schedule(this);
+}
+
+void WheelTimer::stop()
+{
+    if(is_running()) {
+        m_wheel->unschedule(this);
+    }
+}
+
+TimerWheel::TimerWheel(IOLoop &io) : m_io(io)
+{
+    assert(m_io.in_loop_thread());
+
+    for(TimerLink &slot : m_slots) {
+        slot.prev = slot.next = &slot;
+    }
+
+    m_timer = m_io.loop()->resource<uvw::TimerHandle>();
+    m_timer->on<uvw::TimerEvent>([self = this](const uvw::TimerEvent&, uvw::TimerHandle&) {
+        self->tick();
+    });
+}
+
+TimerWheel::~TimerWheel()
+{
+    // Forget any timers still running, so that they don't try to unschedule themselves later.
+    for(TimerLink &slot : m_slots) {
+        while(slot.next != &slot) {
+            unlink(slot.next);
+        }
+    }
+    m_count = 0;
+
+    m_timer->stop();
+    m_timer->close();
+}
+
+uint64_t TimerWheel::now() const
+{
+    return m_io.loop()->now().count();
+}
+
+void TimerWheel::schedule(WheelTimer *timer)
+{
+    assert(m_io.in_loop_thread());
+
+    if(m_count++ == 0) {
+        // The wheel has been idle; start ticking again from now.
+        m_next_tick = std::max(m_next_tick, now() / TICK_MS);
+        m_timer->start(uvw::TimerHandle::Time{TICK_MS}, uvw::TimerHandle::Time{TICK_MS});
+    }
+
+    // The first tick at or after the deadline, unless that's already been run.
+    uint64_t tick = std::max((timer->m_deadline + TICK_MS - 1) / TICK_MS, m_next_tick);
+    link_before(&m_slots[tick % SLOTS], timer);
+}
+
+void TimerWheel::unschedule(WheelTimer *timer)
+{
+    assert(m_io.in_loop_thread());
+
+    unlink(timer);
+    --m_count;
+}
+
+void TimerWheel::tick()
+{
+    uint64_t current = now();
+    uint64_t last_tick = current / TICK_MS;
+
+    // Normally there's just one tick to run, but the loop may have been held up.  A whole
+    //     lap of the wheel covers every slot; later ticks would only be running them again.
+    for(size_t n = 0; m_next_tick <= last_tick && n < SLOTS; ++n) {
+        // Advance before running, so that timers scheduled by the callbacks go in a later slot.
+        uint64_t tick = m_next_tick++;
+        run_slot(m_slots[tick % SLOTS], current);
+    }
+    m_next_tick = std::max(m_next_tick, last_tick + 1);
+
+    if(m_count == 0) {
+        m_timer->stop();
+    }
+}
+
+void TimerWheel::run_slot(TimerLink &slot, uint64_t now)
+{
+    if(slot.next == &slot) {
+        return;
+    }
+
+    // Take the slot's timers out onto a list of our own first: callbacks may start, stop
+    //     and destroy timers (including ones still on this list), which all just unlink.
+    TimerLink pending;
+    pending.prev = slot.prev;
+    pending.next = slot.next;
+    pending.prev->next = &pending;
+    pending.next->prev = &pending;
+    slot.prev = slot.next = &slot;
+
+    while(pending.next != &pending) {
+        WheelTimer *timer = static_cast<WheelTimer*>(pending.next);
+        unlink(timer);
+
+        if(timer->m_deadline > now) {
+            // Due a lap or more from now, or reset since it was scheduled.
+            link_before(&m_slots[((timer->m_deadline + TICK_MS - 1) / TICK_MS) % SLOTS], timer);
+            continue;
+        }
+
+        // The callback may well destroy the timer, so don't touch it afterwards.
+        --m_count;
+        timer->m_callback();
+    }
+}
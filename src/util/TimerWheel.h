@@ -0,0 +1,92 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "deps/uvw/uvw.hpp"
+#include "util/TaskQueue.h"
+
+class IOLoop;
+class TimerWheel;
+
+struct TimerLink {
+    TimerLink *prev = nullptr;
+    TimerLink *next = nullptr;
+};
+
+// A WheelTimer runs a callback once, some number of milliseconds after it is started,
+//     on the loop of the TimerWheel it was started on.  Starting, resetting and stopping
+//     are O(1) and don't allocate, so unlike a uvw::TimerHandle it's fine to have one per
+//     client, and to reset it every time the client does something.
+//
+// A WheelTimer must only be used from its wheel's loop thread; it may be destroyed by its
+//     own callback, but must not be destroyed while it is running on another thread.
+class WheelTimer : private TimerLink
+{
+  public:
+    WheelTimer() = default;
+    WheelTimer(const WheelTimer&) = delete;
+    WheelTimer& operator=(const WheelTimer&) = delete;
+    ~WheelTimer();
+
+    // start schedules the callback to be run ms milliseconds from now, replacing any
+    //     schedule (and callback) the timer already had.
+    void start(TimerWheel &wheel, unsigned long ms, TaskCallback callback);
+    // reset reschedules the timer to run ms (as given to start) milliseconds from now.
+    //     It does nothing if the timer has never been started.
+    void reset();
+    // stop unschedules the timer, if it is running.
+    void stop();
+
+    // is_running returns true if the timer has been started, but not yet run or stopped.
+    inline bool is_running() const
+    {
+        return next != nullptr;
+    }
+
+  private:
+    friend class TimerWheel;
+
+    TimerWheel *m_wheel = nullptr;
+    uint64_t m_deadline = 0; // In loop time, see uvw::Loop::now().
+    unsigned long m_interval = 0;
+    TaskCallback m_callback;
+};
+
+// A TimerWheel runs the WheelTimers of one IOLoop (see IOLoop::timers()) off of a single
+//     uvw::TimerHandle, which only ticks while some timer is running.
+//
+// It is a hashed timing wheel: each timer is kept in the slot for the tick it is due in,
+//     and each tick runs the timers in its slot that are due, moving the rest (due a lap
+//     or more later, or since reset) to their new slot.  Timers run up to TICK_MS late.
+class TimerWheel
+{
+  public:
+    static constexpr uint64_t TICK_MS = 10;
+    static constexpr size_t SLOTS = 512; // 5.12s per lap of the wheel.
+
+    TimerWheel(IOLoop &io);
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    ~TimerWheel();
+
+    // size returns the number of running timers.
+    inline size_t size() const
+    {
+        return m_count;
+    }
+
+  private:
+    friend class WheelTimer;
+
+    uint64_t now() const;
+    void schedule(WheelTimer *timer);
+    void unschedule(WheelTimer *timer);
+    void tick();
+    void run_slot(TimerLink &slot, uint64_t now);
+
+    IOLoop &m_io;
+    std::shared_ptr<uvw::TimerHandle> m_timer;
+    TimerLink m_slots[SLOTS];
+    uint64_t m_next_tick = 0; // The next tick to be run.
+    size_t m_count = 0;
+};
@@ -1,7 +1,7 @@
 import os, time, socket, struct, tempfile, subprocess, ssl
 
 __all__ = ['Daemon', 'Datagram', 'DatagramIterator',
-           'MDConnection', 'ChannelConnection', 'ClientConnection']
+           'MDConnection', 'ChannelConnection', 'ClientConnection', 'filter_bit']
 
 class Daemon(object):
     DAEMON_PATH = './astrond'
@@ -83,6 +83,11 @@ CONSTANTS = {
     'CONTROL_REMOVE_CHANNEL':       9001,
     'CONTROL_ADD_RANGE':            9002,
     'CONTROL_REMOVE_RANGE':         9003,
+    'CONTROL_ADD_CHANNELS':         9004,
+    'CONTROL_REMOVE_CHANNELS':      9005,
+    'CONTROL_ENABLE_FILTER':        9006,
+    'CONTROL_FILTER_RESET':         9007,
+    'CONTROL_FILTER_ADD':           9008,
     'CONTROL_ADD_POST_REMOVE':      9010,
     'CONTROL_CLEAR_POST_REMOVE':    9011,
     'CONTROL_SET_CON_NAME':         9012,
@@ -204,6 +209,8 @@ CONSTANTS = {
     'CLIENT_DISCONNECT':                             3,
     'CLIENT_EJECT':                                  4,
     'CLIENT_HEARTBEAT':                              5,
+    'CLIENT_BUNDLE':                                 6,
+    'CLIENT_UDP_TOKEN':                              7,
     'CLIENT_OBJECT_SET_FIELD':                       120,
     'CLIENT_OBJECT_SET_FIELDS':                      121,
     'CLIENT_OBJECT_LEAVING':                         132,
@@ -217,6 +224,9 @@ CONSTANTS = {
     'CLIENT_ADD_INTEREST_MULTIPLE':                  201,
     'CLIENT_REMOVE_INTEREST':                        203,
     'CLIENT_OBJECT_LOCATION':                        140,
+    # Client features
+    'CLIENT_FEATURE_BUNDLE': 0x0001,
+    'CLIENT_FEATURE_UDP': 0x0002,
     # Client DC reasons
     'CLIENT_DISCONNECT_OVERSIZED_DATAGRAM': 106,
     'CLIENT_DISCONNECT_NO_HELLO': 107,
@@ -275,6 +285,19 @@ else:
 
 CONSTANTS['USE_THREADING'] = 'DISABLE_THREADING' not in os.environ
 
+FILTER_BITS = 1 << 16
+
+def filter_bit(channel):
+    # The bit a channel sets in a Message Director's channel filter (see ChannelFilter).
+    mask = (1 << 64) - 1
+    h = channel & mask
+    h ^= h >> 33
+    h = (h * 0xff51afd7ed558ccd) & mask
+    h ^= h >> 33
+    h = (h * 0xc4ceb9fe1a85ec53) & mask
+    h ^= h >> 33
+    return h % FILTER_BITS
+
 locals().update(CONSTANTS)
 __all__.extend(CONSTANTS.keys())
 
@@ -375,6 +398,24 @@ class Datagram(object):
         dg.add_channel(channel)
         return dg
 
+    @classmethod
+    def create_add_channels(cls, channels):
+        dg = cls.create_control()
+        dg.add_uint16(CONTROL_ADD_CHANNELS)
+        dg.add_uint16(len(channels))
+        for channel in channels:
+            dg.add_channel(channel)
+        return dg
+
+    @classmethod
+    def create_remove_channels(cls, channels):
+        dg = cls.create_control()
+        dg.add_uint16(CONTROL_REMOVE_CHANNELS)
+        dg.add_uint16(len(channels))
+        for channel in channels:
+            dg.add_channel(channel)
+        return dg
+
     @classmethod
     def create_add_range(cls, upper, lower):
         dg = cls.create_control()
@@ -391,6 +432,44 @@ class Datagram(object):
         dg.add_channel(lower)
         return dg
 
+    @classmethod
+    def create_enable_filter(cls):
+        dg = cls.create_control()
+        dg.add_uint16(CONTROL_ENABLE_FILTER)
+        return dg
+
+    @classmethod
+    def create_filter_reset(cls, channels=(), ranges=(), pass_all=False):
+        words = [0] * (FILTER_BITS // 64)
+        for channel in channels:
+            bit = filter_bit(channel)
+            words[bit // 64] |= 1 << (bit % 64)
+
+        dg = cls.create_control()
+        dg.add_uint16(CONTROL_FILTER_RESET)
+        dg.add_uint8(pass_all)
+        for word in words:
+            dg.add_uint64(word)
+        dg.add_uint16(len(ranges))
+        for lo, hi in ranges:
+            dg.add_channel(lo)
+            dg.add_channel(hi)
+        return dg
+
+    @classmethod
+    def create_filter_add(cls, channels=(), ranges=(), pass_all=False):
+        dg = cls.create_control()
+        dg.add_uint16(CONTROL_FILTER_ADD)
+        dg.add_uint8(pass_all)
+        dg.add_uint16(len(channels))
+        for channel in channels:
+            dg.add_channel(channel)
+        dg.add_uint16(len(ranges))
+        for lo, hi in ranges:
+            dg.add_channel(lo)
+            dg.add_channel(hi)
+        return dg
+
     @classmethod
     def create_add_post_remove(cls, sender, datagram):
         dg = cls.create_control()
@@ -18,6 +18,7 @@ CLASSES = [
     'Block',
     'DistributedChunk',
     'DistributedDBTypeTestObject',
+    'DistributedMover',
 ]
 for i,n in enumerate(CLASSES):
     locals()[n] = i
@@ -97,6 +98,10 @@ FIELDS = [
     'db_blob',
     'db_fixblob',
     'db_complex',
+
+    ### Fields for DistributedMover ###
+    'setPosition',
+    'setVelocity',
 ]
 for i,n in enumerate(FIELDS):
     locals()[n] = i
@@ -107,4 +112,4 @@ setRDbD5DefaultValue = 20
 
 # If you edit test.dc *AT ALL*, you will have to recalculate this.
 # If you don't know how, ask CFS.
-DC_HASH = 0xb77baf2
+DC_HASH = 0xea468ff
@@ -1,6 +1,7 @@
 #!/usr/bin/env python2
 import unittest, time, ssl, struct
-from socket import socket, AF_INET, SOCK_STREAM, error as socket_error
+from socket import socket, AF_INET, SOCK_STREAM, SOCK_DGRAM, error as socket_error, \
+    timeout as socket_timeout
 from common.unittests import ProtocolTest
 from common.astron import *
 from common.dcfile import *
@@ -24,6 +25,10 @@ uberdogs:
       class: UberDog2
       anonymous: false
 
+    - id: 1236
+      class: DistributedMover
+      anonymous: false
+
 roles:
     - type: clientagent
       bind: 127.0.0.1:57128
@@ -36,6 +41,8 @@ roles:
           add_interest: enabled
           write_buffer_size: 0
           write_timeout_ms: 0
+      udp:
+          bind: 127.0.0.1:57129
       tuning:
           interest_timeout: 500
 
@@ -78,6 +85,17 @@ roles:
       client:
           heartbeat_timeout: 1000
 
+    - type: clientagent
+      bind: 127.0.0.1:57240
+      version: "Sword Art Online v5.1"
+      channels:
+          min: 550600
+          max: 550699
+      client:
+          heartbeat_timeout: 1000
+      tuning:
+          io_threads: 2
+
 """ % (USE_THREADING, test_dc)
 VERSION = 'Sword Art Online v5.1'
 
@@ -89,6 +107,7 @@ class TestClientAgent(ProtocolTest):
         cls.server = cls.connectToServer()
         cls.server.send(Datagram.create_add_channel(1234))
         cls.server.send(Datagram.create_add_channel(1235))
+        cls.server.send(Datagram.create_add_channel(1236))
 
     @classmethod
     def tearDownClass(cls):
@@ -384,6 +403,278 @@ class TestClientAgent(ProtocolTest):
 
         client.close()
 
+    def test_conflation(self):
+        self.server.flush()
+        client = self.connect()
+        id = self.identify(client)
+
+        # Send a lot of position updates while the client isn't reading, so that they back up.
+        data = 'x' * 4000
+        for seq in range(2000):
+            dg = Datagram.create([id], 1, STATESERVER_OBJECT_SET_FIELD)
+            dg.add_doid(1236)
+            dg.add_uint16(setPosition)
+            dg.add_uint32(seq)
+            dg.add_string(data)
+            self.server.send(dg)
+
+        # An update of a field that isn't conflated, which is never dropped.
+        dg = Datagram.create([id], 1, STATESERVER_OBJECT_SET_FIELD)
+        dg.add_doid(1234)
+        dg.add_uint16(response)
+        dg.add_string('Caught up.')
+        self.server.send(dg)
+        time.sleep(0.5)
+
+        # Positions may have been replaced by newer ones, but never reordered or lost at the end.
+        last = -1
+        received = 0
+        while True:
+            dg = client.recv_maybe()
+            self.assertTrue(dg is not None, "Only received positions up to %d." % last)
+            dgi = DatagramIterator(dg)
+            self.assertEqual(dgi.read_uint16(), CLIENT_OBJECT_SET_FIELD)
+            do_id = dgi.read_doid()
+            field_id = dgi.read_uint16()
+            if field_id == response:
+                self.assertEqual(do_id, 1234)
+                self.assertEqual(dgi.read_string(), 'Caught up.')
+                break
+            self.assertEqual(do_id, 1236)
+            self.assertEqual(field_id, setPosition)
+            seq = dgi.read_uint32()
+            self.assertGreater(seq, last)
+            self.assertEqual(dgi.read_string(), data)
+            last = seq
+            received += 1
+        self.assertEqual(last, 1999)
+        # Some of them must actually have been replaced.
+        self.assertLess(received, 2000)
+
+        client.close()
+
+    def test_bundling(self):
+        self.server.flush()
+
+        # Ask for bundling in the hello...
+        client = self.connect(do_hello = False)
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HELLO)
+        dg.add_uint32(DC_HASH)
+        dg.add_string(VERSION)
+        dg.add_uint32(CLIENT_FEATURE_BUNDLE)
+        client.send(dg)
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HELLO_RESP)
+        dg.add_uint32(CLIENT_FEATURE_BUNDLE)
+        self.expect(client, dg, isClient = True)
+        id = self.identify(client)
+
+        # ...after which the client can send several messages in one bundle...
+        bundle = Datagram()
+        bundle.add_uint16(CLIENT_BUNDLE)
+        for n in range(3):
+            dg = Datagram()
+            dg.add_uint16(CLIENT_OBJECT_SET_FIELD)
+            dg.add_doid(1234)
+            dg.add_uint16(request)
+            dg.add_string('Bundled message %d' % n)
+            bundle.add_blob(dg.get_data())
+        client.send(bundle)
+
+        for n in range(3):
+            dg = Datagram.create([1234], id, STATESERVER_OBJECT_SET_FIELD)
+            dg.add_doid(1234)
+            dg.add_uint16(request)
+            dg.add_string('Bundled message %d' % n)
+            self.expect(self.server, dg)
+
+        # ...and may be sent bundles, which keep the messages in order.
+        expected = []
+        for n in range(10):
+            dg = Datagram.create([id], 1, STATESERVER_OBJECT_SET_FIELD)
+            dg.add_doid(1234)
+            dg.add_uint16(response)
+            dg.add_string('Reply %d' % n)
+            self.server.send(dg)
+
+            dg = Datagram()
+            dg.add_uint16(CLIENT_OBJECT_SET_FIELD)
+            dg.add_doid(1234)
+            dg.add_uint16(response)
+            dg.add_string('Reply %d' % n)
+            expected.append(dg.get_data())
+
+        received = []
+        while len(received) < len(expected):
+            dg = client.recv_maybe()
+            self.assertTrue(dg is not None, "Received %d messages, expected %d." %
+                            (len(received), len(expected)))
+            dgi = DatagramIterator(dg)
+            if dgi.read_uint16() == CLIENT_BUNDLE:
+                while dgi.tell() < len(dg.get_data()):
+                    received.append(dgi.read_string())
+            else:
+                received.append(dg.get_data())
+        self.assertEqual(received, expected)
+
+        # A bundle that ends partway through a message gets the client disconnected.
+        bundle = Datagram()
+        bundle.add_uint16(CLIENT_BUNDLE)
+        bundle.add_size(10)
+        bundle.add_uint16(CLIENT_HEARTBEAT)
+        client.send(bundle)
+        self.assertDisconnect(client, CLIENT_DISCONNECT_TRUNCATED_DATAGRAM)
+
+    def test_udp(self):
+        self.server.flush()
+
+        # Ask for the UDP side-channel in the hello, and get a token for it.
+        client = self.connect(do_hello = False)
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HELLO)
+        dg.add_uint32(DC_HASH)
+        dg.add_string(VERSION)
+        dg.add_uint32(CLIENT_FEATURE_UDP)
+        client.send(dg)
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HELLO_RESP)
+        dg.add_uint32(CLIENT_FEATURE_UDP)
+        self.expect(client, dg, isClient = True)
+        dgi = DatagramIterator(client.recv())
+        self.assertEqual(dgi.read_uint16(), CLIENT_UDP_TOKEN)
+        self.assertEqual(dgi.read_uint16(), 57129)
+        token = dgi.read_uint64()
+        id = self.identify(client)
+        self.set_state(client, CLIENT_STATE_ESTABLISHED)
+
+        udp = socket(AF_INET, SOCK_DGRAM)
+        udp.settimeout(1.0)
+        def send_udp(seq, dg):
+            udp.sendto(struct.pack('<QI', token, seq) + dg.get_data(), ('127.0.0.1', 57129))
+        def recv_udp():
+            data = udp.recv(2048)
+            return struct.unpack('<I', data[:4])[0], Datagram(data[4:])
+
+        def send_velocity(x, y):
+            dg = Datagram.create([id], 1, STATESERVER_OBJECT_SET_FIELD)
+            dg.add_doid(1236)
+            dg.add_uint16(setVelocity)
+            dg.add_int16(x)
+            dg.add_int16(y)
+            self.server.send(dg)
+        velocity = Datagram()
+        velocity.add_uint16(CLIENT_OBJECT_SET_FIELD)
+        velocity.add_doid(1236)
+        velocity.add_uint16(setVelocity)
+        velocity.add_int16(3)
+        velocity.add_int16(-4)
+
+        # Until the client is heard from over UDP, unreliable updates still go over TCP.
+        send_velocity(3, -4)
+        self.expect(client, velocity, isClient = True)
+
+        # Heartbeats over UDP are answered over UDP...
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HEARTBEAT)
+        send_udp(0, dg)
+        seq, dg = recv_udp()
+        self.assertEqual(dg.get_data(), struct.pack('<H', CLIENT_HEARTBEAT))
+
+        # ...after which unreliable updates go over UDP, with increasing sequence numbers.
+        send_velocity(3, -4)
+        next_seq, dg = recv_udp()
+        self.assertEqual(next_seq, seq + 1)
+        self.assertEqual(dg.get_data(), velocity.get_data())
+        self.expectNone(client)
+
+        # The client can send them over UDP too, but ones older than the latest are dropped.
+        for seq, x in ((2, 20), (1, 10), (3, 30)):
+            dg = Datagram()
+            dg.add_uint16(CLIENT_OBJECT_SET_FIELD)
+            dg.add_doid(1236)
+            dg.add_uint16(setVelocity)
+            dg.add_int16(x)
+            dg.add_int16(0)
+            send_udp(seq, dg)
+            time.sleep(0.05)
+        for x in (20, 30):
+            dg = Datagram.create([1236], id, STATESERVER_OBJECT_SET_FIELD)
+            dg.add_doid(1236)
+            dg.add_uint16(setVelocity)
+            dg.add_int16(x)
+            dg.add_int16(0)
+            self.expect(self.server, dg)
+        self.expectNone(self.server)
+
+        # Packets with an unknown token are ignored.
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HEARTBEAT)
+        udp.sendto(struct.pack('<QI', token ^ 1, 4) + dg.get_data(), ('127.0.0.1', 57129))
+        self.assertRaises(socket_timeout, recv_udp)
+
+        # The token alone doesn't move the side-channel to another address: an update
+        # from there is ignored, and so is a heartbeat older than the latest datagram.
+        moved = socket(AF_INET, SOCK_DGRAM)
+        moved.settimeout(1.0)
+        def send_moved(seq, dg):
+            moved.sendto(struct.pack('<QI', token, seq) + dg.get_data(), ('127.0.0.1', 57129))
+        def recv_moved():
+            data = moved.recv(2048)
+            return struct.unpack('<I', data[:4])[0], Datagram(data[4:])
+
+        dg = Datagram()
+        dg.add_uint16(CLIENT_OBJECT_SET_FIELD)
+        dg.add_doid(1236)
+        dg.add_uint16(setVelocity)
+        dg.add_int16(40)
+        dg.add_int16(0)
+        send_moved(4, dg)
+        heartbeat = Datagram()
+        heartbeat.add_uint16(CLIENT_HEARTBEAT)
+        send_moved(2, heartbeat)
+        self.assertRaises(socket_timeout, recv_moved)
+        self.expectNone(self.server)
+
+        # A newer heartbeat from there is answered there with a challenge, while updates
+        # still go to the old address...
+        send_moved(5, heartbeat)
+        seq, dg = recv_moved()
+        dgi = DatagramIterator(dg)
+        self.assertEqual(dgi.read_uint16(), CLIENT_HEARTBEAT)
+        challenge = dgi.read_uint64()
+        send_velocity(3, -4)
+        seq, dg = recv_udp()
+        self.assertEqual(dg.get_data(), velocity.get_data())
+
+        # ...until a heartbeat from there comes back with the challenge.
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HEARTBEAT)
+        dg.add_uint64(challenge ^ 1)
+        send_moved(6, dg)
+        self.assertRaises(socket_timeout, recv_moved)
+        dg = Datagram()
+        dg.add_uint16(CLIENT_HEARTBEAT)
+        dg.add_uint64(challenge)
+        send_moved(7, dg)
+        seq, dg = recv_moved()
+        self.assertEqual(dg.get_data(), struct.pack('<H', CLIENT_HEARTBEAT))
+        send_velocity(3, -4)
+        seq, dg = recv_moved()
+        self.assertEqual(dg.get_data(), velocity.get_data())
+        self.assertRaises(socket_timeout, recv_udp)
+
+        # Reliable fields can't be sent over UDP.
+        dg = Datagram()
+        dg.add_uint16(CLIENT_OBJECT_SET_FIELD)
+        dg.add_doid(1234)
+        dg.add_uint16(request)
+        dg.add_string('Over UDP?')
+        send_moved(8, dg)
+        self.assertDisconnect(client, CLIENT_DISCONNECT_FORBIDDEN_FIELD)
+        moved.close()
+        udp.close()
+
     def test_set_sender(self):
         self.server.flush()
         client = self.connect()
@@ -3452,6 +3743,41 @@ class TestClientAgent(ProtocolTest):
         # We should be disconnected now...
         self.assertDisconnect(client,CLIENT_DISCONNECT_NO_HEARTBEAT)
 
+    def test_io_threads(self):
+        self.server.flush()
+
+        # Clients are handed out to the two I/O threads in turn; each should work the same.
+        clients = [self.connect(port = 57240) for i in range(4)]
+        ids = [self.identify(client, min = 550600, max = 550699) for client in clients]
+        self.assertEqual(len(set(ids)), 4)
+
+        # Datagrams from the server reach each client...
+        for n, (client, id) in enumerate(zip(clients, ids)):
+            raw_dg = Datagram()
+            raw_dg.add_uint16(65413) # Datagram opcode
+            raw_dg.add_uint32(n)
+            dg = Datagram.create([id], 1, CLIENTAGENT_SEND_DATAGRAM)
+            dg.add_string(raw_dg.get_data())
+            self.server.send(dg)
+            self.expect(client, raw_dg, isClient = True)
+
+        # ...their timeouts run on their own threads...
+        for client in clients[1:]:
+            self.send_heartbeat(client)
+        time.sleep(0.6)
+        for client in clients[1:]:
+            self.send_heartbeat(client)
+        time.sleep(0.6)
+        self.assertDisconnect(clients[0], CLIENT_DISCONNECT_NO_HEARTBEAT)
+
+        # ...and the others can still be ejected by the server.
+        for id, client in zip(ids[1:], clients[1:]):
+            dg = Datagram.create([id], 1, CLIENTAGENT_EJECT)
+            dg.add_uint16(4321)
+            dg.add_string('Bye!')
+            self.server.send(dg)
+            self.assertDisconnect(client, 4321)
+
     def test_interest_parent_change(self):
         self.server.flush()
 
@@ -66,6 +66,66 @@ class TestConfigCore(ConfigTest):
             """ % test_dc
         self.assertEquals(self.checkConfig(config), 'Valid')
 
+    def test_routing_threads(self):
+        config = """\
+            messagedirector:
+                bind: 127.0.0.1:57123
+                threaded: true
+                threads: 4
+                queue_size: 1024
+                lockless_lookups: true
+                compact_threshold: 64
+                filter_upstream: true
+                inbox_size: 256
+                cork_upstream: true
+                cork_downstream: true
+                cork_linger: 100
+                inbox_overflow: disconnect
+            """
+        self.assertEquals(self.checkConfig(config), 'Valid')
+
+        config = """\
+            messagedirector:
+                bind: 127.0.0.1:57123
+                threads: 0
+            """
+        self.assertEquals(self.checkConfig(config), 'Invalid')
+
+        config = """\
+            messagedirector:
+                bind: 127.0.0.1:57123
+                queue_size: 1000
+            """
+        self.assertEquals(self.checkConfig(config), 'Invalid')
+
+        config = """\
+            messagedirector:
+                bind: 127.0.0.1:57123
+                compact_threshold: 1
+            """
+        self.assertEquals(self.checkConfig(config), 'Invalid')
+
+        config = """\
+            messagedirector:
+                bind: 127.0.0.1:57123
+                inbox_overflow: explode
+            """
+        self.assertEquals(self.checkConfig(config), 'Invalid')
+
+    def test_unix_addresses(self):
+        config = """\
+            messagedirector:
+                bind: unix:/tmp/astron-test-config.sock
+            """
+        self.assertEquals(self.checkConfig(config), 'Valid')
+
+        config = """\
+            messagedirector:
+                bind: 127.0.0.1:57123
+                connect: unix:
+            """
+        self.assertEquals(self.checkConfig(config), 'Invalid')
+
     def test_roles_missing_type(self):
         config = """\
             messagedirector:
@@ -1,5 +1,5 @@
 #!/usr/bin/env python2
-import unittest
+import unittest, os, tempfile, time
 from socket import *
 
 from common.unittests import ProtocolTest
@@ -11,25 +11,53 @@ messagedirector:
     connect: 127.0.0.1:57124
 """
 
-class TestMessageDirector(ProtocolTest):
+COMPACT_CONFIG = CONFIG + """    compact_threshold: 4
+"""
+
+FILTER_CONFIG = CONFIG + """    filter_upstream: true
+"""
+
+INBOX_CONFIG = CONFIG + """    threads: 2
+    inbox_size: 4
+"""
+
+UNIX_CONFIG = """\
+messagedirector:
+    bind: unix:%s
+    connect: unix:%s
+"""
+
+class MDTestCase(ProtocolTest):
+    # An MD running with config, connected upstream to l1, with participants c1 and c2.
+    config = CONFIG
+
     @classmethod
-    def setUpClass(cls):
+    def listenUpstream(cls):
         listener = socket(AF_INET, SOCK_STREAM)
         listener.setsockopt(SOL_SOCKET, SO_REUSEADDR, 1)
         listener.setsockopt(SOL_TCP, TCP_NODELAY, 1)
         listener.bind(('127.0.0.1', 57124))
+        return listener
+
+    @classmethod
+    def connectParticipant(cls):
+        return cls.connectToServer()
+
+    @classmethod
+    def setUpClass(cls):
+        listener = cls.listenUpstream()
         listener.listen(1)
         listener.settimeout(0.3)
 
-        cls.daemon = Daemon(CONFIG)
+        cls.daemon = Daemon(cls.config)
         cls.daemon.start()
 
         l, _ = listener.accept()
         listener.close()
         cls.l1 = MDConnection(l)
 
-        cls.c1 = cls.connectToServer()
-        cls.c2 = cls.connectToServer()
+        cls.c1 = cls.connectParticipant()
+        cls.c2 = cls.connectParticipant()
 
     @classmethod
     def tearDownClass(cls):
@@ -38,6 +66,7 @@ class TestMessageDirector(ProtocolTest):
         cls.c2.close()
         cls.daemon.stop()
 
+class TestMessageDirector(MDTestCase):
     def test_single(self):
         self.l1.flush()
 
@@ -172,6 +201,53 @@ class TestMessageDirector(ProtocolTest):
             self.c1.send(dg)
             self.c2.send(dg)
 
+    def test_bulk(self):
+        self.l1.flush()
+        self.c1.flush()
+        self.c2.flush()
+
+        # Subscribe to several channels at once...
+        self.c1.send(Datagram.create_add_channels([4441, 4442, 4443]))
+        self.expectNone(self.c1)
+        # The MD should pass them upward in one message.
+        self.expect(self.l1, Datagram.create_add_channels([4441, 4442, 4443]))
+        self.expectNone(self.l1)
+
+        # Each of them should be routed to c1.
+        for channel in [4441, 4442, 4443]:
+            dg = Datagram.create([channel], 0, 1234)
+            dg.add_uint32(0xDEADBEEF)
+            self.l1.send(dg)
+            self.expect(self.c1, dg)
+
+        # Overlapping subscribe on c2; only the new channel goes upward, and on
+        # its own it's sent as a plain CONTROL_ADD_CHANNEL.
+        self.c2.send(Datagram.create_add_channels([4442, 4444]))
+        self.expect(self.l1, Datagram.create_add_channel(4444))
+        self.expectNone(self.l1)
+
+        dg = Datagram.create([4442], 0, 1234)
+        dg.add_uint32(0xDEADBEEF)
+        self.l1.send(dg)
+        self.expect(self.c1, dg)
+        self.expect(self.c2, dg)
+
+        # Unsubscribe c1; 4442 is still wanted by c2.
+        self.c1.send(Datagram.create_remove_channels([4441, 4442, 4443]))
+        self.expect(self.l1, Datagram.create_remove_channels([4441, 4443]))
+        self.expectNone(self.l1)
+
+        dg = Datagram.create([4441, 4442], 0, 1234)
+        dg.add_uint32(0xDEADBEEF)
+        self.l1.send(dg)
+        self.expect(self.c2, dg)
+        self.expectNone(self.c1)
+
+        # And the rest.
+        self.c2.send(Datagram.create_remove_channels([4442, 4444]))
+        self.expect(self.l1, Datagram.create_remove_channels([4442, 4444]))
+        self.expectNone(self.l1)
+
     def test_post_remove(self):
         self.l1.flush()
         self.c1.flush()
@@ -254,6 +330,44 @@ class TestMessageDirector(ProtocolTest):
         # ... and no more messages (duplicates or otherwise)
         self.expectNone(self.l1)
 
+    def test_post_remove_replaced(self):
+        self.l1.flush()
+        self.c1.flush()
+        self.c2.flush()
+
+        # Back up the upstream link with more than the socket buffers can take...
+        data = 'x' * 10000
+        for i in range(1600):
+            dg = Datagram.create([4545], 0, 1234)
+            dg.add_uint32(i)
+            dg.add_string(data)
+            self.c2.send(dg)
+        time.sleep(0.5)
+
+        # ...then replace c1's post removes while it's still backed up.
+        dg_pr = Datagram.create([555444333], 0, 4321)
+        dg_pr.add_string('Replacement')
+        dg_clear_prs = Datagram.create_clear_post_removes(212121)
+        dg_add_pr = Datagram.create_add_post_remove(212121, dg_pr)
+        self.c1.send(dg_clear_prs)
+        self.c1.send(dg_add_pr)
+
+        # Upstream has to get the clear before the add, or the add is wiped out.
+        for i in range(1600):
+            dg = Datagram.create([4545], 0, 1234)
+            dg.add_uint32(i)
+            dg.add_string(data)
+            self.expect(self.l1, dg)
+        self.expect(self.l1, dg_clear_prs)
+        self.expect(self.l1, dg_add_pr)
+        self.expectNone(self.l1)
+
+        # And the post remove is still there when c1 goes.
+        self.c1.close()
+        self.__class__.c1 = self.connectToServer()
+        self.expectMany(self.l1, [dg_pr, dg_clear_prs])
+        self.expectNone(self.l1)
+
     def test_ranges(self):
         self.l1.flush()
         self.c1.flush()
@@ -634,5 +748,253 @@ class TestMessageDirector(ProtocolTest):
         self.__class__.c2 = self.connectToServer()
         self.l1.flush()
 
+class TestMessageDirectorCompaction(MDTestCase):
+    config = COMPACT_CONFIG
+
+    def check_delivery(self, channel, *conns):
+        dg = Datagram.create([channel], 0, 1234)
+        dg.add_uint32(channel)
+        self.l1.send(dg)
+        for conn in conns:
+            self.expect(conn, dg)
+
+    def test_compaction(self):
+        self.l1.flush()
+        self.c1.flush()
+        self.c2.flush()
+
+        # Short runs are advertised channel by channel...
+        for channel in [5000, 5001, 5002]:
+            self.c1.send(Datagram.create_add_channel(channel))
+            self.expect(self.l1, Datagram.create_add_channel(channel))
+
+        # ...until they reach the threshold, when they become a range.
+        self.c1.send(Datagram.create_add_channel(5003))
+        self.expect(self.l1, Datagram.create_add_range(5000, 5003))
+        self.expect(self.l1, Datagram.create_remove_channels([5000, 5001, 5002]))
+        self.expectNone(self.l1)
+
+        # Neighbours grow the range.
+        self.c1.send(Datagram.create_add_channels([5004, 5005]))
+        self.expect(self.l1, Datagram.create_add_range(5004, 5005))
+        self.expectNone(self.l1)
+
+        # Others sharing a channel change nothing upstream.
+        self.c2.send(Datagram.create_add_channel(5001))
+        self.expectNone(self.l1)
+
+        for channel in range(5000, 5006):
+            self.check_delivery(channel, self.c1)
+        self.check_delivery(5001, self.c1, self.c2)
+
+        # A hole cuts the range, but only once nobody locally wants the channel.
+        self.c1.send(Datagram.create_remove_channel(5001))
+        self.expectNone(self.l1)
+        self.c1.send(Datagram.create_remove_channels([5002, 5003]))
+        self.expect(self.l1, Datagram.create_remove_range(5002, 5003))
+        self.expectNone(self.l1)
+
+        # Dropping the rest withdraws what's left, a piece at a time.
+        self.c1.close()
+        self.__class__.c1 = self.connectToServer()
+        self.expectMany(self.l1, [Datagram.create_remove_range(5000, 5000),
+                                  Datagram.create_remove_range(5004, 5005)])
+        self.expectNone(self.l1)
+        self.c2.close()
+        self.__class__.c2 = self.connectToServer()
+        self.expect(self.l1, Datagram.create_remove_range(5001, 5001))
+        self.expectNone(self.l1)
+
+    def test_compaction_under_range(self):
+        self.l1.flush()
+        self.c1.flush()
+        self.c2.flush()
+
+        self.c1.send(Datagram.create_add_channels(range(6000, 6008)))
+        self.expect(self.l1, Datagram.create_add_range(6000, 6007))
+        self.expectNone(self.l1)
+
+        # A participant's range covering part of the compacted range...
+        self.c2.send(Datagram.create_add_range(6004, 6100))
+        self.expect(self.l1, Datagram.create_add_range(6004, 6100))
+
+        # ...must not lose those channels upstream when it's removed.
+        self.c2.send(Datagram.create_remove_range(6004, 6100))
+        self.expect(self.l1, Datagram.create_remove_range(6004, 6100))
+        self.expect(self.l1, Datagram.create_add_range(6004, 6007))
+        self.expectNone(self.l1)
+
+        self.c1.send(Datagram.create_remove_channels(range(6000, 6008)))
+        self.expect(self.l1, Datagram.create_remove_range(6000, 6007))
+        self.expectNone(self.l1)
+
+class TestMessageDirectorFilter(MDTestCase):
+    config = FILTER_CONFIG
+
+    def sync(self):
+        # Anything l1 sent before this has been applied once c1 gets it.
+        dg = Datagram.create([4000], 0, 1234)
+        self.l1.send(dg)
+        self.expect(self.c1, dg)
+
+    def check_upstream(self, channels, forwarded):
+        dg = Datagram.create(channels, 0, 1234)
+        self.c2.send(dg)
+        if forwarded:
+            self.expect(self.l1, dg)
+        else:
+            self.expectNone(self.l1)
+
+    def test_filter(self):
+        # None of the channels we expect to be filtered may collide with wanted ones.
+        wanted = set(filter_bit(c) for c in (5000, 7000, 8000))
+        for c in (5999, 6100, 7100, 7500):
+            self.assertNotIn(filter_bit(c), wanted)
+
+        # The MD asks for a filter as soon as it connects.
+        self.expect(self.l1, Datagram.create_enable_filter())
+
+        self.c1.send(Datagram.create_add_channel(4000))
+        self.expect(self.l1, Datagram.create_add_channel(4000))
+
+        # Until upstream sends one, everything goes up.
+        self.check_upstream([7100], True)
+
+        self.l1.send(Datagram.create_filter_reset([5000], [(6000, 6099)]))
+        self.sync()
+        self.check_upstream([5000], True)
+        self.check_upstream([6050], True)
+        self.check_upstream([6000], True)
+        self.check_upstream([6099], True)
+        self.check_upstream([5999], False)
+        self.check_upstream([6100], False)
+        self.check_upstream([7100], False)
+        self.check_upstream([7100, 5000], True)
+
+        self.l1.send(Datagram.create_filter_add([7000]))
+        self.sync()
+        self.check_upstream([7000], True)
+        self.check_upstream([7100], False)
+
+        # Now c1 is a downstream MD; it's told what upstream and c2 want, but not about 4000.
+        self.c1.send(Datagram.create_enable_filter())
+        self.expect(self.c1, Datagram.create_filter_reset([5000, 7000], [(6000, 6099)]))
+
+        self.c2.send(Datagram.create_add_channel(8000))
+        self.expect(self.l1, Datagram.create_add_channel(8000))
+        self.expect(self.c1, Datagram.create_filter_add([8000]))
+        self.c2.send(Datagram.create_add_range(9000, 9100))
+        self.expect(self.l1, Datagram.create_add_range(9000, 9100))
+        self.expect(self.c1, Datagram.create_filter_add([], [(9000, 9100)]))
+
+        # Its own subscriptions aren't sent back to it.
+        self.c1.send(Datagram.create_add_channel(8100))
+        self.expect(self.l1, Datagram.create_add_channel(8100))
+        self.expectNone(self.c1)
+
+        # Upstream's additions are passed down.
+        self.l1.send(Datagram.create_filter_add([7500]))
+        self.expect(self.c1, Datagram.create_filter_add([7500]))
+
+        # Upstream going back to wanting everything.
+        self.l1.send(Datagram.create_filter_reset(pass_all=True))
+        self.expect(self.c1, Datagram.create_filter_reset(pass_all=True))
+        self.check_upstream([7100], True)
+
+        # Clean up
+        self.c1.send(Datagram.create_remove_channels([4000, 8100]))
+        self.expect(self.l1, Datagram.create_remove_channels([4000, 8100]))
+        self.c2.send(Datagram.create_remove_channel(8000))
+        self.expect(self.l1, Datagram.create_remove_channel(8000))
+        self.c2.send(Datagram.create_remove_range(9000, 9100))
+        self.expect(self.l1, Datagram.create_remove_range(9000, 9100))
+        self.expectNone(self.l1)
+
+class TestMessageDirectorInbox(MDTestCase):
+    config = INBOX_CONFIG
+
+    def test_inbox(self):
+        self.l1.flush()
+
+        self.c1.send(Datagram.create_add_channel(6666))
+        self.expect(self.l1, Datagram.create_add_channel(6666))
+        self.c2.send(Datagram.create_add_channel(6667))
+        self.expect(self.l1, Datagram.create_add_channel(6667))
+
+        # Far more than fits in an inbox at once; the sender waits instead, so nothing
+        # is lost, and each receiver still gets them in order.
+        datagrams = []
+        for i in range(100):
+            dg = Datagram.create([6666, 6667], 0, 1234)
+            dg.add_uint32(i)
+            datagrams.append(dg)
+        for dg in datagrams:
+            self.l1.send(dg)
+        for dg in datagrams:
+            self.expect(self.c1, dg)
+        for dg in datagrams:
+            self.expect(self.c2, dg)
+        self.expectNone(self.l1)
+
+        # Clean up
+        self.c1.send(Datagram.create_remove_channel(6666))
+        self.expect(self.l1, Datagram.create_remove_channel(6666))
+        self.c2.send(Datagram.create_remove_channel(6667))
+        self.expect(self.l1, Datagram.create_remove_channel(6667))
+        self.expectNone(self.l1)
+
+class TestMessageDirectorUnix(MDTestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.tempdir = tempfile.mkdtemp(prefix='astron-')
+        cls.md_path = os.path.join(cls.tempdir, 'md.sock')
+        cls.upstream_path = os.path.join(cls.tempdir, 'upstream.sock')
+        cls.config = UNIX_CONFIG % (cls.md_path, cls.upstream_path)
+        super(TestMessageDirectorUnix, cls).setUpClass()
+
+    @classmethod
+    def listenUpstream(cls):
+        listener = socket(AF_UNIX, SOCK_STREAM)
+        listener.bind(cls.upstream_path)
+        return listener
+
+    @classmethod
+    def connectParticipant(cls):
+        sock = socket(AF_UNIX, SOCK_STREAM)
+        sock.connect(cls.md_path)
+        return MDConnection(sock)
+
+    @classmethod
+    def tearDownClass(cls):
+        super(TestMessageDirectorUnix, cls).tearDownClass()
+        for path in (cls.md_path, cls.upstream_path):
+            if os.path.exists(path):
+                os.remove(path)
+        os.rmdir(cls.tempdir)
+
+    def test_unix(self):
+        self.l1.flush()
+
+        # Subscriptions go upstream as usual...
+        self.c1.send(Datagram.create_add_channel(5555))
+        self.expect(self.l1, Datagram.create_add_channel(5555))
+
+        # ...and so does routing, both ways.
+        dg = Datagram.create([5555], 0, 1234)
+        dg.add_string('HELLO')
+        self.c2.send(dg)
+        self.expect(self.c1, dg)
+        self.expect(self.l1, dg)
+
+        dg = Datagram.create([5555], 0, 4321)
+        self.l1.send(dg)
+        self.expect(self.c1, dg)
+        self.expectNone(self.c2)
+
+        # Clean up
+        self.c1.send(Datagram.create_remove_channel(5555))
+        self.expect(self.l1, Datagram.create_remove_channel(5555))
+        self.expectNone(self.l1)
+
 if __name__ == '__main__':
     unittest.main()